@@ -1,48 +1,59 @@
 #include "environment.hpp"
 
+#include <cmath>
+#include <numbers>
+#include <vector>
+
+#include <core/texture.hpp>
+#include <utils/utils.hpp>
+
 namespace pt {
 
-void Environment::rebuildAliasTable(MTL::Device* device, MTL::Texture* texture) {
+static const float3 lumaCoeffs{0.2126, 0.7152, 0.0722};
+
+// Rows of the texture read back at once, so large maps never need a full copy
+static constexpr size_t maxBandBytes = 64 << 20;
+
+void Environment::buildAliasTable(MTL::Device* device, MTL::Texture* texture) {
   uint64_t width = texture->width();
   uint64_t height = texture->height();
   uint64_t n = width * height;
 
-  /*
-   * If there is an existing alias table, release it, then create the buffer for the new table.
-   */
-  if (m_aliasTable) m_aliasTable->release();
-
   size_t aliasTableSize = n * sizeof(AliasEntry);
-  m_aliasTable = device->newBuffer(aliasTableSize, MTL::ResourceStorageModeShared);
-  auto* aliasTableHandle = static_cast<AliasEntry*>(m_aliasTable->contents());
-
-  /*
-   * Create a temporary texture buffer, so we can read pixels off the texture
-   */
-  auto* textureBuffer = device->newBuffer(n * sizeof(float4), MTL::ResourceStorageModeShared);
-  texture->getBytes(textureBuffer->contents(), width * sizeof(float4), MTL::Region(0, 0, width, height), 0);
-  auto* pixels = static_cast<float4*>(textureBuffer->contents());
+  m_samplingData = device->newBuffer(aliasTableSize, MTL::ResourceStorageModeShared);
+  auto* aliasTableHandle = static_cast<AliasEntry*>(m_samplingData->contents());
 
   /*
    * First, calculate the probability of sampling any given pixel. We make this proportional to
-   * luma (brightness), then scale by number of samples.
+   * luma (brightness) times sin(theta), the solid angle covered by the pixel, then scale by number
+   * of samples. The texture is read in bands of rows.
    */
-  float totalImportance = 0.0f;
-  std::vector<float> importance;
-  importance.reserve(n);
-
-  const float3 lumaCoeffs{0.2126, 0.7152, 0.0722};
-  for (uint64_t i = 0; i < n; i++) {
-    float luma = dot(pixels[i].xyz, lumaCoeffs);
-    importance.push_back(luma);
-    totalImportance += luma;
+  std::vector<float> importance(n);
+
+  const uint64_t bandHeight = std::max(uint64_t(1), maxBandBytes / (width * sizeof(float4)));
+  for (uint64_t y0 = 0; y0 < height; y0 += bandHeight) {
+    uint64_t y1 = std::min(height, y0 + bandHeight);
+    const auto pixels = Texture::readRows(texture, 0, uint32_t(y0), uint32_t(y1));
+
+    utils::parallelFor(y1 - y0, [&](size_t row) {
+      float sinTheta = std::sin(std::numbers::pi_v<float> * (float(y0 + row) + 0.5f) / float(height));
+      for (uint64_t x = 0; x < width; x++) {
+        float luma = std::max(dot(pixels[row * width + x].xyz, lumaCoeffs), 0.0f);
+        importance[(y0 + row) * width + x] = luma * sinTheta;
+      }
+    });
   }
 
-  float scale = float(n) / totalImportance;
-  for (uint64_t i = 0; i < n; i++) {
-    importance[i] *= scale;
+  double totalImportance = 0.0;
+  for (float w : importance) totalImportance += w;
+
+  float scale = totalImportance > 0.0 ? float(double(n) / totalImportance) : 0.0f;
+  if (scale == 0.0f) std::ranges::fill(importance, 1.0f);
+
+  utils::parallelFor(n, [&](size_t i) {
+    if (scale > 0.0f) importance[i] *= scale;
     aliasTableHandle[i].pdf = importance[i];
-  }
+  }, 1 << 16);
 
   /*
    * Build the alias table using Vose's method (modified for numerical stability)
@@ -83,24 +94,126 @@ void Environment::rebuildAliasTable(MTL::Device* device, MTL::Texture* texture)
 
     aliasTableHandle[l].p = 1.0f;
   }
+}
+
+void Environment::buildCdf(MTL::Device* device, MTL::Texture* texture) {
+  uint64_t width = texture->width();
+  uint64_t height = texture->height();
+
+  /*
+   * The CDF grid is at most as large as the texture, with the same aspect ratio. Each cell
+   * covers a block of texels.
+   */
+  uint32_t w = std::clamp(m_samplingOptions.cdfWidth, 1u, uint32_t(width));
+  uint32_t h = std::clamp(uint32_t(std::lround(double(w) * double(height) / double(width))), 1u, uint32_t(height));
+  m_cdfSize = {w, h};
+
+  size_t length = (size_t(h) + 1 + size_t(h) * (w + 1)) * sizeof(float);
+  m_samplingData = device->newBuffer(length, MTL::ResourceStorageModeShared);
+  auto* marginal = static_cast<float*>(m_samplingData->contents());
+  auto* conditional = marginal + h + 1;
+
+  /*
+   * Importance of each cell is its average luma times sin(theta), so each cell's weight is
+   * proportional to the power it receives from the environment over its solid angle. Read the
+   * texture in bands of whole CDF rows, summing the texels of each cell in parallel.
+   */
+  std::vector<float> cells(size_t(w) * h);
+
+  auto rowStart = [&](uint32_t y) { return uint64_t(y) * height / h; };
+  auto colStart = [&](uint32_t x) { return uint64_t(x) * width / w; };
+
+  const uint64_t bandHeight = std::max(uint64_t(1), maxBandBytes / (width * sizeof(float4)));
+  for (uint32_t cy0 = 0; cy0 < h;) {
+    uint32_t cy1 = cy0 + 1;
+    while (cy1 < h && rowStart(cy1 + 1) - rowStart(cy0) <= bandHeight) cy1++;
+
+    uint64_t y0 = rowStart(cy0);
+    const auto pixels = Texture::readRows(texture, 0, uint32_t(y0), uint32_t(rowStart(cy1)));
+
+    utils::parallelFor(size_t(cy1 - cy0) * w, [&](size_t i) {
+      uint32_t cy = cy0 + uint32_t(i / w), cx = uint32_t(i % w);
+
+      double sum = 0.0;
+      for (uint64_t y = rowStart(cy); y < rowStart(cy + 1); y++) {
+        for (uint64_t x = colStart(cx); x < colStart(cx + 1); x++)
+          sum += std::max(dot(pixels[(y - y0) * width + x].xyz, lumaCoeffs), 0.0f);
+      }
+
+      uint64_t texels = (rowStart(cy + 1) - rowStart(cy)) * (colStart(cx + 1) - colStart(cx));
+      float sinTheta = std::sin(std::numbers::pi_v<float> * (float(cy) + 0.5f) / float(h));
+      cells[size_t(cy) * w + cx] = float(sum / double(texels)) * sinTheta;
+    }, 256);
+
+    cy0 = cy1;
+  }
+
+  /*
+   * Build a conditional CDF for each row, then the marginal CDF over row totals. Rows and
+   * maps with no energy fall back to uniform sampling.
+   */
+  std::vector<double> rowTotals(h);
+  utils::parallelFor(h, [&](size_t y) {
+    float* cdf = conditional + y * (w + 1);
+    const float* row = cells.data() + y * w;
+
+    double total = 0.0;
+    for (uint32_t x = 0; x < w; x++) total += row[x];
+    rowTotals[y] = total;
+
+    double running = 0.0;
+    cdf[0] = 0.0f;
+    for (uint32_t x = 0; x < w; x++) {
+      running += total > 0.0 ? row[x] : 1.0;
+      cdf[x + 1] = float(running / (total > 0.0 ? total : double(w)));
+    }
+    cdf[w] = 1.0f;
+  }, 16);
+
+  double total = 0.0;
+  for (double rowTotal : rowTotals) total += rowTotal;
+
+  double running = 0.0;
+  marginal[0] = 0.0f;
+  for (uint32_t y = 0; y < h; y++) {
+    running += total > 0.0 ? rowTotals[y] : 1.0;
+    marginal[y + 1] = float(running / (total > 0.0 ? total : double(h)));
+  }
+  marginal[h] = 1.0f;
+}
 
+void Environment::rebuildSamplingData(MTL::Device* device, MTL::Texture* texture) {
   /*
-   * Clean up
+   * If there is an existing sampling structure, release it, then build the new one.
    */
-  textureBuffer->release();
+  if (m_samplingData) m_samplingData->release();
+  m_samplingData = nullptr;
+
+  m_samplingMode = m_samplingOptions.mode;
+  m_cdfSize = {0, 0};
+
+  if (m_samplingMode == EnvironmentSampling_Cdf) buildCdf(device, texture);
+  else buildAliasTable(device, texture);
 }
 
 void Environment::setTexture(std::optional<Environment::TextureID> id, MTL::Device* device, MTL::Texture* texture) {
   // If we set the texture to something (non empty) and it's different from the current one, we need
-  // to rebuild the alias table
-  if (id && id != m_textureId) rebuildAliasTable(device, texture);
+  // to rebuild the sampling structure
+  if (id && id != m_textureId) rebuildSamplingData(device, texture);
 
   m_textureId = id;
 }
 
-void Environment::setTexture(std::optional<TextureID> id, MTL::Buffer* aliasTable) {
-  if (m_aliasTable) m_aliasTable->release();
-  m_aliasTable = aliasTable;
+void Environment::setTexture(
+  std::optional<TextureID> id,
+  MTL::Buffer* samplingData,
+  EnvironmentSampling mode,
+  uint2 cdfSize
+) {
+  if (m_samplingData) m_samplingData->release();
+  m_samplingData = samplingData;
+  m_samplingMode = mode;
+  m_cdfSize = cdfSize;
   m_textureId = id;
 }
 
@@ -18,24 +18,57 @@ struct AliasEntry {
   uint32_t aliasIdx;
 };
 
+/*
+ * Environment map importance sampling structure. The alias table has one entry
+ * per texel, the CDF is a 2D marginal/conditional CDF over a downsampled grid:
+ * the marginal CDF over rows (height + 1 floats), followed by a conditional
+ * CDF for each row (width + 1 floats each).
+ */
+enum EnvironmentSampling {
+  EnvironmentSampling_Alias = 0,
+  EnvironmentSampling_Cdf,
+};
+
 #ifndef __METAL_VERSION__
 
 class Environment {
 public:
   using TextureID = int32_t;
 
+  struct SamplingOptions {
+    EnvironmentSampling mode = EnvironmentSampling_Cdf;
+    uint32_t cdfWidth = 1024; // Height follows the texture aspect ratio
+  };
+
   [[nodiscard]] constexpr std::optional<TextureID> textureId() const { return m_textureId; }
-  [[nodiscard]] constexpr MTL::Buffer* aliasTable() const { return m_aliasTable; }
+  [[nodiscard]] constexpr MTL::Buffer* samplingData() const { return m_samplingData; }
+  [[nodiscard]] constexpr EnvironmentSampling samplingMode() const { return m_samplingMode; }
+  [[nodiscard]] constexpr uint2 cdfSize() const { return m_cdfSize; }
+  [[nodiscard]] constexpr SamplingOptions& samplingOptions() { return m_samplingOptions; }
 
   void setTexture(std::optional<TextureID> id, MTL::Device* device, MTL::Texture* texture);
 
-  void setTexture(std::optional<TextureID> id, MTL::Buffer* aliasTable);
+  void setTexture(
+    std::optional<TextureID> id,
+    MTL::Buffer* samplingData,
+    EnvironmentSampling mode,
+    uint2 cdfSize = {0, 0}
+  );
+
+  /*
+   * Rebuild the sampling structure with the current sampling options
+   */
+  void rebuildSamplingData(MTL::Device* device, MTL::Texture* texture);
 
 private:
   std::optional<TextureID> m_textureId = std::nullopt;
-  MTL::Buffer* m_aliasTable = nullptr;
+  MTL::Buffer* m_samplingData = nullptr;
+  EnvironmentSampling m_samplingMode = EnvironmentSampling_Alias;
+  uint2 m_cdfSize = {0, 0};
+  SamplingOptions m_samplingOptions;
 
-  void rebuildAliasTable(MTL::Device* device, MTL::Texture* texture);
+  void buildAliasTable(MTL::Device* device, MTL::Texture* texture);
+  void buildCdf(MTL::Device* device, MTL::Texture* texture);
 };
 
 #endif
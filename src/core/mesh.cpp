@@ -1,60 +1,12 @@
 #include "mesh.hpp"
 
-#include <mikktspace.h>
+#include <limits>
 
-namespace pt {
-
-/*
- * Callback functions for mikktspace tangent generation
- */
-namespace mikkt {
-
-static int getNumFaces(const SMikkTSpaceContext* ctx) {
-  return int(static_cast<Mesh*>(ctx->m_pUserData)->indexCount()) / 3;
-}
-
-static int getNumVerticesOfFace(const SMikkTSpaceContext* ctx, int face) {
-  return 3; // Only triangles here
-}
-
-static void getPosition(const SMikkTSpaceContext* ctx, float* outPos, int face, int vert) {
-  auto mesh = static_cast<Mesh*>(ctx->m_pUserData);
-  uint32_t vertexIdx = static_cast<uint32_t*>(mesh->indices()->contents())[face * 3 + vert];
-
-  auto vertexPos = static_cast<float3*>(mesh->vertexPositions()->contents())[vertexIdx];
-  outPos[0] = vertexPos.x;
-  outPos[1] = vertexPos.y;
-  outPos[2] = vertexPos.z;
-}
+#include <utils/utils.hpp>
 
-static void getNormal(const SMikkTSpaceContext* ctx, float* outNormal, int face, int vert) {
-  auto mesh = static_cast<Mesh*>(ctx->m_pUserData);
-  uint32_t vertexIdx = static_cast<uint32_t*>(mesh->indices()->contents())[face * 3 + vert];
-
-  auto vertexData = static_cast<VertexData*>(mesh->vertexData()->contents())[vertexIdx];
-  outNormal[0] = vertexData.normal.x;
-  outNormal[1] = vertexData.normal.y;
-  outNormal[2] = vertexData.normal.z;
-}
-
-static void getTexCoord(const SMikkTSpaceContext* ctx, float* outTexCoord, int face, int vert) {
-  auto mesh = static_cast<Mesh*>(ctx->m_pUserData);
-  uint32_t vertexIdx = static_cast<uint32_t*>(mesh->indices()->contents())[face * 3 + vert];
-
-  auto vertexData = static_cast<VertexData*>(mesh->vertexData()->contents())[vertexIdx];
-  outTexCoord[0] = vertexData.texCoords.x;
-  outTexCoord[1] = vertexData.texCoords.y;
-}
-
-static void setTSpaceBasic(const SMikkTSpaceContext* ctx, const float* tangent, float sign, int face, int vert) {
-  auto mesh = static_cast<Mesh*>(ctx->m_pUserData);
-  uint32_t vertexIdx = static_cast<uint32_t*>(mesh->indices()->contents())[face * 3 + vert];
-
-  auto vertexData = static_cast<VertexData*>(mesh->vertexData()->contents()) + vertexIdx;
-  vertexData->tangent = float4{tangent[0], tangent[1], tangent[2], sign};
-}
+#include "tangents.hpp"
 
-}
+namespace pt {
 
 Mesh::Mesh(
   MTL::Device* device,
@@ -63,14 +15,27 @@ Mesh::Mesh(
   const std::vector<uint32_t>& indices,
   const std::vector<uint32_t>& materialIndices
 ) noexcept: m_indexCount(indices.size()),
-            m_vertexCount(vertexPositions.size()) {
-  size_t vpSize = vertexPositions.size() * sizeof(float3);
+            m_vertexCount(vertexPositions.size()),
+            m_texCoordBounds(vertex_format::texCoordBounds(vertexData.data(), vertexData.size())) {
+  size_t vpSize = vertexPositions.size() * sizeof(PackedFloat3);
   m_vertexPositions = device->newBuffer(vpSize, MTL::ResourceStorageModeShared);
-  memcpy(m_vertexPositions->contents(), vertexPositions.data(), vpSize);
+  auto positions = static_cast<PackedFloat3*>(m_vertexPositions->contents());
+  for (size_t i = 0; i < vertexPositions.size(); i++) {
+    positions[i] = {vertexPositions[i].x, vertexPositions[i].y, vertexPositions[i].z};
+  }
 
-  size_t vdSize = vertexData.size() * sizeof(VertexData);
+  size_t vdSize = vertexData.size() * sizeof(PackedVertexData);
   m_vertexData = device->newBuffer(vdSize, MTL::ResourceStorageModeShared);
-  memcpy(m_vertexData->contents(), vertexData.data(), vdSize);
+  auto packed = static_cast<PackedVertexData*>(m_vertexData->contents());
+  utils::parallelFor(vertexData.size(), [&](size_t i) {
+    packed[i] = vertex_format::pack(vertexData[i], m_texCoordBounds);
+  }, 4096);
+
+  if (!vertex_format::packsTexCoords(m_texCoordBounds)) {
+    m_texCoords = device->newBuffer(vertexData.size() * sizeof(float2), MTL::ResourceStorageModeShared);
+    auto texCoords = static_cast<float2*>(m_texCoords->contents());
+    for (size_t i = 0; i < vertexData.size(); i++) texCoords[i] = vertexData[i].texCoords;
+  }
 
   size_t iSize = indices.size() * sizeof(uint32_t);
   m_indices = device->newBuffer(iSize, MTL::ResourceStorageModeShared);
@@ -87,73 +52,138 @@ Mesh::Mesh(
   MTL::Buffer* indices,
   MTL::Buffer* materialIndices,
   size_t indexCount,
-  size_t vertexCount
+  size_t vertexCount,
+  TexCoordBounds texCoordBounds,
+  MTL::Buffer* texCoords
 ) noexcept
   : m_indexCount(indexCount),
     m_vertexCount(vertexCount),
+    m_texCoordBounds(texCoordBounds),
     m_vertexPositions(vertexPositions),
     m_vertexData(vertexData),
     m_indices(indices),
-    m_materialIndices(materialIndices) {}
+    m_materialIndices(materialIndices),
+    m_texCoords(texCoords) {}
 
 Mesh::~Mesh() {
   m_vertexPositions->release();
   m_vertexData->release();
   m_indices->release();
   m_materialIndices->release();
+  if (m_texCoords) m_texCoords->release();
 }
 
 Mesh::Mesh(Mesh&& m) noexcept {
   m_indexCount = m.m_indexCount;
   m_vertexCount = m.m_vertexCount;
+  m_texCoordBounds = m.m_texCoordBounds;
   m_vertexPositions = m.m_vertexPositions;
   m_vertexData = m.m_vertexData;
   m_indices = m.m_indices;
   m_materialIndices = m.m_materialIndices;
+  m_texCoords = m.m_texCoords;
 
   m.m_vertexPositions = nullptr;
   m.m_vertexData = nullptr;
   m.m_indices = nullptr;
   m.m_materialIndices = nullptr;
+  m.m_texCoords = nullptr;
 }
 
 Mesh& Mesh::operator=(Mesh&& m) noexcept {
+  if (this == &m) return *this;
+
+  m_vertexPositions->release();
+  m_vertexData->release();
+  m_indices->release();
+  m_materialIndices->release();
+  if (m_texCoords) m_texCoords->release();
+
   m_indexCount = m.m_indexCount;
   m_vertexCount = m.m_vertexCount;
+  m_texCoordBounds = m.m_texCoordBounds;
   m_vertexPositions = m.m_vertexPositions;
   m_vertexData = m.m_vertexData;
   m_indices = m.m_indices;
   m_materialIndices = m.m_materialIndices;
+  m_texCoords = m.m_texCoords;
 
   m.m_vertexPositions = nullptr;
   m.m_vertexData = nullptr;
   m.m_indices = nullptr;
   m.m_materialIndices = nullptr;
+  m.m_texCoords = nullptr;
   return *this;
 }
 
+float3 Mesh::position(size_t idx) const {
+  auto p = static_cast<const PackedFloat3*>(m_vertexPositions->contents())[idx];
+  return {p.x, p.y, p.z};
+}
+
+VertexData Mesh::vertex(size_t idx) const {
+  auto vertex = vertex_format::unpack(static_cast<const PackedVertexData*>(m_vertexData->contents())[idx], m_texCoordBounds);
+  if (m_texCoords) vertex.texCoords = static_cast<const float2*>(m_texCoords->contents())[idx];
+  return vertex;
+}
+
+float2 Mesh::texCoords(size_t idx) const {
+  if (m_texCoords) return static_cast<const float2*>(m_texCoords->contents())[idx];
+
+  auto packed = static_cast<const PackedVertexData*>(m_vertexData->contents())[idx].texCoords;
+  return vertex_format::decodeTexCoords(packed, m_texCoordBounds);
+}
+
 void Mesh::generateTangents() {
+  std::vector<float3> positions(m_vertexCount), normals(m_vertexCount);
+  std::vector<float2> texCoords(m_vertexCount);
+  utils::parallelFor(m_vertexCount, [&](size_t i) {
+    const auto vertex = this->vertex(i);
+    positions[i] = position(i);
+    normals[i] = vertex.normal;
+    texCoords[i] = vertex.texCoords;
+  }, 4096);
+
+  const std::span indices(static_cast<const uint32_t*>(m_indices->contents()), m_indexCount);
+  const auto tangents = tangents::generate(positions, normals, texCoords, indices);
+
   /*
-   * TODO: Convert to unindexed vertices before tangent calculation and weld after
-   * We run tangent generation on index vertices for simplicity. This is wrong, and may result in
-   * incorrect tangents for some cases. It mostly works, but we should fix it later.
+   * Weld corners back together: corners of the same vertex share it if their
+   * tangents are equal once packed, otherwise the vertex is split. Vertices
+   * are numbered by first use, and unused vertices are dropped.
    */
-  SMikkTSpaceInterface interface{
-    .m_getNumFaces = mikkt::getNumFaces,
-    .m_getNumVerticesOfFace = mikkt::getNumVerticesOfFace,
-    .m_getPosition = mikkt::getPosition,
-    .m_getNormal = mikkt::getNormal,
-    .m_getTexCoord = mikkt::getTexCoord,
-    .m_setTSpaceBasic = mikkt::setTSpaceBasic,
-    .m_setTSpace = nullptr,
-  };
-
-  SMikkTSpaceContext ctx{
-    .m_pInterface = &interface,
-    .m_pUserData = static_cast<void*>(this),
-  };
-
-  genTangSpaceDefault(&ctx);
+  constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+  std::vector<uint32_t> firstSplit(m_vertexCount, none), nextSplit, packedTangents;
+  std::vector<float3> newPositions;
+  std::vector<VertexData> newVertexData;
+  std::vector<uint32_t> newIndices(m_indexCount);
+  newPositions.reserve(m_vertexCount);
+  newVertexData.reserve(m_vertexCount);
+
+  for (size_t i = 0; i < m_indexCount; i++) {
+    const uint32_t v = indices[i];
+    const uint32_t packed = vertex_format::packTangent(tangents[i]);
+
+    uint32_t split = firstSplit[v];
+    while (split != none && packedTangents[split] != packed) split = nextSplit[split];
+
+    if (split == none) {
+      split = uint32_t(newPositions.size());
+      newPositions.push_back(positions[v]);
+      newVertexData.push_back({.normal = normals[v], .tangent = tangents[i], .texCoords = texCoords[v]});
+      packedTangents.push_back(packed);
+      nextSplit.push_back(firstSplit[v]);
+      firstSplit[v] = split;
+    }
+    newIndices[i] = split;
+  }
+
+  const std::vector<uint32_t> materialIndices(
+    static_cast<const uint32_t*>(m_materialIndices->contents()),
+    static_cast<const uint32_t*>(m_materialIndices->contents()) + m_indexCount / 3
+  );
+
+  *this = Mesh(m_vertexPositions->device(), newPositions, newVertexData, newIndices, materialIndices);
 }
 
 }
@@ -10,18 +10,21 @@
 
 #include <simd/simd.h>
 
+#include "vertex_format.hpp"
+
 using namespace simd;
 
 namespace pt {
 
-struct VertexData {
-  float3 normal;
-  float4 tangent;
-  float2 texCoords;
-};
-
 #ifndef __METAL_VERSION__
 
+/*
+ * Triangle mesh. Vertex positions are stored as packed float3, and the rest
+ * of the vertex attributes in the compact PackedVertexData format; both are
+ * converted from full precision on construction. Meshes with a texture
+ * coordinate range too large to pack also keep full precision texture
+ * coordinates, one float2 per vertex.
+ */
 class Mesh {
 public:
   Mesh(
@@ -38,7 +41,9 @@ public:
     MTL::Buffer* indices,
     MTL::Buffer* materialIndices,
     size_t indexCount,
-    size_t vertexCount
+    size_t vertexCount,
+    TexCoordBounds texCoordBounds,
+    MTL::Buffer* texCoords
   ) noexcept;
 
   Mesh(const Mesh& m) noexcept = delete;
@@ -54,18 +59,35 @@ public:
   [[nodiscard]] constexpr MTL::Buffer* indices() const { return m_indices; }
   [[nodiscard]] constexpr MTL::Buffer* materialIndices() const { return m_materialIndices; }
 
+  /*
+   * Full precision texture coordinates, null if they fit in the packed vertex
+   * data, see vertex_format::packsTexCoords
+   */
+  [[nodiscard]] constexpr MTL::Buffer* texCoordData() const { return m_texCoords; }
+
   [[nodiscard]] constexpr size_t indexCount() const { return m_indexCount; }
   [[nodiscard]] constexpr size_t vertexCount() const { return m_vertexCount; }
 
+  [[nodiscard]] constexpr TexCoordBounds texCoordBounds() const { return m_texCoordBounds; }
+
+  /*
+   * Decoded vertex attributes, for CPU code reading the mesh
+   */
+  [[nodiscard]] float3 position(size_t idx) const;
+  [[nodiscard]] VertexData vertex(size_t idx) const;
+  [[nodiscard]] float2 texCoords(size_t idx) const;
+
   void generateTangents();
 
 private:
   size_t m_indexCount, m_vertexCount;
+  TexCoordBounds m_texCoordBounds;
 
   MTL::Buffer* m_vertexPositions;
   MTL::Buffer* m_vertexData;
   MTL::Buffer* m_indices;
   MTL::Buffer* m_materialIndices;
+  MTL::Buffer* m_texCoords = nullptr;
 };
 
 #endif
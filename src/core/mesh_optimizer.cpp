@@ -0,0 +1,412 @@
+#include "mesh_optimizer.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <format>
+#include <limits>
+#include <unordered_dense.h>
+
+namespace pt::mesh_optimizer {
+
+static constexpr uint32_t none = ~0u;
+
+/*
+ * Forsyth's vertex scores model a LRU cache of this size. Cache misses are
+ * measured with a smaller FIFO cache, closer to actual hardware.
+ */
+static constexpr size_t forsythCacheSize = 32;
+static constexpr size_t fifoCacheSize = 16;
+
+static size_t meshBytes(const MeshData& mesh) {
+  size_t vertexBytes = sizeof(PackedFloat3) + sizeof(PackedVertexData);
+  if (!vertex_format::packsTexCoords(vertex_format::texCoordBounds(mesh.vertexData.data(), mesh.vertexData.size())))
+    vertexBytes += sizeof(float2);
+
+  // Three indices and a material index per triangle
+  return mesh.positions.size() * vertexBytes + mesh.materialIndices.size() * 4 * sizeof(uint32_t);
+}
+
+static size_t cacheMisses(const std::vector<uint32_t>& indices) {
+  std::array<uint32_t, fifoCacheSize> cache;
+  cache.fill(none);
+
+  size_t next = 0, misses = 0;
+  for (uint32_t idx: indices) {
+    if (std::ranges::find(cache, idx) != cache.end()) continue;
+
+    cache[next] = idx;
+    next = (next + 1) % fifoCacheSize;
+    misses++;
+  }
+  return misses;
+}
+
+Stats& Stats::operator+=(const Stats& other) {
+  meshes += other.meshes;
+  verticesBefore += other.verticesBefore;
+  verticesAfter += other.verticesAfter;
+  trianglesBefore += other.trianglesBefore;
+  trianglesAfter += other.trianglesAfter;
+  degenerateTriangles += other.degenerateTriangles;
+  duplicateTriangles += other.duplicateTriangles;
+  bytesBefore += other.bytesBefore;
+  bytesAfter += other.bytesAfter;
+  cacheMissesBefore += other.cacheMissesBefore;
+  cacheMissesAfter += other.cacheMissesAfter;
+  return *this;
+}
+
+std::string Stats::summary() const {
+  auto acmr = [](size_t misses, size_t triangles) {
+    return triangles ? double(misses) / double(triangles) : 0.0;
+  };
+
+  return std::format(
+    "{} -> {} vertices, {} -> {} triangles ({} degenerate, {} duplicate), ACMR {:.3f} -> {:.3f}, {:.1f} KB saved",
+    verticesBefore, verticesAfter,
+    trianglesBefore, trianglesAfter,
+    degenerateTriangles, duplicateTriangles,
+    acmr(cacheMissesBefore, trianglesBefore), acmr(cacheMissesAfter, trianglesAfter),
+    (double(bytesBefore) - double(bytesAfter)) / 1024.0
+  );
+}
+
+/*
+ * Vertex welding
+ */
+struct Cell {
+  int64_t x, y, z;
+
+  constexpr bool operator==(const Cell& other) const = default;
+};
+
+struct CellHash {
+  using is_avalanching = void;
+
+  [[nodiscard]] uint64_t operator()(const Cell& cell) const noexcept {
+    return ankerl::unordered_dense::detail::wyhash::hash(&cell, sizeof(cell));
+  }
+};
+
+static bool attributesMatch(const VertexData& a, const VertexData& b, float tolerance) {
+  return reduce_max(abs(a.normal - b.normal)) <= tolerance &&
+         reduce_max(abs(a.tangent - b.tangent)) <= tolerance &&
+         reduce_max(abs(a.texCoords - b.texCoords)) <= tolerance;
+}
+
+/*
+ * Weld matching vertices and return the new index of every old vertex.
+ * Vertices are bucketed in a grid with cells twice the position tolerance,
+ * so matches for a vertex can only be in the (up to 8) cells overlapped by
+ * its tolerance box. Each vertex is compared against the first vertex of
+ * every group only, so welds don't chain past the tolerance.
+ */
+static std::vector<uint32_t> weld(MeshData& mesh, const Options& options) {
+  const size_t vertexCount = mesh.positions.size();
+
+  float3 lo = std::numeric_limits<float>::infinity(), hi = -lo;
+  for (const auto& p: mesh.positions) {
+    if (!std::isfinite(reduce_add(p))) continue;
+    lo = min(lo, p);
+    hi = max(hi, p);
+  }
+  const float diagonal = reduce_max(hi - lo) >= 0.0f ? length(hi - lo) : 0.0f;
+  const float tolerance = std::max(
+    options.positionTolerance * (diagonal > 0.0f ? diagonal : 1.0f),
+    std::numeric_limits<float>::min()
+  );
+  const float cellSize = 2.0f * tolerance;
+
+  ankerl::unordered_dense::map<Cell, uint32_t, CellHash> cells;
+  std::vector<uint32_t> nextInCell;
+  std::vector<float3> positions;
+  std::vector<VertexData> vertexData;
+  std::vector<uint32_t> remap(vertexCount);
+
+  auto addVertex = [&](size_t v) {
+    positions.push_back(mesh.positions[v]);
+    vertexData.push_back(mesh.vertexData[v]);
+    nextInCell.push_back(none);
+    return uint32_t(positions.size() - 1);
+  };
+
+  for (size_t v = 0; v < vertexCount; v++) {
+    const float3 p = mesh.positions[v];
+
+    // Leave vertices we can't place in the grid alone
+    if (!(reduce_max(abs(p)) / cellSize < 0x1p60f)) {
+      remap[v] = addVertex(v);
+      continue;
+    }
+
+    const float3 cmin = simd::floor((p - tolerance) / cellSize), cmax = simd::floor((p + tolerance) / cellSize);
+    uint32_t match = none;
+    for (auto z = int64_t(cmin.z); z <= int64_t(cmax.z) && match == none; z++) {
+      for (auto y = int64_t(cmin.y); y <= int64_t(cmax.y) && match == none; y++) {
+        for (auto x = int64_t(cmin.x); x <= int64_t(cmax.x) && match == none; x++) {
+          auto it = cells.find({x, y, z});
+          if (it == cells.end()) continue;
+
+          for (uint32_t r = it->second; r != none && match == none; r = nextInCell[r]) {
+            if (reduce_max(abs(positions[r] - p)) <= tolerance &&
+                attributesMatch(vertexData[r], mesh.vertexData[v], options.attributeTolerance))
+              match = r;
+          }
+        }
+      }
+    }
+
+    if (match != none) {
+      remap[v] = match;
+      continue;
+    }
+
+    const uint32_t r = addVertex(v);
+    const float3 c = simd::floor(p / cellSize);
+    auto [it, inserted] = cells.try_emplace({int64_t(c.x), int64_t(c.y), int64_t(c.z)}, none);
+    nextInCell[r] = it->second;
+    it->second = r;
+    remap[v] = r;
+  }
+
+  mesh.positions = std::move(positions);
+  mesh.vertexData = std::move(vertexData);
+  return remap;
+}
+
+/*
+ * Degenerate and duplicate triangle removal
+ */
+struct TriangleKey {
+  std::array<uint32_t, 4> values; // Indices, smallest first, and material index
+
+  constexpr bool operator==(const TriangleKey& other) const = default;
+};
+
+struct TriangleKeyHash {
+  using is_avalanching = void;
+
+  [[nodiscard]] uint64_t operator()(const TriangleKey& key) const noexcept {
+    return ankerl::unordered_dense::detail::wyhash::hash(key.values.data(), sizeof(key.values));
+  }
+};
+
+static void removeDegenerate(MeshData& mesh, Stats& stats) {
+  ankerl::unordered_dense::set<TriangleKey, TriangleKeyHash> seen;
+  std::vector<uint32_t> indices, materialIndices;
+  indices.reserve(mesh.indices.size());
+  materialIndices.reserve(mesh.materialIndices.size());
+
+  for (size_t t = 0; t < mesh.materialIndices.size(); t++) {
+    const uint32_t* tri = mesh.indices.data() + t * 3;
+    if (tri[0] == tri[1] || tri[1] == tri[2] || tri[2] == tri[0]) {
+      stats.degenerateTriangles++;
+      continue;
+    }
+
+    const float3 p0 = mesh.positions[tri[0]], p1 = mesh.positions[tri[1]], p2 = mesh.positions[tri[2]];
+    if (length_squared(cross(p1 - p0, p2 - p0)) == 0.0f) {
+      stats.degenerateTriangles++;
+      continue;
+    }
+
+    // Rotate the smallest index first, keeping the winding
+    const size_t first = tri[0] < tri[1] ? (tri[0] < tri[2] ? 0 : 2) : (tri[1] < tri[2] ? 1 : 2);
+    const TriangleKey key{{tri[first], tri[(first + 1) % 3], tri[(first + 2) % 3], mesh.materialIndices[t]}};
+    if (!seen.insert(key).second) {
+      stats.duplicateTriangles++;
+      continue;
+    }
+
+    indices.insert(indices.end(), tri, tri + 3);
+    materialIndices.push_back(mesh.materialIndices[t]);
+  }
+
+  mesh.indices = std::move(indices);
+  mesh.materialIndices = std::move(materialIndices);
+}
+
+/*
+ * Vertex cache optimization, using Tom Forsyth's linear speed algorithm:
+ * greedily emit the triangle whose vertices score highest, where vertices
+ * score higher the more recently they were used and the fewer triangles they
+ * have left, so that vertices are finished off while they're still cached.
+ */
+static float vertexScore(int32_t cachePosition, uint32_t liveTriangles) {
+  if (liveTriangles == 0) return -1.0f;
+
+  float score = 0.0f;
+  if (cachePosition >= 0) {
+    // Vertices of the last triangle get a fixed score, so it isn't just repeated
+    score = cachePosition < 3
+            ? 0.75f
+            : std::pow(1.0f - float(cachePosition - 3) / float(forsythCacheSize - 3), 1.5f);
+  }
+
+  return score + 2.0f / std::sqrt(float(liveTriangles));
+}
+
+static void optimizeVertexCache(MeshData& mesh) {
+  const size_t vertexCount = mesh.positions.size(), triangleCount = mesh.materialIndices.size();
+
+  // Live (not yet emitted) triangles using each vertex
+  std::vector<uint32_t> offsets(vertexCount + 1, 0), live(vertexCount, 0);
+  for (uint32_t idx: mesh.indices) live[idx]++;
+  for (size_t v = 0; v < vertexCount; v++) offsets[v + 1] = offsets[v] + live[v];
+
+  std::vector<uint32_t> adjacency(mesh.indices.size());
+  {
+    std::vector<uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < mesh.indices.size(); i++) adjacency[cursor[mesh.indices[i]]++] = uint32_t(i / 3);
+  }
+
+  std::vector<int32_t> cachePosition(vertexCount, -1);
+  std::vector<float> vertexScores(vertexCount), triangleScores(triangleCount);
+  for (size_t v = 0; v < vertexCount; v++) vertexScores[v] = vertexScore(-1, live[v]);
+
+  auto triangleScore = [&](uint32_t t) {
+    const uint32_t* tri = mesh.indices.data() + t * 3;
+    return vertexScores[tri[0]] + vertexScores[tri[1]] + vertexScores[tri[2]];
+  };
+
+  uint32_t best = none;
+  float bestScore = -std::numeric_limits<float>::infinity();
+  for (uint32_t t = 0; t < triangleCount; t++) {
+    triangleScores[t] = triangleScore(t);
+    if (triangleScores[t] > bestScore) {
+      best = t;
+      bestScore = triangleScores[t];
+    }
+  }
+
+  std::vector<bool> emitted(triangleCount, false);
+  std::vector<uint32_t> cache, nextCache;
+  std::vector<uint32_t> indices, materialIndices;
+  indices.reserve(mesh.indices.size());
+  materialIndices.reserve(triangleCount);
+
+  size_t deadEndCursor = 0;
+  for (size_t i = 0; i < triangleCount; i++) {
+    // Dead end, no cached vertex has triangles left: take the next one in order
+    if (best == none) {
+      while (emitted[deadEndCursor]) deadEndCursor++;
+      best = uint32_t(deadEndCursor);
+    }
+
+    const uint32_t t = best;
+    const uint32_t* tri = mesh.indices.data() + t * 3;
+    emitted[t] = true;
+    indices.insert(indices.end(), tri, tri + 3);
+    materialIndices.push_back(mesh.materialIndices[t]);
+
+    for (int k = 0; k < 3; k++) {
+      const uint32_t v = tri[k];
+      auto begin = adjacency.begin() + offsets[v], end = begin + live[v];
+      std::iter_swap(std::find(begin, end, t), end - 1);
+      live[v]--;
+    }
+
+    // Move the triangle's vertices to the front of the cache
+    nextCache.assign(tri, tri + 3);
+    for (uint32_t v: cache) {
+      if (v != tri[0] && v != tri[1] && v != tri[2]) nextCache.push_back(v);
+    }
+    for (size_t j = 0; j < nextCache.size(); j++) {
+      const uint32_t v = nextCache[j];
+      cachePosition[v] = j < forsythCacheSize ? int32_t(j) : -1;
+      vertexScores[v] = vertexScore(cachePosition[v], live[v]);
+    }
+    nextCache.resize(std::min(nextCache.size(), forsythCacheSize));
+    std::swap(cache, nextCache);
+
+    // Rescore the live triangles of cached vertices and pick the best one
+    best = none;
+    bestScore = -std::numeric_limits<float>::infinity();
+    for (uint32_t v: cache) {
+      for (uint32_t j = offsets[v]; j < offsets[v] + live[v]; j++) {
+        const uint32_t other = adjacency[j];
+        triangleScores[other] = triangleScore(other);
+        if (triangleScores[other] > bestScore) {
+          best = other;
+          bestScore = triangleScores[other];
+        }
+      }
+    }
+  }
+
+  mesh.indices = std::move(indices);
+  mesh.materialIndices = std::move(materialIndices);
+}
+
+/*
+ * Vertex fetch optimization: number vertices in order of first use, so
+ * vertex reads walk memory mostly forward. Drops unused vertices.
+ */
+static void optimizeVertexFetch(MeshData& mesh) {
+  std::vector<uint32_t> remap(mesh.positions.size(), none);
+  uint32_t next = 0;
+  for (auto& idx: mesh.indices) {
+    if (remap[idx] == none) remap[idx] = next++;
+    idx = remap[idx];
+  }
+
+  std::vector<float3> positions(next);
+  std::vector<VertexData> vertexData(next);
+  for (size_t v = 0; v < remap.size(); v++) {
+    if (remap[v] == none) continue;
+    positions[remap[v]] = mesh.positions[v];
+    vertexData[remap[v]] = mesh.vertexData[v];
+  }
+
+  mesh.positions = std::move(positions);
+  mesh.vertexData = std::move(vertexData);
+}
+
+Stats optimize(MeshData& mesh, const Options& options) {
+  Stats stats{
+    .meshes = 1,
+    .verticesBefore = mesh.positions.size(),
+    .trianglesBefore = mesh.materialIndices.size(),
+    .bytesBefore = meshBytes(mesh),
+    .cacheMissesBefore = cacheMisses(mesh.indices),
+  };
+
+  if (options.weld) {
+    const auto remap = weld(mesh, options);
+    for (auto& idx: mesh.indices) idx = remap[idx];
+  }
+
+  if (options.removeDegenerate) removeDegenerate(mesh, stats);
+  if (options.optimizeVertexCache) optimizeVertexCache(mesh);
+  if (options.optimizeVertexFetch) optimizeVertexFetch(mesh);
+
+  stats.verticesAfter = mesh.positions.size();
+  stats.trianglesAfter = mesh.materialIndices.size();
+  stats.bytesAfter = meshBytes(mesh);
+  stats.cacheMissesAfter = cacheMisses(mesh.indices);
+  return stats;
+}
+
+std::optional<Mesh> optimize(const Mesh& mesh, Stats& stats, const Options& options) {
+  auto indices = static_cast<uint32_t*>(mesh.indices()->contents());
+  auto materialIndices = static_cast<uint32_t*>(mesh.materialIndices()->contents());
+
+  MeshData data{
+    .positions = std::vector<float3>(mesh.vertexCount()),
+    .vertexData = std::vector<VertexData>(mesh.vertexCount()),
+    .indices = {indices, indices + mesh.indexCount()},
+    .materialIndices = {materialIndices, materialIndices + mesh.indexCount() / 3},
+  };
+  for (size_t v = 0; v < mesh.vertexCount(); v++) {
+    data.positions[v] = mesh.position(v);
+    data.vertexData[v] = mesh.vertex(v);
+  }
+
+  stats = optimize(data, options);
+  if (data.indices.empty()) return std::nullopt;
+
+  return Mesh(mesh.vertexPositions()->device(), data.positions, data.vertexData, data.indices, data.materialIndices);
+}
+
+}
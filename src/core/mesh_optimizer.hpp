@@ -0,0 +1,66 @@
+#ifndef PLATINUM_MESH_OPTIMIZER_HPP
+#define PLATINUM_MESH_OPTIMIZER_HPP
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "mesh.hpp"
+
+namespace pt::mesh_optimizer {
+
+struct Options {
+  float positionTolerance = 1e-6f;  // Relative to the mesh's bounding box diagonal
+  float attributeTolerance = 1e-4f; // Absolute, per normal, tangent and texture coordinate component
+
+  bool weld = true;
+  bool removeDegenerate = true;     // Also removes duplicate triangles
+  bool optimizeVertexCache = true;
+  bool optimizeVertexFetch = true;
+};
+
+struct Stats {
+  size_t meshes = 0;
+  size_t verticesBefore = 0, verticesAfter = 0;
+  size_t trianglesBefore = 0, trianglesAfter = 0;
+  size_t degenerateTriangles = 0, duplicateTriangles = 0;
+  size_t bytesBefore = 0, bytesAfter = 0;
+
+  // Vertex cache misses, simulated with a small FIFO cache
+  size_t cacheMissesBefore = 0, cacheMissesAfter = 0;
+
+  Stats& operator+=(const Stats& other);
+
+  [[nodiscard]] std::string summary() const;
+};
+
+/*
+ * Plain mesh data, as passed to the Mesh constructor
+ */
+struct MeshData {
+  std::vector<float3> positions;
+  std::vector<VertexData> vertexData;
+  std::vector<uint32_t> indices;
+  std::vector<uint32_t> materialIndices;
+};
+
+/*
+ * Clean up and reorder a mesh for memory use and rendering speed:
+ *  - Weld vertices whose positions and attributes match within tolerance.
+ *  - Remove degenerate triangles (repeated vertices or zero area) and
+ *    duplicate triangles with the same vertices, winding and material.
+ *  - Reorder triangles for post transform vertex cache hits (Forsyth).
+ *  - Reorder vertices in order of first use, dropping unused ones.
+ * Material indices are kept with their triangles.
+ */
+Stats optimize(MeshData& mesh, const Options& options = {});
+
+/*
+ * Same as above, reading the mesh's buffers and creating a new mesh. Returns
+ * nothing if every triangle would be removed.
+ */
+[[nodiscard]] std::optional<Mesh> optimize(const Mesh& mesh, Stats& stats, const Options& options = {});
+
+}
+
+#endif //PLATINUM_MESH_OPTIMIZER_HPP
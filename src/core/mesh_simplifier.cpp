@@ -0,0 +1,504 @@
+#include "mesh_simplifier.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_dense.h>
+
+#include <utils/utils.hpp>
+
+namespace pt::mesh_simplifier {
+
+static constexpr uint32_t none = ~0u;
+
+// Collapses that turn a triangle's normal by more than this are rejected
+static constexpr float minFlipCosine = 0.25f;
+
+// Each pass only does collapses up to this factor of the cost expected to reach the target
+static constexpr float passCostSlack = 1.5f;
+
+/*
+ * Quadrics
+ */
+Simplifier::Quadric& Simplifier::Quadric::operator+=(const Quadric& q) {
+  a00 += q.a00;
+  a01 += q.a01;
+  a02 += q.a02;
+  a11 += q.a11;
+  a12 += q.a12;
+  a22 += q.a22;
+  b0 += q.b0;
+  b1 += q.b1;
+  b2 += q.b2;
+  c += q.c;
+  weight += q.weight;
+  return *this;
+}
+
+double Simplifier::Quadric::eval(float3 p) const {
+  const double x = p.x, y = p.y, z = p.z;
+  const double r = a00 * x * x + a11 * y * y + a22 * z * z
+                   + 2.0 * (a01 * x * y + a02 * x * z + a12 * y * z)
+                   + 2.0 * (b0 * x + b1 * y + b2 * z) + c;
+  return std::max(r, 0.0);
+}
+
+void Simplifier::Quadric::addPlane(float3 n, float d, double w) {
+  a00 += w * n.x * n.x;
+  a01 += w * n.x * n.y;
+  a02 += w * n.x * n.z;
+  a11 += w * n.y * n.y;
+  a12 += w * n.y * n.z;
+  a22 += w * n.z * n.z;
+  b0 += w * n.x * d;
+  b1 += w * n.y * d;
+  b2 += w * n.z * d;
+  c += w * d * d;
+}
+
+Simplifier::AttributeQuadric& Simplifier::AttributeQuadric::operator+=(const AttributeQuadric& q) {
+  for (int i = 0; i < 5; i++) s[i] += q.s[i];
+  t += q.t;
+  weight += q.weight;
+  return *this;
+}
+
+double Simplifier::AttributeQuadric::eval(const float* a) const {
+  double r = t;
+  for (int i = 0; i < 5; i++) r += weight * double(a[i]) * a[i] - 2.0 * s[i] * a[i];
+  return std::max(r, 0.0);
+}
+
+/*
+ * Position key for finding vertices at the same position, adding zero to turn
+ * -0 into +0
+ */
+struct PositionKey {
+  float x, y, z;
+
+  bool operator==(const PositionKey& other) const = default;
+};
+
+struct PositionKeyHash {
+  using is_avalanching = void;
+
+  [[nodiscard]] uint64_t operator()(const PositionKey& key) const noexcept {
+    return ankerl::unordered_dense::detail::wyhash::hash(&key, sizeof(key));
+  }
+};
+
+Simplifier::Simplifier(const mesh_optimizer::MeshData& mesh, const Options& options)
+  : m_options(options), m_indices(mesh.indices), m_materials(mesh.materialIndices) {
+  const size_t vertexCount = mesh.positions.size();
+  const size_t triangleCount = m_indices.size() / 3;
+  m_materials.resize(triangleCount, 0);
+
+  /*
+   * Normalize positions to the bounding box, so costs don't depend on scale
+   */
+  float3 lo = std::numeric_limits<float>::infinity(), hi = -lo;
+  for (auto p: mesh.positions) {
+    lo = min(lo, p);
+    hi = max(hi, p);
+  }
+  const float3 center = vertexCount ? (lo + hi) * 0.5f : float3{0, 0, 0};
+  m_scale = vertexCount ? std::max(reduce_max(hi - lo) * 0.5f, 1e-20f) : 1.0f;
+
+  m_positions.resize(vertexCount);
+  for (size_t v = 0; v < vertexCount; v++) m_positions[v] = (mesh.positions[v] - center) / m_scale;
+
+  const auto uvBounds = vertex_format::texCoordBounds(mesh.vertexData.data(), mesh.vertexData.size());
+  const float uvExtent = reduce_max(uvBounds.extent);
+  const float uvScale = (uvExtent > 0.0f ? 1.0f / uvExtent : 0.0f) * m_options.texCoordWeight;
+
+  m_attributes.resize(vertexCount);
+  for (size_t v = 0; v < vertexCount; v++) {
+    const auto& vd = mesh.vertexData[v];
+    float2 uv = (vd.texCoords - uvBounds.origin) * uvScale;
+    if (!std::isfinite(uv.x) || !std::isfinite(uv.y)) uv = {0.0f, 0.0f};
+    const float3 n = vd.normal * m_options.normalWeight;
+    m_attributes[v] = {n.x, n.y, n.z, uv.x, uv.y};
+  }
+
+  /*
+   * Vertices at the same position share a topological vertex. Positions used
+   * by several vertices are attribute seams.
+   */
+  ankerl::unordered_dense::map<PositionKey, uint32_t, PositionKeyHash> positions;
+  positions.reserve(vertexCount);
+  m_remap.resize(vertexCount);
+  for (size_t v = 0; v < vertexCount; v++) {
+    const float3 p = mesh.positions[v];
+    const PositionKey key{p.x + 0.0f, p.y + 0.0f, p.z + 0.0f};
+    m_remap[v] = positions.try_emplace(key, uint32_t(v)).first->second;
+  }
+
+  m_seam.assign(vertexCount, false);
+  std::vector<uint32_t> usedBy(vertexCount, none);
+  for (uint32_t idx: m_indices) {
+    auto& used = usedBy[m_remap[idx]];
+    if (used == none) used = idx;
+    else if (used != idx) m_seam[m_remap[idx]] = true;
+  }
+
+  /*
+   * Drop triangles with repeated positions, they have no area and would break
+   * the topology
+   */
+  m_live.assign(triangleCount, true);
+  for (size_t t = 0; t < triangleCount; t++) {
+    const uint32_t a = m_remap[m_indices[t * 3]], b = m_remap[m_indices[t * 3 + 1]], c = m_remap[m_indices[t * 3 + 2]];
+    m_live[t] = a != b && b != c && c != a;
+    if (m_live[t]) m_liveTriangles++;
+  }
+
+  /*
+   * Surface planes and attributes, weighted by area
+   */
+  m_quadrics.resize(vertexCount);
+  m_attributeQuadrics.resize(vertexCount);
+  for (size_t t = 0; t < triangleCount; t++) {
+    if (!m_live[t]) continue;
+
+    const uint32_t* tri = &m_indices[t * 3];
+    const float3 p0 = m_positions[tri[0]], p1 = m_positions[tri[1]], p2 = m_positions[tri[2]];
+    const float3 n = cross(p1 - p0, p2 - p0);
+    const float area = length(n) * 0.5f;
+
+    for (int k = 0; k < 3; k++) {
+      auto& q = m_quadrics[m_remap[tri[k]]];
+      if (area > 0.0f) q.addPlane(n / (area * 2.0f), -dot(n / (area * 2.0f), p0), area);
+      q.weight += area;
+
+      auto& aq = m_attributeQuadrics[tri[k]];
+      const auto& a = m_attributes[tri[k]];
+      for (int i = 0; i < 5; i++) {
+        aq.s[i] += area * a[i];
+        aq.t += area * double(a[i]) * a[i];
+      }
+      aq.weight += area;
+    }
+  }
+
+  /*
+   * Border planes, perpendicular to the surface along open edges
+   */
+  buildAdjacency();
+  for (size_t t = 0; t < triangleCount; t++) {
+    if (!m_live[t]) continue;
+
+    const uint32_t* tri = &m_indices[t * 3];
+    const float3 n = cross(m_positions[tri[1]] - m_positions[tri[0]], m_positions[tri[2]] - m_positions[tri[0]]);
+    for (int k = 0; k < 3; k++) {
+      const uint32_t a = m_remap[tri[k]], b = m_remap[tri[(k + 1) % 3]];
+
+      // Look for the opposite half edge b -> a
+      bool open = true;
+      for (uint32_t i = m_offsets[b]; i < m_offsets[b + 1] && open; i++) {
+        const uint32_t* other = &m_indices[size_t(m_adjacency[i]) * 3];
+        for (int j = 0; j < 3; j++) {
+          if (m_remap[other[j]] == b && m_remap[other[(j + 1) % 3]] == a) open = false;
+        }
+      }
+      if (!open) continue;
+
+      const float3 edge = m_positions[tri[(k + 1) % 3]] - m_positions[tri[k]];
+      const float3 plane = cross(edge, n);
+      if (!(length_squared(plane) > 0.0f)) continue;
+
+      const float3 pn = normalize(plane);
+      const double w = double(length_squared(edge)) * m_options.borderWeight;
+      m_quadrics[a].addPlane(pn, -dot(pn, m_positions[tri[k]]), w);
+      m_quadrics[b].addPlane(pn, -dot(pn, m_positions[tri[k]]), w);
+    }
+  }
+}
+
+/*
+ * Live triangles around each position, as offsets into a flat array
+ */
+void Simplifier::buildAdjacency() {
+  const size_t vertexCount = m_positions.size();
+  m_offsets.assign(vertexCount + 1, 0);
+  for (size_t t = 0; t < m_live.size(); t++) {
+    if (!m_live[t]) continue;
+    for (int k = 0; k < 3; k++) m_offsets[m_remap[m_indices[t * 3 + k]] + 1]++;
+  }
+  for (size_t v = 0; v < vertexCount; v++) m_offsets[v + 1] += m_offsets[v];
+
+  m_adjacency.resize(m_offsets[vertexCount]);
+  std::vector<uint32_t> cursor(m_offsets.begin(), m_offsets.end() - 1);
+  for (size_t t = 0; t < m_live.size(); t++) {
+    if (!m_live[t]) continue;
+    for (int k = 0; k < 3; k++) m_adjacency[cursor[m_remap[m_indices[t * 3 + k]]]++] = uint32_t(t);
+  }
+}
+
+/*
+ * Vertex kinds from the current topology. A border vertex has exactly one
+ * open edge leaving it and one arriving, anything more complex is locked.
+ */
+void Simplifier::classify() {
+  const size_t vertexCount = m_positions.size();
+  m_kinds.assign(vertexCount, Kind::Locked);
+  m_borderNext.assign(vertexCount, none);
+  m_borderPrev.assign(vertexCount, none);
+
+  utils::parallelFor(vertexCount, [&](size_t v) {
+    const uint32_t begin = m_offsets[v], end = m_offsets[v + 1];
+    if (begin == end || m_seam[v]) return;
+
+    auto corner = [&](uint32_t t, int offset) {
+      const uint32_t* tri = &m_indices[size_t(t) * 3];
+      for (int k = 0; k < 3; k++) {
+        if (m_remap[tri[k]] == v) return m_remap[tri[(k + offset) % 3]];
+      }
+      return none;
+    };
+
+    uint32_t openOut = 0, openIn = 0, next = none, prev = none;
+    for (uint32_t i = begin; i < end; i++) {
+      const uint32_t t = m_adjacency[i];
+      if (m_materials[t] != m_materials[m_adjacency[begin]]) return;
+
+      const uint32_t out = corner(t, 1), in = corner(t, 2);
+      bool outPaired = false, inPaired = false;
+      for (uint32_t j = begin; j < end; j++) {
+        if (j == i) continue;
+        const uint32_t other = m_adjacency[j];
+        if (corner(other, 1) == out || corner(other, 2) == in) return; // Non-manifold
+        if (corner(other, 2) == out) outPaired = true;
+        if (corner(other, 1) == in) inPaired = true;
+      }
+
+      if (!outPaired) {
+        openOut++;
+        next = out;
+      }
+      if (!inPaired) {
+        openIn++;
+        prev = in;
+      }
+    }
+
+    if (openOut == 0 && openIn == 0) {
+      m_kinds[v] = Kind::Manifold;
+    } else if (openOut == 1 && openIn == 1) {
+      m_kinds[v] = Kind::Border;
+      m_borderNext[v] = next;
+      m_borderPrev[v] = prev;
+    }
+  }, 4096);
+}
+
+bool Simplifier::canCollapse(uint32_t from, uint32_t to) const {
+  const uint32_t pf = m_remap[from], pt = m_remap[to];
+  if (pf == pt) return false;
+
+  switch (m_kinds[pf]) {
+    case Kind::Manifold: return true;
+    case Kind::Border: return pt == m_borderNext[pf] || pt == m_borderPrev[pf];
+    default: return false;
+  }
+}
+
+double Simplifier::cost(uint32_t from, uint32_t to) const {
+  const auto& q = m_quadrics[m_remap[from]];
+  const auto& aq = m_attributeQuadrics[from];
+  return q.eval(m_positions[to]) / std::max(q.weight, 1e-30)
+         + aq.eval(m_attributes[to].data()) / std::max(aq.weight, 1e-30);
+}
+
+bool Simplifier::collapse(const Collapse& c, std::vector<bool>& locked) {
+  const uint32_t pf = m_remap[c.from], pt = m_remap[c.to];
+  if (locked[pf] || locked[pt]) return false;
+
+  auto contains = [&](uint32_t t, uint32_t p) {
+    const uint32_t* tri = &m_indices[size_t(t) * 3];
+    return m_remap[tri[0]] == p || m_remap[tri[1]] == p || m_remap[tri[2]] == p;
+  };
+
+  /*
+   * Triangles on the collapsed edge must use the same target vertex, one for
+   * border edges and two otherwise
+   */
+  uint32_t shared = 0;
+  for (uint32_t i = m_offsets[pf]; i < m_offsets[pf + 1]; i++) {
+    const uint32_t* tri = &m_indices[size_t(m_adjacency[i]) * 3];
+    for (int k = 0; k < 3; k++) {
+      if (m_remap[tri[k]] != pt) continue;
+      if (tri[k] != c.to) return false;
+      shared++;
+    }
+  }
+  if (shared != (m_kinds[pf] == Kind::Border ? 1u : 2u)) return false;
+
+  /*
+   * Link condition: the only positions next to both ends of the edge are the
+   * opposite corners of the shared triangles, otherwise the collapse would
+   * pinch the surface
+   */
+  auto gatherNeighbors = [&](uint32_t p, std::vector<uint32_t>& out) {
+    out.clear();
+    for (uint32_t i = m_offsets[p]; i < m_offsets[p + 1]; i++) {
+      const uint32_t* tri = &m_indices[size_t(m_adjacency[i]) * 3];
+      for (int k = 0; k < 3; k++) {
+        if (m_remap[tri[k]] != p) out.push_back(m_remap[tri[k]]);
+      }
+    }
+    std::ranges::sort(out);
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+  };
+  gatherNeighbors(pf, m_neighbors);
+  gatherNeighbors(pt, m_targetNeighbors);
+
+  uint32_t common = 0;
+  for (uint32_t p: m_neighbors) {
+    if (p != pt && std::ranges::binary_search(m_targetNeighbors, p)) common++;
+  }
+  if (common != shared) return false;
+
+  /*
+   * Reject collapses that flip or squash the remaining triangles
+   */
+  for (uint32_t i = m_offsets[pf]; i < m_offsets[pf + 1]; i++) {
+    const uint32_t t = m_adjacency[i];
+    if (contains(t, pt)) continue;
+
+    const uint32_t* tri = &m_indices[size_t(t) * 3];
+    float3 p[3], q[3];
+    for (int k = 0; k < 3; k++) {
+      p[k] = m_positions[tri[k]];
+      q[k] = m_remap[tri[k]] == pf ? m_positions[c.to] : p[k];
+    }
+
+    const float3 n0 = cross(p[1] - p[0], p[2] - p[0]), n1 = cross(q[1] - q[0], q[2] - q[0]);
+    const float l0 = length(n0), l1 = length(n1);
+    if (l0 > 0.0f && (l1 == 0.0f || dot(n0, n1) < minFlipCosine * l0 * l1)) return false;
+  }
+
+  /*
+   * Collapse: triangles on the edge are removed and the rest move to the
+   * target vertex
+   */
+  for (uint32_t i = m_offsets[pf]; i < m_offsets[pf + 1]; i++) {
+    const uint32_t t = m_adjacency[i];
+    if (contains(t, pt)) {
+      m_live[t] = false;
+      m_liveTriangles--;
+      continue;
+    }
+
+    for (int k = 0; k < 3; k++) {
+      if (m_remap[m_indices[size_t(t) * 3 + k]] == pf) m_indices[size_t(t) * 3 + k] = c.to;
+    }
+  }
+
+  m_quadrics[pt] += m_quadrics[pf];
+  m_attributeQuadrics[c.to] += m_attributeQuadrics[c.from];
+  m_maxCost = std::max(m_maxCost, double(c.cost));
+
+  // The triangles around the collapsed vertex changed, so its neighbours are done for this pass
+  locked[pf] = locked[pt] = true;
+  for (uint32_t p: m_neighbors) locked[p] = true;
+  return true;
+}
+
+size_t Simplifier::simplify(size_t targetTriangles, float maxError) {
+  const double maxCost = double(maxError / m_scale) * double(maxError / m_scale);
+  const size_t triangleCount = m_live.size();
+
+  std::vector<Collapse> candidates;
+  std::vector<bool> locked;
+  while (m_liveTriangles > targetTriangles && !m_options.stopToken.stop_requested()) {
+    buildAdjacency();
+    classify();
+
+    /*
+     * Cheapest direction of each triangle edge. Inner edges show up twice,
+     * which is fine since the second one gets rejected.
+     */
+    candidates.assign(triangleCount * 3, {std::numeric_limits<float>::infinity(), none, none});
+    utils::parallelFor(triangleCount, [&](size_t t) {
+      if (!m_live[t]) return;
+
+      for (int k = 0; k < 3; k++) {
+        const uint32_t a = m_indices[t * 3 + k], b = m_indices[t * 3 + (k + 1) % 3];
+        auto& candidate = candidates[t * 3 + k];
+        if (canCollapse(a, b)) candidate = {float(cost(a, b)), a, b};
+        if (canCollapse(b, a)) {
+          const float c = float(cost(b, a));
+          if (c < candidate.cost) candidate = {c, b, a};
+        }
+      }
+    }, 4096);
+
+    std::erase_if(candidates, [&](const Collapse& c) { return c.from == none || !(c.cost <= maxCost); });
+    if (candidates.empty()) break;
+
+    /*
+     * Only sort the collapses cheap enough for this pass. Each collapse
+     * removes two triangles, and each edge is in the list twice.
+     */
+    const auto byCost = [](const Collapse& a, const Collapse& b) { return a.cost < b.cost; };
+    const size_t goal = std::min((m_liveTriangles - targetTriangles) / 2 * 2, candidates.size() - 1);
+    std::nth_element(candidates.begin(), candidates.begin() + goal, candidates.end(), byCost);
+    const float passMaxCost = candidates[goal].cost * passCostSlack;
+
+    auto cheap = std::partition(candidates.begin(), candidates.end(), [&](const Collapse& c) {
+      return c.cost <= passMaxCost;
+    });
+    std::sort(candidates.begin(), cheap, byCost);
+
+    locked.assign(m_positions.size(), false);
+    size_t collapses = 0;
+    for (auto it = candidates.begin(); it != candidates.end() && m_liveTriangles > targetTriangles; ++it) {
+      if (it == cheap) {
+        if (collapses > 0) break;
+        std::sort(cheap, candidates.end(), byCost); // Nothing cheap could be collapsed, keep going
+      }
+      if (collapse(*it, locked)) collapses++;
+    }
+
+    if (collapses == 0) break;
+  }
+
+  return m_liveTriangles;
+}
+
+std::vector<uint32_t> Simplifier::indices() const {
+  std::vector<uint32_t> indices;
+  indices.reserve(m_liveTriangles * 3);
+  for (size_t t = 0; t < m_live.size(); t++) {
+    if (m_live[t]) indices.insert(indices.end(), m_indices.begin() + t * 3, m_indices.begin() + t * 3 + 3);
+  }
+  return indices;
+}
+
+float Simplifier::error() const {
+  return float(std::sqrt(m_maxCost)) * m_scale;
+}
+
+std::vector<Lod> buildLods(const mesh_optimizer::MeshData& mesh, const LodOptions& lodOptions, const Options& options) {
+  std::vector<Lod> lods;
+  size_t triangles = mesh.indices.size() / 3;
+  if (triangles / 2 < lodOptions.minTriangles) return lods;
+
+  Simplifier simplifier(mesh, options);
+  while (lods.size() < lodOptions.maxLevels) {
+    const auto target = size_t(float(triangles) * lodOptions.ratio);
+    if (target < lodOptions.minTriangles) break;
+
+    const size_t result = simplifier.simplify(target);
+    if (options.stopToken.stop_requested()) break;
+
+    // Stop if the mesh is mostly locked and barely gets simpler
+    if (float(result) > float(triangles) * (1.0f + lodOptions.ratio) * 0.5f) break;
+
+    lods.push_back({simplifier.indices(), simplifier.error()});
+    triangles = result;
+  }
+
+  return lods;
+}
+
+}
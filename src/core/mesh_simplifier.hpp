@@ -0,0 +1,152 @@
+#ifndef PLATINUM_MESH_SIMPLIFIER_HPP
+#define PLATINUM_MESH_SIMPLIFIER_HPP
+
+#include <array>
+#include <limits>
+#include <stop_token>
+#include <vector>
+
+#include "mesh_optimizer.hpp"
+
+namespace pt::mesh_simplifier {
+
+struct Options {
+  // Weight of attribute error against position error, in units of the mesh's bounding radius
+  float normalWeight = 0.5f;
+  float texCoordWeight = 0.5f;  // Texture coordinates are scaled to the mesh's UV range first
+
+  // Weight of the planes keeping open borders in place, relative to surface planes
+  float borderWeight = 10.0f;
+
+  // Simplification stops early when requested
+  std::stop_token stopToken = {};
+};
+
+/*
+ * Edge collapse simplifier with quadric error metrics (Garland and Heckbert,
+ * "Surface Simplification Using Quadric Error Metrics"). Collapses are half
+ * edge collapses: a vertex is merged into one of its neighbours, so every
+ * simplified mesh uses a subset of the original vertices and can share their
+ * buffers.
+ * Each vertex accumulates a quadric of the triangle planes around it, and
+ * open borders add planes perpendicular to the surface. Normals and texture
+ * coordinates add an area weighted attribute quadric on top, so collapses
+ * that smear shading or UVs cost more.
+ * Vertices on attribute seams (several vertices at the same position), on
+ * material boundaries or on non-manifold edges are never removed. Border
+ * vertices only collapse along their border.
+ * Collapses are done in passes, cheapest first, with each collapse locking
+ * the vertices around it for the rest of the pass. Collapses that would flip
+ * a triangle or change the topology are skipped.
+ */
+class Simplifier {
+public:
+  explicit Simplifier(const mesh_optimizer::MeshData& mesh, const Options& options = {});
+
+  /*
+   * Collapse edges until at most targetTriangles triangles are left, no
+   * collapse stays under maxError or simplification is stopped. Can be called
+   * again with a lower target to continue. Returns the triangle count.
+   */
+  size_t simplify(size_t targetTriangles, float maxError = std::numeric_limits<float>::infinity());
+
+  /*
+   * Indices of the remaining triangles, into the original vertices
+   */
+  [[nodiscard]] std::vector<uint32_t> indices() const;
+
+  [[nodiscard]] constexpr size_t triangleCount() const { return m_liveTriangles; }
+
+  /*
+   * Upper bound of the distance from the simplified surface to the original,
+   * in mesh space units. Attribute error is included in the same units.
+   */
+  [[nodiscard]] float error() const;
+
+private:
+  struct Quadric {
+    double a00 = 0, a01 = 0, a02 = 0, a11 = 0, a12 = 0, a22 = 0;
+    double b0 = 0, b1 = 0, b2 = 0, c = 0;
+    double weight = 0;
+
+    Quadric& operator+=(const Quadric& q);
+    [[nodiscard]] double eval(float3 p) const;
+
+    // Squared distance to the plane n.p + d = 0, times a weight
+    void addPlane(float3 n, float d, double w);
+  };
+
+  /*
+   * Area weighted sum of squared distances to the attributes of the original
+   * vertices, in a 5D space of normals and scaled texture coordinates
+   */
+  struct AttributeQuadric {
+    double s[5] = {};
+    double t = 0, weight = 0;
+
+    AttributeQuadric& operator+=(const AttributeQuadric& q);
+    [[nodiscard]] double eval(const float* a) const;
+  };
+
+  enum class Kind : uint8_t { Manifold, Border, Locked };
+
+  struct Collapse {
+    float cost;
+    uint32_t from, to; // Vertex indices
+  };
+
+  Options m_options;
+  float m_scale = 1.0f;
+  double m_maxCost = 0.0;
+
+  std::vector<float3> m_positions;         // Normalized to the bounding box
+  std::vector<std::array<float, 5>> m_attributes;
+  std::vector<uint32_t> m_indices, m_materials;
+  std::vector<uint32_t> m_remap;           // Vertex to the first vertex at the same position
+  std::vector<bool> m_seam;                // Per position, set if several vertices share it
+  std::vector<bool> m_live;
+  size_t m_liveTriangles = 0;
+
+  std::vector<Quadric> m_quadrics;         // Per position
+  std::vector<AttributeQuadric> m_attributeQuadrics; // Per vertex
+
+  // Per pass topology, by position
+  std::vector<uint32_t> m_offsets, m_adjacency;
+  std::vector<Kind> m_kinds;
+  std::vector<uint32_t> m_borderNext, m_borderPrev;
+
+  void buildAdjacency();
+  void classify();
+
+  [[nodiscard]] bool canCollapse(uint32_t from, uint32_t to) const;
+  [[nodiscard]] double cost(uint32_t from, uint32_t to) const;
+  bool collapse(const Collapse& collapse, std::vector<bool>& locked);
+
+  std::vector<uint32_t> m_neighbors, m_targetNeighbors; // Scratch space for collapse()
+};
+
+struct Lod {
+  std::vector<uint32_t> indices;
+  float error; // In mesh space units, see Simplifier::error()
+};
+
+struct LodOptions {
+  float ratio = 0.5f;          // Triangle count of each level relative to the previous one
+  size_t minTriangles = 2048;  // No levels are built below this
+  size_t maxLevels = 8;
+};
+
+/*
+ * Build a chain of simplified levels, from finest to coarsest, not including
+ * the original mesh. Stops when a level can't get meaningfully smaller than
+ * the previous one.
+ */
+std::vector<Lod> buildLods(
+  const mesh_optimizer::MeshData& mesh,
+  const LodOptions& lodOptions = {},
+  const Options& options = {}
+);
+
+}
+
+#endif //PLATINUM_MESH_SIMPLIFIER_HPP
@@ -226,6 +226,17 @@ struct TonemapOptions {
   float3x3 odt; // Colorspace transform from working -> display space
 };
 
+/*
+ * Region of the full image covered by the source texture. When rendering in
+ * tiles, post process passes that depend on the pixel position within the
+ * image (or sample neighbouring pixels) use this to map tile UVs to image UVs.
+ */
+struct TileInfo {
+  float2 offset = {0, 0};     // Tile origin, in image UVs
+  float2 scale = {1, 1};      // Tile size, in image UVs
+  float2 imageSize = {1, 1};  // Full image size, in pixels
+};
+
 #ifndef __METAL_VERSION__
 
 class PostProcessPass {
@@ -264,9 +275,12 @@ public:
 
   virtual Options options() = 0;
 
+  constexpr void setTile(const TileInfo& tile) { m_tile = tile; }
+
 protected:
   MTL::Device* m_device;
   MTL::RenderPipelineState* m_pso;
+  TileInfo m_tile;
 
   std::string m_name;
 };
@@ -296,6 +310,7 @@ public:
     postEnc->setRenderPipelineState(m_pso);
     postEnc->setFragmentTexture(src, 0);
     postEnc->setFragmentBytes(&m_options, sizeof(Options), 0);
+    postEnc->setFragmentBytes(&m_tile, sizeof(TileInfo), 1);
 
     postEnc->drawPrimitives(MTL::PrimitiveTypeTriangle, (NS::UInteger) 0, 6);
     postEnc->endEncoding();
@@ -7,6 +7,7 @@ namespace pt {
 
 static size_t getTextureBytesPerPixel(MTL::PixelFormat format) {
   if (format == MTL::PixelFormatRGBA32Float) return 4 * sizeof(float);
+  if (format == MTL::PixelFormatRGBA16Float) return 4 * sizeof(uint16_t);
   if (format == MTL::PixelFormatRGBA8Unorm_sRGB) return 4 * sizeof(uint8_t);
   if (format == MTL::PixelFormatRGBA8Unorm) return 4 * sizeof(uint8_t);
   if (format == MTL::PixelFormatRG8Unorm) return 2 * sizeof(uint8_t);
@@ -18,6 +19,21 @@ static size_t getTextureBytesPerPixel(MTL::PixelFormat format) {
   return 0;
 }
 
+/*
+ * Tile size a texture is saved with, if it's saved tiled: streamed textures,
+ * and large compressed textures the device could stream
+ */
+static std::optional<MTL::Size> getSaveTileSize(Texture* texture) {
+  if (texture->streamed()) {
+    const auto& layout = texture->tileCache()->layout(texture->streamId());
+    return MTL::Size(layout.tileWidth, layout.tileHeight, 1);
+  }
+
+  auto* tex = texture->texture();
+  if (std::max(tex->width(), tex->height()) < TileCache::minStreamedSize) return std::nullopt;
+  return TileCache::tileSize(tex->device(), tex->pixelFormat());
+}
+
 Scene::Scene() noexcept: m_nextAssetId(0), m_assets() {
   /*
    * Initialize the scene
@@ -38,6 +54,9 @@ Scene::Scene(const fs::path& path, MTL::Device* device) noexcept: m_nextAssetId(
 
   auto data = json::parse(file);
 
+  // Tiled textures stream from the binary file, if the device can do it
+  if (TileCache::supported(device)) m_binarySource = std::make_shared<const utils::MappedFile>(binaryPath);
+
   /*
    * Load assets
    */
@@ -57,6 +76,9 @@ Scene::Scene(const fs::path& path, MTL::Device* device) noexcept: m_nextAssetId(
     m_nextAssetId = m_nextAssetId <= id ? id + 1 : m_nextAssetId;
   }
 
+  // Streamed textures hold on to the mapping themselves
+  m_binarySource = nullptr;
+
   /*
    * Load scene hierarchy
    */
@@ -69,12 +91,24 @@ Scene::Scene(const fs::path& path, MTL::Device* device) noexcept: m_nextAssetId(
   if (data.contains("envmap")) {
     json envmap = data.at("envmap");
     AssetID textureId = envmap.at("texture");
-    size_t len = envmap.at("aliasTable").at(0);
 
-    MTL::Buffer* aliasTable = device->newBuffer(len, MTL::ResourceStorageModeShared);
-    binaryFile.read((char*) aliasTable->contents(), std::streamsize(len));
+    // Scenes saved before CDF sampling was added only have an alias table
+    auto mode = EnvironmentSampling_Alias;
+    uint2 cdfSize = {0, 0};
+    json samplingData;
+    if (envmap.contains("cdf")) {
+      mode = EnvironmentSampling_Cdf;
+      samplingData = envmap.at("cdf");
+      cdfSize = {uint32_t(envmap.at("cdfSize").at(0)), uint32_t(envmap.at("cdfSize").at(1))};
+    } else {
+      samplingData = envmap.at("aliasTable");
+    }
+    size_t len = samplingData.at(1);
+
+    MTL::Buffer* buffer = device->newBuffer(len, MTL::ResourceStorageModeShared);
+    binaryFile.read((char*) buffer->contents(), std::streamsize(len));
 
-    m_envmap.setTexture(textureId, aliasTable);
+    m_envmap.setTexture(textureId, buffer, mode, cdfSize);
   }
 
   auto end = std::chrono::high_resolution_clock::now();
@@ -89,6 +123,20 @@ void Scene::removeAsset(AssetID id) {
   removeAssetImpl(id);
 }
 
+Scene::AssetID Scene::replaceMesh(AssetID id, Mesh&& mesh) {
+  AssetID newId = createAsset(std::move(mesh), m_assets.at(id).retain);
+
+  for (auto [entity, meshComponent]: m_registry.view<MeshComponent>().each()) {
+    if (meshComponent.id == id) meshComponent.id = newId;
+  }
+
+  // References were moved to the new mesh, so the old one can go
+  m_assetRc[newId] = m_assetRc[id];
+  removeAssetImpl(id);
+
+  return newId;
+}
+
 uint32_t Scene::getAssetRc(AssetID id) {
   return m_assetRc.at(id);
 }
@@ -537,7 +585,13 @@ void Scene::saveToFile(const fs::path& path) {
   auto binaryFilename = std::format("{}_data.bin", path.stem().string());
   auto binaryPath = path.parent_path() / binaryFilename;
 
-  std::ofstream binaryFile(binaryPath, std::ios::out | std::ios::binary);
+  /*
+   * Write the binary to a temporary file and move it in place after, textures
+   * may be streaming from the current one
+   */
+  auto tmpBinaryPath = binaryPath;
+  tmpBinaryPath += ".tmp";
+  std::ofstream binaryFile(tmpBinaryPath, std::ios::out | std::ios::binary);
 
   /*
    * Dump all mesh/texture data to a binary file, and store its byte
@@ -573,14 +627,73 @@ void Scene::saveToFile(const fs::path& path) {
       size_t width = texture->texture()->width();
       size_t height = texture->texture()->height();
 
-      size_t bytesPerPixel = getTextureBytesPerPixel(format);
-      size_t bytesPerRow = bytesPerPixel * width;
-      size_t totalBytes = bytesPerRow * height;
+      /*
+       * Large textures are stored tiled, so they can be streamed. Streamed
+       * textures already have their tiled payload in the source file.
+       */
+      if (auto tileSize = getSaveTileSize(texture)) {
+        std::vector<uint8_t> tiled;
+        std::span<const uint8_t> payload;
+        if (texture->streamed()) {
+          payload = texture->tileCache()->payload(texture->streamId());
+        } else {
+          const TileLayout layout{
+            .format = format,
+            .width = uint32_t(width),
+            .height = uint32_t(height),
+            .levels = uint32_t(texture->texture()->mipmapLevelCount()),
+            .tileWidth = uint32_t(tileSize->width),
+            .tileHeight = uint32_t(tileSize->height),
+          };
+          const auto offsets = layout.tileOffsets();
+          const auto blockFormat = *Texture::blockFormat(format);
+
+          tiled.resize(offsets.back());
+          std::vector<uint8_t> level;
+          for (uint32_t l = 0; l < layout.levels; l++) {
+            const uint32_t w = layout.levelWidth(l), h = layout.levelHeight(l);
+            level.resize(compression::encodedSize(blockFormat, w, h));
+            texture->texture()->getBytes(level.data(), compression::encodedSize(blockFormat, w, 1), MTL::Region(0, 0, w, h), l);
+            layout.tileLevel(level.data(), l, tiled.data(), offsets);
+          }
+          payload = tiled;
+        }
+
+        binaryFile.write((const char*) payload.data(), std::streamsize(payload.size()));
+        textureBufferData[asset.id] = {
+          .offset = cumulativeOffset,
+          .length = payload.size(),
+        };
+        cumulativeOffset += payload.size();
 
-      void* data = malloc(totalBytes);
-      texture->texture()->getBytes(data, bytesPerRow, MTL::Region(0, 0, width, height), 0);
-      binaryFile.write((const char*) data, std::streamsize(totalBytes));
-      free(data);
+        assets.push_back(toJson(asset, textureBufferData, meshBufferData));
+        continue;
+      }
+
+      // Compressed textures store every mip level, since re-encoding them on load is slow
+      size_t totalBytes = 0;
+      auto blockFormat = Texture::blockFormat(format);
+      size_t levels = blockFormat ? texture->texture()->mipmapLevelCount() : 1;
+      for (size_t level = 0; level < levels; level++) {
+        size_t w = std::max(width >> level, size_t(1));
+        size_t h = std::max(height >> level, size_t(1));
+
+        size_t bytesPerRow, levelBytes;
+        if (blockFormat) {
+          bytesPerRow = compression::encodedSize(*blockFormat, uint32_t(w), 1);
+          levelBytes = compression::encodedSize(*blockFormat, uint32_t(w), uint32_t(h));
+        } else {
+          bytesPerRow = getTextureBytesPerPixel(format) * w;
+          levelBytes = bytesPerRow * h;
+        }
+
+        void* data = malloc(levelBytes);
+        texture->texture()->getBytes(data, bytesPerRow, MTL::Region(0, 0, w, h), level);
+        binaryFile.write((const char*) data, std::streamsize(levelBytes));
+        free(data);
+
+        totalBytes += levelBytes;
+      }
 
       textureBufferData[asset.id] = {
         .offset = cumulativeOffset,
@@ -594,6 +707,7 @@ void Scene::saveToFile(const fs::path& path) {
       meshBufferData[asset.id].vertexData = dumpBuffer(mesh->vertexData());
       meshBufferData[asset.id].indices = dumpBuffer(mesh->indices());
       meshBufferData[asset.id].materials = dumpBuffer(mesh->materialIndices());
+      if (mesh->texCoordData()) meshBufferData[asset.id].texCoords = dumpBuffer(mesh->texCoordData());
     }
 
     assets.push_back(toJson(asset, textureBufferData, meshBufferData));
@@ -614,14 +728,22 @@ void Scene::saveToFile(const fs::path& path) {
    * Store environment map texture ID, if there is one
    */
   if (m_envmap.textureId()) {
-    auto envmapBufferData = dumpBuffer(m_envmap.aliasTable());
-
-    sceneJson["envmap"] = {
-      {"texture",    m_envmap.textureId().value()},
-      {"aliasTable", {envmapBufferData.offset, envmapBufferData.length}},
-    };
+    auto envmapBufferData = dumpBuffer(m_envmap.samplingData());
+
+    sceneJson["envmap"] = {{"texture", m_envmap.textureId().value()}};
+    if (m_envmap.samplingMode() == EnvironmentSampling_Cdf) {
+      sceneJson["envmap"]["cdf"] = {envmapBufferData.offset, envmapBufferData.length};
+      sceneJson["envmap"]["cdfSize"] = {m_envmap.cdfSize().x, m_envmap.cdfSize().y};
+    } else {
+      sceneJson["envmap"]["aliasTable"] = {envmapBufferData.offset, envmapBufferData.length};
+    }
   }
 
+  binaryFile.close();
+  std::error_code error;
+  fs::rename(tmpBinaryPath, binaryPath, error);
+  if (error) std::println(stderr, "Scene: Failed to write {}: {}", binaryPath.string(), error.message());
+
   std::ofstream file(path);
   file << sceneJson;
 }
@@ -725,13 +847,17 @@ json Scene::toJson(
 
   const auto& bd = textureBufferData.at(texture.id);
 
-  return {
+  json textureJson = {
     {"name",   texture.asset->name()},
     {"alpha",  texture.asset->hasAlpha()},
     {"size",   {width,     height}},
     {"format", texture.asset->texture()->pixelFormat()},
     {"data",   {bd.offset, bd.length}},
   };
+
+  if (texture.asset->compressed()) textureJson["mips"] = texture.asset->texture()->mipmapLevelCount();
+  if (auto tileSize = getSaveTileSize(texture.asset)) textureJson["tiles"] = {tileSize->width, tileSize->height};
+  return textureJson;
 }
 
 json Scene::toJson(const Scene::AssetData<Material>& material) {
@@ -765,15 +891,20 @@ json Scene::toJson(
   const hashmap<AssetID, MeshBufferData>& meshBufferData
 ) {
   const auto& bd = meshBufferData.at(mesh.id);
-
-  return {
-    {"indexCount",  mesh.asset->indexCount()},
-    {"vertexCount", mesh.asset->vertexCount()},
-    {"positions",   {bd.positions.offset,  bd.positions.length}},
-    {"vertexData",  {bd.vertexData.offset, bd.vertexData.length}},
-    {"indices",     {bd.indices.offset,    bd.indices.length}},
-    {"materials",   {bd.materials.offset,  bd.materials.length}},
+  const auto bounds = mesh.asset->texCoordBounds();
+
+  json meshJson = {
+    {"indexCount",     mesh.asset->indexCount()},
+    {"vertexCount",    mesh.asset->vertexCount()},
+    {"texCoordBounds", json_utils::vec(make_float4(bounds.origin, bounds.extent))},
+    {"positions",      {bd.positions.offset,  bd.positions.length}},
+    {"vertexData",     {bd.vertexData.offset, bd.vertexData.length}},
+    {"indices",        {bd.indices.offset,    bd.indices.length}},
+    {"materials",      {bd.materials.offset,  bd.materials.length}},
   };
+  if (bd.texCoords) meshJson["texCoords"] = {bd.texCoords->offset, bd.texCoords->length};
+
+  return meshJson;
 }
 
 Scene::AssetPtr Scene::assetFromJson(
@@ -794,28 +925,154 @@ std::unique_ptr<Texture> Scene::textureFromJson(const json& json, std::ifstream&
   size_t height = size.at(1);
 
   MTL::PixelFormat format = json.at("format");
-  size_t bytesPerPixel = getTextureBytesPerPixel(format);
-  size_t bytesPerRow = bytesPerPixel * width;
+  std::string name = json.at("name");
+  bool hasAlpha = json.at("alpha");
+
+  if (json.contains("tiles")) {
+    const TileLayout layout{
+      .format = format,
+      .width = uint32_t(width),
+      .height = uint32_t(height),
+      .levels = json.at("mips"),
+      .tileWidth = json.at("tiles").at(0),
+      .tileHeight = json.at("tiles").at(1),
+    };
+    return tiledTextureFromJson(layout, name, hasAlpha, json.at("data").at(0), len, data, device);
+  }
 
   void* buf = malloc(len);
   data.read((char*) buf, std::streamsize(len));
+
+  /*
+   * Compressed textures have every mip level stored one after the other
+   */
+  if (auto blockFormat = Texture::blockFormat(format)) {
+    uint32_t levels = json.at("mips");
+    MTL::Texture* tex = device->newTexture(
+      metal_utils::makeTextureDescriptor(
+        {
+          .width = uint32_t(width),
+          .height = uint32_t(height),
+          .format = format,
+          .mipLevels = levels,
+        }
+      ));
+
+    size_t offset = 0;
+    for (uint32_t level = 0; level < levels; level++) {
+      uint32_t w = std::max(uint32_t(width) >> level, 1u), h = std::max(uint32_t(height) >> level, 1u);
+      tex->replaceRegion(
+        MTL::Region(0, 0, w, h),
+        level,
+        (const uint8_t*) buf + offset,
+        compression::encodedSize(*blockFormat, w, 1)
+      );
+      offset += compression::encodedSize(*blockFormat, w, h);
+    }
+    free(buf);
+
+    return std::make_unique<Texture>(tex, name, hasAlpha);
+  }
+
+  size_t bytesPerPixel = getTextureBytesPerPixel(format);
+  size_t bytesPerRow = bytesPerPixel * width;
+
   MTL::Texture* tex = device->newTexture(
     metal_utils::makeTextureDescriptor(
       {
         .width = uint32_t(width),
         .height = uint32_t(height),
         .format = format,
+        .mipLevels = Texture::mipLevelCount(uint32_t(width), uint32_t(height)),
       }
     ));
   tex->replaceRegion(MTL::Region(0, 0, width, height), 0, buf, bytesPerRow);
   free(buf);
 
-  std::string name = json.at("name");
-  bool hasAlpha = json.at("alpha");
+  // Only the full size level is saved, rebuild the rest
+  auto texture = std::make_unique<Texture>(tex, name, hasAlpha);
+  texture->generateMipmaps();
+  return texture;
+}
+
+std::unique_ptr<Texture> Scene::tiledTextureFromJson(
+  const TileLayout& layout,
+  std::string_view name,
+  bool hasAlpha,
+  size_t offset,
+  size_t len,
+  std::ifstream& data,
+  MTL::Device* device
+) {
+  /*
+   * Stream the texture if we can, the payload stays in the file
+   */
+  if (m_binarySource && *m_binarySource && TileCache::tileSize(device, layout.format)) {
+    if (!m_tileCache) m_tileCache = std::make_shared<TileCache>(device);
+
+    if (auto streamed = m_tileCache->createTexture(layout, m_binarySource, offset)) {
+      data.seekg(std::streamoff(len), std::ios::cur);
+
+      auto [tex, streamId] = *streamed;
+      return std::make_unique<Texture>(tex, name, hasAlpha, m_tileCache, streamId);
+    }
+  }
+
+  /*
+   * Otherwise untile it into a regular texture
+   */
+  std::vector<uint8_t> payload(len);
+  data.read((char*) payload.data(), std::streamsize(len));
+
+  MTL::Texture* tex = device->newTexture(
+    metal_utils::makeTextureDescriptor(
+      {
+        .width = layout.width,
+        .height = layout.height,
+        .format = layout.format,
+        .mipLevels = layout.levels,
+      }
+    ));
+
+  const auto offsets = layout.tileOffsets();
+  const auto blockFormat = *Texture::blockFormat(layout.format);
+  std::vector<uint8_t> level;
+  for (uint32_t l = 0; l < layout.levels; l++) {
+    const uint32_t w = layout.levelWidth(l), h = layout.levelHeight(l);
+    level.resize(compression::encodedSize(blockFormat, w, h));
+    layout.untileLevel(payload.data(), offsets, l, level.data());
+    tex->replaceRegion(MTL::Region(0, 0, w, h), l, level.data(), compression::encodedSize(blockFormat, w, 1));
+  }
+
   return std::make_unique<Texture>(tex, name, hasAlpha);
 }
 
 std::unique_ptr<Mesh> Scene::meshFromJson(const json& json, std::ifstream& data, MTL::Device* device) {
+  size_t vc = json.at("vertexCount");
+  size_t ic = json.at("indexCount");
+
+  /*
+   * Scenes saved before the packed vertex format have full precision vertex
+   * data and no texture coordinate bounds. Read it and let the mesh pack it.
+   */
+  if (!json.contains("texCoordBounds")) {
+    auto read = [&]<typename T>(const char* key, std::vector<T>& values) {
+      size_t len = json.at(key).at(1);
+      values.resize(len / sizeof(T));
+      data.read((char*) values.data(), std::streamsize(len));
+    };
+
+    std::vector<float3> positions;
+    std::vector<VertexData> vertexData;
+    std::vector<uint32_t> indices, materials;
+    read("positions", positions);
+    read("vertexData", vertexData);
+    read("indices", indices);
+    read("materials", materials);
+
+    return std::make_unique<Mesh>(device, positions, vertexData, indices, materials);
+  }
+
   size_t len = json.at("positions").at(1);
   MTL::Buffer* positions = device->newBuffer(len, MTL::ResourceStorageModeShared);
   data.read((char*) positions->contents(), std::streamsize(len));
@@ -832,10 +1089,17 @@ std::unique_ptr<Mesh> Scene::meshFromJson(const json& json, std::ifstream& data,
   MTL::Buffer* materials = device->newBuffer(len, MTL::ResourceStorageModeShared);
   data.read((char*) materials->contents(), std::streamsize(len));
 
-  size_t vc = json.at("vertexCount");
-  size_t ic = json.at("indexCount");
+  MTL::Buffer* texCoords = nullptr;
+  if (json.contains("texCoords")) {
+    len = json.at("texCoords").at(1);
+    texCoords = device->newBuffer(len, MTL::ResourceStorageModeShared);
+    data.read((char*) texCoords->contents(), std::streamsize(len));
+  }
 
-  return std::make_unique<Mesh>(positions, vertexData, indices, materials, ic, vc);
+  const float4 bounds = json_utils::parseFloat4(json.at("texCoordBounds"));
+  return std::make_unique<Mesh>(
+    positions, vertexData, indices, materials, ic, vc, TexCoordBounds{bounds.xy, bounds.zw}, texCoords
+  );
 }
 
 std::unique_ptr<Material> Scene::materialFromJson(const json& materialJson) {
@@ -13,6 +13,7 @@
 #include "camera.hpp"
 #include "material.hpp"
 #include "texture.hpp"
+#include "tile_cache.hpp"
 #include "mesh.hpp"
 #include "transform.hpp"
 #include "environment.hpp"
@@ -159,6 +160,13 @@ public:
     return m_defaultMaterial;
   }
 
+  /*
+   * Tile cache for streamed textures, null if the scene has none
+   */
+  [[nodiscard]] constexpr TileCache* tileCache() {
+    return m_tileCache.get();
+  }
+
   [[nodiscard]] float4x4 worldTransform(NodeID id);
 
   [[nodiscard]] std::vector<Instance> getInstances(const std::function<bool(const Node&)>& filter);
@@ -208,6 +216,13 @@ public:
 
   void removeAsset(AssetID id);
 
+  /*
+   * Replace a mesh asset, moving every reference to it over to the new mesh.
+   * The new mesh gets a new ID, since caches keyed by asset ID assume meshes
+   * don't change. Returns the new ID.
+   */
+  AssetID replaceMesh(AssetID id, Mesh&& mesh);
+
   uint32_t getAssetRc(AssetID id);
 
   bool& assetRetained(AssetID id);
@@ -278,6 +293,13 @@ private:
   Material m_defaultMaterial;
   Environment m_envmap;
 
+  /*
+   * Texture streaming. The scene binary stays mapped while any texture streams
+   * from it.
+   */
+  std::shared_ptr<TileCache> m_tileCache;
+  std::shared_ptr<const utils::MappedFile> m_binarySource;
+
   /*
    * Internal methods
    */
@@ -302,6 +324,7 @@ private:
 
   struct MeshBufferData {
     BufferData positions, vertexData, indices, materials;
+    std::optional<BufferData> texCoords; // Only for meshes with full precision texture coordinates
   };
 
   NodeID nodeFromJson(const json& nodeJson, NodeID parentId = null);
@@ -313,6 +336,15 @@ private:
     MTL::Device* device
   );
   [[nodiscard]] std::unique_ptr<Texture> textureFromJson(const json& json, std::ifstream& data, MTL::Device* device);
+  [[nodiscard]] std::unique_ptr<Texture> tiledTextureFromJson(
+    const TileLayout& layout,
+    std::string_view name,
+    bool hasAlpha,
+    size_t offset,
+    size_t len,
+    std::ifstream& data,
+    MTL::Device* device
+  );
   [[nodiscard]] std::unique_ptr<Mesh> meshFromJson(const json& json, std::ifstream& data, MTL::Device* device);
   [[nodiscard]] std::unique_ptr<Material> materialFromJson(const json& materialJson);
 
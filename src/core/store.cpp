@@ -39,7 +39,7 @@ void Store::importTexture(loaders::texture::TextureType type) {
   const auto extensions = type == loaders::texture::TextureType::HDR ? "hdr,exr" : "png,jpg,jpeg";
   const auto texturePath = utils::fileOpen("/", extensions);
   if (texturePath) {
-    loaders::texture::TextureLoader loader(m_device, m_commandQueue, *m_scene);
+    loaders::texture::TextureLoader loader(m_device, *m_scene);
     loader.loadFromFile(texturePath.value(), texturePath->stem().string(), type);
   }
 }
@@ -0,0 +1,197 @@
+#include "tangents.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+#include <mikktspace.h>
+#include <unordered_dense.h>
+
+#include <utils/utils.hpp>
+
+namespace pt::tangents {
+
+/*
+ * A MikkTSpace run over a subset of the mesh's faces
+ */
+struct Run {
+  std::span<const float3> positions;
+  std::span<const float3> normals;
+  std::span<const float2> texCoords;
+  std::span<const uint32_t> indices;
+
+  std::vector<uint32_t> faces;  // Faces passed to MikkTSpace, in mesh order
+  std::vector<float4> tangents; // Per corner of each face in the run
+};
+
+/*
+ * Callback functions for MikkTSpace
+ */
+namespace mikkt {
+
+static uint32_t vertexIndex(const SMikkTSpaceContext* ctx, int face, int vert) {
+  auto run = static_cast<const Run*>(ctx->m_pUserData);
+  return run->indices[size_t(run->faces[face]) * 3 + vert];
+}
+
+static int getNumFaces(const SMikkTSpaceContext* ctx) {
+  return int(static_cast<const Run*>(ctx->m_pUserData)->faces.size());
+}
+
+static int getNumVerticesOfFace(const SMikkTSpaceContext* ctx, int face) {
+  return 3; // Only triangles here
+}
+
+static void getPosition(const SMikkTSpaceContext* ctx, float* outPos, int face, int vert) {
+  auto pos = static_cast<const Run*>(ctx->m_pUserData)->positions[vertexIndex(ctx, face, vert)];
+  outPos[0] = pos.x;
+  outPos[1] = pos.y;
+  outPos[2] = pos.z;
+}
+
+static void getNormal(const SMikkTSpaceContext* ctx, float* outNormal, int face, int vert) {
+  auto normal = static_cast<const Run*>(ctx->m_pUserData)->normals[vertexIndex(ctx, face, vert)];
+  outNormal[0] = normal.x;
+  outNormal[1] = normal.y;
+  outNormal[2] = normal.z;
+}
+
+static void getTexCoord(const SMikkTSpaceContext* ctx, float* outTexCoord, int face, int vert) {
+  auto texCoords = static_cast<const Run*>(ctx->m_pUserData)->texCoords[vertexIndex(ctx, face, vert)];
+  outTexCoord[0] = texCoords.x;
+  outTexCoord[1] = texCoords.y;
+}
+
+static void setTSpaceBasic(const SMikkTSpaceContext* ctx, const float* tangent, float sign, int face, int vert) {
+  auto run = static_cast<Run*>(ctx->m_pUserData);
+  run->tangents[size_t(face) * 3 + vert] = float4{tangent[0], tangent[1], tangent[2], sign};
+}
+
+}
+
+static void runMikkTSpace(Run& run) {
+  run.tangents.assign(run.faces.size() * 3, float4{1.0f, 0.0f, 0.0f, 1.0f});
+
+  SMikkTSpaceInterface interface{
+    .m_getNumFaces = mikkt::getNumFaces,
+    .m_getNumVerticesOfFace = mikkt::getNumVerticesOfFace,
+    .m_getPosition = mikkt::getPosition,
+    .m_getNormal = mikkt::getNormal,
+    .m_getTexCoord = mikkt::getTexCoord,
+    .m_setTSpaceBasic = mikkt::setTSpaceBasic,
+    .m_setTSpace = nullptr,
+  };
+
+  SMikkTSpaceContext ctx{
+    .m_pInterface = &interface,
+    .m_pUserData = static_cast<void*>(&run),
+  };
+
+  genTangSpaceDefault(&ctx);
+}
+
+/*
+ * MikkTSpace treats corners as the same vertex if their position, normal and
+ * texture coordinates compare equal, even with different indices. Vertices
+ * get a canonical index by the same rule, adding zero to turn -0 into +0.
+ */
+struct VertexKey {
+  float values[8];
+
+  bool operator==(const VertexKey& other) const { return std::memcmp(values, other.values, sizeof(values)) == 0; }
+};
+
+struct VertexKeyHash {
+  using is_avalanching = void;
+
+  [[nodiscard]] uint64_t operator()(const VertexKey& key) const noexcept {
+    return ankerl::unordered_dense::detail::wyhash::hash(key.values, sizeof(key.values));
+  }
+};
+
+static std::vector<uint32_t> canonicalVertices(
+  std::span<const float3> positions,
+  std::span<const float3> normals,
+  std::span<const float2> texCoords
+) {
+  ankerl::unordered_dense::map<VertexKey, uint32_t, VertexKeyHash> vertices;
+  vertices.reserve(positions.size());
+
+  std::vector<uint32_t> canonical(positions.size());
+  for (size_t v = 0; v < positions.size(); v++) {
+    const float3 p = positions[v], n = normals[v];
+    const float2 uv = texCoords[v];
+    const VertexKey key{{
+      p.x + 0.0f, p.y + 0.0f, p.z + 0.0f,
+      n.x + 0.0f, n.y + 0.0f, n.z + 0.0f,
+      uv.x + 0.0f, uv.y + 0.0f,
+    }};
+    canonical[v] = vertices.try_emplace(key, uint32_t(vertices.size())).first->second;
+  }
+
+  return canonical;
+}
+
+std::vector<float4> generate(
+  std::span<const float3> positions,
+  std::span<const float3> normals,
+  std::span<const float2> texCoords,
+  std::span<const uint32_t> indices,
+  size_t chunkFaces
+) {
+  const size_t faceCount = indices.size() / 3;
+  chunkFaces = std::max(chunkFaces, size_t(1));
+
+  if (faceCount <= chunkFaces) {
+    Run run{positions, normals, texCoords, indices, std::vector<uint32_t>(faceCount), {}};
+    std::iota(run.faces.begin(), run.faces.end(), 0u);
+    runMikkTSpace(run);
+    return std::move(run.tangents);
+  }
+
+  /*
+   * Faces using each canonical vertex
+   */
+  const auto canonical = canonicalVertices(positions, normals, texCoords);
+  const size_t canonicalCount = canonical.empty() ? 0 : *std::ranges::max_element(canonical) + 1;
+
+  std::vector<uint32_t> offsets(canonicalCount + 1, 0);
+  for (uint32_t idx: indices) offsets[canonical[idx] + 1]++;
+  for (size_t v = 0; v < canonicalCount; v++) offsets[v + 1] += offsets[v];
+
+  std::vector<uint32_t> adjacency(faceCount * 3);
+  {
+    std::vector<uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < faceCount * 3; i++) adjacency[cursor[canonical[indices[i]]]++] = uint32_t(i / 3);
+  }
+
+  /*
+   * Run each chunk with the faces around it, and keep the tangents of the
+   * chunk's own faces
+   */
+  std::vector<float4> tangents(faceCount * 3);
+  const size_t chunkCount = (faceCount + chunkFaces - 1) / chunkFaces;
+  utils::parallelFor(chunkCount, [&](size_t chunk) {
+    const size_t begin = chunk * chunkFaces, end = std::min(begin + chunkFaces, faceCount);
+
+    Run run{positions, normals, texCoords, indices, {}, {}};
+    for (size_t i = begin * 3; i < end * 3; i++) {
+      const uint32_t v = canonical[indices[i]];
+      run.faces.insert(run.faces.end(), adjacency.begin() + offsets[v], adjacency.begin() + offsets[v + 1]);
+    }
+    std::ranges::sort(run.faces);
+    run.faces.erase(std::unique(run.faces.begin(), run.faces.end()), run.faces.end());
+
+    runMikkTSpace(run);
+
+    for (size_t i = 0; i < run.faces.size(); i++) {
+      const size_t face = run.faces[i];
+      if (face < begin || face >= end) continue;
+      std::copy_n(run.tangents.begin() + i * 3, 3, tangents.begin() + face * 3);
+    }
+  });
+
+  return tangents;
+}
+
+}
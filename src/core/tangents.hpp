@@ -0,0 +1,35 @@
+#ifndef PLATINUM_TANGENTS_HPP
+#define PLATINUM_TANGENTS_HPP
+
+#include <span>
+#include <vector>
+#include <simd/simd.h>
+
+using namespace simd;
+
+namespace pt::tangents {
+
+constexpr size_t defaultChunkFaces = size_t(1) << 16;
+
+/*
+ * MikkTSpace tangents for every triangle corner of an indexed mesh, three per
+ * triangle, with the bitangent sign in w.
+ * Corners are passed to MikkTSpace unwelded, it merges corners with the same
+ * position, normal and texture coordinates on its own, so split vertices (UV
+ * seams, hard edges) get their own tangents.
+ * Meshes with more than chunkFaces triangles are split in chunks processed in
+ * parallel. Each chunk also includes every triangle sharing a vertex with it,
+ * which is everything MikkTSpace looks at for a corner, so the result is the
+ * same as processing the whole mesh at once.
+ */
+std::vector<float4> generate(
+  std::span<const float3> positions,
+  std::span<const float3> normals,
+  std::span<const float2> texCoords,
+  std::span<const uint32_t> indices,
+  size_t chunkFaces = defaultChunkFaces
+);
+
+}
+
+#endif //PLATINUM_TANGENTS_HPP
@@ -1,30 +1,304 @@
 #include "texture.hpp"
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <print>
+
+#include <core/tile_cache.hpp>
+#include <utils/metal_utils.hpp>
+#include <utils/utils.hpp>
+
 namespace pt {
 
 Texture::Texture(MTL::Texture* texture, std::string_view name, bool alpha) noexcept
 	: m_texture(texture), m_name(name), m_alpha(alpha) {}
 
+Texture::Texture(
+  MTL::Texture* texture,
+  std::string_view name,
+  bool alpha,
+  std::shared_ptr<TileCache> tileCache,
+  uint32_t streamId
+) noexcept: m_texture(texture), m_name(name), m_alpha(alpha), m_tileCache(std::move(tileCache)), m_streamId(streamId) {}
+
 Texture::Texture(Texture&& t) noexcept {
   m_texture = t.m_texture;
   m_name = std::move(t.m_name);
   m_alpha = t.m_alpha;
+  m_tileCache = std::move(t.m_tileCache);
+  m_streamId = t.m_streamId;
   
   t.m_texture = nullptr;
+  t.m_tileCache = nullptr;
+  t.m_streamId = 0;
 }
 
 Texture& Texture::operator=(Texture&& t) noexcept {
+  if (this == &t) return *this;
+
+  // Release the texture we're replacing, and its stream if it had one
+  if (m_tileCache) m_tileCache->release(m_streamId);
+  if (m_texture) m_texture->release();
+
   m_texture = t.m_texture;
   m_name = std::move(t.m_name);
   m_alpha = t.m_alpha;
+  m_tileCache = std::move(t.m_tileCache);
+  m_streamId = t.m_streamId;
   
   t.m_texture = nullptr;
+  t.m_tileCache = nullptr;
+  t.m_streamId = 0;
   
   return *this;
 }
 
 Texture::~Texture() {
+  if (m_tileCache) m_tileCache->release(m_streamId);
+  if (m_texture) m_texture->release();
+}
+
+static float srgbToLinear(uint8_t v) {
+  float c = float(v) / 255.0f;
+  return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+uint16_t Texture::floatToHalf(float f) {
+  const uint32_t bits = std::bit_cast<uint32_t>(f);
+  const auto sign = uint16_t((bits >> 16) & 0x8000);
+  const float a = std::abs(f);
+
+  if (!(a > 0.0f)) return 0;
+  if (a >= 65504.0f) return sign | 0x7bff;
+  if (a < 6.1035156e-5f) return sign | uint16_t(std::nearbyint(a * 16777216.0f)); // Denormal, a / 2^-24
+
+  // Round to nearest even, like the hardware conversions
+  const uint32_t magnitude = bits & 0x7fffffff, rest = magnitude & 0x1fff;
+  uint32_t half = (magnitude >> 13) - ((127 - 15) << 10);
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+  return sign | uint16_t(std::min(half, 0x7bffu));
+}
+
+float Texture::halfToFloat(uint16_t h) {
+  const float sign = h & 0x8000 ? -1.0f : 1.0f;
+  const uint32_t exponent = (h >> 10) & 0x1f, mantissa = h & 0x3ff;
+
+  if (exponent == 0) return sign * std::ldexp(float(mantissa), -24);
+  if (exponent == 31) return mantissa ? 0.0f : sign * 65504.0f;
+  return sign * std::ldexp(float(mantissa | 0x400), int(exponent) - 25);
+}
+
+std::optional<compression::BlockFormat> Texture::blockFormat(MTL::PixelFormat format) {
+  switch (format) {
+    case MTL::PixelFormatBC4_RUnorm: return compression::BlockFormat::BC4;
+    case MTL::PixelFormatBC5_RGUnorm: return compression::BlockFormat::BC5;
+    case MTL::PixelFormatBC6H_RGBUfloat: return compression::BlockFormat::BC6H;
+    case MTL::PixelFormatBC7_RGBAUnorm:
+    case MTL::PixelFormatBC7_RGBAUnorm_sRGB: return compression::BlockFormat::BC7;
+    default: return std::nullopt;
+  }
+}
+
+MTL::PixelFormat Texture::compressedPixelFormat(compression::BlockFormat format, bool srgb) {
+  switch (format) {
+    case compression::BlockFormat::BC4: return MTL::PixelFormatBC4_RUnorm;
+    case compression::BlockFormat::BC5: return MTL::PixelFormatBC5_RGUnorm;
+    case compression::BlockFormat::BC6H: return MTL::PixelFormatBC6H_RGBUfloat;
+    case compression::BlockFormat::BC7: return srgb ? MTL::PixelFormatBC7_RGBAUnorm_sRGB : MTL::PixelFormatBC7_RGBAUnorm;
+  }
+  return MTL::PixelFormatInvalid;
+}
+
+std::vector<simd::float4> Texture::readPixels(uint32_t level) const {
+  const uint32_t height = uint32_t(std::max(m_texture->height() >> level, NS::UInteger(1)));
+
+  // Streamed textures aren't fully resident (or CPU accessible), decode the level from the source
+  if (m_tileCache) {
+    const uint32_t width = uint32_t(std::max(m_texture->width() >> level, NS::UInteger(1)));
+    const auto format = m_texture->pixelFormat();
+    return compression::decode(
+      m_tileCache->readLevel(m_streamId, level),
+      width,
+      height,
+      *blockFormat(format),
+      format == MTL::PixelFormatBC7_RGBAUnorm_sRGB
+    );
+  }
+
+  return readRows(m_texture, level, 0, height);
+}
+
+std::vector<simd::float4> Texture::readRows(MTL::Texture* texture, uint32_t level, uint32_t y0, uint32_t y1) {
+  const size_t width = std::max(texture->width() >> level, NS::UInteger(1));
+  const size_t height = std::max(texture->height() >> level, NS::UInteger(1));
+  y1 = std::min(y1, uint32_t(height));
+  if (y0 >= y1) return {};
+
+  const auto region = MTL::Region(0, y0, width, y1 - y0);
+  std::vector<simd::float4> pixels(width * (y1 - y0));
+
+  const auto format = texture->pixelFormat();
+  if (auto block = blockFormat(format)) {
+    /*
+     * Compressed textures are read in whole rows of blocks and decoded on the CPU
+     */
+    const uint32_t by0 = y0 / 4 * 4, by1 = std::min(uint32_t(height), (y1 + 3) / 4 * 4);
+    std::vector<uint8_t> data(compression::encodedSize(*block, uint32_t(width), by1 - by0));
+    const size_t bytesPerRow = compression::encodedSize(*block, uint32_t(width), 1);
+    texture->getBytes(data.data(), bytesPerRow, MTL::Region(0, by0, width, by1 - by0), level);
+
+    const bool srgb = format == MTL::PixelFormatBC7_RGBAUnorm_sRGB;
+    return compression::decode(data, uint32_t(width), by1 - by0, *block, srgb, y0 - by0, y1 - by0);
+  }
+
+  switch (format) {
+    case MTL::PixelFormatRGBA32Float:
+      texture->getBytes(pixels.data(), width * sizeof(simd::float4), region, level);
+      break;
+    case MTL::PixelFormatRGBA16Float: {
+      std::vector<uint16_t> data(pixels.size() * 4);
+      texture->getBytes(data.data(), width * 4 * sizeof(uint16_t), region, level);
+
+      utils::parallelFor(pixels.size(), [&](size_t i) {
+        for (size_t c = 0; c < 4; c++) pixels[i][c] = halfToFloat(data[i * 4 + c]);
+      }, 1 << 14);
+      break;
+    }
+    case MTL::PixelFormatRGBA8Unorm_sRGB:
+    case MTL::PixelFormatRGBA8Unorm:
+    case MTL::PixelFormatRG8Unorm:
+    case MTL::PixelFormatR8Unorm: {
+      const size_t channels = format == MTL::PixelFormatR8Unorm ? 1 : format == MTL::PixelFormatRG8Unorm ? 2 : 4;
+
+      std::vector<uint8_t> data(pixels.size() * channels);
+      texture->getBytes(data.data(), width * channels, region, level);
+
+      std::array<float, 256> lut;
+      for (uint32_t i = 0; i < 256; i++)
+        lut[i] = format == MTL::PixelFormatRGBA8Unorm_sRGB ? srgbToLinear(i) : float(i) / 255.0f;
+
+      for (size_t i = 0; i < pixels.size(); i++) {
+        const uint8_t* texel = &data[i * channels];
+        simd::float4 p = {0.0f, 0.0f, 0.0f, 1.0f};
+        for (size_t c = 0; c < channels; c++)
+          p[c] = c == 3 ? float(texel[c]) / 255.0f : lut[texel[c]];
+        pixels[i] = p;
+      }
+      break;
+    }
+    default:
+      std::println(stderr, "Texture::readRows: Unsupported pixel format {}", int(format));
+      break;
+  }
+
+  return pixels;
+}
+
+static uint8_t linearToSrgb(float c) {
+  c = std::clamp(c, 0.0f, 1.0f);
+  c = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+  return uint8_t(std::lround(c * 255.0f));
+}
+
+uint32_t Texture::mipLevelCount(uint32_t width, uint32_t height) {
+  return uint32_t(std::bit_width(std::max(width, height)));
+}
+
+void Texture::generateMipmaps() {
+  const auto format = m_texture->pixelFormat();
+  const size_t channels = format == MTL::PixelFormatR8Unorm ? 1 : format == MTL::PixelFormatRG8Unorm ? 2 : 4;
+  const bool srgb = format == MTL::PixelFormatRGBA8Unorm_sRGB;
+  const bool hdr = format == MTL::PixelFormatRGBA32Float;
+  const bool half = format == MTL::PixelFormatRGBA16Float;
+  if (m_texture->mipmapLevelCount() <= 1 || blockFormat(format)) return;
+
+  size_t width = m_texture->width(), height = m_texture->height();
+  std::vector<simd::float4> level = readPixels();
+
+  /*
+   * Downsample each level from the previous one with a separable [1 3 3 1] / 8 filter, wrapping
+   * around the edges like the repeat sampler does. Levels are kept as floats, and only
+   * quantized when written to the texture.
+   */
+  const std::array<float, 4> weights = {0.125f, 0.375f, 0.375f, 0.125f};
+  for (uint32_t mip = 1; mip < m_texture->mipmapLevelCount(); mip++) {
+    const size_t w = std::max(width / 2, size_t(1)), h = std::max(height / 2, size_t(1));
+    std::vector<simd::float4> next(w * h);
+
+    utils::parallelFor(h, [&](size_t y) {
+      for (size_t x = 0; x < w; x++) {
+        simd::float4 sum = 0.0f;
+        for (int j = 0; j < 4; j++) {
+          // Axes that are already a single texel don't get filtered
+          const size_t sy = height > 1 ? (2 * y + height + j - 1) % height : 0;
+          const float wy = height > 1 ? weights[j] : (j == 0 ? 1.0f : 0.0f);
+          if (wy == 0.0f) continue;
+
+          for (int i = 0; i < 4; i++) {
+            const size_t sx = width > 1 ? (2 * x + width + i - 1) % width : 0;
+            const float wx = width > 1 ? weights[i] : (i == 0 ? 1.0f : 0.0f);
+            if (wx == 0.0f) continue;
+
+            sum += level[sy * width + sx] * (wx * wy);
+          }
+        }
+        next[y * w + x] = sum;
+      }
+    }, 16);
+
+    const auto region = MTL::Region(0, 0, w, h);
+    if (hdr) {
+      m_texture->replaceRegion(region, mip, next.data(), w * sizeof(simd::float4));
+    } else if (half) {
+      std::vector<uint16_t> data(w * h * 4);
+      utils::parallelFor(w * h, [&](size_t i) {
+        for (size_t c = 0; c < 4; c++) data[i * 4 + c] = floatToHalf(next[i][c]);
+      }, 4096);
+      m_texture->replaceRegion(region, mip, data.data(), w * 4 * sizeof(uint16_t));
+    } else {
+      std::vector<uint8_t> data(w * h * channels);
+      utils::parallelFor(w * h, [&](size_t i) {
+        for (size_t c = 0; c < channels; c++) {
+          const float v = next[i][c];
+          data[i * channels + c] = srgb && c < 3 ? linearToSrgb(v) : uint8_t(std::lround(std::clamp(v, 0.0f, 1.0f) * 255.0f));
+        }
+      }, 4096);
+      m_texture->replaceRegion(region, mip, data.data(), w * channels);
+    }
+
+    level = std::move(next);
+    width = w;
+    height = h;
+  }
+}
+
+void Texture::compress(MTL::Device* device, compression::BlockFormat format, compression::Quality quality) {
+  if (blockFormat(m_texture->pixelFormat())) return;
+
+  /*
+   * Encode every mip level into a new texture with the same dimensions, then swap it in
+   */
+  const bool srgb = m_texture->pixelFormat() == MTL::PixelFormatRGBA8Unorm_sRGB;
+  const uint32_t width = uint32_t(m_texture->width()), height = uint32_t(m_texture->height());
+  const uint32_t levels = uint32_t(m_texture->mipmapLevelCount());
+
+  auto* compressed = device->newTexture(metal_utils::makeTextureDescriptor({
+    .width = width,
+    .height = height,
+    .format = compressedPixelFormat(format, srgb),
+    .mipLevels = levels,
+  }));
+
+  for (uint32_t level = 0; level < levels; level++) {
+    const uint32_t w = std::max(width >> level, 1u), h = std::max(height >> level, 1u);
+    const auto data = compression::encode(readPixels(level), w, h, format, quality, srgb);
+    compressed->replaceRegion(MTL::Region(0, 0, w, h), level, data.data(), compression::encodedSize(format, w, 1));
+  }
+
   m_texture->release();
+  m_texture = compressed;
 }
 
 }
@@ -1,14 +1,28 @@
 #ifndef PLATINUM_TEXTURE_HPP
 #define PLATINUM_TEXTURE_HPP
 
+#include <memory>
+#include <optional>
+#include <vector>
 #include <Metal/Metal.hpp>
+#include <simd/simd.h>
+
+#include <core/texture_compression.hpp>
 
 namespace pt {
 
+class TileCache;
+
 class Texture {
 public:
   Texture(MTL::Texture* texture, std::string_view name, bool alpha) noexcept;
 
+  /*
+   * Streamed texture, created by the tile cache. Only the tiles the renderer
+   * asks for are resident, see TileCache.
+   */
+  Texture(MTL::Texture* texture, std::string_view name, bool alpha, std::shared_ptr<TileCache> tileCache, uint32_t streamId) noexcept;
+
   Texture(const Texture& m) noexcept = delete;
   Texture(Texture&& m) noexcept;
 
@@ -20,11 +34,58 @@ public:
   [[nodiscard]] constexpr MTL::Texture* texture() { return m_texture; }
   [[nodiscard]] constexpr std::string_view name() { return m_name; }
   [[nodiscard]] constexpr bool hasAlpha() const { return m_alpha; }
+
+  [[nodiscard]] constexpr bool streamed() const { return m_tileCache != nullptr; }
+  [[nodiscard]] constexpr TileCache* tileCache() const { return m_tileCache.get(); }
+  [[nodiscard]] constexpr uint32_t streamId() const { return m_streamId; }
+
+  /*
+   * Read the texture back as linear RGBA floats, row major, with missing
+   * channels filled in the same way a shader sample does. Block compressed
+   * textures are decoded on the CPU, streamed ones are read from their source.
+   */
+  [[nodiscard]] std::vector<simd::float4> readPixels(uint32_t level = 0) const;
+
+  /*
+   * Same as readPixels, for rows [y0, y1) of any supported texture
+   */
+  [[nodiscard]] static std::vector<simd::float4> readRows(MTL::Texture* texture, uint32_t level, uint32_t y0, uint32_t y1);
+
+  /*
+   * Fill in mip levels 1 and up from level 0 on the CPU. Filtering is done in
+   * linear space, so sRGB textures are decoded first and encoded again after.
+   */
+  void generateMipmaps();
+
+  /*
+   * Replace the texture with a block compressed copy, encoding every mip
+   * level on the CPU. Mip levels must be generated first, compressed textures
+   * can't be written to.
+   */
+  void compress(MTL::Device* device, compression::BlockFormat format, compression::Quality quality);
+
+  [[nodiscard]] bool compressed() const { return blockFormat(m_texture->pixelFormat()).has_value(); }
+
+  [[nodiscard]] static std::optional<compression::BlockFormat> blockFormat(MTL::PixelFormat format);
+  [[nodiscard]] static MTL::PixelFormat compressedPixelFormat(compression::BlockFormat format, bool srgb);
+
+  /*
+   * Conversion between floats and half floats for RGBA16F textures. Out of
+   * range values are clamped to the largest finite half, and NaNs are flushed
+   * to zero.
+   */
+  [[nodiscard]] static uint16_t floatToHalf(float f);
+  [[nodiscard]] static float halfToFloat(uint16_t h);
+
+  [[nodiscard]] static uint32_t mipLevelCount(uint32_t width, uint32_t height);
   
 private:
   MTL::Texture* m_texture;
   std::string m_name;
   bool m_alpha;
+
+  std::shared_ptr<TileCache> m_tileCache;
+  uint32_t m_streamId = 0;
 };
 
 }
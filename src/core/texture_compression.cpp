@@ -0,0 +1,609 @@
+#include "texture_compression.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+
+#include <utils/utils.hpp>
+
+namespace pt::compression {
+
+/*
+ * Interpolation weights (out of 64) for 4 bit indices, shared by BC6H and BC7
+ */
+static constexpr std::array<int, 16> weights4 = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+static float srgbEncode(float c) {
+  c = std::clamp(c, 0.0f, 1.0f);
+  return c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+}
+
+static float srgbDecode(float c) {
+  return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+/*
+ * Conversion between floats and the bits of an unsigned half float, clamped to the range BC6H
+ * can represent. Denormals are flushed on encode.
+ */
+static uint32_t floatToHalfBits(float f) {
+  if (!(f > 0.0f)) return 0;
+  if (f >= 65504.0f) return 0x7bff;
+
+  const uint32_t bits = std::bit_cast<uint32_t>(f);
+  const int32_t exponent = int32_t((bits >> 23) & 0xff) - 127 + 15;
+  if (exponent <= 0) return 0;
+
+  // Round to nearest, carrying into the exponent if needed
+  uint32_t half = (uint32_t(exponent) << 10) | ((bits >> 13) & 0x3ff);
+  if (bits & 0x1000) half++;
+  return std::min(half, 0x7bffu);
+}
+
+static float halfBitsToFloat(uint32_t h) {
+  const uint32_t exponent = (h >> 10) & 0x1f, mantissa = h & 0x3ff;
+  if (exponent == 0) return std::ldexp(float(mantissa), -24);
+  if (exponent == 31) return 65504.0f;
+  return std::ldexp(float(mantissa | 0x400), int(exponent) - 25);
+}
+
+/*
+ * LSB first bit packing for 128 bit blocks
+ */
+struct BitWriter {
+  uint8_t* data;
+  uint32_t pos = 0;
+
+  void write(uint32_t value, uint32_t bits) {
+    for (uint32_t i = 0; i < bits; i++, pos++) {
+      if ((value >> i) & 1) data[pos / 8] |= uint8_t(1 << (pos % 8));
+    }
+  }
+};
+
+struct BitReader {
+  const uint8_t* data;
+  uint32_t pos = 0;
+
+  uint32_t read(uint32_t bits) {
+    uint32_t value = 0;
+    for (uint32_t i = 0; i < bits; i++, pos++) value |= uint32_t((data[pos / 8] >> (pos % 8)) & 1) << i;
+    return value;
+  }
+};
+
+/*
+ * BC4: two 8 bit endpoints and 3 bit indices. Blocks with r0 > r1 interpolate six values
+ * between the endpoints, otherwise four values plus exact 0 and 1.
+ */
+static void bc4Palette(int r0, int r1, float palette[8]) {
+  palette[0] = float(r0);
+  palette[1] = float(r1);
+  if (r0 > r1) {
+    for (int k = 2; k < 8; k++) palette[k] = float((8 - k) * r0 + (k - 1) * r1) / 7.0f;
+  } else {
+    for (int k = 2; k < 6; k++) palette[k] = float((6 - k) * r0 + (k - 1) * r1) / 5.0f;
+    palette[6] = 0.0f;
+    palette[7] = 255.0f;
+  }
+}
+
+static float bc4Fit(const float values[16], int r0, int r1, uint8_t indices[16]) {
+  float palette[8];
+  bc4Palette(r0, r1, palette);
+
+  float error = 0.0f;
+  for (int i = 0; i < 16; i++) {
+    float best = INFINITY;
+    for (int k = 0; k < 8; k++) {
+      const float d = values[i] - palette[k];
+      if (d * d < best) {
+        best = d * d;
+        indices[i] = uint8_t(k);
+      }
+    }
+    error += best;
+  }
+  return error;
+}
+
+static void encodeBC4(const float block[16], uint8_t* out, Quality quality) {
+  float values[16];
+  float lo = 255.0f, hi = 0.0f, innerLo = 255.0f, innerHi = 0.0f;
+  for (int i = 0; i < 16; i++) {
+    values[i] = std::clamp(block[i], 0.0f, 1.0f) * 255.0f;
+    lo = std::min(lo, values[i]);
+    hi = std::max(hi, values[i]);
+
+    // Range of the values that aren't exactly representable by the 0/1 entries
+    if (values[i] > 0.5f && values[i] < 254.5f) {
+      innerLo = std::min(innerLo, values[i]);
+      innerHi = std::max(innerHi, values[i]);
+    }
+  }
+
+  int bestR0 = int(std::lround(hi)), bestR1 = int(std::lround(lo));
+  uint8_t bestIndices[16], indices[16];
+  float bestError = bc4Fit(values, bestR0, bestR1, bestIndices);
+
+  /*
+   * Search endpoints around the range of the block in both modes. The search radius depends on
+   * quality; Fast only uses the min/max endpoints. fourValues picks the mode with exact 0 and 1,
+   * which needs r0 <= r1.
+   */
+  const int radius = quality == Quality::High ? 2 : quality == Quality::Normal ? 1 : 0;
+  auto search = [&](int c0, int c1, bool fourValues) {
+    for (int d0 = -radius; d0 <= radius; d0++) {
+      for (int d1 = -radius; d1 <= radius; d1++) {
+        int r0 = std::clamp(c0 + d0, 0, 255), r1 = std::clamp(c1 + d1, 0, 255);
+        if (fourValues) std::swap(r0, r1);
+        if ((r0 > r1) == fourValues) continue;
+
+        const float error = bc4Fit(values, r0, r1, indices);
+        if (error < bestError) {
+          bestError = error;
+          bestR0 = r0;
+          bestR1 = r1;
+          std::copy_n(indices, 16, bestIndices);
+        }
+      }
+    }
+  };
+
+  if (quality != Quality::Fast) search(int(std::lround(hi)), int(std::lround(lo)), false);
+  if (quality != Quality::Fast && innerLo <= innerHi)
+    search(int(std::lround(innerHi)), int(std::lround(innerLo)), true);
+
+  out[0] = uint8_t(bestR0);
+  out[1] = uint8_t(bestR1);
+  uint64_t bits = 0;
+  for (int i = 0; i < 16; i++) bits |= uint64_t(bestIndices[i]) << (3 * i);
+  for (int i = 0; i < 6; i++) out[2 + i] = uint8_t(bits >> (8 * i));
+}
+
+static void decodeBC4(const uint8_t* in, float out[16]) {
+  float palette[8];
+  bc4Palette(in[0], in[1], palette);
+
+  uint64_t bits = 0;
+  for (int i = 0; i < 6; i++) bits |= uint64_t(in[2 + i]) << (8 * i);
+  for (int i = 0; i < 16; i++) out[i] = palette[(bits >> (3 * i)) & 7] / 255.0f;
+}
+
+/*
+ * Shared endpoint fitting for BC6H and BC7: a line through the block along its principal axis,
+ * and a least squares refit of both endpoints for a given set of indices.
+ */
+template<int N>
+static void principalAxisEndpoints(const float pixels[16][4], float e0[4], float e1[4]) {
+  float mean[N] = {};
+  for (int i = 0; i < 16; i++) {
+    for (int c = 0; c < N; c++) mean[c] += pixels[i][c] / 16.0f;
+  }
+
+  float cov[N][N] = {};
+  float lo[N], hi[N];
+  std::fill_n(lo, N, INFINITY);
+  std::fill_n(hi, N, -INFINITY);
+  for (int i = 0; i < 16; i++) {
+    for (int a = 0; a < N; a++) {
+      lo[a] = std::min(lo[a], pixels[i][a]);
+      hi[a] = std::max(hi[a], pixels[i][a]);
+      for (int b = 0; b < N; b++) cov[a][b] += (pixels[i][a] - mean[a]) * (pixels[i][b] - mean[b]);
+    }
+  }
+
+  // Power iteration, starting from the bounding box diagonal
+  float axis[N];
+  for (int c = 0; c < N; c++) axis[c] = hi[c] - lo[c];
+  for (int iter = 0; iter < 8; iter++) {
+    float next[N] = {};
+    for (int a = 0; a < N; a++) {
+      for (int b = 0; b < N; b++) next[a] += cov[a][b] * axis[b];
+    }
+
+    float len = 0.0f;
+    for (int c = 0; c < N; c++) len += next[c] * next[c];
+    if (len < 1e-12f) break;
+    for (int c = 0; c < N; c++) axis[c] = next[c] / std::sqrt(len);
+  }
+
+  float len = 0.0f;
+  for (int c = 0; c < N; c++) len += axis[c] * axis[c];
+  if (len < 1e-12f) {
+    for (int c = 0; c < N; c++) e0[c] = e1[c] = mean[c];
+    return;
+  }
+  for (int c = 0; c < N; c++) axis[c] /= std::sqrt(len);
+
+  float tMin = INFINITY, tMax = -INFINITY;
+  for (int i = 0; i < 16; i++) {
+    float t = 0.0f;
+    for (int c = 0; c < N; c++) t += (pixels[i][c] - mean[c]) * axis[c];
+    tMin = std::min(tMin, t);
+    tMax = std::max(tMax, t);
+  }
+
+  for (int c = 0; c < N; c++) {
+    e0[c] = mean[c] + axis[c] * tMin;
+    e1[c] = mean[c] + axis[c] * tMax;
+  }
+}
+
+template<int N>
+static bool leastSquaresEndpoints(const float pixels[16][4], const uint8_t indices[16], float e0[4], float e1[4]) {
+  float a = 0.0f, b = 0.0f, c = 0.0f;
+  float x0[N] = {}, x1[N] = {};
+  for (int i = 0; i < 16; i++) {
+    const float w = float(weights4[indices[i]]) / 64.0f;
+    a += (1.0f - w) * (1.0f - w);
+    b += (1.0f - w) * w;
+    c += w * w;
+    for (int ch = 0; ch < N; ch++) {
+      x0[ch] += (1.0f - w) * pixels[i][ch];
+      x1[ch] += w * pixels[i][ch];
+    }
+  }
+
+  const float det = a * c - b * b;
+  if (std::abs(det) < 1e-6f) return false;
+
+  for (int ch = 0; ch < N; ch++) {
+    e0[ch] = (c * x0[ch] - b * x1[ch]) / det;
+    e1[ch] = (a * x1[ch] - b * x0[ch]) / det;
+  }
+  return true;
+}
+
+/*
+ * BC7 mode 6: a single subset with 7 bit RGBA endpoints, a p-bit per endpoint and 4 bit
+ * indices. Pixels are in [0, 255].
+ */
+struct BC7Block {
+  int q[2][4];
+  int p[2];
+  uint8_t indices[16];
+  float error;
+};
+
+static int bc7Endpoint(const BC7Block& b, int e, int c) { return (b.q[e][c] << 1) | b.p[e]; }
+
+static float bc7AssignIndices(const float pixels[16][4], BC7Block& b) {
+  float palette[16][4];
+  for (int k = 0; k < 16; k++) {
+    for (int c = 0; c < 4; c++)
+      palette[k][c] =
+        float(((64 - weights4[k]) * bc7Endpoint(b, 0, c) + weights4[k] * bc7Endpoint(b, 1, c) + 32) >> 6);
+  }
+
+  b.error = 0.0f;
+  for (int i = 0; i < 16; i++) {
+    float best = INFINITY;
+    for (int k = 0; k < 16; k++) {
+      float d = 0.0f;
+      for (int c = 0; c < 4; c++) d += (pixels[i][c] - palette[k][c]) * (pixels[i][c] - palette[k][c]);
+      if (d < best) {
+        best = d;
+        b.indices[i] = uint8_t(k);
+      }
+    }
+    b.error += best;
+  }
+  return b.error;
+}
+
+static void bc7Quantize(const float e[4], int q[4], int p) {
+  for (int c = 0; c < 4; c++) q[c] = std::clamp(int(std::lround((std::clamp(e[c], 0.0f, 255.0f) - float(p)) * 0.5f)), 0, 127);
+}
+
+static float bc7QuantizationError(const float e[4], int p) {
+  int q[4];
+  bc7Quantize(e, q, p);
+
+  float error = 0.0f;
+  for (int c = 0; c < 4; c++) error += (e[c] - float((q[c] << 1) | p)) * (e[c] - float((q[c] << 1) | p));
+  return error;
+}
+
+static BC7Block bc7Fit(const float pixels[16][4], const float e0[4], const float e1[4], Quality quality) {
+  BC7Block best{};
+  best.error = INFINITY;
+
+  /*
+   * Pick the p-bits that best represent each endpoint, or try every combination on High
+   */
+  const float* endpoints[2] = {e0, e1};
+  int pBits[4][2] = {{0, 0}, {0, 1}, {1, 0}, {1, 1}};
+  int combinations = 4;
+  if (quality != Quality::High) {
+    for (int e = 0; e < 2; e++)
+      pBits[0][e] = bc7QuantizationError(endpoints[e], 1) < bc7QuantizationError(endpoints[e], 0) ? 1 : 0;
+    combinations = 1;
+  }
+
+  for (int i = 0; i < combinations; i++) {
+    BC7Block b{};
+    for (int e = 0; e < 2; e++) {
+      b.p[e] = pBits[i][e];
+      bc7Quantize(endpoints[e], b.q[e], b.p[e]);
+    }
+
+    if (bc7AssignIndices(pixels, b) < best.error) best = b;
+  }
+  return best;
+}
+
+static void encodeBC7(const float block[16][4], uint8_t* out, Quality quality, bool srgb) {
+  float pixels[16][4];
+  for (int i = 0; i < 16; i++) {
+    for (int c = 0; c < 4; c++) {
+      const float v = srgb && c < 3 ? srgbEncode(block[i][c]) : std::clamp(block[i][c], 0.0f, 1.0f);
+      pixels[i][c] = v * 255.0f;
+    }
+  }
+
+  float e0[4], e1[4];
+  principalAxisEndpoints<4>(pixels, e0, e1);
+  BC7Block best = bc7Fit(pixels, e0, e1, quality);
+
+  const int refits = quality == Quality::High ? 4 : quality == Quality::Normal ? 2 : 0;
+  for (int i = 0; i < refits && best.error > 0.0f; i++) {
+    if (!leastSquaresEndpoints<4>(pixels, best.indices, e0, e1)) break;
+
+    auto b = bc7Fit(pixels, e0, e1, quality);
+    if (b.error >= best.error) break;
+    best = b;
+  }
+
+  // The anchor index (pixel 0) has an implicit high bit of 0, swap endpoints to make it so
+  if (best.indices[0] >= 8) {
+    std::swap(best.q[0], best.q[1]);
+    std::swap(best.p[0], best.p[1]);
+    for (auto& index: best.indices) index = uint8_t(15 - index);
+  }
+
+  std::fill_n(out, 16, 0);
+  BitWriter writer{out};
+  writer.write(1 << 6, 7);
+  for (int c = 0; c < 4; c++) {
+    writer.write(uint32_t(best.q[0][c]), 7);
+    writer.write(uint32_t(best.q[1][c]), 7);
+  }
+  writer.write(uint32_t(best.p[0]), 1);
+  writer.write(uint32_t(best.p[1]), 1);
+  for (int i = 0; i < 16; i++) writer.write(best.indices[i], i == 0 ? 3 : 4);
+}
+
+static void decodeBC7(const uint8_t* in, bool srgb, simd::float4 out[16]) {
+  BitReader reader{in};
+  if (reader.read(7) != 1 << 6) {
+    std::fill_n(out, 16, simd::float4{0.0f, 0.0f, 0.0f, 0.0f});
+    return;
+  }
+
+  int q[2][4], p[2];
+  for (int c = 0; c < 4; c++) {
+    q[0][c] = int(reader.read(7));
+    q[1][c] = int(reader.read(7));
+  }
+  p[0] = int(reader.read(1));
+  p[1] = int(reader.read(1));
+
+  for (int i = 0; i < 16; i++) {
+    const int w = weights4[reader.read(i == 0 ? 3 : 4)];
+    for (int c = 0; c < 4; c++) {
+      const int e0 = (q[0][c] << 1) | p[0], e1 = (q[1][c] << 1) | p[1];
+      const float v = float(((64 - w) * e0 + w * e1 + 32) >> 6) / 255.0f;
+      out[i][c] = srgb && c < 3 ? srgbDecode(v) : v;
+    }
+  }
+}
+
+/*
+ * BC6H mode 11: a single region with 10 bit unsigned RGB endpoints and no delta encoding.
+ * Endpoints live in the unquantized 16 bit domain, and interpolated values map to half float
+ * bits as h = (v * 31) >> 6, so the fit works on x = h * 64 / 31.
+ */
+struct BC6HBlock {
+  int q[2][3];
+  uint8_t indices[16];
+  float error;
+};
+
+static int bc6hUnquantize(int q) {
+  if (q == 0) return 0;
+  if (q == 1023) return 0xffff;
+  return ((q << 16) + 0x8000) >> 10;
+}
+
+static int bc6hInterpolate(int a, int b, int index) {
+  const int w = weights4[index];
+  return (((bc6hUnquantize(a) * (64 - w) + bc6hUnquantize(b) * w + 32) >> 6) * 31) >> 6;
+}
+
+static float bc6hAssignIndices(const float halves[16][4], BC6HBlock& b) {
+  float palette[16][3];
+  for (int k = 0; k < 16; k++) {
+    for (int c = 0; c < 3; c++) palette[k][c] = float(bc6hInterpolate(b.q[0][c], b.q[1][c], k));
+  }
+
+  b.error = 0.0f;
+  for (int i = 0; i < 16; i++) {
+    float best = INFINITY;
+    for (int k = 0; k < 16; k++) {
+      float d = 0.0f;
+      for (int c = 0; c < 3; c++) d += (halves[i][c] - palette[k][c]) * (halves[i][c] - palette[k][c]);
+      if (d < best) {
+        best = d;
+        b.indices[i] = uint8_t(k);
+      }
+    }
+    b.error += best;
+  }
+  return b.error;
+}
+
+static BC6HBlock bc6hFit(const float halves[16][4], const float e0[4], const float e1[4]) {
+  BC6HBlock b{};
+  const float* endpoints[2] = {e0, e1};
+  for (int e = 0; e < 2; e++) {
+    for (int c = 0; c < 3; c++)
+      b.q[e][c] = std::clamp(int(std::lround((endpoints[e][c] * 64.0f / 31.0f - 32.0f) / 64.0f)), 0, 1023);
+  }
+
+  bc6hAssignIndices(halves, b);
+  return b;
+}
+
+static void encodeBC6H(const float block[16][4], uint8_t* out, Quality quality) {
+  float halves[16][4];
+  for (int i = 0; i < 16; i++) {
+    for (int c = 0; c < 3; c++) halves[i][c] = float(floatToHalfBits(block[i][c]));
+    halves[i][3] = 0.0f;
+  }
+
+  float e0[4], e1[4];
+  principalAxisEndpoints<3>(halves, e0, e1);
+  BC6HBlock best = bc6hFit(halves, e0, e1);
+
+  const int refits = quality == Quality::High ? 4 : quality == Quality::Normal ? 2 : 0;
+  for (int i = 0; i < refits && best.error > 0.0f; i++) {
+    if (!leastSquaresEndpoints<3>(halves, best.indices, e0, e1)) break;
+
+    auto b = bc6hFit(halves, e0, e1);
+    if (b.error >= best.error) break;
+    best = b;
+  }
+
+  if (best.indices[0] >= 8) {
+    std::swap(best.q[0], best.q[1]);
+    for (auto& index: best.indices) index = uint8_t(15 - index);
+  }
+
+  std::fill_n(out, 16, 0);
+  BitWriter writer{out};
+  writer.write(0x03, 5);
+  for (int e = 0; e < 2; e++) {
+    for (int c = 0; c < 3; c++) writer.write(uint32_t(best.q[e][c]), 10);
+  }
+  for (int i = 0; i < 16; i++) writer.write(best.indices[i], i == 0 ? 3 : 4);
+}
+
+static void decodeBC6H(const uint8_t* in, simd::float4 out[16]) {
+  BitReader reader{in};
+  if (reader.read(5) != 0x03) {
+    std::fill_n(out, 16, simd::float4{0.0f, 0.0f, 0.0f, 1.0f});
+    return;
+  }
+
+  int q[2][3];
+  for (int e = 0; e < 2; e++) {
+    for (int c = 0; c < 3; c++) q[e][c] = int(reader.read(10));
+  }
+
+  for (int i = 0; i < 16; i++) {
+    const int index = int(reader.read(i == 0 ? 3 : 4));
+    out[i] = simd::float4{0.0f, 0.0f, 0.0f, 1.0f};
+    for (int c = 0; c < 3; c++) out[i][c] = halfBitsToFloat(uint32_t(bc6hInterpolate(q[0][c], q[1][c], index)));
+  }
+}
+
+std::vector<uint8_t> encode(
+  std::span<const simd::float4> pixels,
+  uint32_t width,
+  uint32_t height,
+  BlockFormat format,
+  Quality quality,
+  bool srgb
+) {
+  const uint32_t blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+  const size_t stride = blockBytes(format);
+  std::vector<uint8_t> data(size_t(blocksX) * blocksY * stride);
+
+  utils::parallelFor(blocksY, [&](size_t by) {
+    for (uint32_t bx = 0; bx < blocksX; bx++) {
+      /*
+       * Gather the block, repeating edge texels for partial blocks
+       */
+      float block[16][4];
+      for (uint32_t i = 0; i < 16; i++) {
+        const uint32_t x = std::min(bx * 4 + i % 4, width - 1), y = std::min(uint32_t(by) * 4 + i / 4, height - 1);
+        for (int c = 0; c < 4; c++) block[i][c] = pixels[size_t(y) * width + x][c];
+      }
+
+      uint8_t* out = data.data() + (by * blocksX + bx) * stride;
+      switch (format) {
+        case BlockFormat::BC4:
+        case BlockFormat::BC5: {
+          float channel[16];
+          for (int c = 0; c < (format == BlockFormat::BC5 ? 2 : 1); c++) {
+            for (int i = 0; i < 16; i++) channel[i] = block[i][c];
+            encodeBC4(channel, out + c * 8, quality);
+          }
+          break;
+        }
+        case BlockFormat::BC6H:
+          encodeBC6H(block, out, quality);
+          break;
+        case BlockFormat::BC7:
+          encodeBC7(block, out, quality, srgb);
+          break;
+      }
+    }
+  });
+
+  return data;
+}
+
+std::vector<simd::float4> decode(
+  std::span<const uint8_t> data,
+  uint32_t width,
+  uint32_t height,
+  BlockFormat format,
+  bool srgb,
+  uint32_t y0,
+  uint32_t y1
+) {
+  y1 = std::min(y1, height);
+  if (y0 >= y1) return {};
+
+  const uint32_t blocksX = (width + 3) / 4;
+  const size_t stride = blockBytes(format);
+  std::vector<simd::float4> pixels(size_t(width) * (y1 - y0));
+
+  const uint32_t firstBlock = y0 / 4, lastBlock = (y1 - 1) / 4;
+  utils::parallelFor(lastBlock - firstBlock + 1, [&](size_t row) {
+    const uint32_t by = firstBlock + uint32_t(row);
+    for (uint32_t bx = 0; bx < blocksX; bx++) {
+      const uint8_t* in = data.data() + (size_t(by) * blocksX + bx) * stride;
+
+      simd::float4 block[16];
+      switch (format) {
+        case BlockFormat::BC4:
+        case BlockFormat::BC5: {
+          float r[16], g[16] = {};
+          decodeBC4(in, r);
+          if (format == BlockFormat::BC5) decodeBC4(in + 8, g);
+          for (int i = 0; i < 16; i++) block[i] = simd::float4{r[i], g[i], 0.0f, 1.0f};
+          break;
+        }
+        case BlockFormat::BC6H:
+          decodeBC6H(in, block);
+          break;
+        case BlockFormat::BC7:
+          decodeBC7(in, srgb, block);
+          break;
+      }
+
+      for (uint32_t i = 0; i < 16; i++) {
+        const uint32_t x = bx * 4 + i % 4, y = by * 4 + i / 4;
+        if (x < width && y >= y0 && y < y1) pixels[size_t(y - y0) * width + x] = block[i];
+      }
+    }
+  });
+
+  return pixels;
+}
+
+}
@@ -0,0 +1,74 @@
+#ifndef PLATINUM_TEXTURE_COMPRESSION_HPP
+#define PLATINUM_TEXTURE_COMPRESSION_HPP
+
+#include <cstdint>
+#include <span>
+#include <vector>
+#include <simd/simd.h>
+
+namespace pt::compression {
+
+/*
+ * Block compressed texture formats. All of them store 4x4 texel blocks:
+ *  - BC4: one channel, 8 bytes per block (mono masks)
+ *  - BC5: two channels, 16 bytes per block (roughness/metallic)
+ *  - BC6H: unsigned half float RGB, 16 bytes per block (HDR)
+ *  - BC7: RGBA, 16 bytes per block (color)
+ */
+enum class BlockFormat {
+  BC4,
+  BC5,
+  BC6H,
+  BC7,
+};
+
+/*
+ * Encoder quality presets. Fast fits endpoints once along the principal axis,
+ * Normal refines them with least squares fits, High searches further (more
+ * refinement passes, every p-bit combination, both BC4 modes).
+ */
+enum class Quality {
+  Fast = 0,
+  Normal,
+  High,
+};
+
+constexpr size_t blockBytes(BlockFormat format) { return format == BlockFormat::BC4 ? 8 : 16; }
+
+constexpr size_t encodedSize(BlockFormat format, uint32_t width, uint32_t height) {
+  return size_t((width + 3) / 4) * ((height + 3) / 4) * blockBytes(format);
+}
+
+/*
+ * Encode a row major image of linear RGBA floats, in parallel over rows of
+ * blocks. If srgb is set, color is sRGB encoded before compression, to match
+ * the _sRGB pixel formats.
+ */
+[[nodiscard]] std::vector<uint8_t> encode(
+  std::span<const simd::float4> pixels,
+  uint32_t width,
+  uint32_t height,
+  BlockFormat format,
+  Quality quality = Quality::Normal,
+  bool srgb = false
+);
+
+/*
+ * Decode rows [y0, y1) of a compressed image back to linear RGBA floats, with
+ * missing channels filled in the same way a shader sample does. Only the block
+ * modes written by the encoder (BC7 mode 6, BC6H mode 11) are supported, other
+ * modes decode to zero.
+ */
+[[nodiscard]] std::vector<simd::float4> decode(
+  std::span<const uint8_t> data,
+  uint32_t width,
+  uint32_t height,
+  BlockFormat format,
+  bool srgb = false,
+  uint32_t y0 = 0,
+  uint32_t y1 = ~0u
+);
+
+}
+
+#endif //PLATINUM_TEXTURE_COMPRESSION_HPP
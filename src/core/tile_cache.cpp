@@ -0,0 +1,409 @@
+#include "tile_cache.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <print>
+
+#include <core/texture.hpp>
+#include <utils/metal_utils.hpp>
+
+namespace pt {
+
+/*
+ * Tile layout
+ */
+MTL::Region TileLayout::tileRegion(uint32_t level, uint32_t x, uint32_t y) const {
+  const uint32_t x0 = x * tileWidth, y0 = y * tileHeight;
+  return MTL::Region(
+    x0, y0,
+    std::min(tileWidth, levelWidth(level) - x0),
+    std::min(tileHeight, levelHeight(level) - y0)
+  );
+}
+
+size_t TileLayout::tileBytesPerRow(uint32_t level, uint32_t x) const {
+  const auto block = Texture::blockFormat(format);
+  const uint32_t w = std::min(tileWidth, levelWidth(level) - x * tileWidth);
+  return compression::encodedSize(*block, w, 1);
+}
+
+size_t TileLayout::tileBytes(uint32_t level, uint32_t x, uint32_t y) const {
+  const uint32_t h = std::min(tileHeight, levelHeight(level) - y * tileHeight);
+  return tileBytesPerRow(level, x) * ((h + 3) / 4);
+}
+
+std::vector<size_t> TileLayout::tileOffsets() const {
+  std::vector<size_t> offsets = {0};
+  for (uint32_t level = 0; level < levels; level++) {
+    for (uint32_t y = 0; y < tilesY(level); y++) {
+      for (uint32_t x = 0; x < tilesX(level); x++) offsets.push_back(offsets.back() + tileBytes(level, x, y));
+    }
+  }
+  return offsets;
+}
+
+/*
+ * Tiles of a level are contiguous in the payload, index of the first one
+ */
+static size_t firstTileOfLevel(const TileLayout& layout, uint32_t level) {
+  size_t first = 0;
+  for (uint32_t l = 0; l < level; l++) first += size_t(layout.tilesX(l)) * layout.tilesY(l);
+  return first;
+}
+
+void TileLayout::untileLevel(const uint8_t* payload, const std::vector<size_t>& offsets, uint32_t level, uint8_t* dst) const {
+  const size_t first = firstTileOfLevel(*this, level);
+  const size_t levelBytesPerRow = compression::encodedSize(*Texture::blockFormat(format), levelWidth(level), 1);
+
+  for (uint32_t y = 0; y < tilesY(level); y++) {
+    for (uint32_t x = 0; x < tilesX(level); x++) {
+      const uint8_t* tile = payload + offsets[first + y * tilesX(level) + x];
+      const size_t rowBytes = tileBytesPerRow(level, x), rows = tileBytes(level, x, y) / rowBytes;
+      const size_t dstOffset = size_t(y) * (tileHeight / 4) * levelBytesPerRow + tileBytesPerRow(level, 0) * x;
+
+      for (size_t row = 0; row < rows; row++)
+        std::memcpy(dst + dstOffset + row * levelBytesPerRow, tile + row * rowBytes, rowBytes);
+    }
+  }
+}
+
+void TileLayout::tileLevel(const uint8_t* src, uint32_t level, uint8_t* payload, const std::vector<size_t>& offsets) const {
+  const size_t first = firstTileOfLevel(*this, level);
+  const size_t levelBytesPerRow = compression::encodedSize(*Texture::blockFormat(format), levelWidth(level), 1);
+
+  for (uint32_t y = 0; y < tilesY(level); y++) {
+    for (uint32_t x = 0; x < tilesX(level); x++) {
+      uint8_t* tile = payload + offsets[first + y * tilesX(level) + x];
+      const size_t rowBytes = tileBytesPerRow(level, x), rows = tileBytes(level, x, y) / rowBytes;
+      const size_t srcOffset = size_t(y) * (tileHeight / 4) * levelBytesPerRow + tileBytesPerRow(level, 0) * x;
+
+      for (size_t row = 0; row < rows; row++)
+        std::memcpy(tile + row * rowBytes, src + srcOffset + row * levelBytesPerRow, rowBytes);
+    }
+  }
+}
+
+/*
+ * Tile cache
+ */
+TileCache::TileCache(MTL::Device* device, size_t budget) noexcept
+  : m_device(device),
+    m_commandQueue(device->newCommandQueue()),
+    m_pageInEvent(device->newEvent()),
+    m_pageSize(device->sparseTileSizeInBytes()) {
+  auto* desc = MTL::HeapDescriptor::alloc()->init();
+  desc->setType(MTL::HeapTypeSparse);
+  desc->setStorageMode(MTL::StorageModePrivate);
+  desc->setSize(utils::align(budget, m_pageSize));
+
+  m_heap = device->newHeap(desc);
+  m_capacity = m_heap ? desc->size() / m_pageSize : 0;
+  desc->release();
+}
+
+TileCache::~TileCache() {
+  if (m_requests) m_requests->release();
+  if (m_heap) m_heap->release();
+  m_pageInEvent->release();
+  m_commandQueue->release();
+}
+
+bool TileCache::supported(MTL::Device* device) {
+  return device->supportsFamily(MTL::GPUFamilyApple6);
+}
+
+std::optional<MTL::Size> TileCache::tileSize(MTL::Device* device, MTL::PixelFormat format) {
+  /*
+   * Environment maps (BC6H or float) are read back whole to build their
+   * sampling data, so only BC4, BC5 and BC7 textures are streamed
+   */
+  auto block = Texture::blockFormat(format);
+  if (!supported(device) || !block || block == compression::BlockFormat::BC6H) return std::nullopt;
+
+  return device->sparseTileSize(MTL::TextureType2D, format, 1);
+}
+
+std::optional<std::pair<MTL::Texture*, uint32_t>> TileCache::createTexture(
+  const TileLayout& layout,
+  std::shared_ptr<const utils::MappedFile> source,
+  size_t offset
+) {
+  auto size = tileSize(m_device, layout.format);
+  if (!m_heap || !size || size->width != layout.tileWidth || size->height != layout.tileHeight) return std::nullopt;
+
+  auto* texture = m_heap->newTexture(
+    metal_utils::makeTextureDescriptor(
+      {
+        .width = layout.width,
+        .height = layout.height,
+        .storageMode = MTL::StorageModePrivate,
+        .format = layout.format,
+        .usage = MTL::TextureUsageShaderRead,
+        .mipLevels = layout.levels,
+      }
+    ));
+  if (!texture) return std::nullopt;
+
+  /*
+   * The mip tail is mapped as a whole and stays resident, reserve its pages
+   */
+  Stream stream{
+    .layout = layout,
+    .tileOffsets = layout.tileOffsets(),
+    .firstTailLevel = uint32_t(std::min(texture->firstMipmapInTail(), NS::UInteger(layout.levels))),
+    .tailPages = (texture->tailSizeInBytes() + m_pageSize - 1) / m_pageSize,
+    .texture = texture,
+    .source = std::move(source),
+    .sourceOffset = offset,
+    .requestOffset = 0,
+  };
+
+  const size_t resident = m_lru.size();
+  if (stream.tailPages + resident >= m_capacity || offset + stream.tileOffsets.back() > stream.source->size()) {
+    texture->release();
+    return std::nullopt;
+  }
+  m_capacity -= stream.tailPages;
+
+  for (uint32_t level = 0; level <= layout.levels; level++)
+    stream.levelFirstTile.push_back(firstTileOfLevel(layout, level));
+  stream.resident.resize(stream.levelFirstTile.back());
+
+  auto* cmd = m_commandQueue->commandBuffer();
+  if (stream.firstTailLevel < layout.levels) {
+    auto* enc = cmd->resourceStateCommandEncoder();
+    enc->updateTextureMapping(texture, MTL::SparseTextureMappingModeMap, MTL::Region(0, 0, 1, 1), stream.firstTailLevel, 0);
+    enc->endEncoding();
+
+    std::vector<std::pair<uint32_t, uint32_t>> tiles;
+    for (uint32_t level = stream.firstTailLevel; level < layout.levels; level++) {
+      for (uint32_t i = 0; i < layout.tilesX(level) * layout.tilesY(level); i++) tiles.emplace_back(level, i);
+    }
+    upload(cmd, stream, tiles);
+  }
+  cmd->commit();
+  cmd->waitUntilCompleted();
+
+  // Reuse a free slot if there is one
+  auto slot = std::ranges::find_if(m_streams, [](const auto& s) { return !s.has_value(); });
+  uint32_t id = uint32_t(slot - m_streams.begin());
+  if (slot == m_streams.end()) m_streams.emplace_back(std::move(stream));
+  else *slot = std::move(stream);
+
+  m_requestsDirty = true;
+  return std::make_pair(texture, id);
+}
+
+void TileCache::release(uint32_t streamId) {
+  auto& stream = m_streams.at(streamId);
+  if (!stream) return;
+
+  // The texture owns its mappings, they go away with it
+  for (auto& it: stream->resident) {
+    if (it) m_lru.erase(*it);
+  }
+  m_capacity += stream->tailPages;
+
+  stream = std::nullopt;
+  m_requestsDirty = true;
+}
+
+const TileLayout& TileCache::layout(uint32_t streamId) const {
+  return m_streams.at(streamId)->layout;
+}
+
+std::span<const uint8_t> TileCache::payload(uint32_t streamId) const {
+  const auto& stream = *m_streams.at(streamId);
+  return {stream.source->data() + stream.sourceOffset, stream.tileOffsets.back()};
+}
+
+std::vector<uint8_t> TileCache::readLevel(uint32_t streamId, uint32_t level) const {
+  const auto& stream = *m_streams.at(streamId);
+  const auto& layout = stream.layout;
+
+  const auto block = Texture::blockFormat(layout.format);
+  std::vector<uint8_t> data(compression::encodedSize(*block, layout.levelWidth(level), layout.levelHeight(level)));
+  layout.untileLevel(stream.source->data() + stream.sourceOffset, stream.tileOffsets, level, data.data());
+  return data;
+}
+
+MTL::Buffer* TileCache::requestBuffer() {
+  if (!m_requestsDirty) return m_requests;
+
+  size_t words = 0;
+  for (auto& stream: m_streams) {
+    if (!stream) continue;
+    stream->requestOffset = words;
+    words += stream->levelFirstTile.back();
+  }
+
+  if (m_requests) m_requests->release();
+  m_requests = words ? m_device->newBuffer(words * sizeof(uint32_t), MTL::ResourceStorageModeShared) : nullptr;
+  if (m_requests) std::memset(m_requests->contents(), 0, m_requests->length());
+
+  m_requestsDirty = false;
+  return m_requests;
+}
+
+size_t TileCache::requestOffset(uint32_t streamId) const {
+  return m_streams.at(streamId)->requestOffset;
+}
+
+uint32_t TileCache::firstTailLevel(uint32_t streamId) const {
+  return m_streams.at(streamId)->firstTailLevel;
+}
+
+bool TileCache::empty() const {
+  return std::ranges::none_of(m_streams, [](const auto& s) { return s.has_value(); });
+}
+
+TileCache::Update TileCache::update() {
+  if (!m_requests || m_requestsDirty) return {};
+  auto* words = static_cast<uint32_t*>(m_requests->contents());
+
+  /*
+   * Collect the requests, moving resident tiles to the front of the LRU list.
+   * Everything requested this frame ends up in front of every older tile.
+   */
+  std::vector<TileRef> missing;
+  size_t requested = 0;
+  for (uint32_t s = 0; s < m_streams.size(); s++) {
+    auto& stream = m_streams[s];
+    if (!stream) continue;
+
+    uint32_t* streamWords = words + stream->requestOffset;
+    const size_t tailStart = stream->levelFirstTile[stream->firstTailLevel];
+    for (uint32_t tile = 0; tile < tailStart; tile++) {
+      if (!streamWords[tile]) continue;
+      streamWords[tile] = 0;
+      requested++;
+
+      if (auto& it = stream->resident[tile]) {
+        m_lru.splice(m_lru.begin(), m_lru, *it);
+        m_stats.hits++;
+      } else {
+        missing.push_back({s, tile});
+      }
+    }
+  }
+  m_stats.requests += requested;
+  if (missing.empty()) return {};
+
+  /*
+   * Page in coarser levels first, they cover more of the texture per tile.
+   * Stop when the only tiles left to evict were requested this frame.
+   */
+  auto start = std::chrono::high_resolution_clock::now();
+
+  auto levelOf = [&](const TileRef& ref) {
+    const auto& firstTiles = m_streams[ref.stream]->levelFirstTile;
+    return uint32_t(std::ranges::upper_bound(firstTiles, ref.tile) - firstTiles.begin() - 1);
+  };
+  std::ranges::sort(missing, std::greater{}, levelOf);
+
+  const size_t protectedTiles = requested - missing.size();
+  const size_t count = std::min(
+    {missing.size(), maxPageInPerUpdate, m_capacity > protectedTiles ? m_capacity - protectedTiles : size_t(0)}
+  );
+  if (count == 0) return {.missing = missing.size()};
+
+  auto* cmd = m_commandQueue->commandBuffer();
+  auto* enc = cmd->resourceStateCommandEncoder();
+
+  while (m_lru.size() + count > m_capacity) {
+    const auto victim = m_lru.back();
+    auto& stream = *m_streams[victim.stream];
+    const uint32_t level = levelOf(victim);
+    const uint32_t index = victim.tile - uint32_t(stream.levelFirstTile[level]);
+    const uint32_t tilesX = stream.layout.tilesX(level);
+
+    enc->updateTextureMapping(stream.texture, MTL::SparseTextureMappingModeUnmap, MTL::Region(index % tilesX, index / tilesX, 1, 1), level, 0);
+    stream.resident[victim.tile] = std::nullopt;
+    m_lru.pop_back();
+    m_stats.evicted++;
+  }
+
+  std::vector<std::vector<std::pair<uint32_t, uint32_t>>> uploads(m_streams.size());
+  for (size_t i = 0; i < count; i++) {
+    const auto ref = missing[i];
+    auto& stream = *m_streams[ref.stream];
+    const uint32_t level = levelOf(ref);
+    const uint32_t index = ref.tile - uint32_t(stream.levelFirstTile[level]);
+    const uint32_t tilesX = stream.layout.tilesX(level);
+
+    enc->updateTextureMapping(stream.texture, MTL::SparseTextureMappingModeMap, MTL::Region(index % tilesX, index / tilesX, 1, 1), level, 0);
+    m_lru.push_front(ref);
+    stream.resident[ref.tile] = m_lru.begin();
+    uploads[ref.stream].emplace_back(level, index);
+  }
+  enc->endEncoding();
+
+  size_t bytes = 0;
+  for (uint32_t s = 0; s < uploads.size(); s++) {
+    const auto& tiles = uploads[s];
+    if (tiles.empty()) continue;
+
+    const auto& stream = *m_streams[s];
+    for (auto [level, index]: tiles) bytes += stream.layout.tileBytes(level, index % stream.layout.tilesX(level), index / stream.layout.tilesX(level));
+    upload(cmd, stream, tiles);
+  }
+
+  cmd->encodeSignalEvent(m_pageInEvent, ++m_pageIns);
+  cmd->commit();
+
+  auto end = std::chrono::high_resolution_clock::now();
+  m_stats.pagedIn += count;
+  m_stats.bytesPagedIn += bytes;
+  m_stats.pageInSeconds += std::chrono::duration<double>(end - start).count();
+
+  return {.missing = missing.size(), .pagedIn = count};
+}
+
+void TileCache::encodeWait(MTL::CommandBuffer* cmd) const {
+  if (m_pageIns) cmd->encodeWait(m_pageInEvent, m_pageIns);
+}
+
+void TileCache::upload(MTL::CommandBuffer* cmd, const Stream& stream, std::span<const std::pair<uint32_t, uint32_t>> tiles) {
+  const auto& layout = stream.layout;
+
+  /*
+   * Copy the tiles out of the mapped source into a staging buffer, this is
+   * where they're actually read from disk
+   */
+  std::vector<size_t> offsets = {0};
+  for (auto [level, index]: tiles) {
+    const size_t tile = stream.levelFirstTile[level] + index;
+    offsets.push_back(offsets.back() + stream.tileOffsets[tile + 1] - stream.tileOffsets[tile]);
+  }
+
+  auto* staging = m_device->newBuffer(offsets.back(), MTL::ResourceStorageModeShared);
+  auto* contents = static_cast<uint8_t*>(staging->contents());
+  const uint8_t* payload = stream.source->data() + stream.sourceOffset;
+  utils::parallelFor(tiles.size(), [&](size_t i) {
+    const size_t tile = stream.levelFirstTile[tiles[i].first] + tiles[i].second;
+    std::memcpy(contents + offsets[i], payload + stream.tileOffsets[tile], offsets[i + 1] - offsets[i]);
+  }, 16);
+
+  auto* enc = cmd->blitCommandEncoder();
+  for (size_t i = 0; i < tiles.size(); i++) {
+    const auto [level, index] = tiles[i];
+    const uint32_t x = index % layout.tilesX(level), y = index / layout.tilesX(level);
+    const auto region = layout.tileRegion(level, x, y);
+
+    enc->copyFromBuffer(
+      staging, offsets[i],
+      layout.tileBytesPerRow(level, x), 0,
+      region.size,
+      stream.texture, 0, level,
+      region.origin
+    );
+  }
+  enc->endEncoding();
+
+  // The command buffer keeps the staging buffer alive until it's done
+  staging->release();
+}
+
+}
@@ -0,0 +1,210 @@
+#ifndef PLATINUM_TILE_CACHE_HPP
+#define PLATINUM_TILE_CACHE_HPP
+
+#include <list>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+#include <Metal/Metal.hpp>
+
+#include <utils/utils.hpp>
+
+namespace pt {
+
+/*
+ * Layout of a tiled texture payload, as stored in the scene binary. Every mip
+ * level is split in tiles of tileWidth x tileHeight texels, stored one after
+ * the other in row major order, each tile as its own rows of 4x4 blocks. Tiles
+ * on the right and bottom edges, and levels smaller than a tile, are clipped.
+ * Only block compressed formats are tiled.
+ */
+struct TileLayout {
+  MTL::PixelFormat format;
+  uint32_t width, height, levels;
+  uint32_t tileWidth, tileHeight;
+
+  [[nodiscard]] constexpr uint32_t levelWidth(uint32_t level) const { return std::max(width >> level, 1u); }
+  [[nodiscard]] constexpr uint32_t levelHeight(uint32_t level) const { return std::max(height >> level, 1u); }
+  [[nodiscard]] constexpr uint32_t tilesX(uint32_t level) const { return (levelWidth(level) + tileWidth - 1) / tileWidth; }
+  [[nodiscard]] constexpr uint32_t tilesY(uint32_t level) const { return (levelHeight(level) + tileHeight - 1) / tileHeight; }
+
+  // Texel region covered by a tile
+  [[nodiscard]] MTL::Region tileRegion(uint32_t level, uint32_t x, uint32_t y) const;
+
+  [[nodiscard]] size_t tileBytesPerRow(uint32_t level, uint32_t x) const;
+  [[nodiscard]] size_t tileBytes(uint32_t level, uint32_t x, uint32_t y) const;
+
+  /*
+   * Byte offset of every tile in the payload, level by level, with the total
+   * payload size at the end
+   */
+  [[nodiscard]] std::vector<size_t> tileOffsets() const;
+
+  /*
+   * Copy a whole level between the tiled payload and a row major (untiled)
+   * block buffer
+   */
+  void untileLevel(const uint8_t* payload, const std::vector<size_t>& offsets, uint32_t level, uint8_t* dst) const;
+  void tileLevel(const uint8_t* src, uint32_t level, uint8_t* payload, const std::vector<size_t>& offsets) const;
+};
+
+/*
+ * Out of core texture streaming, on top of Metal sparse textures. Streamed
+ * textures are created from a tiled payload in a memory mapped file, and only
+ * their mip tail is resident up front. The path tracer marks the tiles it
+ * wants in a request buffer, one word per tile, and falls back to coarser
+ * levels while they aren't resident. After each frame, update() reads the
+ * requests, evicts the least recently used tiles if needed and pages in the
+ * missing ones. Every tile is allocated from a single sparse heap, so the
+ * cache has a fixed memory budget.
+ *
+ * Page ins run on the cache's own queue without blocking the CPU. Command
+ * buffers sampling streamed textures call encodeWait() so they run after the
+ * last page in.
+ */
+class TileCache {
+public:
+  struct Stats {
+    size_t requests = 0;      // Tiles requested by the integrator
+    size_t hits = 0;          // Requested tiles that were already resident
+    size_t pagedIn = 0;
+    size_t evicted = 0;
+    size_t bytesPagedIn = 0;
+    double pageInSeconds = 0.0;
+
+    [[nodiscard]] constexpr double hitRate() const {
+      return requests ? double(hits) / double(requests) : 1.0;
+    }
+
+    // Page in bandwidth in bytes per second, reading from disk and encoding uploads
+    [[nodiscard]] constexpr double bandwidth() const {
+      return pageInSeconds > 0.0 ? double(bytesPagedIn) / pageInSeconds : 0.0;
+    }
+  };
+
+  struct Update {
+    size_t missing = 0; // Requested tiles that weren't resident during the frame
+    size_t pagedIn = 0;
+  };
+
+  static constexpr size_t defaultBudget = size_t(1) << 30;
+
+  // Textures whose largest side is at least this many texels are tiled when saved
+  static constexpr uint32_t minStreamedSize = 4096;
+
+  // Tiles paged in by a single update, at most, to bound the stall between frames
+  static constexpr size_t maxPageInPerUpdate = 512;
+
+  explicit TileCache(MTL::Device* device, size_t budget = defaultBudget) noexcept;
+
+  TileCache(const TileCache& m) noexcept = delete;
+  TileCache& operator=(const TileCache& m) = delete;
+
+  ~TileCache();
+
+  [[nodiscard]] static bool supported(MTL::Device* device);
+
+  /*
+   * Sparse tile size of a pixel format, in texels. Nothing if the format
+   * can't be streamed on this device.
+   */
+  [[nodiscard]] static std::optional<MTL::Size> tileSize(MTL::Device* device, MTL::PixelFormat format);
+
+  /*
+   * Create a streamed texture from a tiled payload at offset in source. Uploads
+   * the mip tail, the rest of the tiles are paged in on request. Returns the
+   * texture and its stream ID, or nothing if it doesn't fit in the budget.
+   */
+  [[nodiscard]] std::optional<std::pair<MTL::Texture*, uint32_t>> createTexture(
+    const TileLayout& layout,
+    std::shared_ptr<const utils::MappedFile> source,
+    size_t offset
+  );
+
+  /*
+   * Forget a streamed texture, called when the texture is destroyed
+   */
+  void release(uint32_t streamId);
+
+  [[nodiscard]] const TileLayout& layout(uint32_t streamId) const;
+
+  // The texture's tiled payload, as stored in the source file
+  [[nodiscard]] std::span<const uint8_t> payload(uint32_t streamId) const;
+
+  // Read back a whole level as row major blocks, from the source
+  [[nodiscard]] std::vector<uint8_t> readLevel(uint32_t streamId, uint32_t level) const;
+
+  /*
+   * Tile request buffer and the offset of each texture's first request word,
+   * for the argument buffer. The buffer is recreated when textures are added,
+   * so call this after loading.
+   */
+  [[nodiscard]] MTL::Buffer* requestBuffer();
+  [[nodiscard]] size_t requestOffset(uint32_t streamId) const;
+  [[nodiscard]] uint32_t firstTailLevel(uint32_t streamId) const;
+
+  [[nodiscard]] constexpr MTL::Heap* heap() const { return m_heap; }
+  [[nodiscard]] bool empty() const;
+
+  /*
+   * Process the requests written by the last frame, which must have finished.
+   * If any requested tile was missing, the frame fell back to coarser levels
+   * somewhere. Missing tiles are paged in asynchronously, unless they don't
+   * fit in the budget along with the rest of the frame's tiles.
+   */
+  Update update();
+
+  // Make a command buffer wait for the last page in before sampling textures
+  void encodeWait(MTL::CommandBuffer* cmd) const;
+
+  [[nodiscard]] constexpr const Stats& stats() const { return m_stats; }
+  constexpr void resetStats() { m_stats = {}; }
+
+private:
+  struct TileRef {
+    uint32_t stream, tile;
+  };
+
+  struct Stream {
+    TileLayout layout;
+    std::vector<size_t> tileOffsets;
+    std::vector<size_t> levelFirstTile;
+    uint32_t firstTailLevel;
+    size_t tailPages;
+
+    MTL::Texture* texture;
+    std::shared_ptr<const utils::MappedFile> source;
+    size_t sourceOffset;
+    size_t requestOffset;
+
+    // Position of each resident tile in the LRU list
+    std::vector<std::optional<std::list<TileRef>::iterator>> resident;
+  };
+
+  MTL::Device* m_device;
+  MTL::CommandQueue* m_commandQueue;
+  MTL::Heap* m_heap;
+  MTL::Event* m_pageInEvent;
+  uint64_t m_pageIns = 0;   // Value signaled by the last page in
+  size_t m_pageSize;
+  size_t m_capacity = 0;    // Pages left for tiles, after the mip tails
+
+  std::vector<std::optional<Stream>> m_streams;
+  std::list<TileRef> m_lru; // Most recently used first
+
+  MTL::Buffer* m_requests = nullptr;
+  bool m_requestsDirty = true;
+
+  Stats m_stats;
+
+  void upload(
+    MTL::CommandBuffer* cmd,
+    const Stream& stream,
+    std::span<const std::pair<uint32_t, uint32_t>> tiles // (level, tile index within the level)
+  );
+};
+
+}
+
+#endif //PLATINUM_TILE_CACHE_HPP
@@ -0,0 +1,114 @@
+#include "vertex_format.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace pt::vertex_format {
+
+static float signNotZero(float x) { return x >= 0.0f ? 1.0f : -1.0f; }
+
+float2 octEncode(float3 v) {
+  v /= reduce_add(abs(v));
+  float2 e = v.xy;
+  if (v.z < 0.0f) e = float2{(1.0f - std::abs(e.y)) * signNotZero(e.x), (1.0f - std::abs(e.x)) * signNotZero(e.y)};
+  return e;
+}
+
+uint32_t packSnorm2x16(float2 v) {
+  auto quantize = [](float x) { return uint16_t(int16_t(std::round(std::clamp(x, -1.0f, 1.0f) * 32767.0f))); };
+  return uint32_t(quantize(v.x)) | uint32_t(quantize(v.y)) << 16;
+}
+
+float2 unpackSnorm2x16(uint32_t packed) {
+  auto unquantize = [](uint16_t x) { return std::max(float(int16_t(x)) / 32767.0f, -1.0f); };
+  return {unquantize(uint16_t(packed)), unquantize(uint16_t(packed >> 16))};
+}
+
+uint32_t packUnorm2x16(float2 v) {
+  auto quantize = [](float x) { return uint16_t(std::round(std::clamp(x, 0.0f, 1.0f) * 65535.0f)); };
+  return uint32_t(quantize(v.x)) | uint32_t(quantize(v.y)) << 16;
+}
+
+float2 unpackUnorm2x16(uint32_t packed) {
+  return {float(uint16_t(packed)) / 65535.0f, float(uint16_t(packed >> 16)) / 65535.0f};
+}
+
+/*
+ * Octahedral encoding into two snorm16, picking the rounding of each
+ * component that decodes closest to the input instead of rounding to nearest.
+ * If a sign is given, it replaces the lowest bit of the second component.
+ */
+static uint32_t packOctahedral(float3 v, float sign = 0.0f) {
+  if (!(length_squared(v) > 0.0f) || !std::isfinite(reduce_add(v))) v = {0.0f, 0.0f, 1.0f};
+  v = normalize(v);
+
+  const float2 e = octEncode(v) * 32767.0f;
+  uint32_t best = 0;
+  float bestError = std::numeric_limits<float>::infinity();
+  for (int i = 0; i < 4; i++) {
+    const float2 q = {i & 1 ? std::ceil(e.x) : std::floor(e.x), i & 2 ? std::ceil(e.y) : std::floor(e.y)};
+    uint32_t packed = packSnorm2x16(q / 32767.0f);
+    if (sign < 0.0f) packed |= 0x10000;
+    else if (sign > 0.0f) packed &= ~0x10000u;
+
+    const float error = length_squared(octDecode(unpackSnorm2x16(packed)) - v);
+    if (error < bestError) {
+      best = packed;
+      bestError = error;
+    }
+  }
+
+  return best;
+}
+
+TexCoordBounds texCoordBounds(const VertexData* vertices, size_t count) {
+  float2 lo = std::numeric_limits<float>::infinity(), hi = -lo;
+  for (size_t i = 0; i < count; i++) {
+    const float2 uv = vertices[i].texCoords;
+    if (!std::isfinite(uv.x) || !std::isfinite(uv.y)) continue;
+    lo = min(lo, uv);
+    hi = max(hi, uv);
+  }
+
+  if (lo.x > hi.x) return {0.0f, 0.0f};
+  return {lo, hi - lo};
+}
+
+PackedVertexData pack(const VertexData& vertex, const TexCoordBounds& bounds) {
+  float2 uv = vertex.texCoords - bounds.origin;
+  uv.x = bounds.extent.x > 0.0f ? uv.x / bounds.extent.x : 0.0f;
+  uv.y = bounds.extent.y > 0.0f ? uv.y / bounds.extent.y : 0.0f;
+
+  return {
+    .normal = packOctahedral(vertex.normal),
+    .tangent = packTangent(vertex.tangent),
+    .texCoords = packUnorm2x16(uv),
+  };
+}
+
+uint32_t packTangent(float4 tangent) {
+  return packOctahedral(tangent.xyz, signNotZero(tangent.w));
+}
+
+VertexData unpack(const PackedVertexData& vertex, const TexCoordBounds& bounds) {
+  return {
+    .normal = decodeNormal(vertex.normal),
+    .tangent = decodeTangent(vertex.tangent),
+    .texCoords = decodeTexCoords(vertex.texCoords, bounds),
+  };
+}
+
+float3 decodeNormal(uint32_t packed) {
+  return octDecode(unpackSnorm2x16(packed));
+}
+
+float4 decodeTangent(uint32_t packed) {
+  return make_float4(octDecode(unpackSnorm2x16(packed)), (packed & 0x10000) ? -1.0f : 1.0f);
+}
+
+float2 decodeTexCoords(uint32_t packed, const TexCoordBounds& bounds) {
+  return bounds.origin + bounds.extent * unpackUnorm2x16(packed);
+}
+
+}
@@ -0,0 +1,137 @@
+#ifndef PLATINUM_VERTEX_FORMAT_HPP
+#define PLATINUM_VERTEX_FORMAT_HPP
+
+#ifdef __METAL_VERSION__
+
+#include <metal_stdlib>
+
+using namespace metal;
+
+#else
+
+#include <cstddef>
+#include <cstdint>
+
+#endif
+
+#include <simd/simd.h>
+
+using namespace simd;
+
+// Don't nest namespaces here, the MSL compiler complains it's a C++ 17 ext
+namespace pt { // NOLINT(*-concat-nested-namespaces)
+
+/*
+ * Full precision vertex attributes, used to build meshes and by CPU code that
+ * reads them back.
+ */
+struct VertexData {
+  float3 normal;
+  float4 tangent;
+  float2 texCoords;
+};
+
+/*
+ * Vertex attributes as stored in mesh buffers, 12 bytes instead of 48:
+ *  - normal: octahedral encoding, two snorm16.
+ *  - tangent: octahedral encoding, two snorm16. The lowest bit of the second
+ *    component holds the bitangent sign, set if negative.
+ *  - texCoords: two unorm16, relative to the mesh's texture coordinate bounds.
+ *    Meshes with a texture coordinate range too large for unorm16 also keep
+ *    full precision texture coordinates in a separate buffer, see Mesh.
+ * The second component of each pair is in the high 16 bits, which matches the
+ * Metal unpack functions and short2/ushort2 vertex formats.
+ */
+struct PackedVertexData {
+  uint32_t normal;
+  uint32_t tangent;
+  uint32_t texCoords;
+};
+
+/*
+ * Texture coordinates are decoded as origin + extent * unorm16 value
+ */
+struct TexCoordBounds {
+  float2 origin;
+  float2 extent;
+};
+
+/*
+ * Positions are stored as float3 without padding, 12 bytes instead of 16
+ */
+#ifdef __METAL_VERSION__
+using PackedFloat3 = packed_float3;
+#else
+struct PackedFloat3 {
+  float x, y, z;
+};
+#endif
+
+namespace vertex_format {
+
+/*
+ * Octahedral mapping from [-1, 1]^2 to the unit sphere, see Cigolle et al.,
+ * "A Survey of Efficient Representations for Independent Unit Vectors"
+ */
+inline float3 octDecode(float2 e) {
+  const float2 a = abs(e);
+  float3 v = {e.x, e.y, 1.0f - a.x - a.y};
+  const float t = v.z < 0.0f ? -v.z : 0.0f;
+  v.x += v.x >= 0.0f ? -t : t;
+  v.y += v.y >= 0.0f ? -t : t;
+  return normalize(v);
+}
+
+#ifdef __METAL_VERSION__
+
+inline float3 decodeNormal(uint32_t packed) {
+  return octDecode(unpack_snorm2x16_to_float(packed));
+}
+
+inline float4 decodeTangent(uint32_t packed) {
+  return float4(octDecode(unpack_snorm2x16_to_float(packed)), (packed & 0x10000) ? -1.0f : 1.0f);
+}
+
+inline float2 decodeTexCoords(uint32_t packed, TexCoordBounds bounds) {
+  return bounds.origin + bounds.extent * unpack_unorm2x16_to_float(packed);
+}
+
+#else
+
+float2 octEncode(float3 v);
+
+uint32_t packSnorm2x16(float2 v);
+float2 unpackSnorm2x16(uint32_t packed);
+uint32_t packUnorm2x16(float2 v);
+float2 unpackUnorm2x16(uint32_t packed);
+
+/*
+ * Bounds of a set of texture coordinates, ignoring non-finite values
+ */
+TexCoordBounds texCoordBounds(const VertexData* vertices, size_t count);
+
+/*
+ * Largest texture coordinate range packed as unorm16, a step of 1/16384 or a
+ * quarter of a texel in a 4K texture. Larger ranges, usually tiling textures,
+ * need full precision texture coordinates.
+ */
+constexpr float maxPackedTexCoordExtent = 4.0f;
+
+inline bool packsTexCoords(const TexCoordBounds& bounds) {
+  return bounds.extent.x <= maxPackedTexCoordExtent && bounds.extent.y <= maxPackedTexCoordExtent;
+}
+
+PackedVertexData pack(const VertexData& vertex, const TexCoordBounds& bounds);
+uint32_t packTangent(float4 tangent);
+VertexData unpack(const PackedVertexData& vertex, const TexCoordBounds& bounds);
+
+float3 decodeNormal(uint32_t packed);
+float4 decodeTangent(uint32_t packed);
+float2 decodeTexCoords(uint32_t packed, const TexCoordBounds& bounds);
+
+#endif
+
+}
+}
+
+#endif //PLATINUM_VERTEX_FORMAT_HPP
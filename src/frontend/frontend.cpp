@@ -435,7 +435,7 @@ void Frontend::renderMenuBar() {
 
         if (widgets::menu("Texture")) {
           if (widgets::menuItem("Color")) m_store.importTexture(loaders::texture::TextureType::sRGB);
-          if (widgets::menuItem("Normal map")) m_store.importTexture(loaders::texture::TextureType::LinearRGB);
+          if (widgets::menuItem("Normal map")) m_store.importTexture(loaders::texture::TextureType::Normal);
           if (widgets::menuItem("HDR/Env map")) m_store.importTexture(loaders::texture::TextureType::HDR);
           if (widgets::menuItem("Grayscale")) m_store.importTexture(loaders::texture::TextureType::Mono);
           ImGui::EndMenu();
@@ -473,6 +473,11 @@ void Frontend::renderMenuBar() {
 
       ImGui::BeginDisabled(!m_renderViewport.hasImage());
       if (widgets::menuItem("Export to PNG", "Cmd + E")) m_renderViewport.exportImage();
+      if (widgets::menuItem("Export partial render")) m_renderViewport.exportPartialRender();
+      ImGui::EndDisabled();
+
+      ImGui::BeginDisabled(!(m_renderer->status() & renderer_pt::Renderer::Status_Ready));
+      if (widgets::menuItem("Merge partial renders")) m_renderViewport.mergePartialRenders();
       ImGui::EndDisabled();
 
       ImGui::EndMenu();
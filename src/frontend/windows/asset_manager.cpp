@@ -12,11 +12,23 @@ static const char *getTextureFormatName(MTL::Texture *texture) {
   case MTL::PixelFormatRGBA8Unorm_sRGB:
     return "sRGB RGBA 8bpc";
   case MTL::PixelFormatRG8Unorm:
-    return "Roughness/Metallic (RG 8bpc)";
+    return "Two channel (RG 8bpc)";
   case MTL::PixelFormatR8Unorm:
     return "Grayscale 8bit";
   case MTL::PixelFormatRGBA32Float:
     return "HDR (RGBA 32bpc)";
+  case MTL::PixelFormatRGBA16Float:
+    return "HDR (RGBA 16bpc half)";
+  case MTL::PixelFormatBC7_RGBAUnorm:
+    return "Linear RGBA (BC7)";
+  case MTL::PixelFormatBC7_RGBAUnorm_sRGB:
+    return "sRGB RGBA (BC7)";
+  case MTL::PixelFormatBC5_RGUnorm:
+    return "Two channel (BC5)";
+  case MTL::PixelFormatBC4_RUnorm:
+    return "Grayscale (BC4)";
+  case MTL::PixelFormatBC6H_RGBUfloat:
+    return "HDR (BC6H)";
   default:
     return "Unknown format";
   }
@@ -348,6 +360,30 @@ void AssetManager::renderMeshProperties(Scene::AnyAsset &mesh,
 
   ImGui::Text("%lu vertices", asset->vertexCount());
   ImGui::Text("%lu triangles", asset->indexCount() / 3);
+
+  ImGui::Spacing();
+
+  /*
+   * Optimizing replaces the mesh with a new asset, so it can't be done while
+   * a render is using the old one
+   */
+  ImGui::BeginDisabled(m_store.rendering());
+  const bool optimize = ImGui::Button("Optimize mesh");
+  ImGui::EndDisabled();
+
+  if (optimize) {
+    mesh_optimizer::Stats stats;
+    if (auto optimized = mesh_optimizer::optimize(*asset, stats)) {
+      auto newId = m_store.scene().replaceMesh(id, std::move(*optimized));
+      m_selection.SetItemSelected(ImGuiID(id), false);
+      m_selection.SetItemSelected(ImGuiID(newId), true);
+      m_lastOptimization = {newId, stats};
+      return;
+    }
+  }
+
+  if (m_lastOptimization && m_lastOptimization->first == id)
+    ImGui::TextWrapped("%s", m_lastOptimization->second.summary().c_str());
 }
 
 void AssetManager::assetPropertiesHeader(const char *assetTypeName,
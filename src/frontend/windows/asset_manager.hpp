@@ -3,6 +3,7 @@
 
 #include <imgui.h>
 
+#include <core/mesh_optimizer.hpp>
 #include <frontend/window.hpp>
 #include <frontend/widgets.hpp>
 
@@ -27,6 +28,9 @@ private:
   bool m_showMaterials = true;
   bool m_showMeshes = true;
 
+  // Result of the last mesh optimization, shown on the new mesh
+  std::optional<std::pair<Scene::AssetID, mesh_optimizer::Stats>> m_lastOptimization;
+
   uint32_t m_iconSize = 48;
   uint32_t m_spacing = 8;
   uint32_t m_hitSpacing = 4;
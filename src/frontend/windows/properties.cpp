@@ -69,6 +69,36 @@ void Properties::renderNodeProperties(Scene::NodeID id) {
         );
       }
 
+      /*
+       * Environment importance sampling options, rebuild the sampling data when they change
+       */
+      auto& envmap = m_store.scene().envmap();
+      auto& options = envmap.samplingOptions();
+      bool rebuild = false;
+
+      const char* modeNames[] = {"Alias table", "CDF"};
+      if (widgets::combo("Sampling", modeNames[options.mode])) {
+        for (int i = 0; i < 2; i++) {
+          if (widgets::comboItem(modeNames[i], options.mode == i)) {
+            rebuild = options.mode != i;
+            options.mode = EnvironmentSampling(i);
+          }
+        }
+        ImGui::EndCombo();
+      }
+
+      if (options.mode == EnvironmentSampling_Cdf) {
+        widgets::dragInt("CDF resolution", (int*) &options.cdfWidth, 16, 16, 16384);
+        rebuild |= ImGui::IsItemDeactivatedAfterEdit();
+      }
+
+      if (rebuild && envmap.textureId()) {
+        envmap.rebuildSamplingData(
+          m_store.device(),
+          m_store.scene().getAsset<Texture>(envmap.textureId().value())->texture()
+        );
+      }
+
       ImGui::Spacing();
     }
   }
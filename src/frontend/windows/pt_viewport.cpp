@@ -4,6 +4,8 @@
 
 #include <implot.h>
 
+#include <algorithm>
+#include <print>
 #include <utils/utils.hpp>
 #include <vector>
 
@@ -172,7 +174,8 @@ void RenderViewport::renderSettingsWindow(
   ImGui::SeparatorText("Renderer");
 
   auto selectedKernel = m_renderer->selectedKernel();
-  std::array<std::string, 2> kernelNames = {"Simple BSDF sampler", "MIS + NEE"};
+  std::array<std::string, 3> kernelNames = {"Simple BSDF sampler", "MIS + NEE",
+                                            "MIS + NEE (wavefront)"};
   if (widgets::combo("Render kernel", kernelNames[selectedKernel].c_str())) {
     if (widgets::comboItem(kernelNames[0].c_str(), selectedKernel == 0))
       m_renderer->selectKernel(
@@ -186,17 +189,45 @@ void RenderViewport::renderSettingsWindow(
     if (selectedKernel == 1)
       ImGui::SetItemDefaultFocus();
 
+    if (widgets::comboItem(kernelNames[2].c_str(), selectedKernel == 2))
+      m_renderer->selectKernel(
+          uint32_t(renderer_pt::Renderer::Integrators::Wavefront));
+    if (selectedKernel == 2)
+      ImGui::SetItemDefaultFocus();
+
     ImGui::EndCombo();
   }
 
   widgets::dragInt("Samples", &m_nextRenderSampleCount, 1, 0, 1 << 16);
 
+  ImGui::SeparatorText("Distributed render");
+
+  widgets::dragInt("Node count", &m_renderNodeCount, 1, 1, 256);
+  m_renderNodeIdx = std::clamp(m_renderNodeIdx, 0, m_renderNodeCount - 1);
+  widgets::dragInt("Node index", &m_renderNodeIdx, 1, 0, m_renderNodeCount - 1);
+
+  ImGui::SeparatorText("Tiled render");
+
+  ImGui::Checkbox("Render in tiles", &m_tiledRender);
+  ImGui::BeginDisabled(!m_tiledRender);
+  widgets::dragInt("Tile size", &m_tileSize, 16, 256, 1 << 14);
+  ImGui::EndDisabled();
+
   ImGui::SeparatorText("Options");
 
   ImGui::CheckboxFlags("Multiscatter GGX", &m_renderFlags,
                        shaders_pt::RendererFlags_MultiscatterGGX);
   ImGui::CheckboxFlags("GMoN Estimator", &m_renderFlags,
                        shaders_pt::RendererFlags_GMoN);
+  ImGui::BeginDisabled(m_renderer->selectedKernel() !=
+                       uint32_t(renderer_pt::Renderer::Integrators::MIS));
+  ImGui::CheckboxFlags("ReSTIR direct lighting", &m_renderFlags,
+                       shaders_pt::RendererFlags_ReSTIR);
+  ImGui::BeginDisabled(m_tiledRender);
+  ImGui::CheckboxFlags("Path guiding", &m_renderFlags,
+                       shaders_pt::RendererFlags_PathGuiding);
+  ImGui::EndDisabled();
+  ImGui::EndDisabled();
 
   ImGui::EndDisabled();
 
@@ -212,6 +243,20 @@ void RenderViewport::renderSettingsWindow(
 
     widgets::dragFloat("Cap", &gmon.cap, 0.01f, 0.0f, 1.0f, "%.2f");
   }
+
+  if (m_renderFlags & shaders_pt::RendererFlags_PathGuiding) {
+    auto &guiding = m_renderer->guidingOptions();
+
+    ImGui::SeparatorText("Path guiding settings");
+
+    ImGui::BeginDisabled(
+        !(m_renderer->status() & renderer_pt::Renderer::Status_Ready));
+    widgets::dragFloat("BSDF fraction", &guiding.bsdfFraction, 0.01f, 0.05f,
+                       1.0f, "%.2f");
+    widgets::dragInt("Training iterations", (int *)&guiding.trainingIterations,
+                     1, 0, 10);
+    ImGui::EndDisabled();
+  }
   ImGui::Spacing();
 
   ImGui::SeparatorText("Color Management");
@@ -540,9 +585,21 @@ void RenderViewport::startRender() {
   if (canRender()) {
     m_renderSize = m_useViewportSizeForRender ? m_viewportSize * m_dpiScaling
                                               : m_nextRenderSize;
+
+    // Split the sample sequence into contiguous ranges, one per render node
+    const auto sampleCount = (uint32_t)m_nextRenderSampleCount;
+    const auto nodeCount = (uint32_t)m_renderNodeCount;
+    const auto nodeIdx = (uint32_t)m_renderNodeIdx;
+    renderer_pt::Renderer::SampleRange sampleRange{
+        .start = sampleCount * nodeIdx / nodeCount,
+        .count = sampleCount * (nodeIdx + 1) / nodeCount -
+                 sampleCount * nodeIdx / nodeCount,
+    };
+
     m_renderer->startRender(
-        m_cameraNodeId.value(), m_renderSize, (uint32_t)m_nextRenderSampleCount,
-        m_gmonBuckets, color::getColorspace(m_workingSpace), m_renderFlags);
+        m_cameraNodeId.value(), m_renderSize, sampleCount, m_gmonBuckets,
+        color::getColorspace(m_workingSpace), m_renderFlags, sampleRange,
+        m_tiledRender ? uint32_t(m_tileSize) : 0);
     m_store.setRendering(true);
   }
 }
@@ -614,6 +671,48 @@ void RenderViewport::exportImage() const {
   }
 }
 
+void RenderViewport::exportPartialRender() const {
+  if (m_renderer->tiled()) {
+    std::println(stderr, "[Error] Cannot export partial render: tiled renders "
+                         "do not keep the full accumulator");
+    return;
+  }
+
+  const auto savePath = utils::fileSave("../out", "ptpartial");
+  if (savePath) {
+    auto partial = m_renderer->readbackPartialRender();
+    if (!partial.saveToFile(savePath.value()))
+      return;
+
+    std::println("Exported partial render: samples [{}, {}) of {}",
+                 partial.sampleStart, partial.sampleStart + partial.sampleCount,
+                 partial.sampleTotal);
+  }
+}
+
+void RenderViewport::mergePartialRenders() {
+  const auto paths = utils::fileOpenMultiple("../out", "ptpartial");
+  if (paths.empty())
+    return;
+
+  std::vector<renderer_pt::PartialRender> partials;
+  partials.reserve(paths.size());
+  for (const auto &path : paths) {
+    auto partial = renderer_pt::PartialRender::loadFromFile(path);
+    if (!partial)
+      return;
+
+    partials.push_back(std::move(partial.value()));
+  }
+
+  auto merged = renderer_pt::PartialRender::merge(partials);
+  if (!merged)
+    return;
+
+  if (m_renderer->loadPartialRender(merged.value()))
+    m_renderSize = {float(merged->size.x), float(merged->size.y)};
+}
+
 bool RenderViewport::handleInputs(const SDL_Event &event) {
   ImGuiIO &io = ImGui::GetIO();
   bool allowMouseEvents = !io.WantCaptureMouse || m_mouseInViewport;
@@ -29,6 +29,10 @@ public:
 
   void exportImage() const;
 
+  void exportPartialRender() const;
+
+  void mergePartialRenders();
+
   bool handleInputs(const SDL_Event& event);
 
   const uint8_t* keys = nullptr;
@@ -82,6 +86,10 @@ private:
   bool m_useViewportSizeForRender = true;
   int m_renderFlags = shaders_pt::RendererFlags_MultiscatterGGX | shaders_pt::RendererFlags_GMoN;
   uint32_t m_gmonBuckets = 15;
+  int32_t m_renderNodeCount = 1;
+  int32_t m_renderNodeIdx = 0;
+  bool m_tiledRender = false;
+  int32_t m_tileSize = 2048;
 
   // Post process settings
   const hashmap<postprocess::Tonemapper, std::string> m_tonemappers = {
@@ -102,7 +102,7 @@ void SceneExplorer::render() {
 
     if (widgets::menu("Texture")) {
       if (widgets::menuItem("Color")) m_store.importTexture(loaders::texture::TextureType::sRGB);
-      if (widgets::menuItem("Normal map")) m_store.importTexture(loaders::texture::TextureType::LinearRGB);
+      if (widgets::menuItem("Normal map")) m_store.importTexture(loaders::texture::TextureType::Normal);
       if (widgets::menuItem("HDR/Env map")) m_store.importTexture(loaders::texture::TextureType::HDR);
       if (widgets::menuItem("Grayscale")) m_store.importTexture(loaders::texture::TextureType::Mono);
       ImGui::EndMenu();
@@ -19,7 +19,7 @@ static float3 eulerFromQuat(fastgltf::math::fquat q) {
 GltfLoader::GltfLoader(MTL::Device *device, MTL::CommandQueue *commandQueue,
                        Scene &scene) noexcept
     : m_device(device), m_commandQueue(commandQueue),
-      m_textureLoader(device, commandQueue, scene), m_scene(scene) {}
+      m_textureLoader(device, scene), m_scene(scene) {}
 
 /*
  * Load a scene from glTF.
@@ -56,22 +56,39 @@ void GltfLoader::load(const fs::path &path, int options) {
   }
   m_asset = std::make_unique<fastgltf::Asset>(std::move(asset.get()));
   m_options = options;
+  m_optimizerStats = {};
 
   m_materialIds.reserve(m_asset->materials.size());
   for (const auto &material : m_asset->materials)
     loadMaterial(material);
 
-  m_textureIds.reserve(m_texturesToLoad.size());
+  /*
+   * Textures are decoded in parallel, and set on the materials that use them
+   * as they finish loading
+   */
+  std::vector<texture::TextureLoader::MemorySource> textureSources;
+  std::vector<const TextureDescription *> textureDescs;
+  textureSources.reserve(m_texturesToLoad.size());
+  textureDescs.reserve(m_texturesToLoad.size());
   for (const auto &[idx, desc] : m_texturesToLoad) {
-    auto textureId = loadTexture(m_asset->textures[idx], desc.type);
-
-    // Set texture ID on materials using the texture
-    for (const auto &[materialId, slot] : desc.users) {
-      auto *material = m_scene.getAsset<Material>(materialId);
-      m_scene.updateMaterialTexture(material, slot, textureId);
+    if (auto source = getTextureSource(m_asset->textures[idx], desc.type)) {
+      textureSources.push_back(std::move(*source));
+      textureDescs.push_back(&desc);
     }
   }
 
+  m_textureIds.reserve(textureSources.size());
+  m_textureLoader.loadFromMemory(
+      textureSources, [&](size_t i, Scene::AssetID textureId) {
+        m_scene.assetRetained(textureId) = false;
+        m_textureIds.push_back(textureId);
+
+        for (const auto &[materialId, slot] : textureDescs[i]->users) {
+          auto *material = m_scene.getAsset<Material>(materialId);
+          m_scene.updateMaterialTexture(material, slot, textureId);
+        }
+      });
+
   m_meshIds.reserve(m_asset->meshes.size());
   for (const auto &mesh : m_asset->meshes)
     loadMesh(mesh);
@@ -107,6 +124,9 @@ void GltfLoader::load(const fs::path &path, int options) {
       std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
 
   std::println("Import glTF {} in {} ms", path.stem().string(), millis.count());
+  if (m_optimizerStats.meshes > 0)
+    std::println("Optimized {} meshes: {}", m_optimizerStats.meshes,
+                 m_optimizerStats.summary());
 }
 
 /*
@@ -241,7 +261,19 @@ void GltfLoader::loadMesh(const fastgltf::Mesh &gltfMesh) {
   if (!didLoadTangents)
     mesh.generateTangents();
 
-  auto id = m_scene.createAsset(std::move(mesh));
+  /*
+   * Optimize after generating tangents, so vertices are only welded where
+   * their tangents match too
+   */
+  std::optional<Mesh> optimized;
+  if (m_options & LoadOptions_OptimizeMeshes) {
+    mesh_optimizer::Stats stats;
+    optimized = mesh_optimizer::optimize(mesh, stats);
+    m_optimizerStats += stats;
+  }
+
+  auto id = m_scene.createAsset(optimized ? std::move(*optimized)
+                                          : std::move(mesh));
   m_scene.assetRetained(id) = false;
   m_meshIds.push_back(id);
   m_meshMaterials[id] = materialSlots;
@@ -363,7 +395,7 @@ void GltfLoader::loadMaterial(const fastgltf::Material &gltfMat) {
   // Load normal texture
   if (gltfMat.normalTexture) {
     uint16_t textureIdx = gltfMat.normalTexture->textureIndex;
-    m_texturesToLoad[textureIdx].type = texture::TextureType::LinearRGB;
+    m_texturesToLoad[textureIdx].type = texture::TextureType::Normal;
     m_texturesToLoad[textureIdx].users.emplace_back(
         materialId, Material::TextureSlot::Normal);
   }
@@ -394,29 +426,42 @@ void GltfLoader::loadMaterial(const fastgltf::Material &gltfMat) {
 }
 
 /*
- * Load a texture from the glTF file.
+ * Find the encoded image data for a texture in the glTF file.
  */
-Scene::AssetID GltfLoader::loadTexture(const fastgltf::Texture &gltfTex,
-                                       texture::TextureType type) {
+std::optional<texture::TextureLoader::MemorySource>
+GltfLoader::getTextureSource(const fastgltf::Texture &gltfTex,
+                             texture::TextureType type) const {
   // Assume the texture has an image index: we don't support any of the image
   // type extensions for now
   const auto &image = m_asset->images[gltfTex.imageIndex.value()];
 
   // Get through all the levels of indirection to the actual texture bytes
   const auto *bvi = std::get_if<fastgltf::sources::BufferView>(&image.data);
+  if (!bvi) {
+    std::println(stderr, "[Error] gltf: Unsupported image source for {}",
+                 gltfTex.name);
+    return std::nullopt;
+  }
   const auto &bv = m_asset->bufferViews[bvi->bufferViewIndex];
   const auto &buf = m_asset->buffers[bv.bufferIndex];
 
   // This only supports one type of data source. TODO: support other data source
   // types
   const auto *bytes = std::get_if<fastgltf::sources::Array>(&buf.data);
+  if (!bytes) {
+    std::println(stderr, "[Error] gltf: Unsupported buffer source for {}",
+                 gltfTex.name);
+    return std::nullopt;
+  }
   const auto *data =
       reinterpret_cast<const uint8_t *>(&bytes->bytes[bv.byteOffset]);
-  auto len = int32_t(bv.byteLength);
 
-  auto id = m_textureLoader.loadFromMemory(data, len, gltfTex.name, type);
-  m_scene.assetRetained(id) = false;
-  return id;
+  return texture::TextureLoader::MemorySource{
+      .data = data,
+      .length = uint32_t(bv.byteLength),
+      .name = std::string(gltfTex.name),
+      .type = type,
+  };
 }
 
 } // namespace pt::loaders::gltf
@@ -8,6 +8,7 @@
 #include <fastgltf/tools.hpp>
 
 #include <core/scene.hpp>
+#include <core/mesh_optimizer.hpp>
 #include <loaders/texture.hpp>
 
 namespace fs = std::filesystem;
@@ -34,8 +35,9 @@ enum LoadOptions {
   LoadOptions_None = 0,
   LoadOptions_SkipEmptyNodes = 1 << 0,        // Don't create nodes with no loadable objects or children
   LoadOptions_CreateSceneNodes = 1 << 1,      // Create a root node for each scene instead of appending nodes directly
+  LoadOptions_OptimizeMeshes = 1 << 2,        // Weld vertices, remove degenerate triangles and reorder for the GPU
 
-  LoadOptions_Default = LoadOptions_SkipEmptyNodes | LoadOptions_CreateSceneNodes,
+  LoadOptions_Default = LoadOptions_SkipEmptyNodes | LoadOptions_CreateSceneNodes | LoadOptions_OptimizeMeshes,
 };
 
 class GltfLoader {
@@ -66,6 +68,7 @@ private:
   ankerl::unordered_dense::map<uint32_t, TextureDescription> m_texturesToLoad;
 
   int m_options = LoadOptions_Default;
+  mesh_optimizer::Stats m_optimizerStats;
 
   void loadMesh(const fastgltf::Mesh& gltfMesh);
 
@@ -73,7 +76,10 @@ private:
 
   void loadMaterial(const fastgltf::Material& gltfMat);
 
-  [[nodiscard]] Scene::AssetID loadTexture(const fastgltf::Texture& gltfTex, texture::TextureType type);
+  [[nodiscard]] std::optional<texture::TextureLoader::MemorySource> getTextureSource(
+    const fastgltf::Texture& gltfTex,
+    texture::TextureType type
+  ) const;
 };
 
 
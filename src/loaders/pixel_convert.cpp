@@ -0,0 +1,152 @@
+#include "pixel_convert.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+#include <core/texture.hpp>
+#include <utils/utils.hpp>
+
+namespace pt::loaders::texture {
+
+// Pixels per chunk of work handed to a thread
+static constexpr size_t chunkSize = 1 << 16;
+
+/*
+ * Convert a chunk of pixels, returning the lowest source alpha
+ */
+static uint8_t convertChunk(const uint8_t *src, size_t count,
+                            std::span<const uint8_t> map, bool forceAlpha,
+                            uint8_t *dst) {
+  const size_t n = map.size();
+  uint8_t minAlpha = 255;
+  size_t i = 0;
+
+#if defined(__ARM_NEON)
+  /*
+   * NEON: deinterleaving loads split 16 pixels into one register per
+   * channel, so channel mapping is just picking registers to store
+   */
+  uint8x16_t minAlphaV = vdupq_n_u8(255);
+  for (; i + 16 <= count; i += 16) {
+    const uint8x16x4_t px = vld4q_u8(src + i * 4);
+    minAlphaV = vminq_u8(minAlphaV, px.val[3]);
+
+    if (n == 1) {
+      vst1q_u8(dst + i, px.val[map[0]]);
+    } else if (n == 2) {
+      const uint8x16x2_t out = {{px.val[map[0]], px.val[map[1]]}};
+      vst2q_u8(dst + i * 2, out);
+    } else {
+      const uint8x16x4_t out = {{px.val[map[0]], px.val[map[1]],
+                                 px.val[map[2]],
+                                 forceAlpha ? vdupq_n_u8(255)
+                                            : px.val[map[3]]}};
+      vst4q_u8(dst + i * 4, out);
+    }
+  }
+  minAlpha = vminvq_u8(minAlphaV);
+#elif defined(__SSSE3__)
+  /*
+   * SSSE3: a byte shuffle gathers the mapped channels of 4 pixels at the
+   * start of the register. Non-alpha bytes are set before the alpha min.
+   */
+  alignas(16) uint8_t mask[16];
+  std::fill_n(mask, 16, 0x80);
+  for (size_t p = 0; p < 4; p++) {
+    for (size_t c = 0; c < n; c++)
+      mask[p * n + c] = uint8_t(p * 4 + map[c]);
+  }
+
+  const __m128i shuffle = _mm_load_si128((const __m128i *)mask);
+  const __m128i notAlpha = _mm_set1_epi32(0x00ffffff);
+  const __m128i alpha =
+      forceAlpha && n == 4 ? _mm_set1_epi32(int(0xff000000)) : _mm_setzero_si128();
+
+  __m128i minAlphaV = _mm_set1_epi8(char(0xff));
+  for (; i + 4 <= count; i += 4) {
+    const __m128i px = _mm_loadu_si128((const __m128i *)(src + i * 4));
+    minAlphaV = _mm_min_epu8(minAlphaV, _mm_or_si128(px, notAlpha));
+
+    const __m128i out = _mm_or_si128(_mm_shuffle_epi8(px, shuffle), alpha);
+    if (n == 4) {
+      _mm_storeu_si128((__m128i *)(dst + i * 4), out);
+    } else if (n == 2) {
+      _mm_storel_epi64((__m128i *)(dst + i * 2), out);
+    } else {
+      const int32_t packed = _mm_cvtsi128_si32(out);
+      std::memcpy(dst + i, &packed, sizeof(packed));
+    }
+  }
+
+  alignas(16) uint8_t lanes[16];
+  _mm_store_si128((__m128i *)lanes, minAlphaV);
+  minAlpha = std::min({lanes[3], lanes[7], lanes[11], lanes[15]});
+#endif
+
+  // Scalar tail, and the whole chunk when there's no SIMD path
+  for (; i < count; i++) {
+    minAlpha = std::min(minAlpha, src[i * 4 + 3]);
+    for (size_t c = 0; c < n; c++)
+      dst[i * n + c] = src[i * 4 + map[c]];
+    if (forceAlpha && n == 4)
+      dst[i * 4 + 3] = 255;
+  }
+
+  return minAlpha;
+}
+
+bool convertPixels(const uint8_t *src, size_t count,
+                   std::span<const uint8_t> channelMap, bool hasAlphaChannel,
+                   uint8_t *dst) {
+  const size_t chunks = (count + chunkSize - 1) / chunkSize;
+  std::vector<uint8_t> minAlpha(chunks, 255);
+
+  utils::parallelFor(chunks, [&](size_t chunk) {
+    const size_t start = chunk * chunkSize;
+    const size_t n = std::min(chunkSize, count - start);
+    minAlpha[chunk] =
+        convertChunk(src + start * 4, n, channelMap, !hasAlphaChannel,
+                     dst + start * channelMap.size());
+  });
+
+  if (!hasAlphaChannel)
+    return false;
+  return std::ranges::any_of(minAlpha, [](uint8_t a) { return a < 255; });
+}
+
+void convertPixelsToHalf(const float *src, size_t count, uint16_t *dst) {
+  const size_t values = count * 4;
+  const size_t chunks = (values + chunkSize - 1) / chunkSize;
+
+  utils::parallelFor(chunks, [&](size_t chunk) {
+    size_t i = chunk * chunkSize;
+    const size_t end = std::min(values, i + chunkSize);
+
+#if defined(__ARM_NEON)
+    const float32x4_t lo = vdupq_n_f32(-65504.0f), hi = vdupq_n_f32(65504.0f);
+    for (; i + 4 <= end; i += 4) {
+      const float32x4_t v = vminnmq_f32(vmaxnmq_f32(vld1q_f32(src + i), lo), hi);
+      vst1_u16(dst + i, vreinterpret_u16_f16(vcvt_f16_f32(v)));
+    }
+#elif defined(__F16C__)
+    const __m128 lo = _mm_set1_ps(-65504.0f), hi = _mm_set1_ps(65504.0f);
+    for (; i + 4 <= end; i += 4) {
+      const __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i), lo), hi);
+      _mm_storel_epi64((__m128i *)(dst + i),
+                       _mm_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+    }
+#endif
+
+    for (; i < end; i++)
+      dst[i] = Texture::floatToHalf(src[i]);
+  });
+}
+
+} // namespace pt::loaders::texture
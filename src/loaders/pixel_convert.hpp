@@ -0,0 +1,34 @@
+#ifndef PLATINUM_LOADER_PIXEL_CONVERT_HPP
+#define PLATINUM_LOADER_PIXEL_CONVERT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace pt::loaders::texture {
+
+/*
+ * CPU conversion from decoded RGBA pixels to our texture formats. Conversion
+ * is split in chunks across threads, and uses NEON or SSSE3/F16C when
+ * available with a scalar fallback.
+ */
+
+/*
+ * Map channels of 8 bit RGBA pixels to a texture with channelMap.size()
+ * channels: output channel i is source channel channelMap[i]. If the source
+ * has no alpha channel, four channel output has alpha forced to 255.
+ * Returns whether any source alpha is below 255, which is computed in the same
+ * pass.
+ */
+bool convertPixels(const uint8_t *src, size_t count,
+                   std::span<const uint8_t> channelMap, bool hasAlphaChannel,
+                   uint8_t *dst);
+
+/*
+ * Convert RGBA float pixels to RGBA half floats, clamped to the finite range
+ */
+void convertPixelsToHalf(const float *src, size_t count, uint16_t *dst);
+
+} // namespace pt::loaders::texture
+
+#endif
@@ -1,34 +1,24 @@
 #include "texture.hpp"
 
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
 
 #include <stb_image.h>
 #include <tinyexr.h>
 
+#include <loaders/pixel_convert.hpp>
 #include <utils/metal_utils.hpp>
+#include <utils/utils.hpp>
 
 namespace pt::loaders::texture {
-using metal_utils::operator""_ns;
-
-MTL::PixelFormat
-TextureLoader::getSourceTextureFormat(pt::loaders::texture::TextureType type,
-                                      int format) {
-  switch (type) {
-  case TextureType::HDR:
-    return MTL::PixelFormatRGBA32Float;
-  case TextureType::sRGB:
-    return MTL::PixelFormatRGBA8Unorm_sRGB;
-  case TextureType::LinearRGB:
-  case TextureType::RoughnessMetallic:
-  case TextureType::Mono:
-    return MTL::PixelFormatRGBA8Unorm;
-  default:
-    return MTL::PixelFormatInvalid;
-  }
-}
 
 std::tuple<MTL::PixelFormat, std::vector<uint8_t>>
-TextureLoader::getAttributesForTexture(TextureType type) {
+TextureLoader::getAttributesForTexture(TextureType type, bool halfFloat) {
   switch (type) {
   case TextureType::sRGB:
     return std::make_tuple(MTL::PixelFormatRGBA8Unorm_sRGB,
@@ -36,185 +26,390 @@ TextureLoader::getAttributesForTexture(TextureType type) {
   case TextureType::LinearRGB:
     return std::make_tuple(MTL::PixelFormatRGBA8Unorm,
                            std::vector<uint8_t>{0, 1, 2, 3});
+  case TextureType::Normal:
+    return std::make_tuple(MTL::PixelFormatRG8Unorm,
+                           std::vector<uint8_t>{0, 1});
   case TextureType::Mono:
     return std::make_tuple(MTL::PixelFormatR8Unorm, std::vector<uint8_t>{0});
   case TextureType::RoughnessMetallic:
     return std::make_tuple(MTL::PixelFormatRG8Unorm,
                            std::vector<uint8_t>{1, 2});
   case TextureType::HDR:
-    return std::make_tuple(MTL::PixelFormatRGBA32Float,
+    return std::make_tuple(halfFloat ? MTL::PixelFormatRGBA16Float
+                                     : MTL::PixelFormatRGBA32Float,
                            std::vector<uint8_t>{0, 1, 2, 3});
   }
 }
 
-TextureLoader::TextureLoader(MTL::Device *device,
-                             MTL::CommandQueue *commandQueue,
-                             Scene &scene) noexcept
-    : m_device(device), m_commandQueue(commandQueue), m_scene(scene) {
-  /*
-   * Load the shader library
-   */
-  NS::Error *error = nullptr;
-  MTL::Library *lib = device->newLibrary("loaders.metallib"_ns, &error);
-  if (!lib) {
-    std::println(stderr, "TextureLoader: Failed to load shader library: {}",
-                 error->localizedDescription()->utf8String());
-    assert(false);
+compression::BlockFormat TextureLoader::getBlockFormat(TextureType type) {
+  switch (type) {
+  case TextureType::sRGB:
+  case TextureType::LinearRGB:
+    return compression::BlockFormat::BC7;
+  case TextureType::Mono:
+    return compression::BlockFormat::BC4;
+  case TextureType::Normal:
+  case TextureType::RoughnessMetallic:
+    return compression::BlockFormat::BC5;
+  case TextureType::HDR:
+    return compression::BlockFormat::BC6H;
   }
+  std::unreachable();
+}
 
-  /*
-   * Build the texture converter pipeline
-   */
-  auto desc = metal_utils::makeComputePipelineDescriptor({
-      .function = metal_utils::getFunction(lib, "convertTexture"),
-      .threadGroupSizeIsMultipleOfExecutionWidth = true,
-  });
+bool TextureLoader::compressing() const {
+  return m_options.compress && m_device->supportsBCTextureCompression();
+}
 
-  m_textureConverterPso = device->newComputePipelineState(
-      desc, MTL::PipelineOptionNone, nullptr, &error);
-  if (!m_textureConverterPso) {
-    std::println(
-        stderr,
-        "TextureLoader: Failed to create texture converter pipeline: {}",
-        error->localizedDescription()->utf8String());
-    assert(false);
-  }
+std::optional<uint64_t>
+TextureLoader::getCacheKey(std::span<const uint8_t> source,
+                           TextureType type) const {
+  if (!m_options.cache || !m_cache.valid())
+    return std::nullopt;
+
+  const uint32_t settings[] = {
+      uint32_t(type),
+      compressing(),
+      uint32_t(m_options.quality),
+      m_options.halfFloatHdr,
+  };
+  return TextureCache::key(source, settings);
 }
 
-Scene::AssetID TextureLoader::loadFromFile(const fs::path &path,
-                                           std::string_view name,
-                                           TextureType type) {
+std::optional<TextureLoader::DecodedImage>
+TextureLoader::decode(std::span<const uint8_t> source, std::string_view name,
+                      TextureType type) {
+  DecodedImage image;
+  int32_t width = 0, height = 0;
+
   if (type == TextureType::HDR) {
-    if (path.extension().string() == ".exr") {
+    if (IsEXRFromMemory(source.data(), source.size()) == TINYEXR_SUCCESS) {
       // Use tinyexr for EXR file support
-      int32_t width, height;
-      float *rgba;
-      const char *err;
-      int r = LoadEXR(&rgba, &width, &height, path.c_str(), &err);
-      assert(r >= 0);
-
-      return load((uint8_t *)rgba, name, type, width, height, 16, false);
+      float *rgba = nullptr;
+      const char *err = nullptr;
+      if (LoadEXRFromMemory(&rgba, &width, &height, source.data(),
+                            source.size(), &err) != TINYEXR_SUCCESS) {
+        std::println(stderr, "TextureLoader: Failed to decode {}: {}", name,
+                     err ? err : "unknown error");
+        FreeEXRErrorMessage(err);
+        return std::nullopt;
+      }
+      image.pixels.reset((uint8_t *)rgba);
     } else {
       // Otherwise assume Radiance HDR and use stb_image
-      int32_t width, height;
-      const float *pixels =
-          stbi_loadf(path.c_str(), &width, &height, nullptr, 4);
-
-      return load((uint8_t *)pixels, name, type, width, height, 16, false);
+      image.pixels.reset((uint8_t *)stbi_loadf_from_memory(
+          source.data(), int(source.size()), &width, &height, nullptr, 4));
     }
+    image.pixelStride = 4 * sizeof(float);
+    image.hasAlphaChannel = false;
   } else {
-    int32_t width, height;
-    const uint8_t *pixels =
-        stbi_load(path.c_str(), &width, &height, nullptr, 4);
+    image.pixels.reset(stbi_load_from_memory(
+        source.data(), int(source.size()), &width, &height, nullptr, 4));
+    image.pixelStride = 4;
+    image.hasAlphaChannel = true;
+  }
 
-    return load(pixels, name, type, width, height, 4, true);
+  if (!image.pixels) {
+    std::println(stderr, "TextureLoader: Failed to decode {}: {}", name,
+                 stbi_failure_reason());
+    return std::nullopt;
   }
+
+  image.width = uint32_t(width);
+  image.height = uint32_t(height);
+  return image;
 }
 
-Scene::AssetID TextureLoader::loadFromMemory(const uint8_t *data, uint32_t len,
-                                             std::string_view name,
-                                             TextureType type) {
-  int32_t width, height;
-  const uint8_t *pixels =
-      stbi_load_from_memory(data, len, &width, &height, nullptr, 4);
+bool TextureLoader::probe(std::span<const uint8_t> source, TextureType type,
+                          int32_t &width, int32_t &height) {
+  // HDR textures can be EXR, which stb_image doesn't read, see decode()
+  if (type == TextureType::HDR &&
+      IsEXRFromMemory(source.data(), source.size()) == TINYEXR_SUCCESS) {
+    EXRVersion version;
+    if (ParseEXRVersionFromMemory(&version, source.data(), source.size()) !=
+        TINYEXR_SUCCESS)
+      return false;
+
+    EXRHeader header;
+    InitEXRHeader(&header);
+    const char *err = nullptr;
+    if (ParseEXRHeaderFromMemory(&header, &version, source.data(),
+                                 source.size(), &err) != TINYEXR_SUCCESS) {
+      FreeEXRErrorMessage(err);
+      return false;
+    }
+
+    width = header.data_window.max_x - header.data_window.min_x + 1;
+    height = header.data_window.max_y - header.data_window.min_y + 1;
+    FreeEXRHeader(&header);
+    return width > 0 && height > 0;
+  }
 
-  return load(pixels, name, type, width, height, 4, true);
+  return stbi_info_from_memory(source.data(), int(source.size()), &width,
+                               &height, nullptr) != 0;
 }
 
-Scene::AssetID TextureLoader::load(const uint8_t *data, std::string_view name,
-                                   TextureType type, uint32_t width,
-                                   uint32_t height, size_t pixelStride,
-                                   bool hasAlphaChannel) {
-  auto readBuffer = m_device->newBuffer(pixelStride * width * height,
-                                        MTL::ResourceStorageModeShared);
-  memcpy(readBuffer->contents(), data, readBuffer->length());
+size_t TextureLoader::workingSetSize(uint32_t width, uint32_t height,
+                                     TextureType type) const {
+  const size_t pixels = size_t(width) * size_t(height);
+  const bool compress = compressing();
+  const auto [format, channels] =
+      getAttributesForTexture(type, m_options.halfFloatHdr && !compress);
+
+  size_t texelSize = channels.size();
+  if (format == MTL::PixelFormatRGBA16Float)
+    texelSize = 4 * sizeof(uint16_t);
+  else if (format == MTL::PixelFormatRGBA32Float)
+    texelSize = 4 * sizeof(float);
 
   /*
-   * Check if the texture has any pixels with alpha < 1
-   * TODO: this only works for 8 bit per channel textures
-   *  alpha is unsupported for textures with >8 bits per channel
+   * The decoded image lives until the texture is done. Meanwhile the texture
+   * gets converted pixels, then mipmapping and compression work on float
+   * copies of a level and the one below it. Compression also holds an encoded
+   * level and the compressed mip chain, at most a byte per texel each.
    */
-  bool hasAlpha = false;
-  if (hasAlphaChannel) {
-    auto contents = static_cast<uchar4 *>(readBuffer->contents());
-    for (uint32_t i = 0; i < readBuffer->length() / sizeof(uchar4); i++) {
-      if (contents[i].a < 255) {
-        hasAlpha = true;
-        break;
+  const size_t decoded =
+      pixels * (type == TextureType::HDR ? 4 * sizeof(float) : 4);
+  const size_t mipChain = pixels * texelSize * 4 / 3;
+  const size_t working =
+      std::max(pixels * texelSize, pixels * sizeof(simd::float4) * 5 / 4);
+  const size_t compressed = compress ? pixels * 2 * 4 / 3 : 0;
+  return decoded + mipChain + working + compressed;
+}
+
+TextureLoader::TextureLoader(MTL::Device *device, Scene &scene,
+                             ImportOptions options) noexcept
+    : m_device(device), m_scene(scene), m_options(options),
+      m_cache(options.cacheSizeLimit) {}
+
+std::optional<Scene::AssetID>
+TextureLoader::loadFromFile(const fs::path &path, std::string_view name,
+                            TextureType type) {
+  utils::MappedFile file(path);
+  if (!file) {
+    std::println(stderr, "TextureLoader: Failed to open {}", path.string());
+    return std::nullopt;
+  }
+
+  auto texture = load({file.data(), file.size()}, name, type);
+  m_cache.trim();
+
+  if (!texture)
+    return std::nullopt;
+  return m_scene.createAsset(std::move(*texture));
+}
+
+std::optional<Scene::AssetID>
+TextureLoader::loadFromMemory(const uint8_t *data, uint32_t len,
+                              std::string_view name, TextureType type) {
+  auto texture = load({data, len}, name, type);
+  m_cache.trim();
+
+  if (!texture)
+    return std::nullopt;
+  return m_scene.createAsset(std::move(*texture));
+}
+
+void TextureLoader::loadFromMemory(
+    std::span<const MemorySource> sources,
+    const std::function<void(size_t, Scene::AssetID)> &onLoaded,
+    size_t maxBytesInFlight) {
+  auto start = std::chrono::high_resolution_clock::now();
+
+  struct Result {
+    size_t index;
+    std::optional<Texture> texture;
+  };
+
+  std::mutex mutex;
+  std::condition_variable budgetCv, doneCv;
+  size_t bytesInFlight = 0;
+  std::vector<Result> done;
+
+  std::atomic<size_t> next = 0;
+  std::atomic<size_t> decodedBytes = 0;
+  std::atomic<size_t> cachedCount = 0;
+
+  /*
+   * Each worker takes the next source and looks it up in the cache. On a miss
+   * it waits until the texture's working set fits in the memory budget (a lone
+   * texture always fits), then decodes and converts it. With more than one
+   * worker, each converts its textures serially, so there's a worker per
+   * hardware thread instead of nested thread pools.
+   */
+  const size_t threadCount = std::min(
+      sources.size(), size_t(std::max(1u, std::thread::hardware_concurrency())));
+
+  auto worker = [&]() {
+    if (threadCount > 1)
+      utils::runParallelForSerially();
+
+    for (size_t i = next++; i < sources.size(); i = next++) {
+      NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+      const auto &source = sources[i];
+      const std::span<const uint8_t> bytes(source.data, source.length);
+
+      const auto key = getCacheKey(bytes, source.type);
+      std::optional<Texture> texture;
+      if (key)
+        texture = m_cache.load(*key, source.name, m_device);
+
+      if (texture) {
+        cachedCount++;
+      } else {
+        // Sources that can't be probed aren't charged, decode() reports them
+        int32_t width = 0, height = 0;
+        size_t cost = 0;
+        if (probe(bytes, source.type, width, height))
+          cost =
+              workingSetSize(uint32_t(width), uint32_t(height), source.type);
+
+        {
+          std::unique_lock lock(mutex);
+          budgetCv.wait(lock, [&] {
+            return bytesInFlight == 0 ||
+                   bytesInFlight + cost <= maxBytesInFlight;
+          });
+          bytesInFlight += cost;
+        }
+
+        if (auto image = decode(bytes, source.name, source.type)) {
+          decodedBytes +=
+              size_t(image->width) * image->height * image->pixelStride;
+          texture = process(*image, source.name, source.type);
+          if (key)
+            m_cache.store(*key, *texture);
+        }
+
+        {
+          std::lock_guard lock(mutex);
+          bytesInFlight -= cost;
+        }
+        budgetCv.notify_all();
+      }
+
+      {
+        std::lock_guard lock(mutex);
+        done.push_back({i, std::move(texture)});
       }
+      doneCv.notify_one();
+      pool->release();
     }
-  }
+  };
+
+  std::vector<std::jthread> workers;
+  workers.reserve(threadCount);
+  for (size_t t = 0; t < threadCount; t++)
+    workers.emplace_back(worker);
 
   /*
-   * Create a temporary texture as input to the texture converter shader. We
-   * just make this texture RGBA, since it's only used while loading we don't
-   * care about the extra memory use.
+   * Add finished textures to the scene as they come in
    */
-  auto srcPixelFormat = getSourceTextureFormat(type, 0);
-  auto [texturePixelFormat, textureChannels] = getAttributesForTexture(type);
-  auto srcDesc = metal_utils::makeTextureDescriptor({
-      .width = uint32_t(width),
-      .height = uint32_t(height),
-      .format = srcPixelFormat,
-  });
+  for (size_t handled = 0; handled < sources.size();) {
+    std::vector<Result> results;
+    {
+      std::unique_lock lock(mutex);
+      doneCv.wait(lock, [&] { return !done.empty(); });
+      std::swap(results, done);
+    }
+
+    for (auto &result : results) {
+      if (result.texture)
+        onLoaded(result.index, m_scene.createAsset(std::move(*result.texture)));
+    }
+    handled += results.size();
+  }
+
+  m_cache.trim();
+
+  auto end = std::chrono::high_resolution_clock::now();
+  auto millis =
+      std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+  const double megabytes = double(decodedBytes) / double(1 << 20);
+  std::println("Loaded {} textures ({} cached), decoded {:.1f} MB in {} ms "
+               "({:.1f} MB/s)",
+               sources.size(), cachedCount.load(), megabytes, millis.count(),
+               megabytes / std::max(double(millis.count()) / 1000.0, 1e-3));
+}
+
+std::optional<Texture> TextureLoader::load(std::span<const uint8_t> source,
+                                          std::string_view name,
+                                          TextureType type) {
+  const auto key = getCacheKey(source, type);
+  if (key) {
+    if (auto texture = m_cache.load(*key, name, m_device))
+      return texture;
+  }
+
+  auto image = decode(source, name, type);
+  if (!image)
+    return std::nullopt;
+
+  auto texture = process(*image, name, type);
+  if (key)
+    m_cache.store(*key, texture);
+  return texture;
+}
+
+Texture TextureLoader::process(const DecodedImage &image, std::string_view name,
+                               TextureType type) {
+  const uint32_t width = image.width, height = image.height;
+  const uint8_t *data = image.pixels.get();
+  const size_t pixelStride = image.pixelStride;
 
-  auto srcTexture = m_device->newTexture(srcDesc);
-  srcTexture->replaceRegion(MTL::Region(0, 0, 0, width, height, 1), 0,
-                            readBuffer->contents(), pixelStride * width);
+  const bool compress = compressing();
+  auto [texturePixelFormat, textureChannels] =
+      getAttributesForTexture(type, m_options.halfFloatHdr && !compress);
 
   /*
    * Create the actual texture we're going to store. The pixel format here
-   * depends on usage.
+   * depends on usage. Textures get a full mip chain, for texture LOD.
    */
   auto desc = metal_utils::makeTextureDescriptor({
       .width = uint32_t(width),
       .height = uint32_t(height),
       .storageMode = MTL::StorageModeShared,
       .format = texturePixelFormat,
-      .usage = MTL::TextureUsageShaderRead | MTL::TextureUsageShaderWrite,
+      .usage = MTL::TextureUsageShaderRead,
+      .mipLevels = Texture::mipLevelCount(uint32_t(width), uint32_t(height)),
   });
   auto texture = m_device->newTexture(desc);
+  const auto region = MTL::Region(0, 0, width, height);
+  const size_t count = size_t(width) * height;
 
   /*
-   * Run the texture converter shader to store the actual texture
+   * Convert the decoded pixels to the texture format on the CPU. For 8 bit
+   * sources this maps channels and checks for pixels with alpha < 1 in the
+   * same pass. Float sources have no alpha.
    */
-  auto threadsPerThreadgroup = MTL::Size(8, 8, 1);
-  auto threadgroups = MTL::Size((width + threadsPerThreadgroup.width - 1) /
-                                    threadsPerThreadgroup.width,
-                                (height + threadsPerThreadgroup.height - 1) /
-                                    threadsPerThreadgroup.height,
-                                1);
-
-  auto cmd = m_commandQueue->commandBuffer();
-  auto enc = cmd->computeCommandEncoder();
-
-  enc->setComputePipelineState(m_textureConverterPso);
-
-  const uint8_t nChannels = textureChannels.size();
-  enc->setBytes(textureChannels.data(), nChannels * sizeof(uint8_t), 0);
-  enc->setBytes(&nChannels, sizeof(uint8_t), 1);
-  enc->setBytes(&hasAlphaChannel, sizeof(bool), 2);
-
-  enc->setTexture(srcTexture, 0);
-  enc->setTexture(texture, 1);
-
-  enc->dispatchThreadgroups(threadgroups, threadsPerThreadgroup);
-
-  enc->endEncoding();
-  cmd->commit();
-
-  // Clean up temp resources
-  readBuffer->release();
-  srcTexture->release();
+  bool hasAlpha = false;
+  if (pixelStride == 4 * sizeof(float)) {
+    if (texturePixelFormat == MTL::PixelFormatRGBA16Float) {
+      std::vector<uint16_t> converted(count * 4);
+      convertPixelsToHalf((const float *)data, count, converted.data());
+      texture->replaceRegion(region, 0, converted.data(),
+                             width * 4 * sizeof(uint16_t));
+    } else {
+      texture->replaceRegion(region, 0, data, width * pixelStride);
+    }
+  } else {
+    const size_t nChannels = textureChannels.size();
+    std::vector<uint8_t> converted(count * nChannels);
+    hasAlpha = convertPixels(data, count, textureChannels,
+                             image.hasAlphaChannel, converted.data());
+    texture->replaceRegion(region, 0, converted.data(), width * nChannels);
+  }
 
   /*
    * Store the actual texture in our scene and return the ID so it can be set
-   on
-   * the materials that use it, replacing the placeholder
+   * on the materials that use it, replacing the placeholder. Compression
+   * happens last, as it needs the full mip chain.
    */
   Texture asset(texture, name, hasAlpha);
-  return m_scene.createAsset(std::move(asset));
-  return 0;
+  asset.generateMipmaps();
+  if (compress)
+    asset.compress(m_device, getBlockFormat(type), m_options.quality);
+  return asset;
 }
 
 } // namespace pt::loaders::texture
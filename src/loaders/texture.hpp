@@ -2,9 +2,15 @@
 #define PLATINUM_LOADER_TEXTURE_HPP
 
 #include <filesystem>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <span>
 #include <simd/simd.h>
 
 #include <core/scene.hpp>
+#include <core/texture_compression.hpp>
+#include <loaders/texture_cache.hpp>
 
 namespace fs = std::filesystem;
 using namespace simd;
@@ -14,37 +20,126 @@ namespace pt::loaders::texture {
 enum class TextureType {
   sRGB,
   LinearRGB,
+  Normal,
   Mono,
   RoughnessMetallic,
   HDR,
 };
 
+/*
+ * Processing settings for imported textures. Processed textures are cached on
+ * disk, keyed by a hash of the encoded source image and these settings.
+ */
+struct ImportOptions {
+  // Block compress textures, if the device supports it
+  bool compress = true;
+  compression::Quality quality = compression::Quality::Normal;
+
+  // Store HDR images as RGBA16F instead of RGBA32F when not compressing them
+  bool halfFloatHdr = true;
+
+  bool cache = true;
+  size_t cacheSizeLimit = size_t(4) << 30;
+};
+
 class TextureLoader {
 public:
-  explicit TextureLoader(MTL::Device *device, MTL::CommandQueue *commandQueue,
-                         Scene &scene) noexcept;
+  /*
+   * An encoded image in memory, for batch loading
+   */
+  struct MemorySource {
+    const uint8_t *data;
+    uint32_t length;
+    std::string name;
+    TextureType type;
+  };
 
-  Scene::AssetID loadFromFile(const fs::path &path, std::string_view name,
-                              TextureType type);
+  explicit TextureLoader(MTL::Device *device, Scene &scene,
+                         ImportOptions options = {}) noexcept;
 
-  Scene::AssetID loadFromMemory(const uint8_t *data, uint32_t len,
-                                std::string_view name, TextureType type);
+  std::optional<Scene::AssetID> loadFromFile(const fs::path &path,
+                                             std::string_view name,
+                                             TextureType type);
+
+  std::optional<Scene::AssetID> loadFromMemory(const uint8_t *data,
+                                               uint32_t len,
+                                               std::string_view name,
+                                               TextureType type);
+
+  /*
+   * Decode and convert many textures concurrently on a pool of worker
+   * threads, with the working sets of the textures in flight (decoded pixels,
+   * mip chains and conversion buffers) kept under maxBytesInFlight.
+   * Textures are added to the scene on the calling thread as they complete,
+   * calling onLoaded(index, id) for each. Textures that fail to decode are
+   * skipped.
+   */
+  void loadFromMemory(
+      std::span<const MemorySource> sources,
+      const std::function<void(size_t, Scene::AssetID)> &onLoaded,
+      size_t maxBytesInFlight = size_t(1) << 30);
 
 private:
   MTL::Device *m_device;
-  MTL::CommandQueue *m_commandQueue;
-  MTL::ComputePipelineState *m_textureConverterPso = nullptr;
 
   Scene &m_scene;
+  ImportOptions m_options;
+  TextureCache m_cache;
+
+  /*
+   * Decoded source image, RGBA8 or RGBA32F
+   */
+  struct DecodedImage {
+    std::unique_ptr<uint8_t, decltype(&std::free)> pixels{nullptr, std::free};
+    uint32_t width = 0, height = 0;
+    size_t pixelStride = 0;
+    bool hasAlphaChannel = false;
+  };
 
-  static MTL::PixelFormat getSourceTextureFormat(TextureType type,
-                                                 int format); // TODO fix this
   static std::tuple<MTL::PixelFormat, std::vector<uint8_t>>
-  getAttributesForTexture(TextureType type);
+  getAttributesForTexture(TextureType type, bool halfFloat);
+  static compression::BlockFormat getBlockFormat(TextureType type);
 
-  Scene::AssetID load(const uint8_t *data, std::string_view name,
-                      TextureType type, uint32_t width, uint32_t height,
-                      size_t pixelStride, bool hasAlphaChannel);
+  [[nodiscard]] bool compressing() const;
+
+  /*
+   * Cache key for an encoded image with the current settings, or nothing if
+   * caching is disabled
+   */
+  [[nodiscard]] std::optional<uint64_t>
+  getCacheKey(std::span<const uint8_t> source, TextureType type) const;
+
+  [[nodiscard]] static std::optional<DecodedImage>
+  decode(std::span<const uint8_t> source, std::string_view name,
+         TextureType type);
+
+  /*
+   * Read the size of an encoded image from its header, without decoding it.
+   * Returns false if the format isn't recognized.
+   */
+  static bool probe(std::span<const uint8_t> source, TextureType type,
+                    int32_t &width, int32_t &height);
+
+  /*
+   * Peak memory used to decode and process an image of the given size
+   */
+  [[nodiscard]] size_t workingSetSize(uint32_t width, uint32_t height,
+                                      TextureType type) const;
+
+  /*
+   * Load an encoded image from the cache, or decode and process it and store
+   * the result in the cache
+   */
+  [[nodiscard]] std::optional<Texture> load(std::span<const uint8_t> source,
+                                            std::string_view name,
+                                            TextureType type);
+
+  /*
+   * Convert decoded pixels to a texture. Doesn't touch the scene, so it's
+   * safe to call from any thread.
+   */
+  [[nodiscard]] Texture process(const DecodedImage &image,
+                                std::string_view name, TextureType type);
 };
 
 } // namespace pt::loaders::texture
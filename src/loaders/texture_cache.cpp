@@ -0,0 +1,282 @@
+#include "texture_cache.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <print>
+#include <thread>
+#include <vector>
+
+#include <utils/metal_utils.hpp>
+#include <utils/utils.hpp>
+
+namespace pt::loaders::texture {
+
+/*
+ * Header of a cache entry, followed by the data for each mip level. Bump the
+ * version whenever the processed output changes (conversion, mip filter,
+ * encoder).
+ */
+struct CacheHeader {
+  static constexpr uint32_t magic = 0x58545450; // "PTTX"
+  static constexpr uint32_t version = 3;
+
+  uint32_t fileMagic, fileVersion;
+  uint32_t format, width, height, levels;
+  uint32_t alpha, reserved;
+};
+
+static constexpr std::string_view entryExtension = ".ptex";
+
+/*
+ * Row pitch and row count of a mip level as stored in the cache. For block
+ * compressed formats a row is a row of 4x4 blocks.
+ */
+struct LevelLayout {
+  size_t bytesPerRow;
+  uint32_t rows;
+
+  [[nodiscard]] constexpr size_t size() const { return bytesPerRow * rows; }
+};
+
+static std::optional<LevelLayout> getLevelLayout(MTL::PixelFormat format,
+                                                 uint32_t width,
+                                                 uint32_t height) {
+  if (auto blockFormat = Texture::blockFormat(format))
+    return LevelLayout{compression::encodedSize(*blockFormat, width, 1),
+                       (height + 3) / 4};
+
+  switch (format) {
+  case MTL::PixelFormatRGBA32Float:
+    return LevelLayout{width * 4 * sizeof(float), height};
+  case MTL::PixelFormatRGBA16Float:
+    return LevelLayout{width * 4 * sizeof(uint16_t), height};
+  case MTL::PixelFormatRGBA8Unorm:
+  case MTL::PixelFormatRGBA8Unorm_sRGB:
+    return LevelLayout{width * 4, height};
+  case MTL::PixelFormatRG8Unorm:
+    return LevelLayout{width * 2, height};
+  case MTL::PixelFormatR8Unorm:
+    return LevelLayout{width, height};
+  default:
+    return std::nullopt;
+  }
+}
+
+TextureCache::TextureCache(size_t sizeLimit) noexcept
+    : m_directory(utils::cacheDirectory("textures")), m_sizeLimit(sizeLimit) {
+}
+
+uint64_t TextureCache::key(std::span<const uint8_t> source,
+                           std::span<const uint32_t> settings) {
+  /*
+   * Hash the source in 1MB chunks in parallel (FNV-1a), then combine the
+   * chunk hashes with the settings and cache version.
+   */
+  constexpr size_t chunkSize = 1 << 20;
+  constexpr uint64_t fnvOffset = 0xcbf29ce484222325, fnvPrime = 0x100000001b3;
+  auto fnv = [&](uint64_t hash, const uint8_t *bytes, size_t n) {
+    for (size_t i = 0; i < n; i++)
+      hash = (hash ^ bytes[i]) * fnvPrime;
+    return hash;
+  };
+
+  const size_t length = source.size();
+  std::vector<uint64_t> chunks((length + chunkSize - 1) / chunkSize);
+  utils::parallelFor(chunks.size(), [&](size_t i) {
+    const size_t n = std::min(chunkSize, length - i * chunkSize);
+    chunks[i] = fnv(fnvOffset, source.data() + i * chunkSize, n);
+  });
+
+  const uint64_t sizes[] = {CacheHeader::version, length};
+  uint64_t hash = fnv(fnvOffset, (const uint8_t *)sizes, sizeof(sizes));
+  hash = fnv(hash, (const uint8_t *)settings.data(), settings.size_bytes());
+  hash = fnv(hash, (const uint8_t *)chunks.data(),
+             chunks.size() * sizeof(uint64_t));
+
+  return hash;
+}
+
+fs::path TextureCache::path(uint64_t key) const {
+  return *m_directory / std::format("{:016x}{}", key, entryExtension);
+}
+
+std::optional<Texture> TextureCache::load(uint64_t key, std::string_view name,
+                                          MTL::Device *device) const {
+  if (!m_directory)
+    return std::nullopt;
+
+  const auto entryPath = path(key);
+  utils::MappedFile file(entryPath);
+  if (!file || file.size() < sizeof(CacheHeader))
+    return std::nullopt;
+
+  CacheHeader header{};
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (header.fileMagic != CacheHeader::magic ||
+      header.fileVersion != CacheHeader::version || header.width == 0 ||
+      header.height == 0 || header.levels == 0)
+    return std::nullopt;
+
+  /*
+   * Validate the whole entry before creating anything, a truncated file is
+   * treated as a miss
+   */
+  const auto format = MTL::PixelFormat(header.format);
+  std::vector<LevelLayout> layouts;
+  size_t expectedSize = sizeof(CacheHeader);
+  for (uint32_t level = 0; level < header.levels; level++) {
+    const uint32_t w = std::max(header.width >> level, 1u);
+    const uint32_t h = std::max(header.height >> level, 1u);
+    const auto layout = getLevelLayout(format, w, h);
+    if (!layout)
+      return std::nullopt;
+
+    layouts.push_back(*layout);
+    expectedSize += layout->size();
+  }
+
+  if (file.size() < expectedSize) {
+    std::println(stderr, "TextureCache: Truncated cache file {}",
+                 entryPath.string());
+    return std::nullopt;
+  }
+
+  auto desc = metal_utils::makeTextureDescriptor({
+      .width = header.width,
+      .height = header.height,
+      .storageMode = MTL::StorageModeShared,
+      .format = format,
+      .usage = MTL::TextureUsageShaderRead,
+      .mipLevels = header.levels,
+  });
+  auto texture = device->newTexture(desc);
+
+  // Upload straight from the mapped file, the pages are read in on demand
+  const uint8_t *data = file.data() + sizeof(CacheHeader);
+  for (uint32_t level = 0; level < header.levels; level++) {
+    const uint32_t w = std::max(header.width >> level, 1u);
+    const uint32_t h = std::max(header.height >> level, 1u);
+
+    texture->replaceRegion(MTL::Region(0, 0, w, h), level, data,
+                           layouts[level].bytesPerRow);
+    data += layouts[level].size();
+  }
+
+  // Bump the entry's modification time, which is what trim() uses for LRU
+  std::error_code error;
+  fs::last_write_time(entryPath, fs::file_time_type::clock::now(), error);
+
+  return Texture(texture, name, header.alpha != 0);
+}
+
+void TextureCache::store(uint64_t key, Texture &texture) const {
+  if (!m_directory)
+    return;
+
+  auto *tex = texture.texture();
+  const CacheHeader header{
+      .fileMagic = CacheHeader::magic,
+      .fileVersion = CacheHeader::version,
+      .format = uint32_t(tex->pixelFormat()),
+      .width = uint32_t(tex->width()),
+      .height = uint32_t(tex->height()),
+      .levels = uint32_t(tex->mipmapLevelCount()),
+      .alpha = texture.hasAlpha(),
+      .reserved = 0,
+  };
+  if (!getLevelLayout(tex->pixelFormat(), header.width, header.height))
+    return;
+
+  /*
+   * Write to a temporary file and move it in place, so a cache entry is never
+   * seen half written. The temporary name is unique per thread, in case two
+   * imports process the same image at once.
+   */
+  const auto entryPath = path(key);
+  auto tmpPath = entryPath;
+  tmpPath += std::format(".{}.tmp", std::hash<std::thread::id>{}(
+                                        std::this_thread::get_id()));
+  {
+    std::ofstream file(tmpPath, std::ios::out | std::ios::binary);
+    file.write((const char *)&header, sizeof(header));
+
+    std::vector<uint8_t> data;
+    for (uint32_t level = 0; level < header.levels; level++) {
+      const uint32_t w = std::max(header.width >> level, 1u);
+      const uint32_t h = std::max(header.height >> level, 1u);
+      const auto layout = *getLevelLayout(tex->pixelFormat(), w, h);
+
+      data.resize(layout.size());
+      tex->getBytes(data.data(), layout.bytesPerRow, MTL::Region(0, 0, w, h),
+                    level);
+      file.write((const char *)data.data(), std::streamsize(data.size()));
+    }
+
+    if (!file) {
+      std::println(stderr, "TextureCache: Failed to write cache file {}",
+                   entryPath.string());
+      file.close();
+
+      std::error_code error;
+      fs::remove(tmpPath, error);
+      return;
+    }
+  }
+
+  std::error_code error;
+  fs::rename(tmpPath, entryPath, error);
+  if (error)
+    fs::remove(tmpPath, error);
+}
+
+void TextureCache::trim() const {
+  if (!m_directory)
+    return;
+
+  struct Entry {
+    fs::path path;
+    size_t size;
+    fs::file_time_type lastUsed;
+  };
+
+  std::vector<Entry> entries;
+  size_t totalSize = 0;
+
+  std::error_code error;
+  for (const auto &file : fs::directory_iterator(*m_directory, error)) {
+    if (!file.is_regular_file(error) ||
+        file.path().extension() != entryExtension)
+      continue;
+
+    const size_t size = file.file_size(error);
+    if (error)
+      continue;
+    const auto lastUsed = file.last_write_time(error);
+    if (error)
+      continue;
+
+    entries.push_back({file.path(), size, lastUsed});
+    totalSize += size;
+  }
+
+  if (totalSize <= m_sizeLimit)
+    return;
+
+  std::ranges::sort(entries, std::less{}, &Entry::lastUsed);
+
+  size_t removed = 0;
+  for (const auto &entry : entries) {
+    if (totalSize <= m_sizeLimit)
+      break;
+
+    if (fs::remove(entry.path, error)) {
+      totalSize -= entry.size;
+      removed++;
+    }
+  }
+
+  std::println("TextureCache: Removed {} least recently used entries", removed);
+}
+
+} // namespace pt::loaders::texture
@@ -0,0 +1,55 @@
+#ifndef PLATINUM_LOADER_TEXTURE_CACHE_HPP
+#define PLATINUM_LOADER_TEXTURE_CACHE_HPP
+
+#include <filesystem>
+#include <optional>
+#include <span>
+
+#include <core/texture.hpp>
+
+namespace fs = std::filesystem;
+
+namespace pt::loaders::texture {
+
+/*
+ * On disk cache of processed textures (converted, mipmapped and possibly
+ * block compressed), in the user cache directory. Entries are keyed by a
+ * hash of the encoded source image and the processing settings, so a cache
+ * hit skips decoding entirely. Entries are memory mapped on load, and the
+ * least recently used ones are removed when the cache grows past its limit.
+ *
+ * Loading and storing are safe to call from multiple threads.
+ */
+class TextureCache {
+public:
+  explicit TextureCache(size_t sizeLimit) noexcept;
+
+  [[nodiscard]] constexpr bool valid() const { return m_directory.has_value(); }
+
+  /*
+   * Cache key for an encoded source image. Settings holds everything else
+   * that affects the processed texture (type, formats, encoder quality...).
+   */
+  [[nodiscard]] static uint64_t key(std::span<const uint8_t> source,
+                                   std::span<const uint32_t> settings);
+
+  [[nodiscard]] std::optional<Texture>
+  load(uint64_t key, std::string_view name, MTL::Device *device) const;
+  void store(uint64_t key, Texture &texture) const;
+
+  /*
+   * Remove least recently used entries until the cache fits in its size
+   * limit. Called once after each import rather than on every store.
+   */
+  void trim() const;
+
+private:
+  std::optional<fs::path> m_directory;
+  size_t m_sizeLimit;
+
+  [[nodiscard]] fs::path path(uint64_t key) const;
+};
+
+} // namespace pt::loaders::texture
+
+#endif
@@ -1,10 +1,27 @@
 #include <numbers>
+#include <print>
+#include <string_view>
 
 #include <core/store.hpp>
 #include <core/primitives.hpp>
 #include <frontend/frontend.hpp>
+#include <renderer_pt/partial_render.hpp>
+
+int main(int argc, char** argv) {
+  /*
+   * Headless merge tool for distributed renders:
+   *  platinum --merge <output> <partial> [<partial> ...]
+   */
+  if (argc > 1 && std::string_view(argv[1]) == "--merge") {
+    if (argc < 4) {
+      std::println(stderr, "Usage: {} --merge <output> <partial> [<partial> ...]", argv[0]);
+      return 1;
+    }
+
+    std::vector<fs::path> inputs(argv + 3, argv + argc);
+    return pt::renderer_pt::PartialRender::mergeFiles(inputs, argv[2]) ? 0 : 1;
+  }
 
-int main() {
   NS::AutoreleasePool* autoreleasePool = NS::AutoreleasePool::alloc()->init();
 
   pt::Store store;
@@ -0,0 +1,803 @@
+#include "bsdf_batch.hpp"
+
+#include <numbers>
+
+namespace pt::renderer_pt::bsdf {
+using shaders_pt::MaterialGPU;
+
+namespace {
+
+constexpr float pi = std::numbers::pi_v<float>;
+
+/*
+ * Vector helpers. Lanes that take a different branch in the Metal code are
+ * computed for every lane and merged with selects, so helpers must not assume
+ * their inputs are valid in every lane.
+ */
+inline BatchFloat broadcast(float v) { return BatchFloat{} + v; }
+
+inline BatchInt mask(bool v) { return BatchInt{} - int(v); }
+
+inline bool any(const BatchInt &m) { return simd_any(m); }
+
+inline BatchFloat select(const BatchFloat &a, const BatchFloat &b,
+                         const BatchInt &m) {
+  return simd_select(a, b, m);
+}
+
+inline BatchInt select(const BatchInt &a, const BatchInt &b,
+                       const BatchInt &m) {
+  return (a & ~m) | (b & m);
+}
+
+inline BatchFloat3 select(const BatchFloat3 &a, const BatchFloat3 &b,
+                          const BatchInt &m) {
+  return {select(a.x, b.x, m), select(a.y, b.y, m), select(a.z, b.z, m)};
+}
+
+inline BatchFloat3 splat(const BatchFloat &v) { return {v, v, v}; }
+
+inline BatchFloat3 operator+(const BatchFloat3 &a, const BatchFloat3 &b) {
+  return {a.x + b.x, a.y + b.y, a.z + b.z};
+}
+
+inline BatchFloat3 operator-(const BatchFloat3 &a, const BatchFloat3 &b) {
+  return {a.x - b.x, a.y - b.y, a.z - b.z};
+}
+
+inline BatchFloat3 operator-(const BatchFloat3 &a) { return {-a.x, -a.y, -a.z}; }
+
+inline BatchFloat3 operator*(const BatchFloat3 &a, const BatchFloat3 &b) {
+  return {a.x * b.x, a.y * b.y, a.z * b.z};
+}
+
+inline BatchFloat3 operator*(const BatchFloat3 &a, const BatchFloat &s) {
+  return {a.x * s, a.y * s, a.z * s};
+}
+
+inline BatchFloat3 operator*(const BatchFloat &s, const BatchFloat3 &a) {
+  return a * s;
+}
+
+inline BatchFloat3 operator/(const BatchFloat3 &a, const BatchFloat &s) {
+  return {a.x / s, a.y / s, a.z / s};
+}
+
+inline BatchFloat dot(const BatchFloat3 &a, const BatchFloat3 &b) {
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline BatchFloat lengthSquared(const BatchFloat3 &a) { return dot(a, a); }
+
+inline BatchFloat3 normalize(const BatchFloat3 &a) {
+  return a / simd::sqrt(lengthSquared(a));
+}
+
+inline BatchFloat3 cross(const BatchFloat3 &a, const BatchFloat3 &b) {
+  return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z,
+          a.x * b.y - a.y * b.x};
+}
+
+// Same as Metal's reflect(), reflects i about the plane with normal n
+inline BatchFloat3 reflect(const BatchFloat3 &i, const BatchFloat3 &n) {
+  return i - n * (2.0f * dot(n, i));
+}
+
+// Same as Metal's refract(), returns a zero vector on total internal reflection
+inline BatchFloat3 refract(const BatchFloat3 &i, const BatchFloat3 &n,
+                           const BatchFloat &eta) {
+  const auto cosI = dot(n, i);
+  const auto k = 1.0f - eta * eta * (1.0f - cosI * cosI);
+  const auto t = i * eta - n * (eta * cosI + simd::sqrt(simd::max(k, BatchFloat{})));
+  return select(t, BatchFloat3{}, k < 0.0f);
+}
+
+inline BatchFloat3 mirror(const BatchFloat3 &w) { return {-w.x, -w.y, w.z}; }
+
+inline BatchEval select(const BatchEval &a, const BatchEval &b,
+                        const BatchInt &m) {
+  return {select(a.f, b.f, m), select(a.Le, b.Le, m), select(a.pdf, b.pdf, m)};
+}
+
+inline BatchSample select(const BatchSample &a, const BatchSample &b,
+                          const BatchInt &m) {
+  return {
+      .wi = select(a.wi, b.wi, m),
+      .f = select(a.f, b.f, m),
+      .Le = select(a.Le, b.Le, m),
+      .pdf = select(a.pdf, b.pdf, m),
+      .flags = select(a.flags, b.flags, m),
+  };
+}
+
+// Zero out invalid lanes
+inline BatchEval masked(const BatchEval &e, const BatchInt &valid) {
+  return select(BatchEval{}, e, valid);
+}
+
+inline BatchSample masked(const BatchSample &s, const BatchInt &valid) {
+  return select(BatchSample{}, s, valid);
+}
+
+/*
+ * Samplers, see samplers.metal
+ */
+BatchFloat2 sampleDisk(const BatchFloat2 &u) {
+  const auto r = simd::sqrt(u.x);
+  const auto theta = 2.0f * pi * u.y;
+
+  return {r * simd::cos(theta), r * simd::sin(theta)};
+}
+
+BatchFloat3 sampleCosineHemisphere(const BatchFloat2 &u) {
+  const auto phi = u.x * 2.0f * pi;
+  const auto sinTheta = simd::sqrt(u.y);
+  const auto cosTheta = simd::sqrt(1.0f - u.y);
+
+  return {simd::cos(phi) * sinTheta, simd::sin(phi) * sinTheta, cosTheta};
+}
+
+/*
+ * Fresnel terms, see bsdf.metal
+ */
+BatchFloat3 schlick(const BatchFloat3 &f0, const BatchFloat &cosTheta) {
+  const auto k = 1.0f - cosTheta;
+  const auto k2 = k * k;
+  const auto k5 = k2 * k2 * k;
+  return {f0.x + (1.0f - f0.x) * k5, f0.y + (1.0f - f0.y) * k5,
+          f0.z + (1.0f - f0.z) * k5};
+}
+
+BatchFloat fresnel(const BatchFloat &cosThetaIn, const BatchFloat &ior) {
+  const auto cosTheta = simd::clamp(cosThetaIn, BatchFloat{}, broadcast(1.0f));
+
+  const auto sin2Theta_t = (1.0f - cosTheta * cosTheta) / (ior * ior);
+  const auto cosTheta_t = simd::sqrt(simd::max(1.0f - sin2Theta_t, BatchFloat{}));
+  const auto parallel =
+      (ior * cosTheta - cosTheta_t) / (ior * cosTheta + cosTheta_t);
+  const auto perpendicular =
+      (cosTheta - ior * cosTheta_t) / (cosTheta + ior * cosTheta_t);
+  const auto f = (parallel * parallel + perpendicular * perpendicular) * 0.5f;
+
+  return select(f, broadcast(1.0f), sin2Theta_t >= 1.0f);
+}
+
+BatchFloat fresnel(const BatchFloat &cosTheta, float ior) {
+  return fresnel(cosTheta, broadcast(ior));
+}
+
+BatchFloat avgDielectricFresnelFit(const BatchFloat &ior) {
+  const auto above = (ior - 1.0f) / (4.08567f + 1.00071f * ior);
+  const auto below = 0.997118f + 0.1014f * ior - 0.965241f * ior * ior -
+                     0.130607f * ior * ior * ior;
+  return select(below, above, ior >= 1.0f);
+}
+
+} // namespace
+
+void BatchShadingContext::set(size_t lane, const MaterialGPU &mat,
+                              const float3x3 &idt) {
+  albedo.set(lane, idt * mat.baseColor.xyz);
+  emission.set(lane, idt * mat.emission * mat.emissionStrength);
+  roughness[lane] = mat.roughness;
+  metallic[lane] = mat.metallic;
+  transmission[lane] = mat.transmission;
+  clearcoat[lane] = mat.clearcoat;
+  clearcoatRoughness[lane] = mat.clearcoatRoughness;
+  anisotropy[lane] = mat.anisotropy;
+  ior[lane] = mat.ior;
+  flags[lane] = mat.flags;
+}
+
+/*
+ * Trowbridge-Reitz GGX microfacet distribution, see bsdf.metal
+ */
+BatchBSDF::GGX::GGX(const BatchFloat &roughness)
+    : m_alphaX(roughness * roughness), m_alphaY(roughness * roughness) {}
+
+BatchBSDF::GGX::GGX(const BatchFloat &roughness,
+                    const BatchFloat &anisotropic) {
+  const auto alpha = roughness * roughness;
+  const auto aspect = simd::sqrt(1.0f - 0.9f * anisotropic);
+  m_alphaX = alpha / aspect;
+  m_alphaY = alpha * aspect;
+}
+
+BatchFloat BatchBSDF::GGX::mdf(const BatchFloat3 &w) const {
+  const auto cos2Theta = w.z * w.z;
+
+  const auto cos4Theta = cos2Theta * cos2Theta;
+  auto k = 1.0f / cos2Theta *
+           (w.x * w.x / (m_alphaX * m_alphaX) +
+            w.y * w.y / (m_alphaY * m_alphaY));
+
+  k = (1.0f + k) * (1.0f + k);
+  return 1.0f / (pi * m_alphaX * m_alphaY * cos4Theta * k);
+}
+
+BatchFloat BatchBSDF::GGX::g1(const BatchFloat3 &w) const {
+  return 1.0f / (1.0f + lambda(w));
+}
+
+BatchFloat BatchBSDF::GGX::g(const BatchFloat3 &wo,
+                             const BatchFloat3 &wi) const {
+  return 1.0f / (1.0f + lambda(wo) + lambda(wi));
+}
+
+BatchFloat BatchBSDF::GGX::vmdf(const BatchFloat3 &w,
+                                const BatchFloat3 &wm) const {
+  return g1(w) / simd::abs(w.z) * mdf(wm) * simd::abs(dot(w, wm));
+}
+
+BatchFloat3 BatchBSDF::GGX::sampleVmdf(const BatchFloat3 &w,
+                                       const BatchFloat2 &u) const {
+  auto wh = normalize({w.x * m_alphaX, w.y * m_alphaY, w.z});
+  wh = select(wh, -wh, wh.z < 0.0f);
+
+  // cross((0, 0, 1), wh) = (-wh.y, wh.x, 0)
+  const BatchFloat3 b =
+      select(BatchFloat3{broadcast(1.0f), BatchFloat{}, BatchFloat{}},
+             normalize({-wh.y, wh.x, BatchFloat{}}), wh.z < 0.9999f);
+  const auto t = cross(wh, b);
+
+  auto p = sampleDisk(u);
+  const auto h = simd::sqrt(1.0f - p.x * p.x);
+  p.y = simd::mix(h, p.y, 0.5f * wh.z + 0.5f);
+
+  const auto pz = simd::sqrt(simd::max(1.0f - p.x * p.x - p.y * p.y, BatchFloat{}));
+  const auto nh = b * p.x + t * p.y + wh * pz;
+
+  return normalize(
+      {m_alphaX * nh.x, m_alphaY * nh.y, simd::max(nh.z, broadcast(1e-6f))});
+}
+
+BatchFloat BatchBSDF::GGX::singleScatterBRDF(const BatchFloat3 &wo,
+                                             const BatchFloat3 &wi,
+                                             const BatchFloat3 &wm) const {
+  return mdf(wm) * g(wo, wi) / (4.0f * simd::abs(wo.z) * simd::abs(wi.z));
+}
+
+BatchFloat BatchBSDF::GGX::pdf(const BatchFloat3 &wo,
+                               const BatchFloat3 &wm) const {
+  return vmdf(wo, wm) / (4.0f * simd::abs(dot(wo, wm)));
+}
+
+BatchInt BatchBSDF::GGX::isSmooth() const {
+  return (m_alphaX < 1e-3f) & (m_alphaY < 1e-3f);
+}
+
+BatchFloat BatchBSDF::GGX::lambda(const BatchFloat3 &w) const {
+  const auto cos2Theta = w.z * w.z;
+
+  const auto alpha2 =
+      m_alphaX * m_alphaX * w.x * w.x + m_alphaY * m_alphaY * w.y * w.y;
+
+  return (simd::sqrt(1.0f + alpha2 / cos2Theta) - 1.0f) * 0.5f;
+}
+
+/*
+ * Principled BSDF
+ */
+BatchBSDF::BatchBSDF(const BatchShadingContext &ctx, const GgxLuts &luts,
+                     int rendererFlags) noexcept
+    : m_ctx(ctx), m_luts(luts), m_ggx(ctx.roughness, ctx.anisotropy),
+      m_ggxCoat(ctx.clearcoatRoughness),
+      m_multiscatter(rendererFlags & shaders_pt::RendererFlags_MultiscatterGGX) {
+}
+
+BatchEval BatchBSDF::eval(const BatchFloat3 &wo, const BatchFloat3 &wi) const {
+  const auto valid = (wo.z >= 1.5e-3f) & (wi.z >= 1.5e-3f);
+
+  const auto metallic = m_ctx.metallic;
+  const auto transparent = (1.0f - metallic) * m_ctx.transmission;
+  const auto opaque = (1.0f - metallic) * (1.0f - transparent);
+
+  /*
+   * Only evaluate lobes used by at least one lane. Unused lanes may hold NaNs,
+   * so we select instead of multiplying by a zero weight.
+   */
+  BatchEval result{};
+  auto accumulate = [&](const BatchEval &e, const BatchFloat &weight) {
+    const auto m = valid & (weight > 0.0f);
+    result.f = result.f + select(BatchFloat3{}, e.f * weight, m);
+    result.Le = result.Le + select(BatchFloat3{}, e.Le * weight, m);
+    result.pdf += select(BatchFloat{}, e.pdf * weight, m);
+  };
+
+  if (any(valid & (metallic > 0.0f)))
+    accumulate(evalMetallic(wo, wi), metallic);
+  if (any(valid & (transparent > 0.0f)))
+    accumulate(evalTransparentDielectric(wo, wi), transparent);
+  if (any(valid & (opaque > 0.0f)))
+    accumulate(evalOpaqueDielectric(wo, wi), opaque);
+
+  const auto coat = m_ctx.clearcoat;
+  const auto hasCoat = valid & (coat > 0.0f);
+  if (any(hasCoat)) {
+    BatchFloat coatFresnel_ss;
+    const auto coatResult = evalClearcoat(wo, wi, coatFresnel_ss);
+    const auto c = coat * coatFresnel_ss;
+
+    const BatchEval blended = {
+        .f = result.f * (1.0f - c) + coatResult.f * c,
+        .Le = result.Le * (1.0f - c) + coatResult.Le * c,
+        .pdf = result.pdf * (1.0f - c) + coatResult.pdf * c,
+    };
+    result = select(result, blended, hasCoat);
+  }
+
+  return masked(result, valid);
+}
+
+BatchSample BatchBSDF::sample(const BatchFloat3 &wo, const BatchFloat3 &r,
+                              const BatchFloat &rLobe,
+                              const BatchFloat2 &rc) const {
+  const auto c = m_ctx.clearcoat;
+  const auto m = m_ctx.metallic;
+  const auto t = m_ctx.transmission;
+
+  auto pClearcoat = c;
+  if (any(c > 0.0f)) {
+    const auto wmCoat =
+        select(m_ggxCoat.sampleVmdf(wo, rc),
+               BatchFloat3{BatchFloat{}, BatchFloat{}, broadcast(1.0f)},
+               m_ggxCoat.isSmooth());
+    pClearcoat = select(
+        pClearcoat,
+        pClearcoat * fresnel(simd::abs(dot(wo, wmCoat)), m_clearcoatIor),
+        c > 0.0f);
+  }
+
+  const auto pMetallic = pClearcoat + (1.0f - pClearcoat) * m;
+  const auto pTransparent =
+      pClearcoat + (1.0f - pClearcoat) * (m + (1.0f - m) * t);
+
+  const auto isClearcoat = rLobe < pClearcoat;
+  const auto isMetallic = ~isClearcoat & (rLobe < pMetallic);
+  const auto isTransparent =
+      ~isClearcoat & ~isMetallic & (rLobe < pTransparent);
+  const auto isOpaque = ~isClearcoat & ~isMetallic & ~isTransparent;
+
+  BatchSample result{};
+  if (any(isClearcoat))
+    result = select(result, sampleClearcoat(wo, r), isClearcoat);
+  if (any(isMetallic))
+    result = select(result, sampleMetallic(wo, r), isMetallic);
+  if (any(isTransparent))
+    result = select(result, sampleTransparentDielectric(wo, r), isTransparent);
+  if (any(isOpaque))
+    result = select(result, sampleOpaqueDielectric(wo, r), isOpaque);
+
+  return result;
+}
+
+BatchFloat BatchBSDF::sampleLut(GgxLuts::Index idx, const BatchFloat &u,
+                                const BatchFloat &v,
+                                const BatchFloat &w) const {
+  const auto &lut = m_luts[idx];
+
+  BatchFloat result;
+  for (size_t i = 0; i < batchWidth; i++)
+    result[i] = lut.sample(u[i], v[i], w[i]);
+  return result;
+}
+
+BatchFloat BatchBSDF::multiscatterBrdf(const BatchFloat3 &wo,
+                                       const BatchFloat3 &wi,
+                                       BatchFloat &E_avg) const {
+  const BatchFloat zero{};
+  const auto E_wo = sampleLut(GgxLuts::E, wo.z, m_ctx.roughness, zero);
+  const auto E_wi = sampleLut(GgxLuts::E, wi.z, m_ctx.roughness, zero);
+  E_avg = sampleLut(GgxLuts::Eavg, m_ctx.roughness, zero, zero);
+
+  return (1.0f - E_wo) * (1.0f - E_wi) / (pi * (1.0f - E_avg));
+}
+
+BatchFloat BatchBSDF::multiscatter(const BatchFloat3 &wo, const BatchFloat3 &wi,
+                                   const BatchFloat &F_avg) const {
+  BatchFloat E_avg;
+  const auto brdf_ms = multiscatterBrdf(wo, wi, E_avg);
+  const auto fresnel_ms =
+      F_avg * F_avg * E_avg / (1.0f - F_avg * (1.0f - E_avg));
+
+  return fresnel_ms * brdf_ms;
+}
+
+BatchFloat3 BatchBSDF::multiscatter(const BatchFloat3 &wo,
+                                    const BatchFloat3 &wi,
+                                    const BatchFloat3 &F_avg) const {
+  BatchFloat E_avg;
+  const auto brdf_ms = multiscatterBrdf(wo, wi, E_avg);
+  auto fresnel_ms = [&](const BatchFloat &F) {
+    return F * F * E_avg / (1.0f - F * (1.0f - E_avg));
+  };
+
+  return BatchFloat3{fresnel_ms(F_avg.x), fresnel_ms(F_avg.y),
+                     fresnel_ms(F_avg.z)} *
+         brdf_ms;
+}
+
+BatchFloat BatchBSDF::transparentMultiscatter(const BatchFloat3 &wo,
+                                              const BatchFloat &ior) const {
+  /*
+   * Same parametrizations as the Metal implementation: 1 - eta for IOR < 1,
+   * (eta - 1) / eta otherwise. The LUT differs per lane, so we can't use
+   * sampleLut() here.
+   */
+  const auto &lutOut = m_luts[GgxLuts::ETransOut];
+  const auto &lutIn = m_luts[GgxLuts::ETransIn];
+
+  BatchFloat E_wo;
+  for (size_t i = 0; i < batchWidth; i++) {
+    const float cosTheta = std::abs(wo.z[i]);
+    E_wo[i] = ior[i] < 1.0f ? lutOut.sample(cosTheta, m_ctx.roughness[i],
+                                            1.0f - ior[i])
+                            : lutIn.sample(cosTheta, m_ctx.roughness[i],
+                                           (ior[i] - 1.0f) / ior[i]);
+  }
+
+  return 1.0f / E_wo;
+}
+
+BatchFloat BatchBSDF::diffuseFactor(const BatchFloat3 &wo,
+                                    const BatchFloat3 &wi) const {
+  const auto iorParam = (m_ctx.ior - 1.0f) / m_ctx.ior;
+
+  const auto E_ms_wo = sampleLut(GgxLuts::EMs, wo.z, m_ctx.roughness, iorParam);
+  const auto E_ms_wi = sampleLut(GgxLuts::EMs, wi.z, m_ctx.roughness, iorParam);
+  const auto E_ms_avg =
+      sampleLut(GgxLuts::EavgMs, iorParam, m_ctx.roughness, BatchFloat{});
+
+  return (1.0f - E_ms_wo) * (1.0f - E_ms_wi) / (pi * (1.0f - E_ms_avg));
+}
+
+BatchFloat BatchBSDF::opaqueDielectricFactor(const BatchFloat3 &wo,
+                                             const BatchFloat &F_avg) const {
+  const auto iorParam = (m_ctx.ior - 1.0f) / m_ctx.ior;
+
+  const auto E_wo = sampleLut(GgxLuts::E, wo.z, m_ctx.roughness, BatchFloat{});
+  const auto E_ms_wo = sampleLut(GgxLuts::EMs, wo.z, m_ctx.roughness, iorParam);
+
+  const auto fresnel_ms = F_avg * F_avg * E_wo / (1.0f - F_avg * (1.0f - E_wo));
+  return F_avg * E_ms_wo + fresnel_ms * (1.0f - E_ms_wo);
+}
+
+/* ================================================== *
+ *
+ * BSDF Evaluation functions
+ *
+ * ================================================== */
+
+BatchEval BatchBSDF::evalMetallic(const BatchFloat3 &wo, const BatchFloat3 &wi,
+                                  const BatchFloat3 &wm) const {
+  const auto fresnel_ss = schlick(m_ctx.albedo, simd::abs(dot(wo, wm)));
+  auto brdf = fresnel_ss * m_ggx.singleScatterBRDF(wo, wi, wm);
+
+  if (m_multiscatter) {
+    const auto F_avg =
+        (m_ctx.albedo * broadcast(20.0f) + splat(broadcast(1.0f))) /
+        broadcast(21.0f);
+    brdf = brdf + multiscatter(wo, wi, F_avg);
+  }
+
+  return BatchEval{.f = brdf, .pdf = m_ggx.pdf(wo, wm)};
+}
+
+BatchEval BatchBSDF::evalMetallic(const BatchFloat3 &wo,
+                                  const BatchFloat3 &wi) const {
+  auto wm = wo + wi;
+  const auto valid = ~m_ggx.isSmooth() & (lengthSquared(wm) != 0.0f);
+  wm = normalize(wm) * simd::sign(wm.z);
+
+  return masked(evalMetallic(wo, wi, wm), valid);
+}
+
+BatchEval BatchBSDF::evalTransparentDielectric(const BatchFloat3 &wo,
+                                               const BatchFloat3 &wi,
+                                               const BatchFloat3 &wm,
+                                               const BatchFloat &fresnel_ss,
+                                               const BatchFloat &ior) const {
+  const auto thin = (m_ctx.flags & int(MaterialGPU::Material_ThinDielectric)) != 0;
+  const auto isReflection = wo.z * wi.z > 0.0f;
+
+  // Reflection, and transmission through thin dielectrics
+  const auto brdf_ss = m_ggx.singleScatterBRDF(wo, wi, wm);
+  const auto pdf_ss = m_ggx.pdf(wo, wm);
+
+  // Transmission through solid dielectrics
+  auto denom = dot(wi, wm) * ior + dot(wo, wm);
+  denom *= denom;
+
+  const auto dwm_dwi = simd::abs(dot(wi, wm)) / denom;
+  const auto btdf_ss =
+      m_ggx.mdf(wm) * m_ggx.g(wo, wi) *
+      simd::abs(dot(wi, wm) * dot(wo, wm) / (wi.z * wo.z * denom));
+  const auto btdfPdf = m_ggx.vmdf(wo, wm) * dwm_dwi;
+
+  const auto transmitted = select(btdf_ss, brdf_ss, thin);
+  auto bsdf = select(m_ctx.albedo * transmitted, splat(brdf_ss), isReflection);
+  const auto pdf = select(select(btdfPdf, pdf_ss, thin), pdf_ss, isReflection);
+  const auto k = select(1.0f - fresnel_ss, fresnel_ss, isReflection);
+
+  if (m_multiscatter)
+    bsdf = bsdf * transparentMultiscatter(wo, ior);
+
+  return BatchEval{.f = bsdf * k, .pdf = k * pdf};
+}
+
+BatchEval BatchBSDF::evalTransparentDielectric(const BatchFloat3 &wo,
+                                               const BatchFloat3 &wiIn) const {
+  const auto thin = (m_ctx.flags & int(MaterialGPU::Material_ThinDielectric)) != 0;
+  const auto ior = select(m_ctx.ior, 1.0f / m_ctx.ior,
+                          ~thin & (wo.z < 0.0f) & (wiIn.z < 0.0f));
+
+  auto wi = wiIn;
+  auto wm = wi * ior + wo;
+  auto valid = ~m_ggx.isSmooth() & (wi.z != 0.0f) & (wo.z != 0.0f) &
+               (wm.z != 0.0f);
+
+  wm = normalize(wm * simd::sign(wm.z));
+  valid &= ~((dot(wi, wm) * wi.z < 0.0f) | (dot(wo, wm) * wo.z < 0.0f));
+
+  wi = select(wi, BatchFloat3{wi.x, wi.y, -wi.z}, thin);
+  wm = select(wm, normalize(wi + wo), thin);
+
+  const auto fresnel_ss = fresnel(dot(wo, wm), ior);
+  return masked(evalTransparentDielectric(wo, wi, wm, fresnel_ss, ior), valid);
+}
+
+BatchEval BatchBSDF::evalOpaqueDielectric(const BatchFloat3 &wo,
+                                          const BatchFloat3 &wi) const {
+  // GGX/Diffuse blending factor
+  const auto F_avg = avgDielectricFresnelFit(m_ctx.ior);
+  const auto blendingFactor = opaqueDielectricFactor(wo, F_avg);
+
+  // Diffuse BRDF
+  const auto cDiffuse = diffuseFactor(wo, wi);
+  const auto diffusePdf = simd::abs(wi.z) / pi;
+
+  const BatchEval smooth = {
+      .f = m_ctx.albedo * cDiffuse,
+      .pdf = diffusePdf * (1.0f - blendingFactor),
+  };
+
+  const auto isSmooth = m_ggx.isSmooth();
+  if (!any(~isSmooth))
+    return smooth;
+
+  auto wm = wo + wi;
+  const auto valid = isSmooth | (lengthSquared(wm) != 0.0f);
+  wm = normalize(wm) * simd::sign(wm.z);
+
+  const auto fresnel_ss = fresnel(simd::abs(dot(wo, wm)), m_ctx.ior);
+
+  // Dielectric single scattering BRDF
+  auto dielectricBrdf = fresnel_ss * m_ggx.singleScatterBRDF(wo, wi, wm);
+
+  // Multiple scattering
+  if (m_multiscatter)
+    dielectricBrdf += multiscatter(wo, wi, F_avg);
+
+  const BatchEval rough = {
+      .f = splat(dielectricBrdf) + m_ctx.albedo * cDiffuse,
+      .pdf = m_ggx.pdf(wo, wm) * blendingFactor +
+             diffusePdf * (1.0f - blendingFactor),
+  };
+
+  return masked(select(rough, smooth, isSmooth), valid);
+}
+
+BatchEval BatchBSDF::evalClearcoat(const BatchFloat3 &wo, const BatchFloat3 &wi,
+                                   BatchFloat &fresnel_ss) const {
+  auto wm = wo + wi;
+  const auto valid = ~m_ggxCoat.isSmooth() & (lengthSquared(wm) != 0.0f);
+  wm = normalize(wm * simd::sign(wm.z));
+
+  // Invalid lanes get no coat, rather than an uninitialized fresnel term
+  fresnel_ss =
+      select(BatchFloat{}, fresnel(dot(wo, wm), m_clearcoatIor), valid);
+  const BatchEval e = {
+      .f = splat(m_ggxCoat.singleScatterBRDF(wo, wi, wm)),
+      .pdf = m_ggxCoat.pdf(wo, wm),
+  };
+
+  return masked(e, valid);
+}
+
+/* ================================================== *
+ *
+ * BSDF Sampling functions
+ *
+ * ================================================== */
+
+BatchSample BatchBSDF::sampleMetallic(const BatchFloat3 &wo,
+                                      const BatchFloat3 &r) const {
+  // Perfect specular reflection
+  const auto isSmooth = m_ggx.isSmooth();
+  const BatchSample smooth = {
+      .wi = mirror(wo),
+      .f = schlick(m_ctx.albedo, wo.z) / simd::abs(wo.z),
+      .pdf = broadcast(1.0f),
+      .flags = BatchInt{} + (Sample_Reflected | Sample_Specular),
+  };
+  if (!any(~isSmooth))
+    return smooth;
+
+  // Sample the microfacet normal, get incident light direction and evaluate the
+  // BRDF
+  const auto wm = m_ggx.sampleVmdf(wo, {r.x, r.y});
+  const auto wi = reflect(-wo, wm);
+  const auto valid = isSmooth | (wo.z * wi.z >= 0.0f);
+
+  const auto eval = evalMetallic(wo, wi, wm);
+  const BatchSample rough = {
+      .wi = wi,
+      .f = eval.f,
+      .pdf = eval.pdf,
+      .flags = BatchInt{} + (Sample_Reflected | Sample_Glossy),
+  };
+
+  return masked(select(rough, smooth, isSmooth), valid);
+}
+
+BatchSample
+BatchBSDF::sampleTransparentDielectric(const BatchFloat3 &wo,
+                                       const BatchFloat3 &r) const {
+  const auto thin = (m_ctx.flags & int(MaterialGPU::Material_ThinDielectric)) != 0;
+  const auto ior =
+      select(m_ctx.ior, 1.0f / m_ctx.ior, (wo.z < 0.0f) & ~thin);
+  const auto isSmooth = m_ggx.isSmooth();
+
+  // Perfect specular reflection and transmission
+  BatchSample smooth{};
+  auto smoothValid = mask(true);
+  if (any(isSmooth)) {
+    const auto fresnel_ss = fresnel(simd::abs(wo.z), ior);
+    const auto reflected = r.z < fresnel_ss;
+
+    const auto refracted =
+        refract(-wo, {BatchFloat{}, BatchFloat{}, simd::sign(wo.z)}, 1.0f / ior);
+    const auto wt = select(refracted, -wo, thin);
+    const auto wi = select(wt, mirror(wo), reflected);
+    smoothValid = reflected | (wi.z != 0.0f);
+
+    const auto pdf = select(1.0f - fresnel_ss, fresnel_ss, reflected);
+    const auto color = select(m_ctx.albedo, splat(broadcast(1.0f)), reflected);
+
+    smooth = BatchSample{
+        .wi = wi,
+        .f = color * pdf / simd::abs(wi.z),
+        .pdf = pdf,
+        .flags = select(BatchInt{} + (Sample_Specular | Sample_Transmitted),
+                        BatchInt{} + (Sample_Specular | Sample_Reflected),
+                        reflected),
+    };
+    if (!any(~isSmooth))
+      return masked(smooth, smoothValid);
+  }
+
+  // Sample the microfacet normal and evaluate single-scattering fresnel
+  const auto wm = m_ggx.sampleVmdf(wo, {r.x, r.y});
+  const auto cosThetaM = dot(wo, wm);
+  const auto fresnel_ss = fresnel(simd::abs(cosThetaM), ior);
+
+  // Get the incident light direction and evaluate the BSDF
+  const auto reflected = r.z < fresnel_ss;
+  const auto wr = reflect(-wo, wm);
+  const auto wt = select(refract(-wo, wm * simd::sign(cosThetaM), 1.0f / ior),
+                         BatchFloat3{wr.x, wr.y, -wr.z}, thin);
+  const auto wi = select(wt, wr, reflected);
+
+  const auto roughValid =
+      select(thin | (wo.z * wi.z < 0.0f), wo.z * wi.z >= 0.0f, reflected);
+
+  const auto eval = evalTransparentDielectric(wo, wi, wm, fresnel_ss, ior);
+  const BatchSample rough = {
+      .wi = wi,
+      .f = eval.f,
+      .Le = eval.Le,
+      .pdf = eval.pdf,
+      .flags = select(BatchInt{} + (Sample_Glossy | Sample_Transmitted),
+                      BatchInt{} + (Sample_Glossy | Sample_Reflected),
+                      reflected),
+  };
+
+  return masked(select(rough, smooth, isSmooth),
+                select(roughValid, smoothValid, isSmooth));
+}
+
+BatchSample BatchBSDF::sampleOpaqueDielectric(const BatchFloat3 &wo,
+                                              const BatchFloat3 &r) const {
+  const auto F_avg = avgDielectricFresnelFit(m_ctx.ior);
+  const auto blendingFactor = opaqueDielectricFactor(wo, F_avg);
+
+  const auto isDielectric = r.z < blendingFactor;
+  const auto isSmooth = m_ggx.isSmooth();
+
+  BatchSample result{};
+  auto valid = mask(true);
+
+  // Sample the dielectric BRDF
+  if (any(isDielectric)) {
+    const auto wiSmooth = mirror(wo);
+    const BatchSample smooth = {
+        .wi = wiSmooth,
+        .f = splat(fresnel(simd::abs(wo.z), m_ctx.ior) /
+                   simd::abs(wiSmooth.z)),
+        .pdf = blendingFactor,
+        .flags = BatchInt{} + (Sample_Reflected | Sample_Specular),
+    };
+
+    const auto wm = m_ggx.sampleVmdf(wo, {r.x, r.y});
+    const auto wi = reflect(-wo, wm);
+    const auto fresnel_ss = fresnel(simd::abs(dot(wo, wm)), m_ctx.ior);
+    auto dielectricBrdf = fresnel_ss * m_ggx.singleScatterBRDF(wo, wi, wm);
+
+    if (m_multiscatter)
+      dielectricBrdf += multiscatter(wo, wi, F_avg);
+
+    const BatchSample rough = {
+        .wi = wi,
+        .f = splat(dielectricBrdf),
+        .pdf = m_ggx.pdf(wo, wm) * blendingFactor,
+        .flags = BatchInt{} + (Sample_Reflected | Sample_Glossy),
+    };
+
+    result = select(rough, smooth, isSmooth);
+    valid = isSmooth | (lengthSquared(wm) != 0.0f) | ~isDielectric;
+  }
+
+  // Sample the underlying diffuse BRDF
+  if (any(~isDielectric)) {
+    auto wi = sampleCosineHemisphere({r.x, r.y});
+    wi = select(wi, -wi, wo.z < 0.0f);
+
+    const auto cDiffuse = diffuseFactor(wo, wi);
+    const auto emissive =
+        (m_ctx.flags & int(MaterialGPU::Material_Emissive)) != 0;
+
+    const BatchSample diffuse = {
+        .wi = wi,
+        .f = m_ctx.albedo * cDiffuse,
+        .Le = m_ctx.emission / (1.0f - blendingFactor),
+        .pdf = simd::abs(wi.z) / pi * (1.0f - blendingFactor),
+        .flags = (BatchInt{} + (Sample_Reflected | Sample_Diffuse)) |
+                 (emissive & int(Sample_Emitted)),
+    };
+
+    result = select(diffuse, result, isDielectric);
+  }
+
+  return masked(result, valid);
+}
+
+BatchSample BatchBSDF::sampleClearcoat(const BatchFloat3 &wo,
+                                       const BatchFloat3 &r) const {
+  const auto isSmooth = m_ggxCoat.isSmooth();
+  const auto fresnelSmooth = fresnel(wo.z, m_clearcoatIor);
+  const BatchSample smooth = {
+      .wi = mirror(wo),
+      .f = splat(fresnelSmooth / simd::abs(wo.z)),
+      .pdf = fresnelSmooth,
+      .flags = BatchInt{} + (Sample_Reflected | Sample_Specular),
+  };
+  if (!any(~isSmooth))
+    return smooth;
+
+  // Sample the microfacet normal and evaluate single-scattering fresnel
+  const auto wm = m_ggxCoat.sampleVmdf(wo, {r.x, r.y});
+  const auto wi = reflect(-wo, wm);
+  const auto valid = isSmooth | (wo.z * wi.z >= 0.0f);
+
+  const auto fresnel_ss = fresnel(simd::abs(dot(wo, wm)), m_clearcoatIor);
+  const BatchSample rough = {
+      .wi = wi,
+      .f = splat(fresnel_ss * m_ggxCoat.singleScatterBRDF(wo, wi, wm)),
+      .pdf = fresnel_ss * m_ggxCoat.pdf(wo, wm),
+      .flags = BatchInt{} + (Sample_Reflected | Sample_Glossy),
+  };
+
+  return masked(select(rough, smooth, isSmooth), valid);
+}
+
+} // namespace pt::renderer_pt::bsdf
@@ -0,0 +1,188 @@
+#ifndef PLATINUM_BSDF_BATCH_HPP
+#define PLATINUM_BSDF_BATCH_HPP
+
+#include <simd/simd.h>
+
+#include "pt_shader_defs.hpp"
+#include "ggx_luts.hpp"
+
+using namespace simd;
+
+/*
+ * CPU port of the principled BSDF in shaders/bsdf.metal, evaluating and
+ * sampling a batch of shading points at once in SoA layout.
+ * Batches use simd library vectors, which compile to AVX2 (8 wide) or AVX-512
+ * (16 wide) on x86, NEON register pairs on ARM, and scalar code otherwise.
+ */
+#ifndef PLATINUM_BSDF_BATCH_WIDTH
+#define PLATINUM_BSDF_BATCH_WIDTH 8
+#endif
+
+namespace pt::renderer_pt::bsdf {
+
+#if PLATINUM_BSDF_BATCH_WIDTH == 16
+using BatchFloat = simd_float16;
+using BatchInt = simd_int16;
+#else
+using BatchFloat = simd_float8;
+using BatchInt = simd_int8;
+#endif
+
+constexpr size_t batchWidth = PLATINUM_BSDF_BATCH_WIDTH;
+
+struct BatchFloat2 {
+  BatchFloat x, y;
+};
+
+struct BatchFloat3 {
+  BatchFloat x, y, z;
+
+  constexpr void set(size_t lane, float3 v) {
+    x[lane] = v.x;
+    y[lane] = v.y;
+    z[lane] = v.z;
+  }
+
+  [[nodiscard]] constexpr float3 get(size_t lane) const {
+    return {x[lane], y[lane], z[lane]};
+  }
+};
+
+struct BatchFloat4 {
+  BatchFloat x, y, z, w;
+
+  constexpr void set(size_t lane, float4 v) {
+    x[lane] = v.x;
+    y[lane] = v.y;
+    z[lane] = v.z;
+    w[lane] = v.w;
+  }
+
+  [[nodiscard]] constexpr float4 get(size_t lane) const {
+    return {x[lane], y[lane], z[lane], w[lane]};
+  }
+};
+
+// Same values as bsdf::SampleFlags in defs.metal
+enum SampleFlags {
+  Sample_Absorbed = 0,
+  Sample_Emitted = 1 << 0,
+  Sample_Reflected = 1 << 1,
+  Sample_Transmitted = 1 << 2,
+  Sample_Diffuse = 1 << 3,
+  Sample_Glossy = 1 << 4,
+  Sample_Specular = 1 << 5,
+};
+
+/*
+ * Shading parameters for a batch of shading points. Unlike the Metal shading
+ * context, this doesn't sample material textures: callers resolve textured
+ * parameters before filling the batch.
+ */
+struct BatchShadingContext {
+  BatchFloat3 albedo, emission;
+  BatchFloat roughness, metallic, transmission;
+  BatchFloat clearcoat, clearcoatRoughness;
+  BatchFloat anisotropy, ior;
+  BatchInt flags;
+
+  void set(size_t lane, const shaders_pt::MaterialGPU& mat, const float3x3& idt);
+};
+
+struct BatchEval {
+  BatchFloat3 f, Le;
+  BatchFloat pdf;
+};
+
+struct BatchSample {
+  BatchFloat3 wi, f, Le;
+  BatchFloat pdf;
+  BatchInt flags;
+};
+
+class BatchBSDF {
+public:
+  BatchBSDF(const BatchShadingContext& ctx, const GgxLuts& luts, int rendererFlags) noexcept;
+
+  /*
+   * Evaluate the BSDF for every lane, given outgoing and incident light
+   * directions in tangent space. Lanes with invalid directions get f = 0 and
+   * pdf = 0.
+   */
+  [[nodiscard]] BatchEval eval(const BatchFloat3& wo, const BatchFloat3& wi) const;
+
+  /*
+   * Importance sample the BSDF for every lane. r and rLobe correspond to
+   * r.xyz and r.w in the Metal implementation, rc is the clearcoat sample.
+   */
+  [[nodiscard]] BatchSample sample(
+    const BatchFloat3& wo,
+    const BatchFloat3& r,
+    const BatchFloat& rLobe,
+    const BatchFloat2& rc
+  ) const;
+
+private:
+  class GGX {
+  public:
+    explicit GGX(const BatchFloat& roughness);
+
+    GGX(const BatchFloat& roughness, const BatchFloat& anisotropic);
+
+    [[nodiscard]] BatchFloat mdf(const BatchFloat3& w) const;
+    [[nodiscard]] BatchFloat g1(const BatchFloat3& w) const;
+    [[nodiscard]] BatchFloat g(const BatchFloat3& wo, const BatchFloat3& wi) const;
+    [[nodiscard]] BatchFloat vmdf(const BatchFloat3& w, const BatchFloat3& wm) const;
+    [[nodiscard]] BatchFloat3 sampleVmdf(const BatchFloat3& w, const BatchFloat2& u) const;
+    [[nodiscard]] BatchFloat singleScatterBRDF(const BatchFloat3& wo, const BatchFloat3& wi, const BatchFloat3& wm) const;
+    [[nodiscard]] BatchFloat pdf(const BatchFloat3& wo, const BatchFloat3& wm) const;
+    [[nodiscard]] BatchInt isSmooth() const;
+
+  private:
+    BatchFloat m_alphaX, m_alphaY;
+
+    [[nodiscard]] BatchFloat lambda(const BatchFloat3& w) const;
+  };
+
+  const BatchShadingContext& m_ctx;
+  const GgxLuts& m_luts;
+  GGX m_ggx, m_ggxCoat;
+  bool m_multiscatter;
+  static constexpr float m_clearcoatIor = 1.5f;
+
+  [[nodiscard]] BatchFloat sampleLut(GgxLuts::Index idx, const BatchFloat& u, const BatchFloat& v, const BatchFloat& w) const;
+
+  /*
+   * The Metal implementation templates multiscatter() on the fresnel type,
+   * here we split out the LUT lookups so they're shared by all channels.
+   */
+  [[nodiscard]] BatchFloat multiscatterBrdf(const BatchFloat3& wo, const BatchFloat3& wi, BatchFloat& E_avg) const;
+  [[nodiscard]] BatchFloat multiscatter(const BatchFloat3& wo, const BatchFloat3& wi, const BatchFloat& F_avg) const;
+  [[nodiscard]] BatchFloat3 multiscatter(const BatchFloat3& wo, const BatchFloat3& wi, const BatchFloat3& F_avg) const;
+
+  [[nodiscard]] BatchFloat transparentMultiscatter(const BatchFloat3& wo, const BatchFloat& ior) const;
+  [[nodiscard]] BatchFloat diffuseFactor(const BatchFloat3& wo, const BatchFloat3& wi) const;
+  [[nodiscard]] BatchFloat opaqueDielectricFactor(const BatchFloat3& wo, const BatchFloat& F_avg) const;
+
+  [[nodiscard]] BatchEval evalMetallic(const BatchFloat3& wo, const BatchFloat3& wi, const BatchFloat3& wm) const;
+  [[nodiscard]] BatchEval evalMetallic(const BatchFloat3& wo, const BatchFloat3& wi) const;
+  [[nodiscard]] BatchEval evalTransparentDielectric(
+    const BatchFloat3& wo,
+    const BatchFloat3& wi,
+    const BatchFloat3& wm,
+    const BatchFloat& fresnel_ss,
+    const BatchFloat& ior
+  ) const;
+  [[nodiscard]] BatchEval evalTransparentDielectric(const BatchFloat3& wo, const BatchFloat3& wi) const;
+  [[nodiscard]] BatchEval evalOpaqueDielectric(const BatchFloat3& wo, const BatchFloat3& wi) const;
+  [[nodiscard]] BatchEval evalClearcoat(const BatchFloat3& wo, const BatchFloat3& wi, BatchFloat& fresnel_ss) const;
+
+  [[nodiscard]] BatchSample sampleMetallic(const BatchFloat3& wo, const BatchFloat3& r) const;
+  [[nodiscard]] BatchSample sampleTransparentDielectric(const BatchFloat3& wo, const BatchFloat3& r) const;
+  [[nodiscard]] BatchSample sampleOpaqueDielectric(const BatchFloat3& wo, const BatchFloat3& r) const;
+  [[nodiscard]] BatchSample sampleClearcoat(const BatchFloat3& wo, const BatchFloat3& r) const;
+};
+
+}
+
+#endif //PLATINUM_BSDF_BATCH_HPP
@@ -0,0 +1,130 @@
+#include "cpu_texture.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+#include <utils/utils.hpp>
+
+namespace pt::renderer_pt {
+using bsdf::BatchFloat;
+using bsdf::BatchFloat2;
+using bsdf::BatchFloat4;
+using bsdf::BatchInt;
+
+namespace {
+
+uint32_t wrap(float v, uint32_t size) {
+  auto i = int64_t(v) % int64_t(size);
+  return uint32_t(i < 0 ? i + size : i);
+}
+
+/*
+ * Repeat addressing for a batch of integer texel coordinates, given as
+ * floats. The float remainder can be off by one size due to rounding, so
+ * it's corrected in integer registers.
+ */
+BatchInt wrap(const BatchFloat &v, uint32_t size) {
+  const auto s = float(size);
+  BatchInt i = simd_int(v - simd::floor(v * (1.0f / s)) * s);
+  i -= (i >= int(size)) & int(size);
+  i += (i < 0) & int(size);
+  return i;
+}
+
+template <typename T, typename W>
+T bilerp(const T &t00, const T &t10, const T &t01, const T &t11, const W &tx,
+         const W &ty) {
+  return (t00 * (1.0f - tx) + t10 * tx) * (1.0f - ty) +
+         (t01 * (1.0f - tx) + t11 * tx) * ty;
+}
+
+} // namespace
+
+CpuTexture::CpuTexture(uint32_t width, uint32_t height,
+                       std::span<const float4> pixels)
+    : m_width(width), m_height(height),
+      m_tilesX((width + tileSize - 1) / tileSize) {
+  const float4 first = pixels[0];
+  if (std::ranges::all_of(pixels,
+                          [&](float4 p) { return simd_equal(p, first); })) {
+    m_constant = first;
+    return;
+  }
+
+  // Edge tiles are padded to the full tile size, padding is never read
+  const uint32_t tilesY = (height + tileSize - 1) / tileSize;
+  m_texels.resize(size_t(m_tilesX) * tilesY * tileSize * tileSize);
+  utils::parallelFor(
+      height,
+      [&](size_t y) {
+        for (uint32_t x = 0; x < width; x++)
+          m_texels[index(x, uint32_t(y))] = pixels[y * width + x];
+      },
+      64);
+}
+
+float4 CpuTexture::texel(uint32_t x, uint32_t y) const {
+  return m_constant ? *m_constant : m_texels[index(x, y)];
+}
+
+float4 CpuTexture::sample(float2 uv) const {
+  if (m_constant)
+    return *m_constant;
+
+  const float x = uv.x * float(m_width) - 0.5f;
+  const float y = uv.y * float(m_height) - 0.5f;
+  const float fx = std::floor(x), fy = std::floor(y);
+  const float tx = x - fx, ty = y - fy;
+
+  const uint32_t x0 = wrap(fx, m_width), y0 = wrap(fy, m_height);
+  const uint32_t x1 = x0 + 1 == m_width ? 0 : x0 + 1;
+  const uint32_t y1 = y0 + 1 == m_height ? 0 : y0 + 1;
+
+  return bilerp(m_texels[index(x0, y0)], m_texels[index(x1, y0)],
+                m_texels[index(x0, y1)], m_texels[index(x1, y1)], tx, ty);
+}
+
+BatchFloat4 CpuTexture::sample(const BatchFloat2 &uv) const {
+  if (m_constant) {
+    const float4 c = *m_constant;
+    return {BatchFloat{} + c.x, BatchFloat{} + c.y, BatchFloat{} + c.z,
+            BatchFloat{} + c.w};
+  }
+
+  const BatchFloat x = uv.x * float(m_width) - 0.5f;
+  const BatchFloat y = uv.y * float(m_height) - 0.5f;
+  const BatchFloat fx = simd::floor(x), fy = simd::floor(y);
+  const BatchFloat tx = x - fx, ty = y - fy;
+
+  const BatchInt x0 = wrap(fx, m_width), y0 = wrap(fy, m_height);
+  BatchInt x1 = x0 + 1, y1 = y0 + 1;
+  x1 &= ~(x1 == int(m_width));
+  y1 &= ~(y1 == int(m_height));
+
+  // Same as index(), for every lane
+  constexpr int shift = std::countr_zero(tileSize), mask = tileSize - 1;
+  auto index = [&](const BatchInt &tx, const BatchInt &ty) {
+    return (((ty >> shift) * int(m_tilesX) + (tx >> shift)) << (2 * shift)) |
+           ((ty & mask) << shift) | (tx & mask);
+  };
+  const BatchInt i00 = index(x0, y0), i10 = index(x1, y0);
+  const BatchInt i01 = index(x0, y1), i11 = index(x1, y1);
+
+  BatchFloat4 t00, t10, t01, t11;
+  for (size_t lane = 0; lane < bsdf::batchWidth; lane++) {
+    t00.set(lane, m_texels[i00[lane]]);
+    t10.set(lane, m_texels[i10[lane]]);
+    t01.set(lane, m_texels[i01[lane]]);
+    t11.set(lane, m_texels[i11[lane]]);
+  }
+
+  return {
+      bilerp(t00.x, t10.x, t01.x, t11.x, tx, ty),
+      bilerp(t00.y, t10.y, t01.y, t11.y, tx, ty),
+      bilerp(t00.z, t10.z, t01.z, t11.z, tx, ty),
+      bilerp(t00.w, t10.w, t01.w, t11.w, tx, ty),
+  };
+}
+
+} // namespace pt::renderer_pt
@@ -0,0 +1,55 @@
+#ifndef PLATINUM_CPU_TEXTURE_HPP
+#define PLATINUM_CPU_TEXTURE_HPP
+
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "bsdf_batch.hpp"
+
+namespace pt::renderer_pt {
+
+/*
+ * Host side copy of a texture level, for shading work done on the CPU, with
+ * bilinear filtering and repeat addressing like the shaders' samplers.
+ * Texels are stored in 4x4 tiles (one 64 byte cache line per tile row), so
+ * the four taps of a bilinear lookup, and lookups close to each other in
+ * either direction, touch a handful of neighbouring lines instead of rows a
+ * whole texture width apart. Textures where every texel is the same colour
+ * store just that colour, and sampling them is free.
+ */
+class CpuTexture {
+public:
+  static constexpr uint32_t tileSize = 4;
+
+  CpuTexture(uint32_t width, uint32_t height, std::span<const float4> pixels);
+
+  [[nodiscard]] constexpr uint32_t width() const { return m_width; }
+  [[nodiscard]] constexpr uint32_t height() const { return m_height; }
+
+  // The texture's colour, if every texel is the same
+  [[nodiscard]] constexpr const std::optional<float4>& constant() const { return m_constant; }
+
+  [[nodiscard]] float4 texel(uint32_t x, uint32_t y) const;
+
+  [[nodiscard]] float4 sample(float2 uv) const;
+
+  /*
+   * Sample a batch of UVs at once. Addressing and filter weights are computed
+   * for every lane in SIMD registers, only the texel loads are per lane.
+   */
+  [[nodiscard]] bsdf::BatchFloat4 sample(const bsdf::BatchFloat2& uv) const;
+
+private:
+  uint32_t m_width, m_height, m_tilesX;
+  std::optional<float4> m_constant;
+  std::vector<float4> m_texels;
+
+  [[nodiscard]] constexpr size_t index(uint32_t x, uint32_t y) const {
+    return ((size_t(y / tileSize) * m_tilesX + x / tileSize) * tileSize + y % tileSize) * tileSize + x % tileSize;
+  }
+};
+
+}
+
+#endif //PLATINUM_CPU_TEXTURE_HPP
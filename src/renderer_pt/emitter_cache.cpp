@@ -0,0 +1,191 @@
+#include "emitter_cache.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include <core/texture.hpp>
+#include <utils/utils.hpp>
+
+#include "cpu_texture.hpp"
+
+namespace pt::renderer_pt {
+
+namespace {
+
+// Upper bound on texture samples per triangle when averaging emission
+constexpr uint32_t maxTextureSamples = 256;
+
+/*
+ * Average of the texture over a triangle in UV space. Takes stratified samples
+ * (R2 sequence), roughly one per texel covered, mapped uniformly to the
+ * triangle. Samples are taken a batch at a time.
+ */
+float3 averageOverTriangle(const CpuTexture &texture, const float2 *uv) {
+  if (texture.constant())
+    return texture.constant()->xyz;
+
+  const float2 e1 = uv[1] - uv[0], e2 = uv[2] - uv[0];
+  const float texelArea = 0.5f * std::abs(e1.x * e2.y - e1.y * e2.x) *
+                          float(texture.width()) * float(texture.height());
+  const auto samples = uint32_t(
+      std::clamp(std::ceil(texelArea), 1.0f, float(maxTextureSamples)));
+
+  constexpr float a1 = 0.7548776662466927f, a2 = 0.5698402909980532f;
+
+  float3 sum = 0.0f;
+  for (uint32_t first = 0; first < samples; first += bsdf::batchWidth) {
+    const uint32_t count =
+        std::min(samples - first, uint32_t(bsdf::batchWidth));
+
+    // Lanes past the last sample repeat it and are left out of the sum
+    bsdf::BatchFloat2 batch;
+    for (uint32_t lane = 0; lane < bsdf::batchWidth; lane++) {
+      const uint32_t i = first + std::min(lane, count - 1);
+      float u = std::fmod(0.5f + a1 * float(i), 1.0f);
+      float v = std::fmod(0.5f + a2 * float(i), 1.0f);
+      if (u + v > 1.0f) {
+        u = 1.0f - u;
+        v = 1.0f - v;
+      }
+
+      const float2 p = uv[0] + e1 * u + e2 * v;
+      batch.x[lane] = p.x;
+      batch.y[lane] = p.y;
+    }
+
+    const auto values = texture.sample(batch);
+    for (uint32_t lane = 0; lane < count; lane++)
+      sum += values.get(lane).xyz;
+  }
+
+  return sum / float(samples);
+}
+
+} // namespace
+
+uint64_t EmitterCache::KeyHash::operator()(const Key &key) const noexcept {
+  return ankerl::unordered_dense::detail::wyhash::mix(
+      key.mesh, key.texture ^ (0x9e3779b97f4a7c15ull * (key.slot + 1)));
+}
+
+void EmitterCache::update(Scene &scene, std::span<const Key> keys) {
+  std::erase_if(m_entries, [&](const auto &entry) {
+    const auto &key = entry.first;
+    return !scene.assetValid(key.mesh) ||
+           (key.texture != noTexture && !scene.assetValid(key.texture));
+  });
+
+  ankerl::unordered_dense::set<Key, KeyHash> missingKeys;
+  for (const auto &key : keys) {
+    if (!m_entries.contains(key))
+      missingKeys.insert(key);
+  }
+  const auto missing = std::move(missingKeys).extract();
+
+  /*
+   * Collect the triangles using each slot, in parallel across entries.
+   * Textured entries also keep their UVs, to average the texture below.
+   */
+  std::vector<Triangles> built(missing.size());
+  std::vector<std::vector<float2>> texCoords(missing.size());
+  utils::parallelFor(missing.size(), [&](size_t i) {
+    const auto &key = missing[i];
+    const auto &mesh = *scene.getAsset<Mesh>(key.mesh);
+
+    auto materialIndices = (uint32_t *)mesh.materialIndices()->contents();
+    auto indices = (uint32_t *)mesh.indices()->contents();
+
+    auto &triangles = built[i];
+    const auto triangleCount = uint32_t(mesh.indexCount() / 3);
+    for (uint32_t t = 0; t < triangleCount; t++) {
+      if (materialIndices[t] != key.slot)
+        continue;
+
+      const uint32_t *tri = indices + t * 3;
+      const float3 v0 = mesh.position(tri[0]);
+      const float3 v1 = mesh.position(tri[1]);
+      const float3 v2 = mesh.position(tri[2]);
+
+      // Degenerate triangles have no area under any transform, skip them
+      if (length_squared(cross(v1 - v0, v2 - v0)) == 0.0f)
+        continue;
+
+      triangles.primitives.push_back(t);
+      triangles.vertices.insert(triangles.vertices.end(), {v0, v1, v2});
+
+      if (key.texture != noTexture) {
+        for (int j = 0; j < 3; j++)
+          texCoords[i].push_back(mesh.texCoords(tri[j]));
+      }
+    }
+  });
+
+  /*
+   * Average emission textures over each triangle, in parallel across every
+   * new textured triangle. Each texture is read back once.
+   */
+  ankerl::unordered_dense::map<Scene::AssetID, CpuTexture> textures;
+  std::vector<size_t> texturedEntries, offsets = {0};
+  for (size_t i = 0; i < missing.size(); i++) {
+    const auto textureId = missing[i].texture;
+    if (textureId == noTexture)
+      continue;
+
+    if (!textures.contains(textureId)) {
+      auto *texture = scene.getAsset<Texture>(textureId);
+      textures.emplace(textureId,
+                       CpuTexture(uint32_t(texture->texture()->width()),
+                                  uint32_t(texture->texture()->height()),
+                                  texture->readPixels()));
+    }
+
+    texturedEntries.push_back(i);
+    offsets.push_back(offsets.back() + built[i].size());
+    built[i].textureAverages.resize(built[i].size());
+  }
+
+  utils::parallelFor(
+      offsets.back(),
+      [&](size_t idx) {
+        const size_t e = std::ranges::upper_bound(offsets, idx) -
+                         offsets.begin() - 1;
+        const size_t i = texturedEntries[e], t = idx - offsets[e];
+
+        const auto &texture = textures.at(missing[i].texture);
+        built[i].textureAverages[t] =
+            averageOverTriangle(texture, &texCoords[i][t * 3]);
+      },
+      1024);
+
+  /*
+   * Drop triangles where the texture is black, they can't be sampled
+   */
+  for (auto i : texturedEntries) {
+    auto &triangles = built[i];
+
+    size_t kept = 0;
+    for (size_t t = 0; t < triangles.size(); t++) {
+      if (!(reduce_max(triangles.textureAverages[t]) > 0.0f))
+        continue;
+
+      triangles.primitives[kept] = triangles.primitives[t];
+      triangles.textureAverages[kept] = triangles.textureAverages[t];
+      for (int j = 0; j < 3; j++)
+        triangles.vertices[kept * 3 + j] = triangles.vertices[t * 3 + j];
+      kept++;
+    }
+
+    triangles.primitives.resize(kept);
+    triangles.textureAverages.resize(kept);
+    triangles.vertices.resize(kept * 3);
+  }
+
+  for (size_t i = 0; i < missing.size(); i++)
+    m_entries.emplace(missing[i], std::move(built[i]));
+}
+
+const EmitterCache::Triangles &EmitterCache::get(const Key &key) const {
+  return m_entries.at(key);
+}
+
+} // namespace pt::renderer_pt
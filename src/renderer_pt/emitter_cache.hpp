@@ -0,0 +1,64 @@
+#ifndef PLATINUM_EMITTER_CACHE_HPP
+#define PLATINUM_EMITTER_CACHE_HPP
+
+#include <span>
+#include <vector>
+
+#include <core/scene.hpp>
+
+namespace pt::renderer_pt {
+
+/*
+ * Object space emissive triangle lists for each (mesh, material slot, emission
+ * texture) combination, used to build the area light list without walking
+ * every mesh triangle on each render.
+ * Meshes are immutable and asset IDs are never reused, so entries stay valid
+ * as long as their mesh and texture exist, and are kept between renders.
+ */
+class EmitterCache {
+public:
+  static constexpr Scene::AssetID noTexture = ~Scene::AssetID(0);
+
+  struct Key {
+    Scene::AssetID mesh;
+    uint32_t slot;
+    Scene::AssetID texture = noTexture;
+
+    constexpr bool operator==(const Key& other) const = default;
+  };
+
+  struct KeyHash {
+    using is_avalanching = void;
+
+    [[nodiscard]] uint64_t operator()(const Key& key) const noexcept;
+  };
+
+  struct Triangles {
+    std::vector<uint32_t> primitives; // Primitive index within the mesh
+    std::vector<float3> vertices;     // Object space positions, 3 per triangle
+
+    /*
+     * Average emission texture value over each triangle's UV footprint, linear
+     * RGB. Empty for untextured emitters. Triangles where the texture is black
+     * are left out of textured lists.
+     */
+    std::vector<float3> textureAverages;
+
+    [[nodiscard]] constexpr size_t size() const { return primitives.size(); }
+  };
+
+  /*
+   * Make sure every key has an entry, building the missing ones in parallel,
+   * and drop entries for meshes or textures that no longer exist.
+   */
+  void update(Scene& scene, std::span<const Key> keys);
+
+  [[nodiscard]] const Triangles& get(const Key& key) const;
+
+private:
+  ankerl::unordered_dense::map<Key, Triangles, KeyHash> m_entries;
+};
+
+}
+
+#endif //PLATINUM_EMITTER_CACHE_HPP
@@ -0,0 +1,101 @@
+#include "ggx_luts.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <format>
+#include <print>
+
+#include <tinyexr.h>
+
+namespace pt::renderer_pt {
+
+float GgxLut::sample(float u, float v, float w) const {
+  /*
+   * Texel centers are at (i + 0.5) / size, so we offset by half a texel and
+   * clamp the texel indices, like a clamp_to_edge Metal sampler
+   */
+  auto axis = [](float coord, uint32_t size, uint32_t &i0, uint32_t &i1,
+                 float &t) {
+    const float x = coord * float(size) - 0.5f;
+    const float x0 = std::floor(x);
+    t = x - x0;
+
+    const auto max = int32_t(size) - 1;
+    i0 = uint32_t(std::clamp(int32_t(x0), 0, max));
+    i1 = uint32_t(std::clamp(int32_t(x0) + 1, 0, max));
+  };
+
+  uint32_t x0, x1, y0 = 0, y1 = 0, z0 = 0, z1 = 0;
+  float tx, ty = 0.0f, tz = 0.0f;
+  axis(u, width, x0, x1, tx);
+  if (dimensions > 1)
+    axis(v, height, y0, y1, ty);
+  if (dimensions > 2)
+    axis(w, depth, z0, z1, tz);
+
+  auto at = [&](uint32_t x, uint32_t y, uint32_t z) {
+    return data[(size_t(z) * height + y) * width + x];
+  };
+  auto lerp = [](float a, float b, float t) { return a + (b - a) * t; };
+
+  const float c00 = lerp(at(x0, y0, z0), at(x1, y0, z0), tx);
+  const float c10 = lerp(at(x0, y1, z0), at(x1, y1, z0), tx);
+  const float c01 = lerp(at(x0, y0, z1), at(x1, y0, z1), tx);
+  const float c11 = lerp(at(x0, y1, z1), at(x1, y1, z1), tx);
+
+  return lerp(lerp(c00, c10, ty), lerp(c01, c11, ty), tz);
+}
+
+std::optional<GgxLuts> GgxLuts::load(const fs::path &dir) {
+  GgxLuts luts;
+
+  for (size_t i = 0; i < Count; i++) {
+    const auto &lutInfo = info[i];
+    auto &lut = luts.m_luts[i];
+    lut.dimensions = lutInfo.dimensions;
+    lut.depth = lutInfo.depth;
+
+    for (uint32_t zSlice = 0; zSlice < lutInfo.depth; zSlice++) {
+      auto filename =
+          lutInfo.depth > 1
+              ? std::format("{}_{}.exr", lutInfo.filename, zSlice)
+              : std::format("{}.exr", lutInfo.filename);
+      auto path = dir / filename;
+
+      int32_t width, height;
+      float *data;
+      const char *err;
+      int r = LoadEXR(&data, &width, &height, path.c_str(), &err);
+      if (r < 0) {
+        std::println(stderr, "renderer_pt: Failed to load LUT {}: {}",
+                     path.string(), err);
+        FreeEXRErrorMessage(err);
+        return std::nullopt;
+      }
+
+      if (zSlice == 0) {
+        lut.width = uint32_t(width);
+        lut.height = uint32_t(height);
+        lut.data.resize(size_t(width) * height * lut.depth);
+      } else if (uint32_t(width) != lut.width ||
+                 uint32_t(height) != lut.height) {
+        std::println(stderr, "renderer_pt: LUT slice {} has the wrong size",
+                     path.string());
+        free(data);
+        return std::nullopt;
+      }
+
+      // LUT values are stored in the alpha channel
+      float *slice = lut.data.data() + size_t(zSlice) * width * height;
+      for (size_t j = 0; j < size_t(width) * height; j++)
+        slice[j] = data[j * 4 + 3];
+
+      free(data);
+    }
+  }
+
+  return luts;
+}
+
+}
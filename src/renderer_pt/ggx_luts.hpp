@@ -0,0 +1,79 @@
+#ifndef PLATINUM_GGX_LUTS_HPP
+#define PLATINUM_GGX_LUTS_HPP
+
+#include <array>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace pt::renderer_pt {
+
+/*
+ * Single channel float lookup table, sampled like a Metal texture with linear
+ * filtering and clamp to edge addressing.
+ */
+struct GgxLut {
+  uint32_t dimensions = 2;
+  uint32_t width = 0, height = 1, depth = 1;
+  std::vector<float> data;
+
+  [[nodiscard]] float sample(float u, float v = 0.0f, float w = 0.0f) const;
+};
+
+/*
+ * Precomputed GGX albedo tables used for multiple scattering compensation.
+ * Loaded once and shared by the Metal renderer, which uploads them to
+ * textures, and the CPU BSDF implementation.
+ */
+class GgxLuts {
+public:
+  enum Index {
+    E = 0,
+    Eavg,
+    EMs,
+    EavgMs,
+    ETransIn,
+    ETransOut,
+    EavgTransIn,
+    EavgTransOut,
+    Count,
+  };
+
+  struct Info {
+    const char* filename;
+    uint32_t dimensions;
+    uint32_t depth = 1;
+  };
+
+  static constexpr std::array<Info, Count> info = {
+    {
+      {.filename = "ggx_E", .dimensions = 2, .depth = 1},
+      {.filename = "ggx_E_avg", .dimensions = 1, .depth = 1},
+      {.filename = "ggx_ms_E", .dimensions = 3, .depth = 32},
+      {.filename = "ggx_ms_E_avg", .dimensions = 2, .depth = 1},
+      {.filename = "ggx_E_trans_in", .dimensions = 3, .depth = 32},
+      {.filename = "ggx_E_trans_out", .dimensions = 3, .depth = 32},
+      {.filename = "ggx_E_trans_in_avg", .dimensions = 2, .depth = 1},
+      {.filename = "ggx_E_trans_out_avg", .dimensions = 2, .depth = 1},
+    }
+  };
+
+  /*
+   * Load all LUTs from a directory. For 3d LUTs, each slice is stored in a
+   * separate file.
+   */
+  [[nodiscard]] static std::optional<GgxLuts> load(const fs::path& dir);
+
+  [[nodiscard]] constexpr const GgxLut& operator[](Index idx) const {
+    return m_luts[idx];
+  }
+
+private:
+  std::array<GgxLut, Count> m_luts;
+};
+
+}
+
+#endif //PLATINUM_GGX_LUTS_HPP
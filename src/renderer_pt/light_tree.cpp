@@ -0,0 +1,316 @@
+#include "light_tree.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <numbers>
+
+namespace pt::renderer_pt {
+
+namespace {
+
+constexpr float pi = std::numbers::pi_v<float>;
+constexpr float oneMinusEpsilon = 0x1.fffffep-1;
+
+// SAH buckets per axis when splitting a node
+constexpr uint32_t splitBuckets = 12;
+
+float safeSqrt(float x) { return std::sqrt(std::max(0.0f, x)); }
+
+float safeAcos(float x) { return std::acos(std::clamp(x, -1.0f, 1.0f)); }
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) given sines and cosines of a, b
+float cosSubClamped(float sinA, float cosA, float sinB, float cosB) {
+  return cosA > cosB ? 1.0f : cosA * cosB + sinA * sinB;
+}
+
+float sinSubClamped(float sinA, float cosA, float sinB, float cosB) {
+  return cosA > cosB ? 0.0f : sinA * cosB - cosA * sinB;
+}
+
+// Rotate v by theta radians around the (normalized) axis k
+float3 rotate(float3 v, float3 k, float theta) {
+  const float c = std::cos(theta), s = std::sin(theta);
+  return v * c + cross(k, v) * s + k * (dot(k, v) * (1.0f - c));
+}
+
+uint32_t bucketIndex(float c, float lo, float hi) {
+  const auto b = uint32_t(float(splitBuckets) * (c - lo) / (hi - lo));
+  return std::min(b, splitBuckets - 1);
+}
+
+float surfaceArea(const LightBounds &b) {
+  const float3 d = b.max - b.min;
+  return 2.0f * (d.x * d.y + d.x * d.z + d.y * d.z);
+}
+
+/*
+ * Cost of a split candidate, the surface area heuristic weighted by power and
+ * by the solid angle of the emission cone (pbrt-v4, LightBounds split cost).
+ */
+float splitCost(const LightBounds &b, const LightBounds &parent, uint32_t dim) {
+  const float thetaO = safeAcos(b.cosTheta), thetaE = pi * 0.5f;
+  const float thetaW = std::min(thetaO + thetaE, pi);
+  const float sinThetaO = safeSqrt(1.0f - b.cosTheta * b.cosTheta);
+  const float mOmega =
+      2.0f * pi * (1.0f - b.cosTheta) +
+      pi * 0.5f *
+          (2.0f * thetaW * sinThetaO - std::cos(thetaO - 2.0f * thetaW) -
+           2.0f * thetaO * sinThetaO + b.cosTheta);
+
+  const float3 d = parent.max - parent.min;
+  const float kr = std::max({d.x, d.y, d.z}) / d[dim];
+  return b.power * mOmega * kr * surfaceArea(b);
+}
+
+} // namespace
+
+LightBounds LightBounds::triangle(float3 v0, float3 v1, float3 v2,
+                                  float power) {
+  return {
+      .min = simd::min(v0, simd::min(v1, v2)),
+      .max = simd::max(v0, simd::max(v1, v2)),
+      .axis = normalize(cross(v1 - v0, v2 - v0)),
+      .cosTheta = 1.0f,
+      .power = power,
+  };
+}
+
+LightBounds unite(const LightBounds &a, const LightBounds &b) {
+  if (a.empty())
+    return b;
+  if (b.empty())
+    return a;
+
+  LightBounds result{
+      .min = simd::min(a.min, b.min),
+      .max = simd::max(a.max, b.max),
+      .power = a.power + b.power,
+  };
+
+  // Bounding cone for both cones
+  const float thetaA = safeAcos(a.cosTheta), thetaB = safeAcos(b.cosTheta);
+  const float thetaD = safeAcos(dot(a.axis, b.axis));
+
+  if (std::min(thetaD + thetaB, pi) <= thetaA) {
+    result.axis = a.axis;
+    result.cosTheta = a.cosTheta;
+    return result;
+  }
+  if (std::min(thetaD + thetaA, pi) <= thetaB) {
+    result.axis = b.axis;
+    result.cosTheta = b.cosTheta;
+    return result;
+  }
+
+  const float thetaO = (thetaA + thetaD + thetaB) * 0.5f;
+  const float3 wr = cross(a.axis, b.axis);
+  if (thetaO >= pi || length_squared(wr) == 0.0f) {
+    result.axis = a.axis;
+    result.cosTheta = -1.0f; // Entire sphere
+    return result;
+  }
+
+  result.axis = rotate(a.axis, normalize(wr), thetaO - thetaA);
+  result.cosTheta = std::cos(thetaO);
+  return result;
+}
+
+LightTree::LightTree(std::span<const LightBounds> lights) {
+  if (lights.empty())
+    return;
+
+  std::vector<uint32_t> indices(lights.size());
+  for (uint32_t i = 0; i < indices.size(); i++)
+    indices[i] = i;
+
+  m_nodes.reserve(lights.size() * 2 - 1);
+  m_leaves.resize(lights.size(), noLight);
+  build(lights, indices, 0);
+}
+
+uint32_t LightTree::build(std::span<const LightBounds> lights,
+                          std::span<uint32_t> indices, uint32_t parent) {
+  const auto nodeIdx = uint32_t(m_nodes.size());
+  m_nodes.emplace_back();
+
+  LightBounds bounds, centroidBounds;
+  for (auto i : indices) {
+    bounds = unite(bounds, lights[i]);
+
+    const float3 c = lights[i].centroid();
+    centroidBounds.min = simd::min(centroidBounds.min, c);
+    centroidBounds.max = simd::max(centroidBounds.max, c);
+  }
+
+  auto &node = m_nodes[nodeIdx];
+  node = {
+      .boundsMin = bounds.min,
+      .boundsMax = bounds.max,
+      .axis = bounds.axis,
+      .cosTheta = bounds.cosTheta,
+      .power = bounds.power,
+      .parent = parent,
+  };
+
+  if (indices.size() == 1) {
+    node.childOrLight = indices[0];
+    node.isLeaf = 1;
+    m_leaves[indices[0]] = nodeIdx;
+    return nodeIdx;
+  }
+
+  /*
+   * Find the lowest cost split, bucketing lights by centroid along each axis
+   */
+  float bestCost = INFINITY;
+  uint32_t bestDim = 0, bestBucket = 0;
+  for (uint32_t dim = 0; dim < 3; dim++) {
+    const float lo = centroidBounds.min[dim], hi = centroidBounds.max[dim];
+    if (hi <= lo)
+      continue;
+
+    std::array<LightBounds, splitBuckets> buckets;
+    for (auto i : indices) {
+      auto &bucket = buckets[bucketIndex(lights[i].centroid()[dim], lo, hi)];
+      bucket = unite(bucket, lights[i]);
+    }
+
+    for (uint32_t split = 0; split < splitBuckets - 1; split++) {
+      LightBounds below, above;
+      for (uint32_t b = 0; b <= split; b++)
+        below = unite(below, buckets[b]);
+      for (uint32_t b = split + 1; b < splitBuckets; b++)
+        above = unite(above, buckets[b]);
+
+      if (below.empty() || above.empty())
+        continue;
+
+      const float cost =
+          splitCost(below, bounds, dim) + splitCost(above, bounds, dim);
+      if (cost < bestCost) {
+        bestCost = cost;
+        bestDim = dim;
+        bestBucket = split;
+      }
+    }
+  }
+
+  /*
+   * Partition the lights. If every centroid is in the same place there's no
+   * useful split, so just split them in half.
+   */
+  size_t mid = indices.size() / 2;
+  if (bestCost < INFINITY) {
+    const float lo = centroidBounds.min[bestDim];
+    const float hi = centroidBounds.max[bestDim];
+    auto it = std::partition(indices.begin(), indices.end(), [&](uint32_t i) {
+      return bucketIndex(lights[i].centroid()[bestDim], lo, hi) <= bestBucket;
+    });
+    mid = it - indices.begin();
+  }
+
+  build(lights, indices.subspan(0, mid), nodeIdx);
+  const uint32_t second = build(lights, indices.subspan(mid), nodeIdx);
+
+  // The node vector may have been reallocated, don't use the reference
+  m_nodes[nodeIdx].childOrLight = second;
+  return nodeIdx;
+}
+
+float LightTree::importance(const shaders_pt::LightTreeNode &node, float3 pos,
+                            float3 n) {
+  const float3 center = (node.boundsMin + node.boundsMax) * 0.5f;
+  const float3 diagonal = node.boundsMax - node.boundsMin;
+
+  const float dist2 = length_squared(pos - center);
+  const float d2 = std::max(dist2, length(diagonal) * 0.5f);
+
+  // Emitters are two sided, so the cone is checked in both directions
+  const float3 wi = dist2 > 0.0f ? (pos - center) / std::sqrt(dist2) : n;
+  const float cosW = std::abs(dot(node.axis, wi));
+  const float sinW = safeSqrt(1.0f - cosW * cosW);
+
+  // Bound on the angle subtended by the node, from its bounding sphere
+  float cosB = -1.0f;
+  const float r2 = length_squared(diagonal) * 0.25f;
+  if (dist2 > r2)
+    cosB = safeSqrt(1.0f - r2 / dist2);
+  const float sinB = safeSqrt(1.0f - cosB * cosB);
+
+  // Minimum angle between the emission cone and the shading point
+  const float sinO = safeSqrt(1.0f - node.cosTheta * node.cosTheta);
+  const float cosX = cosSubClamped(sinW, cosW, sinO, node.cosTheta);
+  const float sinX = sinSubClamped(sinW, cosW, sinO, node.cosTheta);
+  const float cosP = cosSubClamped(sinX, cosX, sinB, cosB);
+
+  // Emitters emit over the hemisphere around their normal
+  if (cosP <= 0.0f)
+    return 0.0f;
+
+  // Minimum angle between the node and the receiver normal
+  const float cosI = std::abs(dot(wi, n));
+  const float sinI = safeSqrt(1.0f - cosI * cosI);
+  const float cosPI = cosSubClamped(sinI, cosI, sinB, cosB);
+
+  return std::max(node.power * cosP * cosPI / d2, 0.0f);
+}
+
+std::optional<LightTree::Sample> LightTree::sample(float3 pos, float3 n,
+                                                   float r) const {
+  if (m_nodes.empty())
+    return std::nullopt;
+
+  uint32_t nodeIdx = 0;
+  float pmf = 1.0f;
+  while (!m_nodes[nodeIdx].isLeaf) {
+    const uint32_t c0 = nodeIdx + 1, c1 = m_nodes[nodeIdx].childOrLight;
+    const float i0 = importance(m_nodes[c0], pos, n);
+    const float i1 = importance(m_nodes[c1], pos, n);
+    if (i0 == 0.0f && i1 == 0.0f)
+      return std::nullopt;
+
+    const float p0 = i0 / (i0 + i1);
+    if (r < p0) {
+      nodeIdx = c0;
+      r = std::min(r / p0, oneMinusEpsilon);
+      pmf *= p0;
+    } else {
+      nodeIdx = c1;
+      r = std::min((r - p0) / (1.0f - p0), oneMinusEpsilon);
+      pmf *= 1.0f - p0;
+    }
+  }
+
+  if (nodeIdx == 0 && importance(m_nodes[0], pos, n) == 0.0f)
+    return std::nullopt;
+
+  return Sample{m_nodes[nodeIdx].childOrLight, pmf};
+}
+
+float LightTree::pmf(float3 pos, float3 n, uint32_t lightIdx) const {
+  if (lightIdx >= m_leaves.size())
+    return 0.0f;
+
+  uint32_t nodeIdx = m_leaves[lightIdx];
+  if (nodeIdx == 0)
+    return importance(m_nodes[0], pos, n) > 0.0f ? 1.0f : 0.0f;
+
+  // Walk up from the leaf, multiplying the probability of each branch
+  float pmf = 1.0f;
+  while (nodeIdx != 0) {
+    const uint32_t parent = m_nodes[nodeIdx].parent;
+    const uint32_t c0 = parent + 1, c1 = m_nodes[parent].childOrLight;
+    const float i0 = importance(m_nodes[c0], pos, n);
+    const float i1 = importance(m_nodes[c1], pos, n);
+    if (i0 + i1 == 0.0f)
+      return 0.0f;
+
+    pmf *= (nodeIdx == c0 ? i0 : i1) / (i0 + i1);
+    nodeIdx = parent;
+  }
+
+  return pmf;
+}
+
+} // namespace pt::renderer_pt
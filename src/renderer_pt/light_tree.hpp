@@ -0,0 +1,81 @@
+#ifndef PLATINUM_LIGHT_TREE_HPP
+#define PLATINUM_LIGHT_TREE_HPP
+
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "pt_shader_defs.hpp"
+
+namespace pt::renderer_pt {
+
+/*
+ * Spatial and directional bounds of a set of lights. Emitters in the renderer
+ * are two sided, each one bounded by a cone around its normal.
+ */
+struct LightBounds {
+  float3 min = {INFINITY, INFINITY, INFINITY};
+  float3 max = {-INFINITY, -INFINITY, -INFINITY};
+  float3 axis = {0.0f, 0.0f, 1.0f};
+  float cosTheta = 1.0f;
+  float power = 0.0f;
+
+  [[nodiscard]] constexpr bool empty() const { return power == 0.0f; }
+
+  [[nodiscard]] float3 centroid() const { return (min + max) * 0.5f; }
+
+  static LightBounds triangle(float3 v0, float3 v1, float3 v2, float power);
+};
+
+LightBounds unite(const LightBounds& a, const LightBounds& b);
+
+/*
+ * Light BVH used to pick lights for next event estimation, proportional to an
+ * estimate of their contribution at the shading point (Conty Estevez and
+ * Kulla, "Importance Sampling of Many Lights with Adaptive Tree Splitting",
+ * using the formulation from pbrt-v4).
+ * The tree is built on the CPU and uploaded as a flat array of nodes. sample()
+ * and pmf() mirror the traversal in shaders/kernel.metal.
+ */
+class LightTree {
+public:
+  static constexpr uint32_t noLight = ~0u;
+
+  explicit LightTree(std::span<const LightBounds> lights);
+
+  [[nodiscard]] constexpr const std::vector<shaders_pt::LightTreeNode>& nodes() const {
+    return m_nodes;
+  }
+
+  // Leaf node index for each light, in the order they were passed in
+  [[nodiscard]] constexpr const std::vector<uint32_t>& leaves() const {
+    return m_leaves;
+  }
+
+  struct Sample {
+    uint32_t lightIdx;
+    float pmf;
+  };
+
+  /*
+   * Pick a light for a shading point at pos with shading normal n. Returns
+   * nothing if no light can contribute to the point.
+   */
+  [[nodiscard]] std::optional<Sample> sample(float3 pos, float3 n, float r) const;
+
+  // Probability of sample() picking the given light
+  [[nodiscard]] float pmf(float3 pos, float3 n, uint32_t lightIdx) const;
+
+  // Importance of a node for a shading point, matches the Metal implementation
+  [[nodiscard]] static float importance(const shaders_pt::LightTreeNode& node, float3 pos, float3 n);
+
+private:
+  std::vector<shaders_pt::LightTreeNode> m_nodes;
+  std::vector<uint32_t> m_leaves;
+
+  uint32_t build(std::span<const LightBounds> lights, std::span<uint32_t> indices, uint32_t parent);
+};
+
+}
+
+#endif //PLATINUM_LIGHT_TREE_HPP
@@ -0,0 +1,388 @@
+#include "opacity_cache.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <print>
+
+#include <core/texture.hpp>
+#include <utils/utils.hpp>
+
+#include "pt_shader_defs.hpp"
+
+namespace pt::renderer_pt {
+using shaders_pt::OpacityState;
+
+namespace {
+
+constexpr uint32_t microSubdivisions = 1 << shaders_pt::Opacity_MicromapLevel;
+constexpr uint32_t microTriangles = microSubdivisions * microSubdivisions;
+static_assert(microTriangles * 2 == shaders_pt::Opacity_MicromapWords * 32);
+
+// Cells visited per axis by a pyramid query, at most
+constexpr int64_t maxQueryCells = 4;
+
+// Texel coordinates past this are treated as unknown, to stay within int64
+constexpr float maxTexelCoord = 0x1p40f;
+
+/*
+ * Alpha range, quantized to 8 bits conservatively: min is rounded down and
+ * max up, so a range is only fully opaque or transparent if every texel is.
+ */
+struct AlphaRange {
+  uint8_t min = 255, max = 0;
+
+  constexpr void merge(AlphaRange r) {
+    min = std::min(min, r.min);
+    max = std::max(max, r.max);
+  }
+
+  [[nodiscard]] constexpr OpacityState state() const {
+    if (min == 255)
+      return shaders_pt::Opacity_Opaque;
+    if (max == 0)
+      return shaders_pt::Opacity_Transparent;
+    return shaders_pt::Opacity_Unknown;
+  }
+};
+
+/*
+ * Min/max alpha pyramid. Level l cell c covers texels [c * 2^l, (c + 1) * 2^l)
+ * on each axis, clipped to the texture, so any texel rectangle can be bounded
+ * by a handful of cells.
+ */
+class AlphaPyramid {
+public:
+  AlphaPyramid(uint32_t width, uint32_t height,
+               std::span<const float4> pixels) {
+    Level level{width, height, std::vector<AlphaRange>(pixels.size())};
+    utils::parallelFor(
+        pixels.size(),
+        [&](size_t i) {
+          const float a = pixels[i].w * 255.0f;
+          if (std::isnan(a)) {
+            level.ranges[i] = {0, 255};
+            return;
+          }
+
+          level.ranges[i] = {
+              uint8_t(std::clamp(std::floor(a), 0.0f, 255.0f)),
+              uint8_t(std::clamp(std::ceil(a), 0.0f, 255.0f)),
+          };
+        },
+        1 << 16);
+    m_levels.push_back(std::move(level));
+
+    while (m_levels.back().width > 1 || m_levels.back().height > 1) {
+      const auto &prev = m_levels.back();
+      Level next{(prev.width + 1) / 2, (prev.height + 1) / 2, {}};
+      next.ranges.resize(size_t(next.width) * next.height);
+
+      for (uint32_t y = 0; y < next.height; y++) {
+        for (uint32_t x = 0; x < next.width; x++) {
+          auto &range = next.ranges[size_t(y) * next.width + x];
+          const uint32_t x1 = std::min(x * 2 + 2, prev.width);
+          const uint32_t y1 = std::min(y * 2 + 2, prev.height);
+          for (uint32_t cy = y * 2; cy < y1; cy++) {
+            for (uint32_t cx = x * 2; cx < x1; cx++)
+              range.merge(prev.ranges[size_t(cy) * prev.width + cx]);
+          }
+        }
+      }
+      m_levels.push_back(std::move(next));
+    }
+  }
+
+  [[nodiscard]] constexpr uint32_t width() const { return m_levels[0].width; }
+  [[nodiscard]] constexpr uint32_t height() const { return m_levels[0].height; }
+
+  /*
+   * Alpha range over the texels in [x0, x1] x [y0, y1], inclusive, with
+   * repeat addressing
+   */
+  [[nodiscard]] AlphaRange range(int64_t x0, int64_t x1, int64_t y0,
+                                 int64_t y1) const {
+    std::pair<int64_t, int64_t> xs[2], ys[2];
+    const size_t nx = wrap(x0, x1, width(), xs);
+    const size_t ny = wrap(y0, y1, height(), ys);
+
+    AlphaRange result;
+    for (size_t i = 0; i < nx; i++) {
+      for (size_t j = 0; j < ny; j++)
+        result.merge(range(xs[i], ys[j]));
+    }
+    return result;
+  }
+
+private:
+  struct Level {
+    uint32_t width, height;
+    std::vector<AlphaRange> ranges;
+  };
+
+  std::vector<Level> m_levels;
+
+  /*
+   * Split a texel range into at most two ranges inside the texture
+   */
+  static size_t wrap(int64_t a, int64_t b, uint32_t size,
+                     std::pair<int64_t, int64_t> *out) {
+    if (b - a + 1 >= int64_t(size)) {
+      out[0] = {0, size - 1};
+      return 1;
+    }
+
+    const int64_t start = (a % size + size) % size, end = start + (b - a);
+    if (end < int64_t(size)) {
+      out[0] = {start, end};
+      return 1;
+    }
+
+    out[0] = {start, size - 1};
+    out[1] = {0, end - size};
+    return 2;
+  }
+
+  [[nodiscard]] AlphaRange range(std::pair<int64_t, int64_t> x,
+                                 std::pair<int64_t, int64_t> y) const {
+    uint32_t l = 0;
+    while (l + 1 < m_levels.size() &&
+           ((x.second >> l) - (x.first >> l) >= maxQueryCells ||
+            (y.second >> l) - (y.first >> l) >= maxQueryCells))
+      l++;
+
+    const auto &level = m_levels[l];
+    AlphaRange result;
+    for (int64_t cy = y.first >> l; cy <= y.second >> l; cy++) {
+      for (int64_t cx = x.first >> l; cx <= x.second >> l; cx++)
+        result.merge(level.ranges[size_t(cy) * level.width + size_t(cx)]);
+    }
+    return result;
+  }
+};
+
+/*
+ * Opacity of a triangle given in texel space. The bilinear filter reads the
+ * texel under a point and the next one on each axis, half a texel off.
+ */
+OpacityState classify(const AlphaPyramid &alpha, std::span<const float2> p) {
+  float2 lo = p[0], hi = p[0];
+  for (const auto &v : p.subspan(1)) {
+    lo = simd::min(lo, v);
+    hi = simd::max(hi, v);
+  }
+
+  return alpha
+      .range(int64_t(std::floor(lo.x - 0.5f)),
+             int64_t(std::floor(hi.x - 0.5f)) + 1,
+             int64_t(std::floor(lo.y - 0.5f)),
+             int64_t(std::floor(hi.y - 0.5f)) + 1)
+      .state();
+}
+
+/*
+ * Classify a triangle, filling in its micromap if it's masked. Micro-triangles
+ * are numbered like opacityMicroTriangle() in intersections.metal.
+ */
+using Micromap = std::array<uint32_t, shaders_pt::Opacity_MicromapWords>;
+
+OpacityState classify(const AlphaPyramid &alpha, const float2 *uv,
+                      Micromap &micromap) {
+  const float2 size = {float(alpha.width()), float(alpha.height())};
+  const float2 p[3] = {uv[0] * size, uv[1] * size, uv[2] * size};
+  for (const auto &v : p) {
+    if (!(std::abs(v.x) < maxTexelCoord && std::abs(v.y) < maxTexelCoord))
+      return shaders_pt::Opacity_Unknown;
+  }
+
+  const auto state = classify(alpha, p);
+  if (state != shaders_pt::Opacity_Unknown)
+    return state;
+
+  auto point = [&](uint32_t i, uint32_t j) {
+    const float u = float(i) / float(microSubdivisions);
+    const float v = float(j) / float(microSubdivisions);
+    return p[0] + (p[1] - p[0]) * u + (p[2] - p[0]) * v;
+  };
+
+  micromap.fill(0);
+  uint32_t counts[3] = {};
+  uint32_t idx = 0;
+  for (uint32_t j = 0; j < microSubdivisions; j++) {
+    for (uint32_t i = 0; i + j < microSubdivisions; i++) {
+      const float2 lower[3] = {point(i, j), point(i + 1, j), point(i, j + 1)};
+      const float2 upper[3] = {point(i + 1, j), point(i, j + 1),
+                               point(i + 1, j + 1)};
+
+      for (bool isUpper : {false, true}) {
+        if (isUpper && i + j + 1 == microSubdivisions)
+          break;
+
+        const auto micro = classify(alpha, isUpper ? upper : lower);
+        micromap[idx / 16] |= uint32_t(micro) << (2 * (idx % 16));
+        counts[micro]++;
+        idx++;
+      }
+    }
+  }
+
+  if (counts[shaders_pt::Opacity_Opaque] == microTriangles)
+    return shaders_pt::Opacity_Opaque;
+  if (counts[shaders_pt::Opacity_Transparent] == microTriangles)
+    return shaders_pt::Opacity_Transparent;
+  if (counts[shaders_pt::Opacity_Unknown] == microTriangles)
+    return shaders_pt::Opacity_Unknown;
+  return shaders_pt::Opacity_Masked;
+}
+
+} // namespace
+
+uint64_t OpacityCache::KeyHash::operator()(const Key &key) const noexcept {
+  uint64_t hash = ankerl::unordered_dense::detail::wyhash::hash(key.mesh);
+  for (auto texture : key.textures)
+    hash = ankerl::unordered_dense::detail::wyhash::mix(hash, texture);
+  return hash;
+}
+
+OpacityCache::~OpacityCache() {
+  for (auto &[key, entry] : m_entries) {
+    if (entry.buffer)
+      entry.buffer->release();
+  }
+}
+
+void OpacityCache::update(Scene &scene, MTL::Device *device,
+                          std::span<const Key> keys) {
+  std::erase_if(m_entries, [&](auto &entry) {
+    const auto &key = entry.first;
+    const bool valid =
+        scene.assetValid(key.mesh) &&
+        std::ranges::all_of(key.textures, [&](Scene::AssetID id) {
+          return id == noTexture || scene.assetValid(id);
+        });
+
+    if (!valid && entry.second.buffer)
+      entry.second.buffer->release();
+    return !valid;
+  });
+
+  std::vector<const Key *> missing;
+  for (const auto &key : keys) {
+    if (!m_entries.contains(key) &&
+        std::ranges::none_of(missing, [&](const Key *k) { return *k == key; }))
+      missing.push_back(&key);
+  }
+  if (missing.empty())
+    return;
+
+  /*
+   * Build an alpha pyramid for every texture used by a missing entry. Each
+   * texture is read back once.
+   */
+  ankerl::unordered_dense::map<Scene::AssetID, AlphaPyramid> pyramids;
+  for (const auto *key : missing) {
+    for (auto id : key->textures) {
+      if (id == noTexture || pyramids.contains(id))
+        continue;
+
+      auto *texture = scene.getAsset<Texture>(id);
+      pyramids.emplace(id, AlphaPyramid(uint32_t(texture->texture()->width()),
+                                        uint32_t(texture->texture()->height()),
+                                        texture->readPixels()));
+    }
+  }
+
+  Entry total;
+  for (const auto *key : missing) {
+    const auto &mesh = *scene.getAsset<Mesh>(key->mesh);
+    auto materialIndices = (uint32_t *)mesh.materialIndices()->contents();
+    auto indices = (uint32_t *)mesh.indices()->contents();
+
+    /*
+     * Classify every triangle in parallel, then pack the micromaps of masked
+     * triangles after the descriptors
+     */
+    const auto triangleCount = uint32_t(mesh.indexCount() / 3);
+    std::vector<OpacityState> states(triangleCount);
+    std::vector<Micromap> micromaps(triangleCount);
+    utils::parallelFor(
+        triangleCount,
+        [&](size_t t) {
+          const uint32_t slot = materialIndices[t];
+          const auto textureId =
+              slot < key->textures.size() ? key->textures[slot] : noTexture;
+
+          // Slots without an alpha texture only use the base colour alpha
+          if (textureId == noTexture) {
+            states[t] = shaders_pt::Opacity_Opaque;
+            return;
+          }
+
+          const float2 uv[3] = {mesh.texCoords(indices[t * 3]),
+                                mesh.texCoords(indices[t * 3 + 1]),
+                                mesh.texCoords(indices[t * 3 + 2])};
+          states[t] = classify(pyramids.at(textureId), uv, micromaps[t]);
+        },
+        1024);
+
+    Entry entry;
+    for (auto state : states) {
+      switch (state) {
+      case shaders_pt::Opacity_Opaque:
+        entry.opaque++;
+        break;
+      case shaders_pt::Opacity_Transparent:
+        entry.transparent++;
+        break;
+      case shaders_pt::Opacity_Masked:
+        entry.masked++;
+        break;
+      default:
+        entry.unknown++;
+        break;
+      }
+    }
+
+    const size_t words =
+        triangleCount + entry.masked * shaders_pt::Opacity_MicromapWords;
+    entry.buffer =
+        device->newBuffer(std::max(words, size_t(1)) * sizeof(uint32_t),
+                          MTL::ResourceStorageModeShared);
+
+    auto *data = (uint32_t *)entry.buffer->contents();
+    size_t offset = triangleCount;
+    for (uint32_t t = 0; t < triangleCount; t++) {
+      data[t] = uint32_t(states[t]);
+      if (states[t] != shaders_pt::Opacity_Masked)
+        continue;
+
+      data[t] |= uint32_t(offset) << 2;
+      std::ranges::copy(micromaps[t], data + offset);
+      offset += shaders_pt::Opacity_MicromapWords;
+    }
+
+    total.opaque += entry.opaque;
+    total.transparent += entry.transparent;
+    total.masked += entry.masked;
+    total.unknown += entry.unknown;
+    m_entries.emplace(*key, entry);
+  }
+
+  const auto triangles = double(total.opaque + total.transparent +
+                                total.masked + total.unknown);
+  if (triangles == 0.0)
+    return;
+
+  std::println("OpacityCache: Classified {} triangles, {:.1f}% opaque, "
+               "{:.1f}% transparent, {:.1f}% masked, {:.1f}% sampled",
+               size_t(triangles), 100.0 * double(total.opaque) / triangles,
+               100.0 * double(total.transparent) / triangles,
+               100.0 * double(total.masked) / triangles,
+               100.0 * double(total.unknown) / triangles);
+}
+
+const OpacityCache::Entry &OpacityCache::get(const Key &key) const {
+  return m_entries.at(key);
+}
+
+} // namespace pt::renderer_pt
@@ -0,0 +1,70 @@
+#ifndef PLATINUM_OPACITY_CACHE_HPP
+#define PLATINUM_OPACITY_CACHE_HPP
+
+#include <span>
+#include <vector>
+
+#include <core/scene.hpp>
+
+namespace pt::renderer_pt {
+
+/*
+ * Precomputed opacity of alpha tested meshes, so the intersection function
+ * only samples the base colour texture where alpha actually varies.
+ * Each triangle is classified against its material's alpha channel as fully
+ * opaque, fully transparent, or mixed, by bounding its UV footprint (including
+ * the bilinear filter's reach) against a min/max alpha pyramid. Mixed
+ * triangles are subdivided into a micromap of micro-triangles classified the
+ * same way, and those that are still mixed fall back to sampling.
+ * Entries are keyed by mesh and per slot alpha texture, shared between
+ * instances and kept between renders like the emitter cache.
+ */
+class OpacityCache {
+public:
+  static constexpr Scene::AssetID noTexture = ~Scene::AssetID(0);
+
+  struct Key {
+    Scene::AssetID mesh;
+    std::vector<Scene::AssetID> textures; // Alpha texture for each material slot
+
+    bool operator==(const Key& other) const = default;
+  };
+
+  struct KeyHash {
+    using is_avalanching = void;
+
+    [[nodiscard]] uint64_t operator()(const Key& key) const noexcept;
+  };
+
+  struct Entry {
+    MTL::Buffer* buffer = nullptr; // Descriptor per triangle, then micromaps
+
+    // Triangle counts by opacity state
+    size_t opaque = 0, transparent = 0, masked = 0, unknown = 0;
+
+    [[nodiscard]] constexpr bool allOpaque() const {
+      return transparent == 0 && masked == 0 && unknown == 0;
+    }
+  };
+
+  OpacityCache() = default;
+  OpacityCache(const OpacityCache& m) = delete;
+  OpacityCache& operator=(const OpacityCache& m) = delete;
+
+  ~OpacityCache();
+
+  /*
+   * Make sure every key has an entry, building the missing ones, and drop
+   * entries for meshes or textures that no longer exist.
+   */
+  void update(Scene& scene, MTL::Device* device, std::span<const Key> keys);
+
+  [[nodiscard]] const Entry& get(const Key& key) const;
+
+private:
+  ankerl::unordered_dense::map<Key, Entry, KeyHash> m_entries;
+};
+
+}
+
+#endif //PLATINUM_OPACITY_CACHE_HPP
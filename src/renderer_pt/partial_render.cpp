@@ -0,0 +1,267 @@
+#include "partial_render.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <print>
+
+#include "pt_shader_defs.hpp"
+
+namespace pt::renderer_pt {
+
+bool PartialRender::validHeader() const {
+  constexpr int knownFlags =
+      shaders_pt::RendererFlags_MultiscatterGGX |
+      shaders_pt::RendererFlags_GMoN | shaders_pt::RendererFlags_ReSTIR |
+      shaders_pt::RendererFlags_PathGuiding;
+
+  if (size.x == 0 || size.y == 0 || size.x > m_maxSize || size.y > m_maxSize)
+    return false;
+  if (flags & ~knownFlags)
+    return false;
+  if (buckets == 0 || buckets > m_maxBuckets ||
+      (!(flags & shaders_pt::RendererFlags_GMoN) && buckets != 1))
+    return false;
+
+  return sampleTotal > 0 && sampleStart <= sampleTotal &&
+         sampleCount <= sampleTotal - sampleStart;
+}
+
+bool PartialRender::valid() const {
+  if (!validHeader() || bucketSamples.size() != buckets ||
+      sums.size() != pixelCount() * buckets)
+    return false;
+
+  /*
+   * Frame f goes to bucket min(f / samplesPerBucket, buckets - 1), so each
+   * bucket gets the part of the range that overlaps its frames
+   */
+  const uint32_t perBucket = samplesPerBucket();
+  const uint32_t end = sampleStart + sampleCount;
+  for (uint32_t i = 0; i < buckets; i++) {
+    const uint64_t first = std::min(uint64_t(i) * perBucket, uint64_t(end));
+    const uint64_t last = i + 1 == buckets ? uint64_t(end)
+                                           : uint64_t(i + 1) * perBucket;
+    const uint64_t lo = std::max(first, uint64_t(sampleStart));
+    const uint64_t hi = std::min(last, uint64_t(end));
+    if (bucketSamples[i] != (hi > lo ? hi - lo : 0))
+      return false;
+  }
+
+  return true;
+}
+
+bool PartialRender::saveToFile(const fs::path &path) const {
+  std::ofstream file(path, std::ios::out | std::ios::binary);
+  if (!file) {
+    std::println(stderr, "[Error] partial render: Failed to open {} for writing",
+                 path.string());
+    return false;
+  }
+
+  auto write = [&](const auto &value) {
+    file.write((const char *)&value, sizeof(value));
+  };
+
+  write(m_magic);
+  write(m_version);
+  write(size);
+  write(sampleTotal);
+  write(sampleStart);
+  write(sampleCount);
+  write(buckets);
+  write(flags);
+
+  file.write((const char *)bucketSamples.data(),
+             std::streamsize(sizeof(uint32_t) * bucketSamples.size()));
+  file.write((const char *)sums.data(),
+             std::streamsize(sizeof(float4) * sums.size()));
+
+  return bool(file);
+}
+
+std::optional<PartialRender>
+PartialRender::loadFromFile(const fs::path &path) {
+  std::ifstream file(path, std::ios::in | std::ios::binary);
+  if (!file) {
+    std::println(stderr, "[Error] partial render: Failed to open {}",
+                 path.string());
+    return std::nullopt;
+  }
+
+  auto read = [&](auto &value) { file.read((char *)&value, sizeof(value)); };
+
+  uint32_t magic = 0, version = 0;
+  read(magic);
+  read(version);
+  if (magic != m_magic || version != m_version) {
+    std::println(stderr,
+                 "[Error] partial render: {} is not a partial render file or "
+                 "has an unsupported version",
+                 path.string());
+    return std::nullopt;
+  }
+
+  PartialRender partial;
+  read(partial.size);
+  read(partial.sampleTotal);
+  read(partial.sampleStart);
+  read(partial.sampleCount);
+  read(partial.buckets);
+  read(partial.flags);
+
+  if (!file || !partial.validHeader()) {
+    std::println(stderr, "[Error] partial render: {} has an invalid header",
+                 path.string());
+    return std::nullopt;
+  }
+
+  /*
+   * The rest of the file must be exactly the bucket sample counts and sums
+   * the header describes
+   */
+  const size_t headerBytes = size_t(file.tellg());
+  const size_t payloadBytes =
+      sizeof(uint32_t) * partial.buckets +
+      sizeof(float4) * partial.pixelCount() * partial.buckets;
+  file.seekg(0, std::ios::end);
+  const size_t fileBytes = size_t(file.tellg());
+  file.seekg(std::streamoff(headerBytes), std::ios::beg);
+
+  if (fileBytes != headerBytes + payloadBytes) {
+    std::println(stderr,
+                 "[Error] partial render: {} is {} bytes, expected {}",
+                 path.string(), fileBytes, headerBytes + payloadBytes);
+    return std::nullopt;
+  }
+
+  partial.bucketSamples.resize(partial.buckets);
+  partial.sums.resize(partial.pixelCount() * partial.buckets);
+
+  file.read((char *)partial.bucketSamples.data(),
+            std::streamsize(sizeof(uint32_t) * partial.bucketSamples.size()));
+  file.read((char *)partial.sums.data(),
+            std::streamsize(sizeof(float4) * partial.sums.size()));
+
+  if (!file) {
+    std::println(stderr, "[Error] partial render: Failed to read {}",
+                 path.string());
+    return std::nullopt;
+  }
+
+  if (!partial.valid()) {
+    std::println(stderr,
+                 "[Error] partial render: {} has bucket sample counts that "
+                 "don't match its sample range",
+                 path.string());
+    return std::nullopt;
+  }
+
+  return partial;
+}
+
+std::optional<PartialRender>
+PartialRender::merge(const std::vector<PartialRender> &partials) {
+  if (partials.empty())
+    return std::nullopt;
+
+  /*
+   * Validate the partials: they must all belong to the same frame, and their
+   * sample ranges must be disjoint.
+   */
+  const auto &first = partials[0];
+  for (const auto &partial : partials) {
+    if (!partial.valid()) {
+      std::println(stderr, "[Error] partial render: Cannot merge an invalid "
+                           "partial render");
+      return std::nullopt;
+    }
+
+    if (!equal(partial.size, first.size) ||
+        partial.sampleTotal != first.sampleTotal ||
+        partial.buckets != first.buckets || partial.flags != first.flags) {
+      std::println(stderr,
+                   "[Error] partial render: Cannot merge partials with "
+                   "different render settings");
+      return std::nullopt;
+    }
+  }
+
+  std::vector<const PartialRender *> sorted;
+  sorted.reserve(partials.size());
+  for (const auto &partial : partials)
+    sorted.push_back(&partial);
+  std::ranges::sort(sorted, {}, &PartialRender::sampleStart);
+
+  /*
+   * The result is a single sample range, which is what the renderer and GMoN
+   * bucket selection assume, so there can't be gaps between the ranges
+   */
+  for (size_t i = 1; i < sorted.size(); i++) {
+    const auto *prev = sorted[i - 1];
+    const uint32_t prevEnd = prev->sampleStart + prev->sampleCount;
+    if (prevEnd != sorted[i]->sampleStart) {
+      std::println(stderr,
+                   "[Error] partial render: Sample ranges [{}, {}) and [{}, "
+                   "{}) {}",
+                   prev->sampleStart, prevEnd, sorted[i]->sampleStart,
+                   sorted[i]->sampleStart + sorted[i]->sampleCount,
+                   prevEnd > sorted[i]->sampleStart ? "overlap"
+                                                    : "aren't contiguous");
+      return std::nullopt;
+    }
+  }
+
+  /*
+   * Sum the bucket sample counts and per-pixel sums
+   */
+  PartialRender merged{
+      .size = first.size,
+      .sampleTotal = first.sampleTotal,
+      .sampleStart = sorted[0]->sampleStart,
+      .sampleCount = 0,
+      .buckets = first.buckets,
+      .flags = first.flags,
+      .bucketSamples = std::vector<uint32_t>(first.buckets, 0),
+      .sums = std::vector<float4>(first.sums.size(), float4{0, 0, 0, 0}),
+  };
+
+  for (const auto *partial : sorted) {
+    merged.sampleCount += partial->sampleCount;
+    for (uint32_t i = 0; i < merged.buckets; i++)
+      merged.bucketSamples[i] += partial->bucketSamples[i];
+    for (size_t i = 0; i < merged.sums.size(); i++)
+      merged.sums[i] += partial->sums[i];
+  }
+
+  return merged;
+}
+
+bool PartialRender::mergeFiles(const std::vector<fs::path> &inputs,
+                               const fs::path &output) {
+  auto start = std::chrono::high_resolution_clock::now();
+
+  std::vector<PartialRender> partials;
+  partials.reserve(inputs.size());
+  for (const auto &input : inputs) {
+    auto partial = loadFromFile(input);
+    if (!partial)
+      return false;
+
+    partials.push_back(std::move(partial.value()));
+  }
+
+  auto merged = merge(partials);
+  if (!merged || !merged->saveToFile(output))
+    return false;
+
+  auto end = std::chrono::high_resolution_clock::now();
+  auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+  std::println("Merged {} partial renders ({} / {} samples) in {} ms",
+               partials.size(), merged->sampleCount, merged->sampleTotal,
+               millis.count());
+
+  return true;
+}
+
+} // namespace pt::renderer_pt
@@ -0,0 +1,84 @@
+#ifndef PLATINUM_PARTIAL_RENDER_HPP
+#define PLATINUM_PARTIAL_RENDER_HPP
+
+#include <algorithm>
+#include <filesystem>
+#include <optional>
+#include <vector>
+#include <simd/simd.h>
+
+using namespace simd;
+
+namespace fs = std::filesystem;
+
+namespace pt::renderer_pt {
+
+/*
+ * Mergeable partial render result. Used to split a single frame across several
+ * render nodes: each node renders a disjoint range of the sample sequence
+ * (frame indices [sampleStart, sampleStart + sampleCount) out of sampleTotal)
+ * and writes the per-pixel sums of every accumulator bucket, along with the
+ * sample count for each bucket. Every pixel receives every sample, so sample
+ * counts are tracked per bucket rather than per pixel.
+ * Without GMoN there is a single bucket.
+ */
+struct PartialRender {
+  uint2 size = {0, 0};
+  uint32_t sampleTotal = 0, sampleStart = 0, sampleCount = 0;
+  uint32_t buckets = 1;
+  int flags = 0;
+
+  std::vector<uint32_t> bucketSamples;  // Samples accumulated into each bucket
+  std::vector<float4> sums;             // Per-pixel sums, one full image per bucket
+
+  [[nodiscard]] constexpr size_t pixelCount() const {
+    return size_t(size.x) * size_t(size.y);
+  }
+
+  // Samples per GMoN bucket, the renderer assigns buckets the same way
+  [[nodiscard]] constexpr uint32_t samplesPerBucket() const {
+    const uint32_t n = std::max(buckets, 1u);
+    return std::max((sampleTotal + n - 1) / n, 1u);
+  }
+
+  /*
+   * Check that the fields describe a partial the renderer could have written:
+   * known flags, a bucket count matching the GMoN flag, a sample range within
+   * the total and bucket sample counts matching the range. Sums must have one
+   * image per bucket.
+   */
+  [[nodiscard]] bool valid() const;
+
+  [[nodiscard]] bool saveToFile(const fs::path& path) const;
+
+  [[nodiscard]] static std::optional<PartialRender> loadFromFile(const fs::path& path);
+
+  /*
+   * Merge a set of partials for the same frame. Partials must have matching
+   * size, total sample count, bucket count and flags, and their sample ranges
+   * must be contiguous without overlapping, so the result covers a single
+   * range. It's equivalent (up to floating point rounding) to rendering that
+   * range on a single node.
+   */
+  [[nodiscard]] static std::optional<PartialRender> merge(const std::vector<PartialRender>& partials);
+
+  /*
+   * Merge partial render files from disk and write the result. Used by the
+   * headless merge tool.
+   */
+  static bool mergeFiles(const std::vector<fs::path>& inputs, const fs::path& output);
+
+private:
+  static constexpr uint32_t m_magic = 0x52505450; // "PTPR"
+  static constexpr uint32_t m_version = 1;
+
+  // Limits for header fields, so a corrupt file can't make us allocate much
+  static constexpr uint32_t m_maxSize = 16384;    // Largest Metal texture
+  static constexpr uint32_t m_maxBuckets = 64;
+
+  [[nodiscard]] bool validHeader() const;
+};
+
+}
+
+#endif //PLATINUM_PARTIAL_RENDER_HPP
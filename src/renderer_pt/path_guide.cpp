@@ -0,0 +1,241 @@
+#include "path_guide.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include <utils/utils.hpp>
+
+namespace pt::renderer_pt {
+
+void PathGuide::DTree::splat(float2 p, float value) {
+  uint32_t nodeIdx = 0;
+  while (true) {
+    const uint32_t qx = p.x >= 0.5f, qy = p.y >= 0.5f;
+    const uint32_t q = qx | (qy << 1);
+
+    auto &node = nodes[nodeIdx];
+    node.sum[q] += value;
+    if (node.child[q] == 0)
+      return;
+
+    p = p * 2.0f - float2{float(qx), float(qy)};
+    nodeIdx = node.child[q];
+  }
+}
+
+PathGuide::DTree PathGuide::DTree::refined() const {
+  DTree result;
+  result.nodes[0].sum = nodes[0].sum;
+
+  const float total = reduce_add(nodes[0].sum);
+  if (!(total > 0.0f))
+    return result;
+
+  /*
+   * Subdivide every quadrant holding more than a small fraction of the total
+   * energy, and collapse the rest. New quadrants start out with their parent's
+   * energy spread evenly.
+   */
+  struct Item {
+    uint32_t node, oldNode, depth;
+  };
+  constexpr uint32_t noNode = ~0u;
+
+  std::vector<Item> stack = {{0, 0, 1}};
+  while (!stack.empty()) {
+    const auto item = stack.back();
+    stack.pop_back();
+
+    for (uint32_t q = 0; q < 4; q++) {
+      const float sum = result.nodes[item.node].sum[q];
+      if (sum / total <= directionalThreshold ||
+          item.depth >= maxDirectionalDepth)
+        continue;
+
+      uint32_t oldChild = noNode;
+      if (item.oldNode != noNode && nodes[item.oldNode].child[q] != 0)
+        oldChild = nodes[item.oldNode].child[q];
+
+      DNode child;
+      child.sum = sum * 0.25f;
+      if (oldChild != noNode)
+        child.sum = nodes[oldChild].sum;
+
+      const auto childIdx = uint32_t(result.nodes.size());
+      result.nodes.push_back(child);
+      result.nodes[item.node].child[q] = childIdx;
+      stack.push_back({childIdx, oldChild, item.depth + 1});
+    }
+  }
+
+  return result;
+}
+
+void PathGuide::reset() {
+  m_nodes.clear();
+  m_iteration = 0;
+  m_spatialNodes.clear();
+  m_directionalNodes.clear();
+}
+
+uint32_t PathGuide::leaf(float3 pos) const {
+  uint32_t nodeIdx = 0;
+  while (m_nodes[nodeIdx].child != 0) {
+    const auto &node = m_nodes[nodeIdx];
+    const float split = (node.min[node.axis] + node.max[node.axis]) * 0.5f;
+    nodeIdx = node.child + (pos[node.axis] >= split ? 1 : 0);
+  }
+  return nodeIdx;
+}
+
+void PathGuide::record(std::span<const shaders_pt::GuidingRecord> records) {
+  if (records.empty())
+    return;
+
+  /*
+   * The first batch of records sets the bounds of the spatial tree. The root
+   * is a cube, so cycling split axes keeps cells roughly cubic.
+   */
+  if (m_nodes.empty()) {
+    float3 min = INFINITY, max = -INFINITY;
+    for (const auto &record : records) {
+      min = simd::min(min, record.pos);
+      max = simd::max(max, record.pos);
+    }
+
+    const float3 center = (min + max) * 0.5f;
+    const float halfSize = reduce_max(max - min) * 0.5f * 1.01f + 1e-4f;
+    m_nodes.push_back({.min = center - halfSize, .max = center + halfSize});
+  }
+
+  /*
+   * Bucket records by spatial leaf, then splat each leaf's records in parallel
+   */
+  std::vector<uint32_t> leaves(records.size());
+  utils::parallelFor(
+      records.size(), [&](size_t i) { leaves[i] = leaf(records[i].pos); },
+      4096);
+
+  std::vector<size_t> offsets(m_nodes.size() + 1, 0);
+  for (auto leafIdx : leaves)
+    offsets[leafIdx + 1]++;
+  for (size_t i = 1; i < offsets.size(); i++)
+    offsets[i] += offsets[i - 1];
+
+  std::vector<uint32_t> sorted(records.size());
+  auto cursor = offsets;
+  for (uint32_t i = 0; i < records.size(); i++)
+    sorted[cursor[leaves[i]]++] = i;
+
+  utils::parallelFor(m_nodes.size(), [&](size_t nodeIdx) {
+    auto &node = m_nodes[nodeIdx];
+    for (size_t i = offsets[nodeIdx]; i < offsets[nodeIdx + 1]; i++) {
+      const auto &record = records[sorted[i]];
+      if (std::isfinite(record.value) && record.value >= 0.0f)
+        node.building.splat(record.dir, record.value);
+    }
+    node.samples += offsets[nodeIdx + 1] - offsets[nodeIdx];
+  });
+}
+
+void PathGuide::split(uint32_t nodeIdx, size_t threshold) {
+  if (m_nodes[nodeIdx].child != 0) {
+    const auto child = m_nodes[nodeIdx].child;
+    split(child, threshold);
+    split(child + 1, threshold);
+    return;
+  }
+
+  if (m_nodes[nodeIdx].samples <= threshold)
+    return;
+
+  /*
+   * Split the leaf in half along its axis. Both children start out with a
+   * copy of the parent's directional trees.
+   */
+  const auto child = uint32_t(m_nodes.size());
+  m_nodes.push_back(m_nodes[nodeIdx]);
+  m_nodes.push_back(m_nodes[nodeIdx]);
+
+  auto &node = m_nodes[nodeIdx];
+  const uint32_t axis = node.axis;
+  const float mid = (node.min[axis] + node.max[axis]) * 0.5f;
+  node.child = child;
+
+  for (uint32_t i = 0; i < 2; i++) {
+    auto &c = m_nodes[child + i];
+    c.axis = (axis + 1) % 3;
+    c.samples = node.samples / 2;
+    if (i == 0)
+      c.max[axis] = mid;
+    else
+      c.min[axis] = mid;
+  }
+
+  node.sampling = node.building = {};
+  split(child, threshold);
+  split(child + 1, threshold);
+}
+
+void PathGuide::refine() {
+  if (m_nodes.empty()) {
+    m_iteration++;
+    return;
+  }
+
+  const auto threshold =
+      size_t(spatialThreshold * std::sqrt(std::exp2(float(m_iteration))));
+  split(0, threshold);
+
+  /*
+   * The refined tree built this iteration becomes the sampling distribution,
+   * and the building tree keeps its structure with the energy cleared. Leaves
+   * that saw no light keep sampling the previous distribution.
+   */
+  utils::parallelFor(m_nodes.size(), [&](size_t nodeIdx) {
+    auto &node = m_nodes[nodeIdx];
+    if (node.child != 0)
+      return;
+
+    auto refined = node.building.refined();
+    if (reduce_add(refined.nodes[0].sum) > 0.0f)
+      node.sampling = refined;
+
+    for (auto &dnode : refined.nodes)
+      dnode.sum = 0.0f;
+    node.building = std::move(refined);
+    node.samples = 0;
+  });
+
+  m_iteration++;
+  flatten();
+}
+
+void PathGuide::flatten() {
+  m_spatialNodes.resize(m_nodes.size());
+  m_directionalNodes.clear();
+
+  for (size_t i = 0; i < m_nodes.size(); i++) {
+    const auto &node = m_nodes[i];
+    auto &flat = m_spatialNodes[i];
+
+    flat = {
+        .split = (node.min[node.axis] + node.max[node.axis]) * 0.5f,
+        .axis = node.axis,
+        .child = node.child,
+    };
+    if (node.child != 0)
+      continue;
+
+    const auto offset = uint32_t(m_directionalNodes.size());
+    flat.dtree = offset;
+    for (const auto &dnode : node.sampling.nodes) {
+      auto &flatNode = m_directionalNodes.emplace_back();
+      flatNode.sum = dnode.sum;
+      for (int q = 0; q < 4; q++)
+        flatNode.child[q] = dnode.child[q] != 0 ? dnode.child[q] + offset : 0;
+    }
+  }
+}
+
+} // namespace pt::renderer_pt
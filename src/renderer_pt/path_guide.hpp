@@ -0,0 +1,80 @@
+#ifndef PLATINUM_PATH_GUIDE_HPP
+#define PLATINUM_PATH_GUIDE_HPP
+
+#include <span>
+#include <vector>
+
+#include "pt_shader_defs.hpp"
+
+namespace pt::renderer_pt {
+
+/*
+ * SD-tree for path guiding (Müller et al., "Practical Path Guiding for
+ * Efficient Light-Transport Simulation", 2017). A binary tree over space, with
+ * a quadtree over directions in each leaf holding the incident radiance seen
+ * in that region.
+ * The renderer trains it in iterations of doubling sample counts: the GPU
+ * writes radiance records, record() splats them into the tree being built and
+ * refine() ends the iteration, making that tree the one sampled on the GPU.
+ */
+class PathGuide {
+public:
+  // Spatial leaves split once they see this many samples, times sqrt(2^i)
+  static constexpr float spatialThreshold = 12000.0f;
+
+  // Directional nodes holding more than this fraction of the energy subdivide
+  static constexpr float directionalThreshold = 0.01f;
+  static constexpr uint32_t maxDirectionalDepth = 20;
+
+  void reset();
+
+  void record(std::span<const shaders_pt::GuidingRecord> records);
+
+  void refine();
+
+  [[nodiscard]] constexpr uint32_t iteration() const { return m_iteration; }
+
+  // Flattened sampling trees, valid after the first call to refine()
+  [[nodiscard]] constexpr const std::vector<shaders_pt::GuidingSpatialNode>& spatialNodes() const {
+    return m_spatialNodes;
+  }
+
+  [[nodiscard]] constexpr const std::vector<shaders_pt::GuidingDirectionalNode>& directionalNodes() const {
+    return m_directionalNodes;
+  }
+
+private:
+  struct DNode {
+    float4 sum = 0.0f;
+    uint4 child = 0;
+  };
+
+  struct DTree {
+    std::vector<DNode> nodes = {DNode{}};
+
+    void splat(float2 p, float value);
+    [[nodiscard]] DTree refined() const;
+  };
+
+  struct SNode {
+    float3 min, max;
+    uint32_t axis = 0;
+    uint32_t child = 0;
+    size_t samples = 0;
+    DTree sampling, building;
+  };
+
+  std::vector<SNode> m_nodes;
+  uint32_t m_iteration = 0;
+
+  std::vector<shaders_pt::GuidingSpatialNode> m_spatialNodes;
+  std::vector<shaders_pt::GuidingDirectionalNode> m_directionalNodes;
+
+  [[nodiscard]] uint32_t leaf(float3 pos) const;
+  void split(uint32_t nodeIdx, size_t threshold);
+  void flatten();
+};
+
+}
+
+#endif //PLATINUM_PATH_GUIDE_HPP
@@ -22,6 +22,12 @@
 #define metal_resource(T) MTL::ResourceID
 #endif
 
+#ifdef __METAL_VERSION__
+#define metal_atomic_uint atomic_uint
+#else
+#define metal_atomic_uint uint32_t
+#endif
+
 #include <simd/simd.h>
 
 #include "../core/mesh.hpp"
@@ -63,19 +69,41 @@ struct CameraData {
 struct AreaLight {
   uint32_t instanceIdx;
   uint32_t indices[3];
-  float area, power, cumulativePower;
-  float3 emission;
+  float area, power;
+  uint32_t treeNode;      // Light tree leaf holding this light
+  uint32_t primitiveIdx;  // Used to look up the material of textured emitters
+  float3 emission;        // Average emission, textured emitters sample the texture
+};
+
+/*
+ * Light tree node. Interior nodes have their first child right after them and
+ * the second one at childOrLight, leaves hold a single light. Bounds, power and
+ * the emission cone of a node cover every light below it.
+ */
+struct LightTreeNode {
+  float3 boundsMin, boundsMax;
+  float3 axis;            // Emission cone axis
+  float cosTheta;         // Cosine of the emission cone half angle
+  float power;
+  uint32_t childOrLight;
+  uint32_t parent;
+  uint32_t isLeaf;
 };
 
 struct EnvironmentLight {
   uint32_t textureIdx;
+  uint32_t sampling;      // EnvironmentSampling mode
+  uint2 cdfSize;          // CDF grid size, CDF sampling only
   metal_ptr(AliasEntry, device) alias;
+  metal_ptr(float, device) cdf;
 };
 
 enum RendererFlags {
   RendererFlags_None = 0,
   RendererFlags_MultiscatterGGX = 1 << 0,
   RendererFlags_GMoN = 1 << 1,
+  RendererFlags_ReSTIR = 1 << 2,
+  RendererFlags_PathGuiding = 1 << 3,
 };
 
 /*
@@ -104,27 +132,62 @@ struct MaterialGPU {
 
 struct Constants {
   uint32_t frameIdx{}, spp{}, gmonBuckets{};
+  uint32_t bucketFrameIdx{}; // Samples already accumulated into the target accumulator
   uint32_t lightCount{};
   uint32_t envLightCount{};
   uint32_t lutSizeE{}, lutSizeEavg{};
   int flags{};
-  float totalLightPower{};
   uint2 size{};
+  int2 tileOrigin{}; // Accumulator origin within the image, for tiled rendering
+  uint32_t guidingRecordCapacity{};
+  float guidingBsdfFraction{}; // Probability of sampling the BSDF instead of the guiding distribution
   float3x3 idt{};
   CameraData camera{};
 };
 
 struct VertexResource {
-  metal_ptr(float3, device) position;
-  metal_ptr(VertexData, device) data;
+  metal_ptr(PackedFloat3, device) position;
+  metal_ptr(PackedVertexData, device) data;
+  metal_ptr(float2, device) texCoords; // Full precision texture coordinates, if the mesh has them
+  TexCoordBounds texCoordBounds;
 };
 
+#ifdef __METAL_VERSION__
+/*
+ * Texture coordinates of a vertex, full precision if the mesh has them
+ */
+inline float2 loadTexCoords(const device VertexResource& vertices, uint32_t idx) {
+  if (vertices.texCoords) return vertices.texCoords[idx];
+  return vertex_format::decodeTexCoords(vertices.data[idx].texCoords, vertices.texCoordBounds);
+}
+#endif
+
 struct PrimitiveResource {
   metal_ptr(uint32_t, device) materialSlot;
 };
 
+/*
+ * Opacity micromaps for alpha tested instances, see OpacityCache. Each
+ * triangle has a descriptor with its opacity state in the low two bits, and
+ * for masked triangles the index of its micromap in the rest. A micromap
+ * splits the triangle in 4^Opacity_MicromapLevel micro-triangles, with two
+ * bits of state each, numbered row by row along the second barycentric.
+ */
+enum OpacityState {
+  Opacity_Transparent = 0,
+  Opacity_Opaque = 1,       // Texture alpha is 1, only the base colour alpha applies
+  Opacity_Unknown = 2,      // Sample the texture
+  Opacity_Masked = 3,       // Descriptors only, look up the micromap
+};
+
+enum OpacityLimits {
+  Opacity_MicromapLevel = 3,
+  Opacity_MicromapWords = 4, // 32 bit words per micromap
+};
+
 struct InstanceResource {
   metal_ptr(MaterialGPU, device) materials;
+  metal_ptr(uint32_t, device) opacity; // Descriptors, then micromaps. Null if the instance isn't alpha tested
 };
 
 struct Luts {
@@ -138,13 +201,80 @@ struct Luts {
   metal_texture(2) EavgTransOut;
 };
 
-#ifdef __METAL_VERSION__
-
+/*
+ * Scene texture. Streamed textures (see core/tile_cache.hpp) have a tile
+ * request word per tile, and only their mip tail is always resident.
+ */
 struct Texture {
-  texture2d<float> tex;
+  metal_texture(2) tex;
+  metal_ptr(uint32_t, device) tileRequests; // Null if the texture isn't streamed
+  uint2 tileSize;
+  uint32_t firstTailLevel;
 };
 
-#endif
+/*
+ * ReSTIR direct lighting structs. Reservoirs hold a single light sample picked
+ * by resampling, along with the weights needed to reuse it across pixels and
+ * frames.
+ */
+enum RestirLimits {
+  Restir_Candidates = 16,        // Light samples per pixel in the initial pass
+  Restir_SpatialNeighbors = 4,
+  Restir_SpatialRadius = 16,     // In pixels
+  Restir_HistoryLimit = 20,      // Max temporal history, as a multiple of Restir_Candidates
+};
+
+struct LightReservoir {
+  float3 pos;             // Point on an area light, or direction to an environment light
+  float3 normal;          // Light surface normal
+  float3 Li;              // Emitted radiance
+  float wSum;             // Sum of resampling weights
+  float W;                // Contribution weight of the selected sample
+  uint32_t M;             // Number of candidates the reservoir has seen
+  uint32_t isEnv;
+  uint32_t frameIdx;      // Frame that wrote the reservoir, for temporal reuse
+};
+
+struct RestirSurface {
+  float3 origin, direction; // Camera ray
+  float3 normal;            // Shading normal, used to reject dissimilar neighbours
+  uint32_t instanceIdx, primitiveIdx;
+  uint32_t indices[3];
+  float2 barycentricCoords;
+  float distance;
+  uint32_t valid;           // Zero on a miss, or if the surface has no non-specular lobes
+};
+
+/*
+ * Path guiding structs. The SD-tree is trained on the CPU from radiance records
+ * written by the GPU, and uploaded as two flat node arrays.
+ */
+enum GuidingLimits {
+  Guiding_RecordsPerPath = 4,    // Radiance records written by each path, at most
+};
+
+struct GuidingSpatialNode {
+  float split;            // Split position along axis, for interior nodes
+  uint32_t axis;
+  uint32_t child;         // First child, the second one is right after it. Zero for leaves
+  uint32_t dtree;         // Root of the leaf's directional tree
+};
+
+/*
+ * Directional quadtree node over the cylindrical mapping of the sphere,
+ * (cos theta, phi) in [0, 1]^2. Quadrant q covers x >= 0.5 if q & 1, and
+ * y >= 0.5 if q & 2. sum holds the radiance in each quadrant.
+ */
+struct GuidingDirectionalNode {
+  float4 sum;
+  uint4 child;            // Zero for quadrants without a child node
+};
+
+struct GuidingRecord {
+  float3 pos;
+  float2 dir;             // Cylindrical coordinates, same as the directional tree
+  float value;            // Incident radiance luminance over the sample PDF
+};
 
 struct Arguments {
   metal_ptr(VertexResource, device) vertexResources;
@@ -154,8 +284,17 @@ struct Arguments {
   metal_resource(instance_acceleration_structure) accelStruct;
   metal_resource(IntersectionFunctionTable) intersectionFunctionTable;
   metal_ptr(AreaLight, device) lights;
+  metal_ptr(LightTreeNode, device) lightTree;
+  metal_ptr(uint32_t, device) lightIndices;         // Light index for each emissive primitive
+  metal_ptr(uint32_t, device) instanceLightOffsets; // Per instance offset into lightIndices
   metal_ptr(EnvironmentLight, device) envLights;
   metal_ptr(Texture, device) textures;
+  metal_ptr(LightReservoir, device) reservoirs;     // ReSTIR only, two per accumulator pixel
+  metal_ptr(RestirSurface, device) restirSurfaces;  // ReSTIR only, one per accumulator pixel
+  metal_ptr(GuidingSpatialNode, device) guidingSpatial;         // Null until the first training iteration
+  metal_ptr(GuidingDirectionalNode, device) guidingDirectional;
+  metal_ptr(GuidingRecord, device) guidingRecords;              // Null when not training
+  metal_ptr(metal_atomic_uint, device) guidingRecordCount;
 
   Luts luts;
   Constants constants;
@@ -165,6 +304,63 @@ struct GmonOptions {
   float cap = 1.0f;
 };
 
+struct GuidingOptions {
+  float bsdfFraction = 0.5f;
+  uint32_t trainingIterations = 5; // Iteration i renders 2^i samples
+};
+
+/*
+ * Wavefront integrator structs. Path state is kept in buffers between stages,
+ * and stages pass paths to each other through queues of path indices.
+ */
+enum WavefrontLimits {
+  Wavefront_MaterialBins = 16,           // One bin per combination of material flags
+  Wavefront_ThreadsPerThreadgroup = 64,
+};
+
+struct PathState {
+  float3 origin, direction;
+  float3 attenuation;
+  float3 L;
+  float3 lastPos;         // Last hit position, for MIS on emitter hits
+  float3 lastNormal;      // Last hit shading normal, for MIS on emitter hits
+  float lastPdf;          // Last BSDF sample PDF
+  uint32_t lastFlags;     // Last BSDF sample flags
+  float pathLength;       // Distance travelled, for ray cone texture LOD
+  uint32_t samplerOffset, samplerDim;
+};
+
+struct PathHit {
+  uint32_t instanceIdx, primitiveIdx;
+  uint32_t indices[3];
+  uint32_t bin;           // Material bin, used to sort hits before shading
+  float2 barycentricCoords;
+  float distance;
+};
+
+struct ShadowRay {
+  float3 origin, direction;
+  float3 Ld;              // Contribution if the light is not occluded
+  float maxDistance;
+  float alphaSample;      // Sample for the alpha test intersection function
+  uint32_t pathIdx;
+};
+
+struct DispatchArgs {
+  uint32_t threadgroups[3];
+};
+
+struct WavefrontCounters {
+  metal_atomic_uint pathCount[2];   // Paths in each of the ping-ponged path queues
+  metal_atomic_uint hitCount;
+  metal_atomic_uint shadowCount;
+  metal_atomic_uint binCount[Wavefront_MaterialBins];
+  metal_atomic_uint binOffset[Wavefront_MaterialBins];
+
+  DispatchArgs extendArgs, shadeArgs, shadowArgs;
+  DispatchArgs bounceArgs; // A single threadgroup while the bounce has paths to extend, none after
+};
+
 }
 }
 
@@ -1,8 +1,12 @@
 #include "renderer_pt.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
 #include <cstring>
 #include <filesystem>
 #include <print>
+#include <utility>
 
 #include <tinyexr.h>
 
@@ -24,11 +28,20 @@ Renderer::Renderer(MTL::Device *device, MTL::CommandQueue *commandQueue,
 }
 
 Renderer::~Renderer() {
+  if (m_pendingFrame.cmd != nullptr) {
+    m_pendingFrame.cmd->waitUntilCompleted();
+    m_pendingFrame.cmd->release();
+  }
+
   // Release textures
   if (m_renderTarget != nullptr)
     m_renderTarget->release();
   if (m_accumulator != nullptr)
     m_accumulator->release();
+  if (m_accumulatorSnapshot != nullptr)
+    m_accumulatorSnapshot->release();
+  if (m_tileTarget != nullptr)
+    m_tileTarget->release();
   if (m_postProcessBuffer[0] != nullptr)
     m_postProcessBuffer[0]->release();
   if (m_postProcessBuffer[1] != nullptr)
@@ -43,12 +56,42 @@ Renderer::~Renderer() {
     pipeline->release();
   for (auto *ift : m_intersectionFunctionTables)
     ift->release();
+  for (auto *pipeline : m_wavefrontPipelines)
+    pipeline->release();
+  for (auto *ift : m_wavefrontIfts) {
+    if (ift != nullptr)
+      ift->release();
+  }
+  for (auto *pipeline : m_restirPipelines)
+    pipeline->release();
+  if (m_restirIft != nullptr)
+    m_restirIft->release();
   if (m_gmonPipeline != nullptr)
     m_gmonPipeline->release();
 
   // Release buffers
   if (m_constantsBuffer != nullptr)
     m_constantsBuffer->release();
+  for (auto *buffer : {m_wavefrontPaths, m_wavefrontHits, m_wavefrontShadowRays,
+                       m_wavefrontCounters}) {
+    if (buffer != nullptr)
+      buffer->release();
+  }
+  for (auto *queue : m_wavefrontQueues) {
+    if (queue != nullptr)
+      queue->release();
+  }
+  for (auto *buffer :
+       {m_restirReservoirs, m_restirSurfaces, m_restirSnapshot}) {
+    if (buffer != nullptr)
+      buffer->release();
+  }
+  for (auto *buffer : {m_guidingRecords[0], m_guidingRecords[1],
+                       m_guidingRecordCounts[0], m_guidingRecordCounts[1],
+                       m_guidingSpatialNodes, m_guidingDirectionalNodes}) {
+    if (buffer != nullptr)
+      buffer->release();
+  }
 
   // Release residency sets
   if (m_pathtracingResidencySet)
@@ -70,6 +113,13 @@ Renderer::postProcessOptions() {
 }
 
 void Renderer::render() {
+  /*
+   * Finish the last sampled frame first, it may have to be sampled again. Its
+   * path guiding records are used once this frame is committed.
+   */
+  const bool resample = finishPendingFrame();
+  const auto finished = std::exchange(m_pendingFrame, {});
+
   if (m_startRender) {
     /*
      * Clear residency sets
@@ -81,6 +131,9 @@ void Renderer::render() {
      * Setup render
      */
     rebuildRenderTargets();
+    rebuildWavefrontBuffers();
+    rebuildRestirBuffers();
+    rebuildGuidingBuffers();
     rebuildResourceBuffers();
     rebuildLightData();
     rebuildAccelerationStructures();
@@ -93,17 +146,12 @@ void Renderer::render() {
     m_pathtracingResidencySet->commit();
     m_gmonResidencySet->commit();
 
-    /*
-     * Calculate threadgroup size and count
-     */
-    uint2 size{(uint32_t)m_currentRenderSize.x,
-               (uint32_t)m_currentRenderSize.y};
-    m_threadsPerThreadgroup = MTL::Size(8, 8, 1);
-    m_threadgroups = MTL::Size((size.x + m_threadsPerThreadgroup.width - 1) /
-                                   m_threadsPerThreadgroup.width,
-                               (size.y + m_threadsPerThreadgroup.height - 1) /
-                                   m_threadsPerThreadgroup.height,
-                               1);
+    updateThreadgroups();
+    beginTile(0);
+
+    if (auto *tileCache = m_store.scene().tileCache())
+      tileCache->resetStats();
+    m_streamingOverBudget = false;
 
     m_timer = 0;
     m_renderStart = std::chrono::high_resolution_clock::now();
@@ -114,21 +162,59 @@ void Renderer::render() {
     return;
 
   /*
-   * Update frame index
+   * When rendering in tiles, move on to the next tile once the current one
+   * has been resolved
    */
-  auto arguments =
-      static_cast<shaders_pt::Arguments *>(m_argumentBuffer->contents());
-  arguments->constants.frameIdx = (uint32_t)m_accumulatedFrames;
+  if (tiled() && m_tilesDone == m_tileIdx + 1 && m_tilesDone < tileCount())
+    beginTile(m_tileIdx + 1);
 
   auto cmd = m_commandQueue->commandBuffer();
-  uint32_t samplesPerBucket =
-      (m_accumulationFrames + m_gmonBuckets - 1) / m_gmonBuckets;
-  uint32_t gmonIdx = m_accumulatedFrames / samplesPerBucket;
+
+  if (auto *tileCache = m_store.scene().tileCache())
+    tileCache->encodeWait(cmd);
+
+  // Textures are streamed if the render started with any, see snapshotFrame()
+  const bool streaming = m_accumulatorSnapshot != nullptr;
+
+  /*
+   * The frame index is global across nodes, so each node samples a disjoint
+   * part of the sample sequence and GMoN buckets line up when merging
+   */
+  uint32_t frameIdx = uint32_t(m_sampleStart + m_accumulatedFrames);
+  uint32_t gmonIdx = 0;
+  if (m_flags & shaders_pt::RendererFlags_GMoN)
+    gmonIdx = std::min(frameIdx / samplesPerBucket(), m_gmonBuckets - 1);
 
   /*
    * If rendering the scene, run the path tracing kernel to accumulate samples
    */
-  if (m_accumulatedFrames < m_accumulationFrames) {
+  const bool sampled = m_accumulatedFrames < m_accumulationFrames;
+  const bool training = sampled && guidingTraining();
+  const uint32_t records = m_guidingSampledFrames & 1;
+  if (sampled) {
+    auto arguments =
+        static_cast<shaders_pt::Arguments *>(m_argumentBuffer->contents());
+
+    /*
+     * Path guiding training frames only write records, alternating between
+     * two buffers so the last frame's can be read while this one runs. They
+     * take sample indices past the render's range and aren't accumulated: the
+     * accumulator keeps the latest one until the first guided frame replaces
+     * it, so the render doesn't average in samples from an untrained guide.
+     */
+    if (training) {
+      arguments->constants.frameIdx =
+          uint32_t(m_sampleTotal) + m_guidingSampledFrames++;
+      arguments->constants.bucketFrameIdx = 0;
+      arguments->guidingRecords = m_guidingRecords[records]->gpuAddress();
+      arguments->guidingRecordCount =
+          m_guidingRecordCounts[records]->gpuAddress();
+    } else {
+      arguments->constants.frameIdx = frameIdx;
+      arguments->constants.bucketFrameIdx = m_bucketSamples[gmonIdx]++;
+      arguments->guidingRecords = 0;
+    }
+
     // Make PT resources resident
     cmd->useResidencySet(m_pathtracingResidencySet);
 
@@ -138,36 +224,320 @@ void Renderer::render() {
       accumulator = m_gmonAccumulators[gmonIdx];
     }
 
-    // Create and set up a compute command encoder
-    auto computeEnc = cmd->computeCommandEncoder();
-
-    computeEnc->setBuffer(m_argumentBuffer, 0, 0);
-    computeEnc->setTexture(accumulator, 0);
+    if (streaming)
+      snapshotFrame(cmd, accumulator, resample);
+
+    if (wavefront()) {
+      renderWavefront(cmd, accumulator);
+    } else {
+      // Create and set up a compute command encoder
+      auto computeEnc = cmd->computeCommandEncoder();
+
+      computeEnc->setBuffer(m_argumentBuffer, 0, 0);
+      computeEnc->setTexture(accumulator, 0);
+
+      // Pick light samples for the primary hits before path tracing
+      if (restir()) {
+        computeEnc->setIntersectionFunctionTable(m_restirIft, 1);
+        for (auto *pipeline : m_restirPipelines) {
+          computeEnc->setComputePipelineState(pipeline);
+          computeEnc->dispatchThreadgroups(m_threadgroups,
+                                           m_threadsPerThreadgroup);
+        }
+      }
 
-    computeEnc->setComputePipelineState(
-        m_pathtracingPipelines[m_selectedPipeline]);
-    computeEnc->dispatchThreadgroups(m_threadgroups, m_threadsPerThreadgroup);
-    computeEnc->endEncoding();
+      computeEnc->setComputePipelineState(
+          m_pathtracingPipelines[m_selectedPipeline]);
+      computeEnc->dispatchThreadgroups(m_threadgroups,
+                                       m_threadsPerThreadgroup);
+      computeEnc->endEncoding();
+    }
 
-    m_accumulatedFrames++;
+    if (!training)
+      m_accumulatedFrames++;
 
     auto now = std::chrono::high_resolution_clock::now();
     auto time = now - m_renderStart;
     auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(time);
     m_timer = millis.count();
+
+    /*
+     * Report throughput when the render finishes. Frames read back later are
+     * reported once they're finished.
+     */
+    if (m_accumulatedFrames == m_accumulationFrames &&
+        m_tileIdx + 1 == tileCount() && !streaming)
+      reportRenderStats();
+  }
+
+  /*
+   * Resolve the accumulated samples to the render target. When rendering in
+   * tiles, each tile is resolved once after accumulating all of its samples,
+   * then copied into the full size render target. A streamed tile's last frame
+   * may be undone, so the tile is resolved by the frame after it.
+   */
+  if (!tiled()) {
+    resolve(cmd, m_renderTarget);
+  } else if (m_accumulatedFrames == m_accumulationFrames &&
+             m_tilesDone == m_tileIdx && !(sampled && streaming)) {
+    resolve(cmd, m_tileTarget);
+
+    const uint32_t x = (m_tileIdx % m_tileCount.x) * m_tileSize;
+    const uint32_t y = (m_tileIdx / m_tileCount.x) * m_tileSize;
+    const uint32_t w = std::min(m_tileSize, uint32_t(m_currentRenderSize.x) - x);
+    const uint32_t h = std::min(m_tileSize, uint32_t(m_currentRenderSize.y) - y);
+
+    auto benc = cmd->blitCommandEncoder();
+    benc->copyFromTexture(m_tileTarget, 0, 0,
+                          MTL::Origin(m_tileApron, m_tileApron, 0),
+                          MTL::Size(w, h, 1), m_renderTarget, 0, 0,
+                          MTL::Origin(x, y, 0));
+    benc->endEncoding();
+
+    m_tilesDone++;
+  }
+
+  cmd->commit();
+
+  /*
+   * Keep the frame until the next one, to read back its path guiding records
+   * and tile requests
+   */
+  if (sampled && (training || streaming)) {
+    m_pendingFrame = {
+        .cmd = cmd->retain(),
+        .bucket = gmonIdx,
+        .records = records,
+        .training = training,
+        .streamed = streaming,
+    };
+  }
+
+  // Train on the last frame's records while this one runs
+  if (finished.training)
+    trainPathGuide(finished.records, cmd);
+}
+
+bool Renderer::finishPendingFrame() {
+  auto &frame = m_pendingFrame;
+  if (frame.cmd == nullptr)
+    return false;
+
+  frame.cmd->waitUntilCompleted();
+  frame.cmd->release();
+  frame.cmd = nullptr;
+
+  /*
+   * Page in the tiles requested by the frame. If any of them were missing, the
+   * frame fell back to coarser levels somewhere and has to be sampled again,
+   * unless nothing could be paged in because its tiles don't fit the budget.
+   */
+  bool resample = false;
+  auto *tileCache = m_store.scene().tileCache();
+  if (frame.streamed && tileCache) {
+    const auto update = tileCache->update();
+    resample = update.pagedIn > 0;
+
+    if (update.missing > 0 && update.pagedIn == 0 && !m_streamingOverBudget) {
+      std::println(stderr,
+                   "renderer_pt: texture tiles needed by a frame don't fit in "
+                   "the streaming budget, coarser levels will be used");
+      m_streamingOverBudget = true;
+    }
+  }
+
+  if (m_startRender) {
+    frame.training = false;
+    return false;
+  }
+
+  if (resample) {
+    if (frame.training) {
+      *static_cast<uint32_t *>(m_guidingRecordCounts[frame.records]
+                                   ->contents()) = 0;
+      frame.training = false;
+    } else {
+      m_accumulatedFrames--;
+      m_bucketSamples[frame.bucket]--;
+    }
+    return true;
+  }
+
+  if (m_accumulatedFrames == m_accumulationFrames &&
+      m_tileIdx + 1 == tileCount())
+    reportRenderStats();
+
+  return false;
+}
+
+/*
+ * Copy the state a streamed frame changes, or copy it back to undo the frame
+ * before sampling it again. Only the frame's accumulator and the ReSTIR
+ * history carry over to the next frame.
+ */
+void Renderer::snapshotFrame(MTL::CommandBuffer *cmd, MTL::Texture *accumulator,
+                             bool restore) {
+  auto benc = cmd->blitCommandEncoder();
+  if (restore)
+    benc->copyFromTexture(m_accumulatorSnapshot, accumulator);
+  else
+    benc->copyFromTexture(accumulator, m_accumulatorSnapshot);
+
+  if (restir()) {
+    const auto size = accumulatorSize();
+    const size_t pixelCount = size_t(size.x) * size_t(size.y);
+    const size_t reservoirs = pixelCount * sizeof(shaders_pt::LightReservoir);
+    const size_t surfaces = pixelCount * sizeof(shaders_pt::RestirSurface);
+
+    // Only the second set of reservoirs is kept for temporal reuse
+    if (restore) {
+      benc->copyFromBuffer(m_restirSnapshot, 0, m_restirReservoirs, reservoirs,
+                           reservoirs);
+      benc->copyFromBuffer(m_restirSnapshot, reservoirs, m_restirSurfaces, 0,
+                           surfaces);
+    } else {
+      benc->copyFromBuffer(m_restirReservoirs, reservoirs, m_restirSnapshot, 0,
+                           reservoirs);
+      benc->copyFromBuffer(m_restirSurfaces, 0, m_restirSnapshot, reservoirs,
+                           surfaces);
+    }
+  }
+  benc->endEncoding();
+}
+
+/*
+ * Report throughput when the render finishes, so integrators can be compared
+ * on the same scene
+ */
+void Renderer::reportRenderStats() const {
+  const double paths = double(m_currentRenderSize.x) * m_currentRenderSize.y *
+                       m_accumulationFrames;
+  std::string integrator =
+      wavefront() ? "wavefront"
+                  : m_pathtracingPipelineFunctions[m_selectedPipeline];
+  if (restir())
+    integrator += " + ReSTIR";
+  if (guiding())
+    integrator += " + path guiding";
+  std::println("renderer_pt: {} samples ({}) in {} ms, {:.2f} Mpaths/s",
+               m_accumulationFrames, integrator, m_timer,
+               paths / double(std::max(m_timer, size_t(1))) * 1e-3);
+
+  if (auto *tileCache = m_store.scene().tileCache()) {
+    const auto &stats = tileCache->stats();
+    std::println("renderer_pt: texture streaming {:.1f}% hit rate, {} "
+                 "tiles paged in ({:.1f} MB, {:.1f} MB/s), {} evicted",
+                 stats.hitRate() * 100.0, stats.pagedIn,
+                 double(stats.bytesPagedIn) / double(1 << 20),
+                 stats.bandwidth() / double(1 << 20), stats.evicted);
+  }
+}
+
+void Renderer::renderWavefront(MTL::CommandBuffer *cmd,
+                               MTL::Texture *accumulator) {
+  /*
+   * Reset queue counters
+   */
+  auto benc = cmd->blitCommandEncoder();
+  benc->fillBuffer(m_wavefrontCounters,
+                   NS::Range(0, sizeof(shaders_pt::WavefrontCounters)), 0);
+  benc->endEncoding();
+
+  /*
+   * All stages share the same buffer bindings. Dispatches within the encoder
+   * run in order, and each stage sizes the next one through indirect dispatch
+   * arguments so we never dispatch threads for terminated paths.
+   */
+  auto computeEnc = cmd->computeCommandEncoder();
+
+  computeEnc->setBuffer(m_argumentBuffer, 0, 0);
+  computeEnc->setBuffer(m_wavefrontPaths, 0, 1);
+  computeEnc->setBuffer(m_wavefrontCounters, 0, 2);
+  computeEnc->setBuffer(m_wavefrontQueues[2], 0, 7);
+  computeEnc->setBuffer(m_wavefrontHits, 0, 8);
+  computeEnc->setBuffer(m_wavefrontShadowRays, 0, 9);
+  computeEnc->setTexture(accumulator, 0);
+
+  const MTL::Size single(1, 1, 1);
+  const MTL::Size threads(shaders_pt::Wavefront_ThreadsPerThreadgroup, 1, 1);
+  auto dispatchIndirect = [&](WavefrontStage stage, size_t argsOffset) {
+    computeEnc->setComputePipelineState(m_wavefrontPipelines[stage]);
+    if (m_wavefrontIfts[stage] != nullptr)
+      computeEnc->setIntersectionFunctionTable(m_wavefrontIfts[stage], 10);
+    computeEnc->dispatchThreadgroups(m_wavefrontCounters, argsOffset, threads);
+  };
+  auto dispatchSingle = [&](WavefrontStage stage) {
+    computeEnc->setComputePipelineState(m_wavefrontPipelines[stage]);
+    computeEnc->dispatchThreadgroups(single, single);
+  };
+
+  /*
+   * Stages after PrepareExtend only run while the bounce has paths, so once
+   * every path has terminated the remaining bounces cost one tiny dispatch
+   * each. The bounce count can't be cut short on the CPU without waiting for
+   * the GPU, and paths usually end much earlier by russian roulette.
+   */
+  auto dispatchWhileAlive = [&](WavefrontStage stage) {
+    computeEnc->setComputePipelineState(m_wavefrontPipelines[stage]);
+    computeEnc->dispatchThreadgroups(
+        m_wavefrontCounters,
+        offsetof(shaders_pt::WavefrontCounters, bounceArgs), single);
+  };
+
+  uint32_t queueIdx = 0, bounce = 0;
+  computeEnc->setBytes(&queueIdx, sizeof(uint32_t), 3);
+  computeEnc->setBytes(&bounce, sizeof(uint32_t), 4);
+  computeEnc->setBuffer(m_wavefrontQueues[0], 0, 5);
+
+  computeEnc->setComputePipelineState(
+      m_wavefrontPipelines[WavefrontStage_Generate]);
+  computeEnc->dispatchThreadgroups(m_threadgroups, m_threadsPerThreadgroup);
+
+  for (; bounce < m_wavefrontMaxBounces; bounce++) {
+    queueIdx = bounce & 1;
+    computeEnc->setBytes(&queueIdx, sizeof(uint32_t), 3);
+    computeEnc->setBytes(&bounce, sizeof(uint32_t), 4);
+    computeEnc->setBuffer(m_wavefrontQueues[queueIdx], 0, 5);
+    computeEnc->setBuffer(m_wavefrontQueues[queueIdx ^ 1], 0, 6);
+
+    dispatchSingle(WavefrontStage_PrepareExtend);
+    dispatchIndirect(WavefrontStage_Extend,
+                     offsetof(shaders_pt::WavefrontCounters, extendArgs));
+    dispatchWhileAlive(WavefrontStage_PrepareShade);
+    dispatchIndirect(WavefrontStage_Sort,
+                     offsetof(shaders_pt::WavefrontCounters, extendArgs));
+    dispatchIndirect(WavefrontStage_Shade,
+                     offsetof(shaders_pt::WavefrontCounters, shadeArgs));
+    dispatchWhileAlive(WavefrontStage_PrepareShadow);
+    dispatchIndirect(WavefrontStage_Shadow,
+                     offsetof(shaders_pt::WavefrontCounters, shadowArgs));
   }
 
+  computeEnc->setComputePipelineState(
+      m_wavefrontPipelines[WavefrontStage_Accumulate]);
+  computeEnc->dispatchThreadgroups(m_threadgroups, m_threadsPerThreadgroup);
+
+  computeEnc->endEncoding();
+}
+
+void Renderer::resolve(MTL::CommandBuffer *cmd, MTL::Texture *target) {
   /*
    * Every N frames or in the last frame, accumulate GMoN buffers into the
-   * main accumulator buffer
+   * main accumulator buffer. Only the buckets this render has written to are
+   * used, which matters when rendering a sample range on a render node.
    */
-  if ((m_flags & shaders_pt::RendererFlags_GMoN)) {
+  if ((m_flags & shaders_pt::RendererFlags_GMoN) && m_accumulatedFrames > 0) {
     cmd->useResidencySet(m_gmonResidencySet);
     auto gmonEnc = cmd->computeCommandEncoder();
 
-    uint32_t fullBuckets = gmonIdx + 1;
+    uint32_t firstBucket = uint32_t(m_sampleStart) / samplesPerBucket();
+    uint32_t lastFrame = uint32_t(m_sampleStart + m_accumulatedFrames - 1);
+    uint32_t lastBucket =
+        std::min(lastFrame / samplesPerBucket(), m_gmonBuckets - 1);
+    uint32_t fullBuckets = lastBucket - firstBucket + 1;
 
-    gmonEnc->setBuffer(m_gmonAccumulatorBuffer, 0, 0);
+    gmonEnc->setBuffer(m_gmonAccumulatorBuffer,
+                       firstBucket * sizeof(MTL::ResourceID), 0);
     gmonEnc->setBytes(&fullBuckets, sizeof(uint32_t), 1);
     gmonEnc->setBytes(&m_gmonOptions, sizeof(shaders_pt::GmonOptions), 2);
     gmonEnc->setTexture(m_accumulator, 0);
@@ -191,28 +561,61 @@ void Renderer::render() {
 
   m_tonemapPass->options().tonemap->odt =
       color::transform(m_workingSpace, m_outputSpace);
-  m_tonemapPass->apply(m_postProcessBuffer[0], m_renderTarget, cmd);
-
-  cmd->commit();
+  m_tonemapPass->apply(m_postProcessBuffer[0], target, cmd);
 }
 
 void Renderer::startRender(Scene::NodeID cameraNodeId, float2 viewportSize,
                            uint32_t sampleCount, uint32_t gmonBuckets,
-                           const color::Colorspace &workingSpace, int flags) {
+                           const color::Colorspace &workingSpace, int flags,
+                           SampleRange sampleRange, uint32_t tileSize) {
   if (!equal(viewportSize, m_currentRenderSize)) {
     m_currentRenderSize = viewportSize;
     m_aspect = m_currentRenderSize.x / m_currentRenderSize.y;
   }
 
+  m_sampleTotal = sampleCount;
+  m_sampleStart = std::min(sampleRange.start, sampleCount);
   m_accumulatedFrames = 0;
-  m_accumulationFrames = sampleCount;
+  m_accumulationFrames = sampleCount - m_sampleStart;
+  if (sampleRange.count > 0)
+    m_accumulationFrames =
+        std::min(size_t(sampleRange.count), m_accumulationFrames);
 
   m_cameraNodeId = cameraNodeId;
-  m_flags = flags;
+  m_flags = m_renderFlags = flags;
   m_gmonBuckets = gmonBuckets;
+  m_bucketSamples.assign(
+      (flags & shaders_pt::RendererFlags_GMoN) ? gmonBuckets : 1, 0);
 
   m_workingSpace = workingSpace;
 
+  /*
+   * Set up tiles. Tiles are padded with an apron on every side, so passes
+   * sampling neighbouring pixels have valid data at the tile edges.
+   */
+  const uint2 size{(uint32_t)m_currentRenderSize.x,
+                   (uint32_t)m_currentRenderSize.y};
+  m_tileSize = tileSize > 0 && (tileSize < size.x || tileSize < size.y)
+                   ? tileSize
+                   : 0;
+  m_tileApron = m_tileSize > 0 ? tileApron() : 0;
+  m_tileCount = m_tileSize > 0 ? (size + m_tileSize - 1) / m_tileSize
+                               : uint2{1, 1};
+  m_tileIdx = 0;
+  m_tilesDone = 0;
+
+  /*
+   * Path guiding trains on whole frames before the render frames, but tiled
+   * renders only run the training frames before the first tile, so the guide
+   * would only ever learn that tile. Tiled renders don't use guiding.
+   */
+  if (m_tileSize > 0 && (m_flags & shaders_pt::RendererFlags_PathGuiding)) {
+    m_flags &= ~shaders_pt::RendererFlags_PathGuiding;
+    m_renderFlags = m_flags;
+    std::println(stderr,
+                 "renderer_pt: Path guiding is not supported in tiled renders");
+  }
+
   m_startRender = true;
 }
 
@@ -228,7 +631,7 @@ Renderer::makeGeometryDescriptor(const Mesh *mesh) {
   desc->setIndexType(MTL::IndexTypeUInt32);
 
   desc->setVertexBuffer(mesh->vertexPositions());
-  desc->setVertexStride(sizeof(float3));
+  desc->setVertexStride(sizeof(PackedFloat3));
   desc->setTriangleCount(mesh->indexCount() / 3);
 
   /*
@@ -305,6 +708,21 @@ void Renderer::buildPipelines() {
   auto alphaTestIntersectionFunction =
       metal_utils::getFunction(lib, "alphaTestIntersectionFunction");
 
+  auto makeIntersectionFunctionTable =
+      [&](MTL::ComputePipelineState *pipeline) {
+        auto *iftDesc =
+            MTL::IntersectionFunctionTableDescriptor::alloc()->init();
+        iftDesc->setFunctionCount(1);
+        auto *intersectionFunctionTable =
+            pipeline->newIntersectionFunctionTable(iftDesc);
+        iftDesc->release();
+
+        intersectionFunctionTable->setFunction(
+            pipeline->functionHandle(alphaTestIntersectionFunction), 0);
+
+        return intersectionFunctionTable;
+      };
+
   for (const auto &kernelName : m_pathtracingPipelineFunctions) {
     auto *pipeline = metal_utils::createComputePipeline(
         m_device, kernelName,
@@ -314,17 +732,57 @@ void Renderer::buildPipelines() {
             .threadGroupSizeIsMultipleOfExecutionWidth = true,
         });
 
-    auto *iftDesc = MTL::IntersectionFunctionTableDescriptor::alloc()->init();
-    iftDesc->setFunctionCount(1);
-    auto *intersectionFunctionTable =
-        pipeline->newIntersectionFunctionTable(iftDesc);
-    iftDesc->release();
+    m_pathtracingPipelines.push_back(pipeline);
+    m_intersectionFunctionTables.push_back(
+        makeIntersectionFunctionTable(pipeline));
+  }
 
-    intersectionFunctionTable->setFunction(
-        pipeline->functionHandle(alphaTestIntersectionFunction), 0);
+  /*
+   * Build the wavefront integrator pipelines. Stages that trace rays need
+   * their own intersection function table, as tables are tied to a pipeline.
+   */
+  for (size_t i = 0; i < WavefrontStage_Count; i++) {
+    const auto &kernelName = m_wavefrontFunctions[i];
+    const bool tracesRays =
+        i == WavefrontStage_Extend || i == WavefrontStage_Shadow;
+
+    // Prepare stages run on a single thread to set up indirect dispatches
+    const bool singleThread = i == WavefrontStage_PrepareExtend ||
+                              i == WavefrontStage_PrepareShade ||
+                              i == WavefrontStage_PrepareShadow;
+
+    metal_utils::ComputePipelineParams params{
+        .function = metal_utils::getFunction(lib, kernelName.c_str()),
+        .threadGroupSizeIsMultipleOfExecutionWidth = !singleThread,
+    };
+    if (tracesRays)
+      params.linkedFunctions = {alphaTestIntersectionFunction};
+
+    m_wavefrontPipelines[i] =
+        metal_utils::createComputePipeline(m_device, kernelName, params);
+    if (tracesRays)
+      m_wavefrontIfts[i] =
+          makeIntersectionFunctionTable(m_wavefrontPipelines[i]);
+  }
 
-    m_pathtracingPipelines.push_back(pipeline);
-    m_intersectionFunctionTables.push_back(intersectionFunctionTable);
+  /*
+   * Build the ReSTIR pipelines, run before the MIS kernel when enabled
+   */
+  for (size_t i = 0; i < RestirStage_Count; i++) {
+    const auto &kernelName = m_restirFunctions[i];
+    const bool tracesRays = i == RestirStage_Initial;
+
+    metal_utils::ComputePipelineParams params{
+        .function = metal_utils::getFunction(lib, kernelName.c_str()),
+        .threadGroupSizeIsMultipleOfExecutionWidth = true,
+    };
+    if (tracesRays)
+      params.linkedFunctions = {alphaTestIntersectionFunction};
+
+    m_restirPipelines[i] =
+        metal_utils::createComputePipeline(m_device, kernelName, params);
+    if (tracesRays)
+      m_restirIft = makeIntersectionFunctionTable(m_restirPipelines[i]);
   }
 
   /*
@@ -383,65 +841,40 @@ void Renderer::buildConstantsBuffer() {
 }
 
 void Renderer::loadGgxLutTextures() {
-  m_luts.reserve(m_lutInfo.size());
-  for (auto lut : m_lutInfo) {
-    /*
-     * Load the LUT image. For 3d LUTs, load the first slice.
-     */
-    auto filename = std::format("resource/lut/{}{}.exr", lut.filename,
-                                lut.depth > 1 ? "_0" : "");
-    auto path = fs::current_path() / filename;
-
-    int32_t width, height;
-    float *data;
-    const char *err;
-    int r = LoadEXR(&data, &width, &height, path.c_str(), &err);
-    assert(r >= 0);
-
-    // Create temp buffer for reading the image to
-    auto buffer = m_device->newBuffer(sizeof(float) * width * height,
-                                      MTL::ResourceStorageModeShared);
-    float *bufferData = (float *)buffer->contents();
-    for (int i = 0; i < width * height; i++) {
-      bufferData[i] = data[i * 4 + 3];
-    }
+  auto luts = GgxLuts::load(fs::current_path() / "resource/lut");
+  assert(luts.has_value());
+  m_ggxLuts = std::move(luts.value());
+
+  m_luts.reserve(GgxLuts::Count);
+  for (size_t i = 0; i < GgxLuts::Count; i++) {
+    const auto &lut = m_ggxLuts[GgxLuts::Index(i)];
+
+    MTL::TextureType type = MTL::TextureType2D;
+    if (lut.dimensions == 1)
+      type = MTL::TextureType1D;
+    else if (lut.dimensions == 3)
+      type = MTL::TextureType3D;
 
     // Create the texture
     auto texd = metal_utils::makeTextureDescriptor({
-        .width = (uint32_t)width,
-        .height = (uint32_t)height,
-        .depth = (uint32_t)lut.depth,
-        .type = lut.type,
+        .width = lut.width,
+        .height = lut.height,
+        .depth = lut.depth,
+        .type = type,
         .format = MTL::PixelFormatR32Float,
     });
     auto texture = m_device->newTexture(texd);
 
-    // Load the first slice
-    auto region = MTL::Region(0, 0, 0, width, height, 1);
-    texture->replaceRegion(region, 0, buffer->contents(),
-                           sizeof(float) * width);
-
-    /*
-     * For 3d LUTs, load each subsequent slice and copy it to the texture
-     */
-    for (uint32_t zSlice = 1; zSlice < lut.depth; zSlice++) {
-      filename = std::format("resource/lut/{}_{}.exr", lut.filename, zSlice);
-      path = fs::current_path() / filename;
-
-      int r = LoadEXR(&data, &width, &height, path.c_str(), &err);
-      assert(r >= 0);
-      for (int i = 0; i < width * height; i++) {
-        bufferData[i] = data[i * 4 + 3];
-      }
-
-      auto sliceRegion = MTL::Region(0, 0, zSlice, width, height, 1);
-      texture->replaceRegion(sliceRegion, 0, buffer->contents(),
-                             sizeof(float) * width);
+    // Copy each slice to the texture
+    const size_t sliceSize = size_t(lut.width) * lut.height;
+    for (uint32_t zSlice = 0; zSlice < lut.depth; zSlice++) {
+      auto region = MTL::Region(0, 0, zSlice, lut.width, lut.height, 1);
+      texture->replaceRegion(region, 0, lut.data.data() + zSlice * sliceSize,
+                             sizeof(float) * lut.width);
     }
 
     m_luts.push_back(texture);
-    m_lutSizes.push_back(width);
-    buffer->release();
+    m_lutSizes.push_back(lut.width);
   }
 }
 
@@ -467,13 +900,8 @@ void Renderer::rebuildResourceBuffers() {
   if (m_texturesBuffer != nullptr)
     m_texturesBuffer->release();
 
-  if (m_gmonAccumulatorBuffer != nullptr) {
-    m_gmonAccumulatorBuffer->release();
-    m_gmonAccumulatorBuffer = nullptr;
-  }
-
-  m_pathtracingResidencySet->addAllocation(
-      m_intersectionFunctionTables[m_selectedPipeline]);
+  for (auto *ift : activeIntersectionFunctionTables())
+    m_pathtracingResidencySet->addAllocation(ift);
   for (const auto *lut : m_luts)
     m_pathtracingResidencySet->addAllocation(lut);
 
@@ -484,8 +912,9 @@ void Renderer::rebuildResourceBuffers() {
    */
   auto meshes = m_store.scene().getAll<Mesh>();
 
-  m_vertexResourcesBuffer = m_device->newBuffer(
-      m_resourcesStride * 2 * meshes.size(), MTL::ResourceStorageModeShared);
+  m_vertexResourcesBuffer =
+      m_device->newBuffer(sizeof(shaders_pt::VertexResource) * meshes.size(),
+                          MTL::ResourceStorageModeShared);
   m_primitiveResourcesBuffer = m_device->newBuffer(
       m_resourcesStride * meshes.size(), MTL::ResourceStorageModeShared);
 
@@ -499,10 +928,16 @@ void Renderer::rebuildResourceBuffers() {
   m_meshVertexDataBuffers.reserve(meshes.size());
   m_meshMaterialIndexBuffers.reserve(meshes.size());
   for (const auto &mesh : meshes) {
-    auto vertexResourceHandle =
-        (uint64_t *)m_vertexResourcesBuffer->contents() + idx * 2;
-    vertexResourceHandle[0] = mesh.asset->vertexPositions()->gpuAddress();
-    vertexResourceHandle[1] = mesh.asset->vertexData()->gpuAddress();
+    auto vertexResources =
+        (shaders_pt::VertexResource *)m_vertexResourcesBuffer->contents();
+    vertexResources[idx] = {
+        .position = mesh.asset->vertexPositions()->gpuAddress(),
+        .data = mesh.asset->vertexData()->gpuAddress(),
+        .texCoords = mesh.asset->texCoordData()
+                         ? mesh.asset->texCoordData()->gpuAddress()
+                         : 0,
+        .texCoordBounds = mesh.asset->texCoordBounds(),
+    };
 
     auto primResourceHandle =
         (uint64_t *)m_primitiveResourcesBuffer->contents() + idx;
@@ -515,6 +950,8 @@ void Renderer::rebuildResourceBuffers() {
     m_pathtracingResidencySet->addAllocation(mesh.asset->vertexPositions());
     m_pathtracingResidencySet->addAllocation(mesh.asset->vertexData());
     m_pathtracingResidencySet->addAllocation(mesh.asset->materialIndices());
+    if (mesh.asset->texCoordData())
+      m_pathtracingResidencySet->addAllocation(mesh.asset->texCoordData());
 
     idx++;
   }
@@ -523,21 +960,43 @@ void Renderer::rebuildResourceBuffers() {
    * Create texture resource buffer, pointing to each scene texture.
    */
   auto textures = m_store.scene().getAll<Texture>();
-  std::vector<MTL::ResourceID> texturePointers;
+  std::vector<shaders_pt::Texture> textureResources;
+
+  /*
+   * Streamed textures live in the tile cache's heap, and point to their tile
+   * request words
+   */
+  auto *tileCache = m_store.scene().tileCache();
+  MTL::Buffer *tileRequests = tileCache ? tileCache->requestBuffer() : nullptr;
+  if (tileRequests) {
+    m_pathtracingResidencySet->addAllocation(tileCache->heap());
+    m_pathtracingResidencySet->addAllocation(tileRequests);
+  }
 
   m_textureIndices.clear();
   for (const auto &texture : textures) {
-    m_textureIndices[texture.id] = texturePointers.size();
-    texturePointers.push_back(texture.asset->texture()->gpuResourceID());
-
-    m_pathtracingResidencySet->addAllocation(texture.asset->texture());
+    m_textureIndices[texture.id] = textureResources.size();
+
+    shaders_pt::Texture resource{
+        .tex = texture.asset->texture()->gpuResourceID()};
+    if (texture.asset->streamed() && tileRequests) {
+      const uint32_t id = texture.asset->streamId();
+      const auto &layout = tileCache->layout(id);
+      resource.tileRequests = tileRequests->gpuAddress() +
+                              tileCache->requestOffset(id) * sizeof(uint32_t);
+      resource.tileSize = {layout.tileWidth, layout.tileHeight};
+      resource.firstTailLevel = tileCache->firstTailLevel(id);
+    } else {
+      m_pathtracingResidencySet->addAllocation(texture.asset->texture());
+    }
+    textureResources.push_back(resource);
   }
 
-  m_texturesBuffer =
-      m_device->newBuffer(sizeof(MTL::ResourceID) * texturePointers.size(),
-                          MTL::ResourceStorageModeShared);
-  memcpy(m_texturesBuffer->contents(), texturePointers.data(),
-         sizeof(MTL::ResourceID) * texturePointers.size());
+  m_texturesBuffer = m_device->newBuffer(
+      sizeof(shaders_pt::Texture) * textureResources.size(),
+      MTL::ResourceStorageModeShared);
+  memcpy(m_texturesBuffer->contents(), textureResources.data(),
+         sizeof(shaders_pt::Texture) * textureResources.size());
   if (m_texturesBuffer)
     m_pathtracingResidencySet->addAllocation(m_texturesBuffer);
 
@@ -549,12 +1008,15 @@ void Renderer::rebuildResourceBuffers() {
   auto instances = m_store.scene().getInstances();
 
   m_instanceResourcesBuffer = m_device->newBuffer(
-      m_resourcesStride * instances.size(), MTL::ResourceStorageModeShared);
+      sizeof(shaders_pt::InstanceResource) * instances.size(),
+      MTL::ResourceStorageModeShared);
   if (m_instanceResourcesBuffer)
     m_pathtracingResidencySet->addAllocation(m_instanceResourcesBuffer);
 
   idx = 0;
   m_instanceMaterialBuffers.reserve(instances.size());
+  std::vector<std::optional<OpacityCache::Key>> opacityKeys;
+  opacityKeys.reserve(instances.size());
   for (const auto &instance : instances) {
     // Create and fill the materials buffer
     const auto &materialIds =
@@ -565,6 +1027,8 @@ void Renderer::rebuildResourceBuffers() {
         MTL::ResourceStorageModeShared);
 
     size_t materialIdx = 0;
+    OpacityCache::Key opacityKey{instance.mesh.id, {}};
+    bool alphaTested = false;
     for (auto materialId : materialIds) {
       auto *material = getMaterialOrDefault(materialId);
 
@@ -618,6 +1082,13 @@ void Renderer::rebuildResourceBuffers() {
       if (material->baseColor[3] < 1.0 ||
           (baseTexture && baseTexture->hasAlpha()))
         bsdf.flags |= shaders_pt::MaterialGPU::Material_UseAlpha;
+
+      alphaTested |=
+          bool(bsdf.flags & shaders_pt::MaterialGPU::Material_UseAlpha);
+      opacityKey.textures.push_back(
+          baseTexture && baseTexture->hasAlpha()
+              ? *material->getTexture(Material::TextureSlot::BaseColor)
+              : OpacityCache::noTexture);
       if (material->anisotropy != 0.0)
         bsdf.flags |= shaders_pt::MaterialGPU::Material_Anisotropic;
       if (material->isEmissive())
@@ -625,29 +1096,56 @@ void Renderer::rebuildResourceBuffers() {
     }
 
     // Add the material buffer addresses to the instance resources buffer
-    auto instanceResourceHandle =
-        (uint64_t *)m_instanceResourcesBuffer->contents() + idx++;
-    *instanceResourceHandle = materialsBuffer->gpuAddress();
+    auto *instanceResources =
+        (shaders_pt::InstanceResource *)m_instanceResourcesBuffer->contents();
+    instanceResources[idx++] = {.materials = materialsBuffer->gpuAddress()};
 
     m_instanceMaterialBuffers.push_back(materialsBuffer);
     m_pathtracingResidencySet->addAllocation(materialsBuffer);
+
+    if (alphaTested)
+      opacityKeys.push_back(std::move(opacityKey));
+    else
+      opacityKeys.emplace_back();
   }
 
   /*
-   * Create GMoN accumulators buffer, contains pointers to all the accumulator
-   * textures
+   * Point alpha tested instances to their opacity data, so the intersection
+   * function only samples textures where it has to. Instances that turn out
+   * to be fully opaque, with no base colour alpha, don't need alpha testing
+   * at all: clearing their alpha flags makes them opaque in the TLAS.
    */
-  if (m_flags & shaders_pt::RendererFlags_GMoN) {
-    m_gmonAccumulatorBuffer =
-        m_device->newBuffer(m_gmonBuckets * sizeof(MTL::ResourceID),
-                            MTL::ResourceStorageModeShared);
-
-    for (size_t i = 0; i < m_gmonBuckets; i++) {
-      auto *gmonAccHandle =
-          (MTL::ResourceID *)m_gmonAccumulatorBuffer->contents() + i;
-      *gmonAccHandle = m_gmonAccumulators[i]->gpuResourceID();
+  std::vector<OpacityCache::Key> keys;
+  for (const auto &key : opacityKeys) {
+    if (key)
+      keys.push_back(*key);
+  }
+  m_opacityCache.update(m_store.scene(), m_device, keys);
+
+  for (size_t i = 0; i < instances.size(); i++) {
+    if (!opacityKeys[i])
+      continue;
+
+    const auto &opacity = m_opacityCache.get(*opacityKeys[i]);
+    auto *instanceResources =
+        (shaders_pt::InstanceResource *)m_instanceResourcesBuffer->contents();
+    instanceResources[i].opacity = opacity.buffer->gpuAddress();
+    m_pathtracingResidencySet->addAllocation(opacity.buffer);
+
+    auto *materials =
+        (shaders_pt::MaterialGPU *)m_instanceMaterialBuffers[i]->contents();
+    const size_t materialCount = opacityKeys[i]->textures.size();
+    const bool opaque =
+        opacity.allOpaque() &&
+        std::all_of(materials, materials + materialCount,
+                    [](const auto &bsdf) { return bsdf.baseColor.w >= 1.0f; });
+    if (opaque) {
+      for (size_t j = 0; j < materialCount; j++)
+        materials[j].flags &= ~shaders_pt::MaterialGPU::Material_UseAlpha;
     }
   }
+
+  rebuildGmonAccumulatorBuffer();
 }
 
 void Renderer::rebuildAccelerationStructures() {
@@ -769,10 +1267,22 @@ void Renderer::rebuildArgumentBuffer() {
   arguments->instances = m_instanceBuffer->gpuAddress();
   arguments->accelStruct = m_instanceAccelStruct->gpuResourceID();
   arguments->intersectionFunctionTable =
-      m_intersectionFunctionTables[m_selectedPipeline]->gpuResourceID();
-  arguments->lights = m_lightDataBuffer->gpuAddress();
-  arguments->envLights = m_envLightDataBuffer->gpuAddress();
+      activeIntersectionFunctionTables()[0]->gpuResourceID();
+  auto gpuAddress = [](MTL::Buffer *buffer) -> uint64_t {
+    return buffer ? buffer->gpuAddress() : 0;
+  };
+  arguments->lights = gpuAddress(m_lightDataBuffer);
+  arguments->lightTree = gpuAddress(m_lightTreeBuffer);
+  arguments->lightIndices = gpuAddress(m_lightIndicesBuffer);
+  arguments->instanceLightOffsets = gpuAddress(m_instanceLightOffsetsBuffer);
+  arguments->envLights = gpuAddress(m_envLightDataBuffer);
   arguments->textures = m_texturesBuffer->gpuAddress();
+  arguments->reservoirs = gpuAddress(m_restirReservoirs);
+  arguments->restirSurfaces = gpuAddress(m_restirSurfaces);
+  arguments->guidingSpatial = gpuAddress(m_guidingSpatialNodes);
+  arguments->guidingDirectional = gpuAddress(m_guidingDirectionalNodes);
+  arguments->guidingRecords = 0; // Set per frame while training
+  arguments->guidingRecordCount = 0;
 
   // GGX Multiscatter LUTs
   arguments->luts.E = m_luts[0]->gpuResourceID();
@@ -785,10 +1295,10 @@ void Renderer::rebuildArgumentBuffer() {
   arguments->luts.EavgTransOut = m_luts[7]->gpuResourceID();
 
   /*
-   * Bind the argument buffer to the active intersection function table
+   * Bind the argument buffer to the active intersection function tables
    */
-  m_intersectionFunctionTables[m_selectedPipeline]->setBuffer(m_argumentBuffer,
-                                                              0, 0);
+  for (auto *ift : activeIntersectionFunctionTables())
+    ift->setBuffer(m_argumentBuffer, 0, 0);
 }
 
 void Renderer::rebuildRenderTargets() {
@@ -800,6 +1310,10 @@ void Renderer::rebuildRenderTargets() {
   for (auto *gmonAcc : m_gmonAccumulators)
     gmonAcc->release();
   m_gmonAccumulators.clear();
+  if (m_accumulatorSnapshot != nullptr) {
+    m_accumulatorSnapshot->release();
+    m_accumulatorSnapshot = nullptr;
+  }
 
   if (m_postProcessBuffer[0] != nullptr)
     m_postProcessBuffer[0]->release();
@@ -808,10 +1322,16 @@ void Renderer::rebuildRenderTargets() {
 
   if (m_renderTarget != nullptr)
     m_renderTarget->release();
+  if (m_tileTarget != nullptr) {
+    m_tileTarget->release();
+    m_tileTarget = nullptr;
+  }
 
+  // Accumulators and post process RTs are tile sized when rendering in tiles
+  const auto size = accumulatorSize();
   auto texd = metal_utils::makeTextureDescriptor({
-      .width = uint32_t(m_currentRenderSize.x),
-      .height = uint32_t(m_currentRenderSize.y),
+      .width = size.x,
+      .height = size.y,
       .format = MTL::PixelFormatRGBA32Float,
       .usage = MTL::TextureUsageShaderWrite | MTL::TextureUsageShaderRead |
                MTL::TextureUsageRenderTarget,
@@ -829,104 +1349,402 @@ void Renderer::rebuildRenderTargets() {
     }
   }
 
-  // Create final render target
+  // Copy of the accumulator a streamed frame writes to, see snapshotFrame()
+  auto *tileCache = m_store.scene().tileCache();
+  if (tileCache && !tileCache->empty())
+    m_accumulatorSnapshot = m_device->newTexture(texd);
+
+  // Create final render target, and the tile render target if needed
   texd->setUsage(MTL::TextureUsageRenderTarget | MTL::TextureUsageShaderRead);
   texd->setPixelFormat(MTL::PixelFormatRGBA8Unorm);
+  if (tiled())
+    m_tileTarget = m_device->newTexture(texd);
+
+  texd->setWidth(uint32_t(m_currentRenderSize.x));
+  texd->setHeight(uint32_t(m_currentRenderSize.y));
   m_renderTarget = m_device->newTexture(texd);
 }
 
+void Renderer::rebuildGmonAccumulatorBuffer() {
+  if (m_gmonAccumulatorBuffer != nullptr) {
+    m_gmonAccumulatorBuffer->release();
+    m_gmonAccumulatorBuffer = nullptr;
+  }
+
+  /*
+   * Create GMoN accumulators buffer, contains pointers to all the accumulator
+   * textures
+   */
+  if (m_flags & shaders_pt::RendererFlags_GMoN) {
+    m_gmonAccumulatorBuffer =
+        m_device->newBuffer(m_gmonBuckets * sizeof(MTL::ResourceID),
+                            MTL::ResourceStorageModeShared);
+
+    for (size_t i = 0; i < m_gmonBuckets; i++) {
+      auto *gmonAccHandle =
+          (MTL::ResourceID *)m_gmonAccumulatorBuffer->contents() + i;
+      *gmonAccHandle = m_gmonAccumulators[i]->gpuResourceID();
+    }
+  }
+}
+
+void Renderer::rebuildWavefrontBuffers() {
+  for (auto *buffer : {m_wavefrontPaths, m_wavefrontHits, m_wavefrontShadowRays,
+                       m_wavefrontCounters}) {
+    if (buffer != nullptr)
+      buffer->release();
+  }
+  for (auto *queue : m_wavefrontQueues) {
+    if (queue != nullptr)
+      queue->release();
+  }
+  m_wavefrontPaths = m_wavefrontHits = m_wavefrontShadowRays = nullptr;
+  m_wavefrontCounters = nullptr;
+  m_wavefrontQueues = {};
+
+  if (!wavefront())
+    return;
+
+  /*
+   * Path state is stored for every pixel in the accumulator, indexed by its
+   * position. Wavefront buffers are only accessed by the GPU.
+   */
+  const auto size = accumulatorSize();
+  const size_t pathCount = size_t(size.x) * size_t(size.y);
+  auto makeBuffer = [&](size_t length) {
+    return m_device->newBuffer(length, MTL::ResourceStorageModePrivate);
+  };
+
+  m_wavefrontPaths = makeBuffer(pathCount * sizeof(shaders_pt::PathState));
+  m_wavefrontHits = makeBuffer(pathCount * sizeof(shaders_pt::PathHit));
+  m_wavefrontShadowRays =
+      makeBuffer(pathCount * sizeof(shaders_pt::ShadowRay));
+  m_wavefrontCounters = makeBuffer(sizeof(shaders_pt::WavefrontCounters));
+  for (auto &queue : m_wavefrontQueues)
+    queue = makeBuffer(pathCount * sizeof(uint32_t));
+}
+
+void Renderer::rebuildRestirBuffers() {
+  for (auto **buffer :
+       {&m_restirReservoirs, &m_restirSurfaces, &m_restirSnapshot}) {
+    if (*buffer != nullptr)
+      (*buffer)->release();
+    *buffer = nullptr;
+  }
+
+  if (!restir())
+    return;
+
+  /*
+   * Two reservoirs per accumulator pixel: the output of the initial pass, and
+   * the final one, kept for temporal reuse in the next frame. Buffers start
+   * zeroed, so there is no history on the first frame.
+   */
+  const auto size = accumulatorSize();
+  const size_t pixelCount = size_t(size.x) * size_t(size.y);
+  auto makeBuffer = [&](size_t length) {
+    auto *buffer =
+        m_device->newBuffer(length, MTL::ResourceStorageModeShared);
+    memset(buffer->contents(), 0, length);
+    m_pathtracingResidencySet->addAllocation(buffer);
+    return buffer;
+  };
+
+  m_restirReservoirs =
+      makeBuffer(pixelCount * 2 * sizeof(shaders_pt::LightReservoir));
+  m_restirSurfaces =
+      makeBuffer(pixelCount * sizeof(shaders_pt::RestirSurface));
+
+  // Reservoirs kept for temporal reuse and surfaces, see snapshotFrame()
+  auto *tileCache = m_store.scene().tileCache();
+  if (tileCache && !tileCache->empty())
+    m_restirSnapshot =
+        makeBuffer(pixelCount * (sizeof(shaders_pt::LightReservoir) +
+                                 sizeof(shaders_pt::RestirSurface)));
+}
+
+void Renderer::rebuildGuidingBuffers() {
+  for (auto **buffer : {&m_guidingRecords[0], &m_guidingRecords[1],
+                        &m_guidingRecordCounts[0], &m_guidingRecordCounts[1],
+                        &m_guidingSpatialNodes, &m_guidingDirectionalNodes}) {
+    if (*buffer != nullptr)
+      (*buffer)->release();
+    *buffer = nullptr;
+  }
+
+  m_pathGuide.reset();
+  m_guidingFrames = 0;
+  m_guidingSampledFrames = 0;
+
+  if (!guiding())
+    return;
+
+  /*
+   * Room for a few records per path, capped so large renders don't need huge
+   * buffers. Records past the capacity are dropped.
+   */
+  const auto size = accumulatorSize();
+  const size_t capacity =
+      std::min(size_t(size.x) * size_t(size.y) *
+                   shaders_pt::Guiding_RecordsPerPath,
+               size_t(m_guidingMaxRecords));
+
+  for (size_t i = 0; i < m_guidingRecords.size(); i++) {
+    m_guidingRecords[i] = m_device->newBuffer(
+        capacity * sizeof(shaders_pt::GuidingRecord),
+        MTL::ResourceStorageModeShared);
+    m_guidingRecordCounts[i] =
+        m_device->newBuffer(sizeof(uint32_t), MTL::ResourceStorageModeShared);
+    *static_cast<uint32_t *>(m_guidingRecordCounts[i]->contents()) = 0;
+
+    m_pathtracingResidencySet->addAllocation(m_guidingRecords[i]);
+    m_pathtracingResidencySet->addAllocation(m_guidingRecordCounts[i]);
+  }
+}
+
+void Renderer::trainPathGuide(uint32_t recordBuffer,
+                              MTL::CommandBuffer *inFlight) {
+  auto *count =
+      static_cast<uint32_t *>(m_guidingRecordCounts[recordBuffer]->contents());
+  const auto *records = static_cast<const shaders_pt::GuidingRecord *>(
+      m_guidingRecords[recordBuffer]->contents());
+
+  // A frame sampled before training ended may still have records, drop them
+  if (guidingTraining())
+    m_pathGuide.record(
+        {records, std::min(*count, m_constants.guidingRecordCapacity)});
+  *count = 0;
+  if (!guidingTraining())
+    return;
+
+  /*
+   * Iteration i is 2^i frames long, so iterations end after 2^k - 1 frames.
+   * Refine the tree and upload it for the GPU to sample.
+   */
+  m_guidingFrames++;
+  if ((m_guidingFrames & (m_guidingFrames + 1)) != 0)
+    return;
+
+  m_pathGuide.refine();
+  if (m_pathGuide.spatialNodes().empty())
+    return;
+
+  // The frame in flight samples the current tree, wait before replacing it
+  inFlight->waitUntilCompleted();
+
+  for (auto **buffer : {&m_guidingSpatialNodes, &m_guidingDirectionalNodes}) {
+    if (*buffer != nullptr) {
+      m_pathtracingResidencySet->removeAllocation(*buffer);
+      (*buffer)->release();
+    }
+    *buffer = nullptr;
+  }
+
+  const auto &spatial = m_pathGuide.spatialNodes();
+  const auto &directional = m_pathGuide.directionalNodes();
+  m_guidingSpatialNodes = m_device->newBuffer(
+      spatial.data(), spatial.size() * sizeof(shaders_pt::GuidingSpatialNode),
+      MTL::ResourceStorageModeShared);
+  m_guidingDirectionalNodes = m_device->newBuffer(
+      directional.data(),
+      directional.size() * sizeof(shaders_pt::GuidingDirectionalNode),
+      MTL::ResourceStorageModeShared);
+
+  m_pathtracingResidencySet->addAllocation(m_guidingSpatialNodes);
+  m_pathtracingResidencySet->addAllocation(m_guidingDirectionalNodes);
+  m_pathtracingResidencySet->commit();
+
+  auto arguments =
+      static_cast<shaders_pt::Arguments *>(m_argumentBuffer->contents());
+  arguments->guidingSpatial = m_guidingSpatialNodes->gpuAddress();
+  arguments->guidingDirectional = m_guidingDirectionalNodes->gpuAddress();
+}
+
 void Renderer::rebuildLightData() {
   /*
    * Release light data buffers, if they exist
    */
-  if (m_lightDataBuffer != nullptr)
-    m_lightDataBuffer->release();
-  if (m_envLightDataBuffer != nullptr)
-    m_envLightDataBuffer->release();
+  for (auto **buffer :
+       {&m_lightDataBuffer, &m_lightTreeBuffer, &m_lightIndicesBuffer,
+        &m_instanceLightOffsetsBuffer, &m_envLightDataBuffer}) {
+    if (*buffer != nullptr)
+      (*buffer)->release();
+    *buffer = nullptr;
+  }
 
   /*
-   * Iterate all instances, finding the ones with emissive materials.
-   * For each instance with emissive materials, iterate its primitives. Any
-   * primitives that use an emissive material get added as lights.
+   * Find the emissive material slots of every instance. Triangle lists for
+   * each (mesh, slot, emission texture) combination come from the emitter
+   * cache, so we only look at materials here and never at individual triangles.
    */
-  std::vector<shaders_pt::AreaLight> lights;
-  ankerl::unordered_dense::set<Scene::AssetID> instanceEmissiveMaterials;
-  uint32_t instanceIdx = 0;
-  m_lightTotalPower = 0.0f;
-  for (const auto &instance : m_store.scene().getInstances()) {
-    instanceEmissiveMaterials.clear();
-    for (auto materialId : *instance.node.materialIds().value()) {
-      Material *material = nullptr;
-      if (materialId)
-        material = m_store.scene().getAsset<Material>(materialId.value());
+  struct EmissiveSlot {
+    EmitterCache::Key key;
+    float3 emission; // Material emission times strength, before the texture
+  };
 
-      if (material != nullptr && material->isEmissive()) {
-        instanceEmissiveMaterials.insert(materialId.value());
-      }
+  struct EmissiveInstance {
+    uint32_t instanceIdx;
+    float4x4 transform;
+    const uint32_t *indices;
+    std::vector<EmissiveSlot> slots;
+    size_t primitiveCount;
+    size_t lightOffset = 0, primitiveOffset = 0;
+  };
+
+  const auto instances = m_store.scene().getInstances();
+  const auto idt = color::transform(color::BT709, m_workingSpace);
+
+  std::vector<EmissiveInstance> emissiveInstances;
+  std::vector<EmitterCache::Key> keys;
+  for (uint32_t instanceIdx = 0; instanceIdx < instances.size();
+       instanceIdx++) {
+    const auto &instance = instances[instanceIdx];
+
+    // A singular transform flattens every triangle, nothing to sample
+    if (simd_determinant(instance.transformMatrix) == 0.0f)
+      continue;
+
+    EmissiveInstance emissive{
+        .instanceIdx = instanceIdx,
+        .transform = instance.transformMatrix,
+        .indices = (uint32_t *)instance.mesh.asset->indices()->contents(),
+        .primitiveCount = instance.mesh.asset->indexCount() / 3,
+    };
+
+    const auto &materialIds = *instance.node.materialIds().value();
+    for (uint32_t slot = 0; slot < materialIds.size(); slot++) {
+      Material *material = nullptr;
+      if (materialIds[slot])
+        material = m_store.scene().getAsset<Material>(materialIds[slot].value());
+
+      if (material == nullptr || !material->isEmissive())
+        continue;
+
+      // Black emitters can't be sampled, leave them to MIS
+      const auto emission = material->emission * material->emissionStrength;
+      if (!(reduce_max(emission) > 0.0f))
+        continue;
+
+      const EmitterCache::Key key{
+          instance.mesh.id,
+          slot,
+          material->getTexture(Material::TextureSlot::Emission)
+              .value_or(EmitterCache::noTexture),
+      };
+      emissive.slots.push_back({key, emission});
+      keys.push_back(key);
     }
 
-    if (!instanceEmissiveMaterials.empty()) {
-      auto materialIndices =
-          (uint32_t *)instance.mesh.asset->materialIndices()->contents();
-      auto indices = (uint32_t *)instance.mesh.asset->indices()->contents();
-      auto vertices =
-          (float3 *)instance.mesh.asset->vertexPositions()->contents();
-
-      auto triangleCount = instance.mesh.asset->indexCount() / 3;
-      for (int i = 0; i < triangleCount; i++) {
-        auto material = instance.node.material(materialIndices[i]).value();
-        if (instanceEmissiveMaterials.contains(material.id)) {
-          // Transform the primitive vertices: this ensures the right area is
-          // calculated if the instance is scaled
-          const auto v0 = (instance.transformMatrix *
-                           make_float4(vertices[indices[i * 3 + 0]], 1.0f))
-                              .xyz;
-          const auto v1 = (instance.transformMatrix *
-                           make_float4(vertices[indices[i * 3 + 1]], 1.0f))
-                              .xyz;
-          const auto v2 = (instance.transformMatrix *
-                           make_float4(vertices[indices[i * 3 + 2]], 1.0f))
-                              .xyz;
-
-          const auto edge1 = v1 - v0;
-          const auto edge2 = v2 - v0;
-          const auto area = length(cross(edge1, edge2)) * 0.5f;
-
-          const auto emission = color::transform(color::BT709, m_workingSpace) *
-                                material.asset->emission *
-                                material.asset->emissionStrength;
-          const auto lightPower =
-              dot(emission, float3{0, 1, 0}) * area * std::numbers::pi_v<float>;
-          m_lightTotalPower += lightPower;
-
-          lights.push_back({
-              .instanceIdx = instanceIdx,
-              .indices = {indices[i * 3 + 0], indices[i * 3 + 1],
-                          indices[i * 3 + 2]},
-              .area = area,
-              .power = lightPower,
-              .cumulativePower = m_lightTotalPower,
-              .emission = emission,
-          });
-        }
+    if (!emissive.slots.empty())
+      emissiveInstances.push_back(std::move(emissive));
+  }
+
+  m_emitterCache.update(m_store.scene(), keys);
+
+  /*
+   * Assign each emissive instance a range in the light list, and a range in
+   * the per-primitive light index list so emitter hits can find the light they
+   * belong to for MIS.
+   */
+  size_t lightCount = 0, primitiveCount = 0;
+  std::vector<uint32_t> instanceLightOffsets(instances.size(),
+                                             LightTree::noLight);
+  for (auto &emissive : emissiveInstances) {
+    emissive.lightOffset = lightCount;
+    emissive.primitiveOffset = primitiveCount;
+    instanceLightOffsets[emissive.instanceIdx] = uint32_t(primitiveCount);
+
+    for (const auto &slot : emissive.slots)
+      lightCount += m_emitterCache.get(slot.key).size();
+    primitiveCount += emissive.primitiveCount;
+  }
+
+  std::vector<shaders_pt::AreaLight> lights(lightCount);
+  std::vector<LightBounds> lightBounds(lightCount);
+  std::vector<uint32_t> lightIndices(primitiveCount, LightTree::noLight);
+
+  /*
+   * Transform the cached triangles to world space, in parallel across
+   * instances. Transforming the vertices ensures the right area is calculated
+   * if the instance is scaled.
+   * Textured emitters are weighted by the average of the texture over each
+   * triangle, so the light tree picks bright texels more often.
+   */
+  utils::parallelFor(emissiveInstances.size(), [&](size_t i) {
+    const auto &emissive = emissiveInstances[i];
+
+    size_t lightIdx = emissive.lightOffset;
+    for (const auto &slot : emissive.slots) {
+      const auto &triangles = m_emitterCache.get(slot.key);
+      const bool textured = !triangles.textureAverages.empty();
+
+      for (size_t t = 0; t < triangles.size(); t++, lightIdx++) {
+        const float3 emission =
+            idt * (textured ? slot.emission * triangles.textureAverages[t]
+                            : slot.emission);
+        // Lights that end up with no power are never picked by the tree
+        const float radiance = std::max(dot(emission, float3{0, 1, 0}), 0.0f);
+
+        float3 v[3];
+        for (int j = 0; j < 3; j++)
+          v[j] = (emissive.transform *
+                  make_float4(triangles.vertices[t * 3 + j], 1.0f))
+                     .xyz;
+
+        const auto area = length(cross(v[1] - v[0], v[2] - v[0])) * 0.5f;
+        const auto lightPower = radiance * area * std::numbers::pi_v<float>;
+
+        const uint32_t primitiveIdx = triangles.primitives[t];
+        const uint32_t *indices = emissive.indices + primitiveIdx * 3;
+        lights[lightIdx] = {
+            .instanceIdx = emissive.instanceIdx,
+            .indices = {indices[0], indices[1], indices[2]},
+            .area = area,
+            .power = lightPower,
+            .primitiveIdx = primitiveIdx,
+            .emission = emission,
+        };
+        lightBounds[lightIdx] =
+            LightBounds::triangle(v[0], v[1], v[2], lightPower);
+        lightIndices[emissive.primitiveOffset + primitiveIdx] =
+            uint32_t(lightIdx);
       }
     }
-    instanceIdx++;
-  }
+  });
 
   m_lightCount = (uint32_t)lights.size();
 
   /*
-   * Create and fill the lights buffer
+   * Build the light tree, and link each light to its leaf so we can compute
+   * the probability of sampling it
    */
-  size_t lightBufSize = sizeof(shaders_pt::AreaLight) * lights.size();
-  if (lightBufSize) {
-    m_lightDataBuffer =
-        m_device->newBuffer(lightBufSize, MTL::ResourceStorageModeShared);
-    memcpy(m_lightDataBuffer->contents(), lights.data(), lightBufSize);
-    if (m_lightDataBuffer)
-      m_pathtracingResidencySet->addAllocation(m_lightDataBuffer);
-  }
+  LightTree lightTree(lightBounds);
+  for (size_t i = 0; i < lights.size(); i++)
+    lights[i].treeNode = lightTree.leaves()[i];
+
+  /*
+   * Create and fill the light buffers
+   */
+  auto makeBuffer = [&](const void *data, size_t size) -> MTL::Buffer * {
+    if (size == 0)
+      return nullptr;
+
+    auto *buffer = m_device->newBuffer(size, MTL::ResourceStorageModeShared);
+    memcpy(buffer->contents(), data, size);
+    m_pathtracingResidencySet->addAllocation(buffer);
+    return buffer;
+  };
+
+  m_lightDataBuffer = makeBuffer(
+      lights.data(), sizeof(shaders_pt::AreaLight) * lights.size());
+  m_lightTreeBuffer = makeBuffer(lightTree.nodes().data(),
+                                 sizeof(shaders_pt::LightTreeNode) *
+                                     lightTree.nodes().size());
+  m_lightIndicesBuffer = makeBuffer(lightIndices.data(),
+                                    sizeof(uint32_t) * lightIndices.size());
+  m_instanceLightOffsetsBuffer =
+      makeBuffer(instanceLightOffsets.data(),
+                 sizeof(uint32_t) * instanceLightOffsets.size());
 
   /*
    * Load environment lights into the argument buffer.
@@ -934,18 +1752,23 @@ void Renderer::rebuildLightData() {
    * this to support more
    */
   std::vector<shaders_pt::EnvironmentLight> envLights;
-  m_envLightAliasTables.clear();
+  m_envLightSamplingData.clear();
 
   const auto &envmap = m_store.scene().envmap();
   if (envmap.textureId()) {
+    MTL::Buffer *samplingData = envmap.samplingData();
+    const bool cdf = envmap.samplingMode() == EnvironmentSampling_Cdf;
+
     envLights.push_back({
         .textureIdx = uint32_t(m_textureIndices.at(envmap.textureId().value())),
-        .alias = envmap.aliasTable()->gpuAddress(),
+        .sampling = uint32_t(envmap.samplingMode()),
+        .cdfSize = envmap.cdfSize(),
+        .alias = cdf ? 0 : samplingData->gpuAddress(),
+        .cdf = cdf ? samplingData->gpuAddress() : 0,
     });
 
-    MTL::Buffer *aliasTable = envmap.aliasTable();
-    m_envLightAliasTables.push_back(aliasTable);
-    m_pathtracingResidencySet->addAllocation(aliasTable);
+    m_envLightSamplingData.push_back(samplingData);
+    m_pathtracingResidencySet->addAllocation(samplingData);
   }
 
   m_envLightCount = (uint32_t)envLights.size();
@@ -953,13 +1776,9 @@ void Renderer::rebuildLightData() {
   /*
    * Create and fill the lights buffer
    */
-  size_t envLightBufSize =
-      sizeof(shaders_pt::EnvironmentLight) * envLights.size();
   m_envLightDataBuffer =
-      m_device->newBuffer(envLightBufSize, MTL::ResourceStorageModeShared);
-  memcpy(m_envLightDataBuffer->contents(), envLights.data(), envLightBufSize);
-  if (m_envLightDataBuffer)
-    m_pathtracingResidencySet->addAllocation(m_envLightDataBuffer);
+      makeBuffer(envLights.data(),
+                 sizeof(shaders_pt::EnvironmentLight) * envLights.size());
 }
 
 void Renderer::updateConstants(Scene::NodeID cameraNodeId, int flags) {
@@ -989,7 +1808,7 @@ void Renderer::updateConstants(Scene::NodeID cameraNodeId, int flags) {
 
   m_constants = {
       .frameIdx = 0,
-      .spp = uint32_t(m_accumulationFrames),
+      .spp = uint32_t(m_sampleTotal),
       .gmonBuckets =
           (m_flags & shaders_pt::RendererFlags_GMoN) ? m_gmonBuckets : 1,
       .lightCount = m_lightCount,
@@ -997,9 +1816,14 @@ void Renderer::updateConstants(Scene::NodeID cameraNodeId, int flags) {
       .lutSizeE = m_lutSizes[0],
       .lutSizeEavg = m_lutSizes[1],
       .flags = flags,
-      .totalLightPower = m_lightTotalPower,
       .size = {(uint32_t)m_currentRenderSize.x,
                (uint32_t)m_currentRenderSize.y},
+      .guidingRecordCapacity =
+          m_guidingRecords[0] != nullptr
+              ? uint32_t(m_guidingRecords[0]->length() /
+                         sizeof(shaders_pt::GuidingRecord))
+              : 0,
+      .guidingBsdfFraction = m_guidingOptions.bsdfFraction,
       .idt = color::transform(
           color::BT709,
           m_workingSpace), // Transform matrix for sRGB -> render space
@@ -1023,6 +1847,10 @@ void Renderer::updateConstants(Scene::NodeID cameraNodeId, int flags) {
 int Renderer::status() const {
   if (m_renderTarget != nullptr && m_accumulatedFrames < m_accumulationFrames)
     return Status_Busy;
+  if (m_pendingFrame.cmd != nullptr)
+    return Status_Busy;
+  if (m_renderTarget != nullptr && tiled() && m_tilesDone < tileCount())
+    return Status_Busy;
 
   int status = Status_Ready;
   if (m_renderTarget != nullptr)
@@ -1031,7 +1859,8 @@ int Renderer::status() const {
 }
 
 std::pair<size_t, size_t> Renderer::renderProgress() const {
-  return {m_accumulatedFrames, m_accumulationFrames};
+  return {m_tileIdx * m_accumulationFrames + m_accumulatedFrames,
+          tileCount() * m_accumulationFrames};
 }
 
 size_t Renderer::renderTime() const { return m_timer; }
@@ -1058,6 +1887,230 @@ NS::SharedPtr<MTL::Buffer> Renderer::readbackRenderTarget(uint2 *size) const {
   return NS::TransferPtr(readbackBuffer);
 }
 
+PartialRender Renderer::readbackPartialRender() const {
+  const auto accumulators = bucketAccumulators();
+
+  PartialRender partial{
+      .size = {(uint32_t)m_currentRenderSize.x,
+               (uint32_t)m_currentRenderSize.y},
+      .sampleTotal = uint32_t(m_sampleTotal),
+      .sampleStart = uint32_t(m_sampleStart),
+      .sampleCount = uint32_t(m_accumulatedFrames),
+      .buckets = uint32_t(accumulators.size()),
+      .flags = m_renderFlags,
+      .bucketSamples = m_bucketSamples,
+  };
+
+  /*
+   * Copy every accumulator into a single readback buffer
+   */
+  const auto bytesPerRow = sizeof(float4) * partial.size.x;
+  const auto bytesPerImage = bytesPerRow * partial.size.y;
+
+  auto cmd = m_commandQueue->commandBuffer();
+  auto benc = cmd->blitCommandEncoder();
+
+  const auto readbackBuffer = NS::TransferPtr(m_device->newBuffer(
+      bytesPerImage * accumulators.size(), MTL::ResourceStorageModeShared));
+  for (size_t i = 0; i < accumulators.size(); i++) {
+    benc->copyFromTexture(accumulators[i], 0, 0, MTL::Origin(0, 0, 0),
+                          MTL::Size(partial.size.x, partial.size.y, 1),
+                          readbackBuffer.get(), i * bytesPerImage, bytesPerRow,
+                          bytesPerImage);
+  }
+  benc->endEncoding();
+  cmd->commit();
+  cmd->waitUntilCompleted();
+
+  /*
+   * Accumulators hold the running average, multiply by the bucket sample
+   * count to get mergeable sums
+   */
+  const auto *means = (float4 *)readbackBuffer->contents();
+  const size_t pixelCount = partial.pixelCount();
+  partial.sums.resize(pixelCount * accumulators.size());
+  for (size_t bucket = 0; bucket < accumulators.size(); bucket++) {
+    const float count = float(partial.bucketSamples[bucket]);
+    for (size_t i = 0; i < pixelCount; i++) {
+      const size_t idx = bucket * pixelCount + i;
+      partial.sums[idx] = means[idx] * count;
+    }
+  }
+
+  return partial;
+}
+
+bool Renderer::loadPartialRender(const PartialRender &partial) {
+  if (!partial.valid()) {
+    std::println(stderr, "[Error] renderer_pt: Cannot load an invalid partial "
+                         "render");
+    return false;
+  }
+
+  // Drop the frame in flight, if any, it belongs to the render being replaced
+  if (m_pendingFrame.cmd != nullptr) {
+    m_pendingFrame.cmd->waitUntilCompleted();
+    m_pendingFrame.cmd->release();
+  }
+  m_pendingFrame = {};
+
+  m_currentRenderSize = {float(partial.size.x), float(partial.size.y)};
+  m_aspect = m_currentRenderSize.x / m_currentRenderSize.y;
+
+  /*
+   * A loaded partial is only resolved, never sampled, so GMoN is the only
+   * flag that applies. The rest describe how it was sampled, and would point
+   * render() at buffers that weren't built for it. They're kept for readback.
+   */
+  m_flags = partial.flags & shaders_pt::RendererFlags_GMoN;
+  m_renderFlags = partial.flags;
+  m_gmonBuckets = partial.buckets;
+  m_bucketSamples = partial.bucketSamples;
+  m_sampleTotal = partial.sampleTotal;
+  m_sampleStart = partial.sampleStart;
+  m_accumulationFrames = m_accumulatedFrames = partial.sampleCount;
+  m_tileSize = m_tileApron = 0;
+  m_tileCount = {1, 1};
+  m_tileIdx = m_tilesDone = 0;
+
+  /*
+   * Rebuild render targets at the partial render size
+   */
+  m_gmonResidencySet->removeAllAllocations();
+  rebuildRenderTargets();
+  rebuildGmonAccumulatorBuffer();
+  m_gmonResidencySet->commit();
+  updateThreadgroups();
+  setPostProcessTile(0);
+
+  /*
+   * Upload the averaged buckets to the accumulators. The post process
+   * pipeline (and GMoN, if enabled) then runs as usual in render().
+   */
+  const auto accumulators = bucketAccumulators();
+  const size_t pixelCount = partial.pixelCount();
+  std::vector<float4> means(pixelCount);
+  for (size_t bucket = 0; bucket < accumulators.size(); bucket++) {
+    const uint32_t count = partial.bucketSamples[bucket];
+    const float invCount = count > 0 ? 1.0f / float(count) : 0.0f;
+    for (size_t i = 0; i < pixelCount; i++)
+      means[i] = partial.sums[bucket * pixelCount + i] * invCount;
+
+    auto region = MTL::Region(0, 0, 0, partial.size.x, partial.size.y, 1);
+    accumulators[bucket]->replaceRegion(region, 0, means.data(),
+                                        sizeof(float4) * partial.size.x);
+  }
+
+  m_timer = 0;
+  m_startRender = false;
+  return true;
+}
+
+void Renderer::updateThreadgroups() {
+  /*
+   * Calculate threadgroup size and count
+   */
+  const auto size = accumulatorSize();
+  m_threadsPerThreadgroup = MTL::Size(8, 8, 1);
+  m_threadgroups = MTL::Size((size.x + m_threadsPerThreadgroup.width - 1) /
+                                 m_threadsPerThreadgroup.width,
+                             (size.y + m_threadsPerThreadgroup.height - 1) /
+                                 m_threadsPerThreadgroup.height,
+                             1);
+}
+
+void Renderer::beginTile(uint32_t tileIdx) {
+  m_tileIdx = tileIdx;
+  m_accumulatedFrames = 0;
+  std::ranges::fill(m_bucketSamples, 0);
+
+  auto arguments =
+      static_cast<shaders_pt::Arguments *>(m_argumentBuffer->contents());
+  arguments->constants.tileOrigin = tileOrigin(tileIdx);
+
+  setPostProcessTile(tileIdx);
+}
+
+void Renderer::setPostProcessTile(uint32_t tileIdx) {
+  postprocess::TileInfo tileInfo{.imageSize = m_currentRenderSize};
+
+  if (tiled()) {
+    const int2 origin = tileOrigin(tileIdx);
+    const auto size = accumulatorSize();
+
+    tileInfo.offset = float2{float(origin.x), float(origin.y)} /
+                      m_currentRenderSize;
+    tileInfo.scale = float2{float(size.x), float(size.y)} / m_currentRenderSize;
+  }
+
+  for (auto &pass : m_postProcessPasses)
+    pass->setTile(tileInfo);
+  m_tonemapPass->setTile(tileInfo);
+}
+
+uint32_t Renderer::tileApron() const {
+  /*
+   * Chromatic aberration is the only pass sampling other pixels. It scales
+   * image UVs around the center, in a space where the long side of the image
+   * spans [0, 1], so the largest offset is at the corners. The apron is sized
+   * for the options set when the render starts.
+   */
+  for (const auto &pass : m_postProcessPasses) {
+    auto options = pass->options();
+    if (options.type != postprocess::PostProcessPass::Type::ChromaticAberration)
+      continue;
+
+    const auto &ca = *options.chromaticAberration;
+    const float amount = std::abs(ca.amount) * 0.005f * 0.01f *
+                         std::max(1.0f, std::abs(ca.greenShift) * 0.01f);
+    const float maxDim = std::max(m_currentRenderSize.x, m_currentRenderSize.y);
+    const float maxRadius = 0.7072f;
+
+    // Add a couple pixels for bilinear filtering
+    return uint32_t(std::ceil(amount * maxRadius * maxDim)) + 2;
+  }
+
+  return 0;
+}
+
+int2 Renderer::tileOrigin(uint32_t tileIdx) const {
+  if (!tiled())
+    return {0, 0};
+
+  const int x = int((tileIdx % m_tileCount.x) * m_tileSize);
+  const int y = int((tileIdx / m_tileCount.x) * m_tileSize);
+  return int2{x, y} - int(m_tileApron);
+}
+
+uint2 Renderer::accumulatorSize() const {
+  if (tiled())
+    return uint2{m_tileSize, m_tileSize} + 2 * m_tileApron;
+  return {(uint32_t)m_currentRenderSize.x, (uint32_t)m_currentRenderSize.y};
+}
+
+std::vector<MTL::IntersectionFunctionTable *>
+Renderer::activeIntersectionFunctionTables() const {
+  if (wavefront())
+    return {m_wavefrontIfts[WavefrontStage_Extend],
+            m_wavefrontIfts[WavefrontStage_Shadow]};
+
+  if (restir())
+    return {m_intersectionFunctionTables[m_selectedPipeline], m_restirIft};
+
+  return {m_intersectionFunctionTables[m_selectedPipeline]};
+}
+
+uint32_t Renderer::samplesPerBucket() const {
+  const auto buckets = std::max(m_gmonBuckets, 1u);
+  return std::max(uint32_t((m_sampleTotal + buckets - 1) / buckets), 1u);
+}
+
+std::vector<MTL::Texture *> Renderer::bucketAccumulators() const {
+  if (m_flags & shaders_pt::RendererFlags_GMoN)
+    return m_gmonAccumulators;
+  return {m_accumulator};
+}
+
 Material *Renderer::getMaterialOrDefault(std::optional<Scene::AssetID> id) {
   Material *material = nullptr;
   if (id)
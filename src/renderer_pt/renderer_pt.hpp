@@ -8,6 +8,12 @@
 #include <core/postprocessing.hpp>
 
 #include "pt_shader_defs.hpp"
+#include "partial_render.hpp"
+#include "ggx_luts.hpp"
+#include "light_tree.hpp"
+#include "emitter_cache.hpp"
+#include "opacity_cache.hpp"
+#include "path_guide.hpp"
 
 namespace pt::renderer_pt {
 
@@ -16,6 +22,7 @@ public:
   enum class Integrators {
     Simple = 0,
     MIS,
+    Wavefront,
   };
 
   enum Status {
@@ -25,6 +32,16 @@ public:
     Status_Done = 1 << 3,
   };
 
+  /*
+   * Range of the sample sequence to render. Used to split a render across
+   * multiple nodes, each rendering a disjoint range. A count of zero renders
+   * all remaining samples.
+   */
+  struct SampleRange {
+    uint32_t start = 0;
+    uint32_t count = 0;
+  };
+
   Renderer(
     MTL::Device* device,
     MTL::CommandQueue* commandQueue,
@@ -41,7 +58,9 @@ public:
     uint32_t sampleCount,
     uint32_t gmonBuckets,
     const color::Colorspace& workingSpace,
-    int flags = 0
+    int flags = 0,
+    SampleRange sampleRange = {},
+    uint32_t tileSize = 0
   );
 
   [[nodiscard]] constexpr uint32_t selectedKernel() const {
@@ -56,8 +75,18 @@ public:
 
   [[nodiscard]] NS::SharedPtr<MTL::Buffer> readbackRenderTarget(uint2* size) const;
 
+  [[nodiscard]] PartialRender readbackPartialRender() const;
+
+  bool loadPartialRender(const PartialRender& partial);
+
+  [[nodiscard]] constexpr const GgxLuts& ggxLuts() const {
+    return m_ggxLuts;
+  }
+
   [[nodiscard]] int status() const;
 
+  [[nodiscard]] constexpr bool tiled() const { return m_tileSize > 0; }
+
   [[nodiscard]] std::pair<size_t, size_t> renderProgress() const;
 
   [[nodiscard]] size_t renderTime() const;
@@ -70,6 +99,8 @@ public:
 
   [[nodiscard]] constexpr shaders_pt::GmonOptions& gmonOptions() { return m_gmonOptions; }
 
+  [[nodiscard]] constexpr shaders_pt::GuidingOptions& guidingOptions() { return m_guidingOptions; }
+
   color::Colorspace& outputColorspace();
 
 private:
@@ -99,12 +130,115 @@ private:
   std::vector<MTL::ComputePipelineState*> m_pathtracingPipelines;
   std::vector<MTL::IntersectionFunctionTable*> m_intersectionFunctionTables;
 
+  /*
+   * Wavefront integrator state
+   */
+  enum WavefrontStage {
+    WavefrontStage_Generate = 0,
+    WavefrontStage_PrepareExtend,
+    WavefrontStage_Extend,
+    WavefrontStage_PrepareShade,
+    WavefrontStage_Sort,
+    WavefrontStage_Shade,
+    WavefrontStage_PrepareShadow,
+    WavefrontStage_Shadow,
+    WavefrontStage_Accumulate,
+    WavefrontStage_Count,
+  };
+  constexpr static const std::array<std::string, WavefrontStage_Count> m_wavefrontFunctions = {
+    "wavefrontGenerate",
+    "wavefrontPrepareExtend",
+    "wavefrontExtend",
+    "wavefrontPrepareShade",
+    "wavefrontSort",
+    "wavefrontShade",
+    "wavefrontPrepareShadow",
+    "wavefrontShadow",
+    "wavefrontAccumulate",
+  };
+  static constexpr uint32_t m_wavefrontMaxBounces = 50; // Same as MAX_BOUNCES in the megakernels
+  std::array<MTL::ComputePipelineState*, WavefrontStage_Count> m_wavefrontPipelines = {};
+  std::array<MTL::IntersectionFunctionTable*, WavefrontStage_Count> m_wavefrontIfts = {}; // Only for stages that trace rays
+
+  MTL::Buffer* m_wavefrontPaths = nullptr;
+  MTL::Buffer* m_wavefrontHits = nullptr;
+  MTL::Buffer* m_wavefrontShadowRays = nullptr;
+  MTL::Buffer* m_wavefrontCounters = nullptr;
+  std::array<MTL::Buffer*, 3> m_wavefrontQueues = {}; // Two ping-ponged path queues, sorted hit queue
+
+  /*
+   * ReSTIR direct lighting state, used with the MIS integrator
+   */
+  enum RestirStage {
+    RestirStage_Initial = 0,
+    RestirStage_Spatial,
+    RestirStage_Count,
+  };
+  constexpr static const std::array<std::string, RestirStage_Count> m_restirFunctions = {
+    "restirInitial",
+    "restirSpatial",
+  };
+  std::array<MTL::ComputePipelineState*, RestirStage_Count> m_restirPipelines = {};
+  MTL::IntersectionFunctionTable* m_restirIft = nullptr; // Initial stage traces primary rays
+
+  MTL::Buffer* m_restirReservoirs = nullptr;
+  MTL::Buffer* m_restirSurfaces = nullptr;
+
+  /*
+   * Path guiding state, used with the MIS integrator. Training frames run
+   * before the render's own frames and write radiance records, which are read
+   * back into the SD-tree while the next frame runs.
+   */
+  static constexpr uint32_t m_guidingMaxRecords = 1 << 21;
+  PathGuide m_pathGuide;
+  shaders_pt::GuidingOptions m_guidingOptions;
+  uint32_t m_guidingFrames = 0;        // Frames recorded into the SD-tree so far
+  uint32_t m_guidingSampledFrames = 0; // Training frames sampled so far
+
+  std::array<MTL::Buffer*, 2> m_guidingRecords = {}; // Alternate between training frames
+  std::array<MTL::Buffer*, 2> m_guidingRecordCounts = {};
+  MTL::Buffer* m_guidingSpatialNodes = nullptr;
+  MTL::Buffer* m_guidingDirectionalNodes = nullptr;
+
+  /*
+   * The last sampled frame, while it has path guiding records or tile requests
+   * to read back. The next frame waits for it to complete before starting,
+   * and trains the path guide on its records once it's committed itself.
+   */
+  struct PendingFrame {
+    MTL::CommandBuffer* cmd = nullptr;
+    uint32_t bucket = 0;
+    uint32_t records = 0; // Path guiding record buffer
+    bool training = false;
+    bool streamed = false;
+  };
+  PendingFrame m_pendingFrame;
+
+  /*
+   * Texture streaming. Tiles requested by a frame are paged in before the next
+   * one. A frame that fell back to coarser levels is shown, then undone and
+   * sampled again once its tiles are resident, so the render doesn't depend on
+   * what was resident when. Undoing a frame restores a copy of its accumulator
+   * and ReSTIR history taken before it.
+   */
+  MTL::Texture* m_accumulatorSnapshot = nullptr;
+  MTL::Buffer* m_restirSnapshot = nullptr;
+  bool m_streamingOverBudget = false;
+
   // Render targets
   MTL::Texture* m_accumulator = nullptr;
   MTL::Texture* m_renderTarget = nullptr;
 
+  // Tiled rendering. Accumulators and post process buffers are tile sized, and
+  // each tile is resolved into m_tileTarget, then copied into m_renderTarget.
+  uint32_t m_tileSize = 0, m_tileApron = 0;
+  uint2 m_tileCount = {1, 1};
+  uint32_t m_tileIdx = 0, m_tilesDone = 0;
+  MTL::Texture* m_tileTarget = nullptr;
+
   // GMoN
   uint32_t m_gmonBuckets = 0;
+  std::vector<uint32_t> m_bucketSamples;
   std::vector<MTL::Texture*> m_gmonAccumulators;
   MTL::ComputePipelineState* m_gmonPipeline = nullptr;
   MTL::Buffer* m_gmonAccumulatorBuffer = nullptr;
@@ -117,12 +251,15 @@ private:
 
   // Light data
   uint32_t m_lightCount = 0;
-  float m_lightTotalPower = 0.0f;
   MTL::Buffer* m_lightDataBuffer = nullptr;
+  MTL::Buffer* m_lightTreeBuffer = nullptr;
+  MTL::Buffer* m_lightIndicesBuffer = nullptr;
+  MTL::Buffer* m_instanceLightOffsetsBuffer = nullptr;
+  EmitterCache m_emitterCache;
 
   uint32_t m_envLightCount = 0;
   MTL::Buffer* m_envLightDataBuffer = nullptr;
-  std::vector<const MTL::Buffer*> m_envLightAliasTables;
+  std::vector<const MTL::Buffer*> m_envLightSamplingData;
 
   // Constants and resources
   shaders_pt::Constants m_constants = {};
@@ -140,40 +277,27 @@ private:
 
   MTL::Buffer* m_instanceResourcesBuffer = nullptr;
   std::vector<MTL::Buffer*> m_instanceMaterialBuffers;
+  OpacityCache m_opacityCache;
 
   ankerl::unordered_dense::map<Scene::AssetID, size_t> m_textureIndices;
   MTL::Buffer* m_texturesBuffer = nullptr;
   MTL::Buffer* m_argumentBuffer = nullptr;
 
   // LUT textures
-  struct LUTInfo {
-    const char* filename;
-    MTL::TextureType type;
-    uint32_t depth = 1;
-  };
-  static constexpr std::array<LUTInfo, 8> m_lutInfo = {
-    {
-      {.filename = "ggx_E", .type = MTL::TextureType2D, .depth = 1},
-      {.filename = "ggx_E_avg", .type = MTL::TextureType1D, .depth = 1},
-      {.filename = "ggx_ms_E", .type = MTL::TextureType3D, .depth = 32},
-      {.filename = "ggx_ms_E_avg", .type = MTL::TextureType2D, .depth = 1},
-      {.filename = "ggx_E_trans_in", .type = MTL::TextureType3D, .depth = 32},
-      {.filename = "ggx_E_trans_out", .type = MTL::TextureType3D, .depth = 32},
-      {.filename = "ggx_E_trans_in_avg", .type = MTL::TextureType2D, .depth = 1},
-      {.filename = "ggx_E_trans_out_avg", .type = MTL::TextureType2D, .depth = 1},
-    }
-  };
+  GgxLuts m_ggxLuts;
   std::vector<MTL::Texture*> m_luts;
   std::vector<uint32_t> m_lutSizes;
 
   // Frame data
   static constexpr const size_t m_maxFramesInFlight = 3;
   size_t m_frameIdx = 0, m_accumulationFrames = 128, m_accumulatedFrames = 0;
+  size_t m_sampleTotal = 128, m_sampleStart = 0;
   size_t m_timer = 0;
   std::chrono::time_point<std::chrono::high_resolution_clock> m_renderStart;
   bool m_startRender = false;
   Scene::NodeID m_cameraNodeId = Scene::null;
   int m_flags = 0;
+  int m_renderFlags = 0; // Flags the accumulators were sampled with, for partial renders
 
   // Color management
   color::Colorspace m_workingSpace = color::BT2020;
@@ -201,10 +325,43 @@ private:
   void rebuildAccelerationStructures();
   void rebuildArgumentBuffer();
   void rebuildRenderTargets();
+  void rebuildGmonAccumulatorBuffer();
   void rebuildLightData();
   void updateConstants(Scene::NodeID cameraNodeId, int flags);
 
+  void rebuildWavefrontBuffers();
+  void rebuildRestirBuffers();
+  void rebuildGuidingBuffers();
+
+  // Render functions
+  void renderWavefront(MTL::CommandBuffer* cmd, MTL::Texture* accumulator);
+  void resolve(MTL::CommandBuffer* cmd, MTL::Texture* target);
+  void beginTile(uint32_t tileIdx);
+  void setPostProcessTile(uint32_t tileIdx);
+  void trainPathGuide(uint32_t recordBuffer, MTL::CommandBuffer* inFlight);
+  bool finishPendingFrame();
+  void snapshotFrame(MTL::CommandBuffer* cmd, MTL::Texture* accumulator, bool restore);
+  void reportRenderStats() const;
+
   // Utility functions
+  void updateThreadgroups();
+  [[nodiscard]] constexpr bool wavefront() const { return m_selectedPipeline == uint32_t(Integrators::Wavefront); }
+  [[nodiscard]] constexpr bool restir() const {
+    return (m_flags & shaders_pt::RendererFlags_ReSTIR) && m_selectedPipeline == uint32_t(Integrators::MIS);
+  }
+  [[nodiscard]] constexpr bool guiding() const {
+    return (m_flags & shaders_pt::RendererFlags_PathGuiding) && m_selectedPipeline == uint32_t(Integrators::MIS);
+  }
+  [[nodiscard]] constexpr bool guidingTraining() const {
+    return guiding() && m_pathGuide.iteration() < m_guidingOptions.trainingIterations;
+  }
+  [[nodiscard]] std::vector<MTL::IntersectionFunctionTable*> activeIntersectionFunctionTables() const;
+  [[nodiscard]] uint32_t tileApron() const;
+  [[nodiscard]] int2 tileOrigin(uint32_t tileIdx) const;
+  [[nodiscard]] uint2 accumulatorSize() const;
+  [[nodiscard]] constexpr uint32_t tileCount() const { return m_tileCount.x * m_tileCount.y; }
+  [[nodiscard]] uint32_t samplesPerBucket() const;
+  [[nodiscard]] std::vector<MTL::Texture*> bucketAccumulators() const;
   Material* getMaterialOrDefault(std::optional<Scene::AssetID> id);
 };
 
@@ -0,0 +1,354 @@
+#include "samplers.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cmath>
+
+namespace pt::renderer_pt::samplers {
+using shaders_pt::haltonPrimes;
+using shaders_pt::zMatrix1stD;
+using shaders_pt::zMatrix2ndD;
+using shaders_pt::zPermutations;
+
+namespace {
+
+/*
+ * Integer hashes are templated so the scalar and SIMD paths share a single
+ * implementation, T is either uint32_t or BatchUint.
+ */
+template <typename T> void pcg4dImpl(T &x, T &y, T &z, T &w) {
+  x = x * 1664525u + 1013904223u;
+  y = y * 1664525u + 1013904223u;
+  z = z * 1664525u + 1013904223u;
+  w = w * 1664525u + 1013904223u;
+
+  x += y * w;
+  y += z * x;
+  z += x * y;
+  w += y * z;
+
+  x ^= x >> 16u;
+  y ^= y >> 16u;
+  z ^= z >> 16u;
+  w ^= w >> 16u;
+
+  x += y * w;
+  y += z * x;
+  z += x * y;
+  w += y * z;
+}
+
+template <typename T> T reverseBits32(T v) {
+  v = (v << 16) | (v >> 16);
+  v = ((v & 0x00ff00ffu) << 8) | ((v & 0xff00ff00u) >> 8);
+  v = ((v & 0x0f0f0f0fu) << 4) | ((v & 0xf0f0f0f0u) >> 4);
+  v = ((v & 0x33333333u) << 2) | ((v & 0xccccccccu) >> 2);
+  v = ((v & 0x55555555u) << 1) | ((v & 0xaaaaaaaau) >> 1);
+  return v;
+}
+
+template <typename T> T scrambleHash(T x) {
+  x = ((x >> 16) ^ x) * 0x45d9f3bu;
+  x = ((x >> 16) ^ x) * 0x45d9f3bu;
+  x = (x >> 16) ^ x;
+  return x;
+}
+
+template <typename T> T scramble(T v, const T &seed) {
+  v = reverseBits32(v);
+  v ^= v * 0x3d20adeau;
+  v += seed;
+  v *= (seed >> 16) | 1u;
+  v ^= v * 0x05526c56u;
+  v ^= v * 0x53a22864u;
+  return reverseBits32(v);
+}
+
+// Z-sampler digit permutation hash, maps to the 0-23 range
+template <typename T> T zHash(T i, const T &d) {
+  constexpr uint32_t mask = (1 << 24) - 1;
+  constexpr uint32_t alpha = 0x9E377A; // Approximates 1 - golden ratio
+
+  i ^= (0x55555555u * d);
+  T x = (i * alpha) & mask; // Fractional part
+  return (x * 24u) >> 24;   // Map to 0-23 range
+}
+
+template <typename T> T sobol(const T &index, const uint32_t *matrix) {
+  T v = T{};
+  for (uint32_t i = 0; i < 32; i++)
+    v ^= matrix[i] & (0u - ((index >> i) & 1u));
+  return v;
+}
+
+/*
+ * Permutation table packed into 2-bit fields, one 48-bit mask per input digit,
+ * so SIMD lookups are shifts instead of gathers.
+ */
+constexpr std::array<uint64_t, 4> packedPermutations = [] {
+  std::array<uint64_t, 4> packed{};
+  for (uint32_t h = 0; h < 24; h++) {
+    for (uint32_t d = 0; d < 4; d++)
+      packed[d] |= uint64_t(zPermutations[h][d]) << (2 * h);
+  }
+  return packed;
+}();
+
+BatchUint permute(const BatchUint &h, uint32_t digit) {
+  const auto lo = uint32_t(packedPermutations[digit]);
+  const auto hi = uint32_t(packedPermutations[digit] >> 32);
+
+  const auto isHi = (BatchUint)(h >= 16u);
+  const auto table = ((BatchUint{} + lo) & ~isHi) | ((BatchUint{} + hi) & isHi);
+  return (table >> ((h & 15u) << 1)) & 3u;
+}
+
+inline BatchUint iota(uint32_t start) {
+  BatchUint result;
+  for (uint32_t i = 0; i < batchWidth; i++)
+    result[i] = start + i;
+  return result;
+}
+
+uint32_t nextPowerOfTwo(uint32_t v) { return std::bit_ceil(v); }
+
+float halton(uint32_t i, uint32_t d) {
+  assert(d < HaltonSampler::maxDimensions);
+  const uint32_t b = haltonPrimes[d];
+
+  // Matches the Metal implementation, see samplers.metal
+  float f = 1.0f;
+  const float invB = 1.0f / float(b);
+
+  float r = 0.0f;
+  while (i > 0) {
+    f = f * invB;
+    r = std::fma(f, float(i % b), r);
+    i = i / b;
+  }
+
+  return std::min(r, oneMinusEpsilon);
+}
+
+} // namespace
+
+uint4 pcg4d(uint4 v) {
+  uint32_t x = v.x, y = v.y, z = v.z, w = v.w;
+  pcg4dImpl(x, y, z, w);
+  return uint4{x, y, z, w};
+}
+
+BatchUint4 pcg4d(const BatchUint4 &v) {
+  auto result = v;
+  pcg4dImpl(result.x, result.y, result.z, result.w);
+  return result;
+}
+
+float fixedPt2Float(uint32_t v) {
+  const float f = float(v) * float(2.3283064365386963e-10);
+  return std::min(f, oneMinusEpsilon);
+}
+
+BatchFloat fixedPt2Float(const BatchUint &v) {
+  const BatchFloat f = simd_float(v) * float(2.3283064365386963e-10);
+  return simd::min(f, BatchFloat{} + oneMinusEpsilon);
+}
+
+void pixelSeeds(uint2 tid, uint32_t sample, std::span<uint32_t> out) {
+  for (size_t i = 0; i < out.size(); i += batchWidth) {
+    const auto x = iota(tid.x + uint32_t(i));
+    const auto seeds = pcg4d({x, BatchUint{} + tid.y, BatchUint{} + sample,
+                              x + tid.y});
+
+    const auto count = std::min(batchWidth, out.size() - i);
+    for (size_t j = 0; j < count; j++)
+      out[i + j] = seeds.x[j];
+  }
+}
+
+/*
+ * Z-sampler
+ */
+ZSampler::ZSampler(uint2 tid, uint2 size, uint32_t spp, uint32_t sample) {
+  uint32_t resolution = nextPowerOfTwo(std::max(size.x, size.y));
+  m_log2Resolution = std::countr_zero(resolution);
+  m_log2spp = spp > 1 ? 32 - std::countl_zero(spp - 1) : 0;
+
+  m_base4Digits = m_log2Resolution + (m_log2spp + 1) / 2;
+
+  m_z = 0;
+
+  // Calculate the "canonical" Morton curve index for the pixel
+  for (uint32_t i = 0; i < m_log2Resolution; i++) {
+    m_z |= ((tid.x >> i) & 1) << (2 * i);
+    m_z |= ((tid.y >> i) & 1) << (2 * i + 1);
+  }
+
+  // Shift back and calculate the full "canonical" index for the sample
+  m_z <<= m_log2spp;
+  m_z |= sample;
+
+  if (m_log2spp & 1) {
+    m_z <<= 1;
+    m_z |= (sample & 1);
+  }
+
+  // Precompute the prefix and digit for every permuted base 4 digit
+  const uint32_t lastDigit = m_log2spp & 1;
+  for (uint32_t j = lastDigit; j < m_base4Digits; j++) {
+    assert(m_digitCount < m_maxDigits);
+
+    const uint32_t shift = 2 * (m_base4Digits - j - 1);
+    const uint32_t x = shift < 32 ? m_z >> shift : 0;
+    m_digits[m_digitCount] = x & 3;
+    m_prefixes[m_digitCount] = x >> 2;
+    m_digitCount++;
+  }
+}
+
+float ZSampler::sample1d() {
+  uint32_t idx = index(m_dim++);
+  return fixedPt2Float(scramble(sobol(idx, zMatrix1stD), scrambleHash(m_dim)));
+}
+
+float2 ZSampler::sample2d() {
+  uint32_t idx = index(m_dim++);
+  const auto seed = scrambleHash(m_dim);
+  return {fixedPt2Float(scramble(sobol(idx, zMatrix1stD), seed)),
+          fixedPt2Float(scramble(sobol(idx, zMatrix2ndD), seed))};
+}
+
+void ZSampler::sample1d(std::span<float> out) {
+  for (size_t i = 0; i < out.size(); i += batchWidth) {
+    const auto dims = iota(m_dim);
+    const auto idx = index(dims);
+
+    // The Metal sampler scrambles using the dimension after incrementing it
+    const auto seeds = scrambleHash(dims + 1u);
+    const auto values = fixedPt2Float(scramble(sobol(idx, zMatrix1stD), seeds));
+
+    const auto count = std::min(batchWidth, out.size() - i);
+    for (size_t j = 0; j < count; j++)
+      out[i + j] = values[j];
+    m_dim += uint32_t(count);
+  }
+}
+
+void ZSampler::sample2d(std::span<float2> out) {
+  for (size_t i = 0; i < out.size(); i += batchWidth) {
+    const auto dims = iota(m_dim);
+    const auto idx = index(dims);
+
+    const auto seeds = scrambleHash(dims + 1u);
+    const auto x = fixedPt2Float(scramble(sobol(idx, zMatrix1stD), seeds));
+    const auto y = fixedPt2Float(scramble(sobol(idx, zMatrix2ndD), seeds));
+
+    const auto count = std::min(batchWidth, out.size() - i);
+    for (size_t j = 0; j < count; j++)
+      out[i + j] = float2{x[j], y[j]};
+    m_dim += uint32_t(count);
+  }
+}
+
+uint32_t ZSampler::index(uint32_t dim) const {
+  uint32_t z_pi = 0; // Permuted index
+
+  for (uint32_t k = 0; k < m_digitCount; k++) {
+    z_pi <<= 2;
+    z_pi |= zPermutations[zHash(m_prefixes[k], dim)][m_digits[k]];
+  }
+
+  if (m_log2spp & 1) {
+    uint32_t digit = m_z & 1;
+    z_pi <<= 1;
+    z_pi |= digit ^ (zHash(m_z >> 1, dim) & 1);
+  }
+
+  return z_pi;
+}
+
+BatchUint ZSampler::index(const BatchUint &dims) const {
+  BatchUint z_pi = BatchUint{};
+
+  for (uint32_t k = 0; k < m_digitCount; k++) {
+    const auto h = zHash(BatchUint{} + m_prefixes[k], dims);
+    z_pi = (z_pi << 2) | permute(h, m_digits[k]);
+  }
+
+  if (m_log2spp & 1) {
+    const uint32_t digit = m_z & 1;
+    const auto h = zHash(BatchUint{} + (m_z >> 1), dims);
+    z_pi = (z_pi << 1) | (digit ^ (h & 1u));
+  }
+
+  return z_pi;
+}
+
+/*
+ * Halton sampler
+ */
+HaltonSampler::HaltonSampler(uint2 tid, uint2 size, uint32_t spp,
+                             uint32_t sample) {
+  m_offset = pcg4d(uint4{tid.x, tid.y, sample, tid.x + tid.y}).x;
+}
+
+float HaltonSampler::sample1d() { return halton(m_offset, m_dim++); }
+
+float2 HaltonSampler::sample2d() {
+  float x = halton(m_offset, m_dim++);
+  float y = halton(m_offset, m_dim++);
+  return {x, y};
+}
+
+void HaltonSampler::sample1d(std::span<float> out) {
+  for (size_t i = 0; i < out.size(); i += batchWidth) {
+    const auto count = std::min(batchWidth, out.size() - i);
+    assert(m_dim + count <= maxDimensions);
+
+    // Lanes past the end of the block reuse the last base
+    BatchUint b;
+    for (uint32_t j = 0; j < batchWidth; j++)
+      b[j] = haltonPrimes[m_dim + std::min(j, uint32_t(count) - 1)];
+
+    /*
+     * Same arithmetic as halton(), one dimension per lane. Lanes that run out
+     * of digits keep iterating, but only add exact zeros.
+     */
+    BatchFloat f = BatchFloat{} + 1.0f;
+    const BatchFloat invB = 1.0f / simd_float(b);
+    BatchFloat r = BatchFloat{};
+    BatchUint idx = BatchUint{} + m_offset;
+    while (simd_any(idx != 0u)) {
+      f = f * invB;
+      r = simd::fma(f, simd_float(idx % b), r);
+      idx = idx / b;
+    }
+    r = simd::min(r, BatchFloat{} + oneMinusEpsilon);
+
+    for (size_t j = 0; j < count; j++)
+      out[i + j] = r[j];
+    m_dim += uint32_t(count);
+  }
+}
+
+/*
+ * PCG4D sampler
+ */
+PCG4DSampler::PCG4DSampler(uint2 tid, uint2 size, uint32_t spp,
+                           uint32_t sample) {
+  const auto seed = pcg4d(uint4{tid.x, tid.y, sample, tid.x + tid.y}).x;
+  m_v = uint4{seed, seed, seed, seed};
+}
+
+float PCG4DSampler::sample1d() {
+  m_v = pcg4d(m_v);
+  return fixedPt2Float(m_v.x);
+}
+
+float2 PCG4DSampler::sample2d() {
+  m_v = pcg4d(m_v);
+  return {fixedPt2Float(m_v.x), fixedPt2Float(m_v.y)};
+}
+
+} // namespace pt::renderer_pt::samplers
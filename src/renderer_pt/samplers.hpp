@@ -0,0 +1,116 @@
+#ifndef PLATINUM_SAMPLERS_HPP
+#define PLATINUM_SAMPLERS_HPP
+
+#include <array>
+#include <span>
+#include <simd/simd.h>
+
+#include "sampler_tables.hpp"
+
+using namespace simd;
+
+/*
+ * CPU implementation of the samplers in shaders/samplers.metal. Every sampler
+ * produces the same sequence as its Metal counterpart, bit for bit, so CPU and
+ * GPU renders with the same seed are directly comparable.
+ * Block functions generate several dimensions (or pixels) at once using simd
+ * library vectors, 8 lanes at a time.
+ */
+namespace pt::renderer_pt::samplers {
+
+using BatchUint = simd_uint8;
+using BatchFloat = simd_float8;
+
+constexpr size_t batchWidth = 8;
+
+struct BatchUint4 {
+  BatchUint x, y, z, w;
+};
+
+constexpr float oneMinusEpsilon = 0x1.fffffep-1;
+
+uint4 pcg4d(uint4 v);
+BatchUint4 pcg4d(const BatchUint4& v);
+
+float fixedPt2Float(uint32_t v);
+BatchFloat fixedPt2Float(const BatchUint& v);
+
+/*
+ * Per-pixel sampler seeds, pcg4d(tid, sample, tid.x + tid.y).x, for a run of
+ * out.size() pixels starting at tid and going right along the row. Used by
+ * the Halton and PCG4D samplers.
+ */
+void pixelSeeds(uint2 tid, uint32_t sample, std::span<uint32_t> out);
+
+class ZSampler {
+public:
+  ZSampler(uint2 tid, uint2 size, uint32_t spp, uint32_t sample);
+
+  float sample1d();
+  float2 sample2d();
+
+  // Equivalent to calling sample1d() out.size() times
+  void sample1d(std::span<float> out);
+
+  // Equivalent to calling sample2d() out.size() times
+  void sample2d(std::span<float2> out);
+
+private:
+  static constexpr uint32_t m_maxDigits = 17;
+
+  uint32_t m_z; // Canonical index of the pixel
+  uint32_t m_base4Digits;
+  uint32_t m_log2spp;
+  uint32_t m_log2Resolution;
+  uint32_t m_dim = 0;
+
+  /*
+   * The Morton prefix and base 4 digit for each permuted digit only depend on
+   * the pixel and sample, so we compute them once instead of every dimension.
+   */
+  std::array<uint32_t, m_maxDigits> m_prefixes{};
+  std::array<uint32_t, m_maxDigits> m_digits{};
+  uint32_t m_digitCount = 0;
+
+  [[nodiscard]] uint32_t index(uint32_t dim) const;
+  [[nodiscard]] BatchUint index(const BatchUint& dims) const;
+};
+
+class HaltonSampler {
+public:
+  HaltonSampler(uint2 tid, uint2 size, uint32_t spp, uint32_t sample);
+
+  // Resume from a saved state
+  HaltonSampler(uint32_t offset, uint32_t dim) : m_offset(offset), m_dim(dim) {}
+
+  float sample1d();
+  float2 sample2d();
+
+  // Equivalent to calling sample1d() out.size() times
+  void sample1d(std::span<float> out);
+
+  [[nodiscard]] constexpr uint32_t offset() const { return m_offset; }
+  [[nodiscard]] constexpr uint32_t dimension() const { return m_dim; }
+
+  // Number of dimensions before the sequence runs out of bases
+  static constexpr uint32_t maxDimensions = std::size(shaders_pt::haltonPrimes);
+
+private:
+  uint32_t m_offset;
+  uint32_t m_dim = 0;
+};
+
+class PCG4DSampler {
+public:
+  PCG4DSampler(uint2 tid, uint2 size, uint32_t spp, uint32_t sample);
+
+  float sample1d();
+  float2 sample2d();
+
+private:
+  uint4 m_v;
+};
+
+}
+
+#endif //PLATINUM_SAMPLERS_HPP
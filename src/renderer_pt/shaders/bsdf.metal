@@ -10,7 +10,8 @@ using namespace metal;
  */
 namespace bsdf {
 ShadingContext::ShadingContext(device const MaterialGPU &mat, float2 uv,
-                               float3x3 idt, device Texture *textures) {
+                               float3x3 idt, device Texture *textures,
+                               float lod) {
   albedo = mat.baseColor.rgb;
   emission = mat.emission;
   roughness = mat.roughness;
@@ -22,17 +23,21 @@ ShadingContext::ShadingContext(device const MaterialGPU &mat, float2 uv,
   ior = mat.ior;
   flags = mat.flags;
 
-  constexpr sampler s(address::repeat, filter::linear);
+  constexpr sampler s(address::repeat, filter::linear, mip_filter::linear);
   if (mat.baseTextureId >= 0)
-    albedo = textures[mat.baseTextureId].tex.sample(s, uv).rgb;
+    albedo = sampleTextureLod(textures[mat.baseTextureId], s, uv, lod).rgb;
+  // Emission stays at level 0 to match light sampling, see sampleAreaLight()
   if (mat.emissionTextureId >= 0)
-    emission *= textures[mat.emissionTextureId].tex.sample(s, uv).rgb;
+    emission *=
+        sampleTextureLevelZero(textures[mat.emissionTextureId], s, uv).rgb;
   if (mat.transmissionTextureId >= 0)
-    transmission = textures[mat.transmissionTextureId].tex.sample(s, uv).r;
+    transmission =
+        sampleTextureLod(textures[mat.transmissionTextureId], s, uv, lod).r;
   if (mat.clearcoatTextureId >= 0)
-    clearcoat = textures[mat.clearcoatTextureId].tex.sample(s, uv).r;
+    clearcoat =
+        sampleTextureLod(textures[mat.clearcoatTextureId], s, uv, lod).r;
   if (mat.rmTextureId >= 0) {
-    float2 rm = textures[mat.rmTextureId].tex.sample(s, uv).rg;
+    float2 rm = sampleTextureLod(textures[mat.rmTextureId], s, uv, lod).rg;
     roughness *= rm.x;
     metallic *= rm.y;
   }
@@ -174,10 +179,9 @@ inline bool GGX::isSmooth() const {
 inline float GGX::lambda(float3 w) const {
   const auto cos2Theta = w.z * w.z;
 
-  auto alpha2 = m_alpha.x * m_alpha.x;
-  if (m_alpha.x != m_alpha.y) {
-    alpha2 = alpha2 * w.x * w.x + m_alpha.y * m_alpha.y * w.y * w.y;
-  }
+  // alpha^2 * tan^2(theta) = (alpha_x^2 * w_x^2 + alpha_y^2 * w_y^2) / cos^2(theta)
+  const auto alpha2 =
+      m_alpha.x * m_alpha.x * w.x * w.x + m_alpha.y * m_alpha.y * w.y * w.y;
 
   return (sqrt(1.0f + alpha2 / cos2Theta) - 1.0f) * 0.5f;
 }
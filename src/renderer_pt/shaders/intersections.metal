@@ -5,6 +5,37 @@
 using namespace metal;
 using namespace raytracing;
 
+/*
+ * Micro-triangle of an opacity micromap under a point, given its barycentric
+ * coordinates. Micro-triangles are numbered row by row along the second
+ * coordinate, alternating upward and downward facing ones within a row.
+ */
+inline uint32_t opacityMicroTriangle(float2 barycentricCoords) {
+  constexpr uint32_t n = 1 << Opacity_MicromapLevel;
+  const float2 f = max(barycentricCoords, 0.0f) * float(n);
+
+  const uint32_t j = min(uint32_t(f.y), n - 1);
+  const uint32_t i = min(uint32_t(f.x), n - 1 - j);
+  const bool upper = i + j < n - 1 && (f.x - float(i)) + (f.y - float(j)) > 1.0f;
+  return j * (2 * n - j) + 2 * i + (upper ? 1 : 0);
+}
+
+/*
+ * Opacity of a triangle at a point, from its precomputed descriptor and
+ * micromap. Instances without opacity data always sample the texture.
+ */
+inline OpacityState opacityState(device const uint32_t* opacity, uint32_t primitiveIdx, float2 barycentricCoords) {
+  if (opacity == nullptr) return Opacity_Unknown;
+
+  const uint32_t descriptor = opacity[primitiveIdx];
+  const auto state = OpacityState(descriptor & 3);
+  if (state != Opacity_Masked) return state;
+
+  const uint32_t micro = opacityMicroTriangle(barycentricCoords);
+  const uint32_t word = opacity[(descriptor >> 2) + micro / 16];
+  return OpacityState((word >> (2 * (micro % 16))) & 3);
+}
+
 [[intersection(triangle, triangle_data, instancing)]]
 bool alphaTestIntersectionFunction(
   uint32_t primitiveIdx 										[[primitive_id]],
@@ -24,14 +55,22 @@ bool alphaTestIntersectionFunction(
   
   float alpha = material.baseColor.a;
   if (material.baseTextureId >= 0) {
+    /*
+     * Only sample the texture where the opacity data can't tell if it's
+     * fully opaque or transparent
+     */
+    const auto state = opacityState(instanceResource.opacity, primitiveIdx, barycentricCoords);
+    if (state == Opacity_Transparent) return false;
+    if (state == Opacity_Opaque) return alpha > r;
+
     float2 vertexTexCoords[3];
     for (int i = 0; i < 3; i++)
-      vertexTexCoords[i] = vertexResource.data[primitiveData->indices[i]].texCoords;
+      vertexTexCoords[i] = loadTexCoords(vertexResource, primitiveData->indices[i]);
     
     float2 surfaceUV = interpolate(vertexTexCoords, barycentricCoords);
     
     constexpr sampler s(address::repeat, filter::linear);
-    alpha *= args.textures[material.baseTextureId].tex.sample(s, surfaceUV).a;
+    alpha *= sampleTextureLevelZero(args.textures[material.baseTextureId], s, surfaceUV).a;
   }
   
 //  return true;
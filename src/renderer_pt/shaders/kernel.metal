@@ -77,6 +77,7 @@ struct Hit {
   float3 normal;          // Surface normal           (world space)
   float3 geometricNormal; // Geometric (face) normal 	(world space)
   float2 uv;              // Surface UVs at hit position
+  float lod;              // Texture LOD from the ray cone, see sampleTextureLod()
   float3 wo;              // Outgoing light direction (tangent space)
   Frame frame;            // Shading coordinate frame, Z-up normal aligned
   device const MaterialGPU *material; // Material
@@ -94,10 +95,20 @@ struct Resources {
   const device InstanceResource *instanceResources;
   device Texture *textures;
 
-  inline device VertexResource &getVertices(uint32_t instanceIdx) {
+  inline const device VertexResource &getVertices(uint32_t instanceIdx) {
     auto geometryIdx = instances[instanceIdx].accelerationStructureIndex;
-    return *(device VertexResource *)((device uint64_t *)vertexResources +
-                                      geometryIdx * 2);
+    return vertexResources[geometryIdx];
+  }
+
+  inline device const MaterialGPU &getMaterial(uint32_t instanceIdx,
+                                               uint32_t primitiveIdx) {
+    auto geometryIdx = instances[instanceIdx].accelerationStructureIndex;
+
+    device auto &primitiveResource = primitiveResources[geometryIdx];
+    device auto &instanceResource = instanceResources[instanceIdx];
+
+    auto materialSlot = primitiveResource.materialSlot[primitiveIdx];
+    return instanceResource.materials[materialSlot];
   }
 
   inline float4x4 getTransform(uint32_t instanceIdx) {
@@ -117,33 +128,49 @@ struct Resources {
    */
   inline Hit getIntersectionData(
       const thread ray &ray,
-      const thread triangle_instance_intersection &intersection) {
-    auto instanceIdx = intersection.instance_id;
-    auto geometryIdx = instances[instanceIdx].accelerationStructureIndex;
+      const thread triangle_instance_intersection &intersection,
+      float coneWidth = 0.0f) {
+    device auto &data = *(device PrimitiveData *)intersection.primitive_data;
+    uint3 indices(data.indices[0], data.indices[1], data.indices[2]);
 
-    device auto &vertexResource = vertexResources[geometryIdx];
-    device auto &primitiveResource = primitiveResources[geometryIdx];
-    device auto &instanceResource = instanceResources[instanceIdx];
+    return getIntersectionData(ray, intersection.instance_id,
+                               intersection.primitive_id, indices,
+                               intersection.triangle_barycentric_coord,
+                               intersection.distance, coneWidth);
+  }
 
-    device auto &data = *(device PrimitiveData *)intersection.primitive_data;
+  /*
+   * Same as above, from individual intersection values. Used by kernels that
+   * store intersections in a buffer and shade them in a separate dispatch.
+   * coneWidth is the width of the ray cone at the hit, used to pick texture
+   * LODs; zero samples full size textures.
+   */
+  inline Hit getIntersectionData(const thread ray &ray, uint32_t instanceIdx,
+                                 uint32_t primitiveIdx, uint3 indices,
+                                 float2 barycentricCoords, float distance,
+                                 float coneWidth = 0.0f) {
+    auto geometryIdx = instances[instanceIdx].accelerationStructureIndex;
 
-    auto materialSlot =
-        primitiveResource.materialSlot[intersection.primitive_id];
-    device const auto &material = instanceResource.materials[materialSlot];
+    device auto &vertexResource = vertexResources[geometryIdx];
+    device const auto &material = getMaterial(instanceIdx, primitiveIdx);
 
     float3 vertexPositions[3];
     float3 vertexNormals[3];
     float3 vertexTangents[3];
     float2 vertexTexCoords[3];
+    float tangentSign = 1.0f;
     for (int i = 0; i < 3; i++) {
-      vertexPositions[i] = vertexResource.position[data.indices[i]];
-      vertexNormals[i] = vertexResource.data[data.indices[i]].normal;
-      vertexTangents[i] = vertexResource.data[data.indices[i]].tangent.xyz;
-      vertexTexCoords[i] = vertexResource.data[data.indices[i]].texCoords;
+      const auto packed = vertexResource.data[indices[i]];
+      const float4 tangent = pt::vertex_format::decodeTangent(packed.tangent);
+
+      vertexPositions[i] = vertexResource.position[indices[i]];
+      vertexNormals[i] = pt::vertex_format::decodeNormal(packed.normal);
+      vertexTangents[i] = tangent.xyz;
+      vertexTexCoords[i] = loadTexCoords(vertexResource, indices[i]);
+      if (i == 0)
+        tangentSign = tangent.w;
     }
-    float tangentSign = vertexResource.data[data.indices[0]].tangent.w;
 
-    float2 barycentricCoords = intersection.triangle_barycentric_coord;
     float3 surfaceNormal = interpolate(vertexNormals, barycentricCoords);
     float3 surfaceTangent = interpolate(vertexTangents, barycentricCoords);
     float2 surfaceUV = interpolate(vertexTexCoords, barycentricCoords);
@@ -153,7 +180,7 @@ struct Resources {
 
     float4x4 objectToWorld = getTransform(instanceIdx);
 
-    float3 wsHitPoint = ray.origin + ray.direction * intersection.distance;
+    float3 wsHitPoint = ray.origin + ray.direction * distance;
     float3 wsSurfaceNormal =
         normalize(transformVec(surfaceNormal, objectToWorld));
     float3 wsSurfaceTangent =
@@ -163,12 +190,40 @@ struct Resources {
 
     auto frame = Frame::fromNT(wsSurfaceNormal, wsSurfaceTangent, tangentSign);
 
+    /*
+     * Texture LOD from the ray cone footprint (Akenine-Moller et al., "Texture
+     * Level of Detail Strategies for Real-Time Ray Tracing"), leaving out the
+     * texture size term which depends on each texture
+     */
+    float lod = lodLevelZero;
+    const float3 e1 = transformVec(vertexPositions[1] - vertexPositions[0],
+                                   objectToWorld);
+    const float3 e2 = transformVec(vertexPositions[2] - vertexPositions[0],
+                                   objectToWorld);
+    const float2 t1 = vertexTexCoords[1] - vertexTexCoords[0];
+    const float2 t2 = vertexTexCoords[2] - vertexTexCoords[0];
+    const float worldArea = length(cross(e1, e2));
+    const float uvArea = abs(t1.x * t2.y - t1.y * t2.x);
+    if (coneWidth > 0.0f && worldArea > 0.0f && uvArea > 0.0f) {
+      const float cosTheta =
+          max(abs(dot(wsGeometricNormal, ray.direction)), 1e-3f);
+      lod = max(0.5f * log2(uvArea / worldArea) + log2(coneWidth / cosTheta),
+                lodLevelZero);
+    }
+
     if (material.normalTextureId >= 0) {
-      constexpr sampler s(address::repeat, filter::linear);
-      float3 sampledNormal =
-          textures[material.normalTextureId].tex.sample(s, surfaceUV).rgb *
+      /*
+       * Normal maps store only X and Y, Z is reconstructed from the unit
+       * length. Older RGB normal maps are read the same way.
+       */
+      constexpr sampler s(address::repeat, filter::linear, mip_filter::linear);
+      const float2 xy =
+          sampleTextureLod(textures[material.normalTextureId], s,
+                           surfaceUV, lod)
+                  .rg *
               2.0 -
           1.0;
+      float3 sampledNormal(xy, sqrt(saturate(1.0f - dot(xy, xy))));
 
       wsSurfaceNormal = frame.localToWorld(sampledNormal);
       frame = Frame::fromNormal(wsSurfaceNormal);
@@ -181,6 +236,7 @@ struct Resources {
         .normal = wsSurfaceNormal,
         .geometricNormal = wsGeometricNormal,
         .uv = surfaceUV,
+        .lod = lod,
         .wo = wo,
         .frame = frame,
         .material = &material,
@@ -237,6 +293,38 @@ spawnRayFromCamera(constant CameraData &camera, uint2 pixel, float2 pixelSample,
   return ray;
 }
 
+/*
+ * Spread angle of the ray cone through a pixel, for texture LOD. Cones keep
+ * this spread along the whole path, as if every surface were flat, so their
+ * width is the spread times the distance travelled.
+ */
+__attribute__((always_inline)) float rayConeSpread(constant CameraData &camera,
+                                                   uint2 size) {
+  const float3 center =
+      camera.topLeft + 0.5f * (float(size.x) * camera.pixelDeltaU +
+                               float(size.y) * camera.pixelDeltaV);
+  return length(camera.pixelDeltaU) / length(center - camera.position);
+}
+
+/*
+ * Get the image pixel a thread renders to, offsetting by the tile origin when
+ * rendering in tiles. Returns false if the thread falls outside the
+ * accumulator or the image.
+ */
+__attribute__((always_inline)) bool
+getPixel(uint2 tid, constant Constants &constants,
+         texture2d<float, access::read_write> acc, thread uint2 &pixel) {
+  if (tid.x >= acc.get_width() || tid.y >= acc.get_height())
+    return false;
+
+  int2 pos = int2(tid) + constants.tileOrigin;
+  if (pos.x < 0 || pos.y < 0)
+    return false;
+
+  pixel = uint2(pos);
+  return pixel.x < constants.size.x && pixel.y < constants.size.y;
+}
+
 /*
  * Create an intersector marked to intersect opaque triangle geometry
  * Utility function to reuse in multiple kernels
@@ -257,7 +345,8 @@ kernel void pathtracingKernel(uint2 tid [[thread_position_in_grid]],
                               constant Arguments &args [[buffer(0)]],
                               texture2d<float, access::read_write> acc
                               [[texture(0)]]) {
-  if (tid.x < args.constants.size.x && tid.y < args.constants.size.y) {
+  uint2 pixel;
+  if (getPixel(tid, args.constants, acc, pixel)) {
     /*
      * Create the resources struct for extracting intersection data
      */
@@ -272,14 +361,14 @@ kernel void pathtracingKernel(uint2 tid [[thread_position_in_grid]],
     /*
      * Initialize the sampler
      */
-    samplers::HaltonSampler halton(tid, args.constants.size, args.constants.spp,
-                                   args.constants.frameIdx);
+    samplers::HaltonSampler halton(pixel, args.constants.size,
+                                   args.constants.spp, args.constants.frameIdx);
 
     /*
      * Spawn ray and create an intersector
      */
-    auto ray = spawnRayFromCamera(args.constants.camera, tid, halton.sample2d(),
-                                  halton.sample2d());
+    auto ray = spawnRayFromCamera(args.constants.camera, pixel,
+                                  halton.sample2d(), halton.sample2d());
     auto i = createTriangleIntersector();
     triangle_instance_intersection intersection;
 
@@ -288,6 +377,9 @@ kernel void pathtracingKernel(uint2 tid [[thread_position_in_grid]],
      */
     float3 attenuation(1.0);
     float3 L(0.0);
+    const float coneSpread =
+        rayConeSpread(args.constants.camera, args.constants.size);
+    float pathLength = 0.0f; // Distance travelled, for texture LOD
     for (int bounce = 0; bounce < MAX_BOUNCES; bounce++) {
       float ir = halton.sample1d();
       intersection = i.intersect(ray, args.accelStruct,
@@ -310,7 +402,9 @@ kernel void pathtracingKernel(uint2 tid [[thread_position_in_grid]],
         break;
       }
 
-      const auto hit = resources.getIntersectionData(ray, intersection);
+      pathLength += intersection.distance;
+      const auto hit = resources.getIntersectionData(ray, intersection,
+                                                     coneSpread * pathLength);
 
       /*
        * Sample the BSDF to get the next ray direction
@@ -318,7 +412,7 @@ kernel void pathtracingKernel(uint2 tid [[thread_position_in_grid]],
       auto r = float4(halton.sample2d(), halton.sample1d(), halton.sample1d());
 
       bsdf::ShadingContext ctx(*hit.material, hit.uv, args.constants.idt,
-                               args.textures);
+                               args.textures, hit.lod);
       auto bsdf = bsdf::BSDF(ctx, args.constants, args.luts);
       auto sample = bsdf.sample(hit.wo, r, halton.sample2d());
 
@@ -358,8 +452,7 @@ kernel void pathtracingKernel(uint2 tid [[thread_position_in_grid]],
     /*
      * Accumulate samples
      */
-    uint32_t localFrameIdx =
-        args.constants.frameIdx / args.constants.gmonBuckets;
+    uint32_t localFrameIdx = args.constants.bucketFrameIdx;
     if (localFrameIdx > 0) {
       float3 L_prev = acc.read(tid).xyz;
 
@@ -372,25 +465,125 @@ kernel void pathtracingKernel(uint2 tid [[thread_position_in_grid]],
 }
 
 /*
- * Sample a light from the scene, where the probability of sampling a given
- * light is proportional to its total emitted power. Very simple sampler, but
- * much better than uniform sampling.
+ * Light tree traversal, see light_tree.hpp. The importance of a node estimates
+ * its contribution to a shading point at pos with shading normal n, from its
+ * power, distance and emission cone.
+ */
+float cosSubClamped(float sinA, float cosA, float sinB, float cosB) {
+  return cosA > cosB ? 1.0f : cosA * cosB + sinA * sinB;
+}
+
+float sinSubClamped(float sinA, float cosA, float sinB, float cosB) {
+  return cosA > cosB ? 0.0f : sinA * cosB - cosA * sinB;
+}
+
+float lightTreeImportance(const device LightTreeNode &node, float3 pos,
+                          float3 n) {
+  const float3 center = (node.boundsMin + node.boundsMax) * 0.5f;
+  const float3 diagonal = node.boundsMax - node.boundsMin;
+
+  const float dist2 = length_squared(pos - center);
+  const float d2 = max(dist2, length(diagonal) * 0.5f);
+
+  // Emitters are two sided, so the cone is checked in both directions
+  const float3 wi = dist2 > 0.0f ? (pos - center) / sqrt(dist2) : n;
+  const float cosW = abs(dot(node.axis, wi));
+  const float sinW = sqrt(max(0.0f, 1.0f - cosW * cosW));
+
+  // Bound on the angle subtended by the node, from its bounding sphere
+  float cosB = -1.0f;
+  const float r2 = length_squared(diagonal) * 0.25f;
+  if (dist2 > r2)
+    cosB = sqrt(max(0.0f, 1.0f - r2 / dist2));
+  const float sinB = sqrt(max(0.0f, 1.0f - cosB * cosB));
+
+  // Minimum angle between the emission cone and the shading point
+  const float sinO = sqrt(max(0.0f, 1.0f - node.cosTheta * node.cosTheta));
+  const float cosX = cosSubClamped(sinW, cosW, sinO, node.cosTheta);
+  const float sinX = sinSubClamped(sinW, cosW, sinO, node.cosTheta);
+  const float cosP = cosSubClamped(sinX, cosX, sinB, cosB);
+
+  // Emitters emit over the hemisphere around their normal
+  if (cosP <= 0.0f)
+    return 0.0f;
+
+  // Minimum angle between the node and the receiver normal
+  const float cosI = abs(dot(wi, n));
+  const float sinI = sqrt(max(0.0f, 1.0f - cosI * cosI));
+  const float cosPI = cosSubClamped(sinI, cosI, sinB, cosB);
+
+  return max(node.power * cosP * cosPI / d2, 0.0f);
+}
+
+/*
+ * Pick an area light by traversing the light tree, choosing each child with
+ * probability proportional to its importance. Returns the light index, and the
+ * probability of picking it in pmf, or zero if no light can contribute.
  */
-device AreaLight &sampleLightPower(device AreaLight *lights,
-                                   constant Constants &constants, float r) {
-  r *= constants.totalLightPower;
+uint32_t sampleLightTree(const device LightTreeNode *nodes, float3 pos,
+                         float3 n, float r, thread float &pmf) {
+  uint32_t nodeIdx = 0;
+  pmf = 1.0f;
+  while (!nodes[nodeIdx].isLeaf) {
+    const uint32_t c0 = nodeIdx + 1, c1 = nodes[nodeIdx].childOrLight;
+    const float i0 = lightTreeImportance(nodes[c0], pos, n);
+    const float i1 = lightTreeImportance(nodes[c1], pos, n);
+    if (i0 == 0.0f && i1 == 0.0f) {
+      pmf = 0.0f;
+      return 0;
+    }
+
+    const float p0 = i0 / (i0 + i1);
+    if (r < p0) {
+      nodeIdx = c0;
+      r = min(r / p0, oneMinusEpsilon);
+      pmf *= p0;
+    } else {
+      nodeIdx = c1;
+      r = min((r - p0) / (1.0f - p0), oneMinusEpsilon);
+      pmf *= 1.0f - p0;
+    }
+  }
 
-  // Find the first light with cumulative power >= r using a quick binary search
-  auto sz = constants.lightCount - 1, idx = 0u;
-  while (sz > 0) {
-    auto h = sz >> 1, middle = idx + h;
-    auto res = lights[middle].cumulativePower < r;
-    idx = res ? (middle + 1) : idx;
-    sz = res ? sz - (h + 1) : h;
+  if (nodeIdx == 0 && lightTreeImportance(nodes[0], pos, n) == 0.0f)
+    pmf = 0.0f;
+
+  return nodes[nodeIdx].childOrLight;
+}
+
+/*
+ * Probability of sampleLightTree() picking a light, walking up the tree from
+ * the light's leaf.
+ */
+float lightTreePmf(const device LightTreeNode *nodes, float3 pos, float3 n,
+                   const device AreaLight &light) {
+  uint32_t nodeIdx = light.treeNode;
+  if (nodeIdx == 0)
+    return lightTreeImportance(nodes[0], pos, n) > 0.0f ? 1.0f : 0.0f;
+
+  float pmf = 1.0f;
+  while (nodeIdx != 0) {
+    const uint32_t parent = nodes[nodeIdx].parent;
+    const uint32_t c0 = parent + 1, c1 = nodes[parent].childOrLight;
+    const float i0 = lightTreeImportance(nodes[c0], pos, n);
+    const float i1 = lightTreeImportance(nodes[c1], pos, n);
+    if (i0 + i1 == 0.0f)
+      return 0.0f;
+
+    pmf *= (nodeIdx == c0 ? i0 : i1) / (i0 + i1);
+    nodeIdx = parent;
   }
-  idx = clamp(idx, 0u, constants.lightCount - 1);
 
-  return lights[idx];
+  return pmf;
+}
+
+/*
+ * Probability of picking an environment light over an area light
+ */
+float infiniteLightProbability(constant Constants &constants) {
+  size_t envCount = constants.envLightCount;
+  return constants.lightCount == 0 ? 1.0
+                                   : float(envCount) / float(envCount + 1);
 }
 
 struct LightSample {
@@ -402,15 +595,18 @@ struct LightSample {
 };
 
 /*
- * Sample an area light.
+ * Sample an area light. Lights store their average emission, textured ones
+ * look up the texture at the sampled point to get the actual emitted light.
  */
 LightSample sampleAreaLight(thread const Hit &hit, thread Resources &res,
-                            device AreaLight &light, float2 r) {
+                            device AreaLight &light, float3x3 idt, float2 r) {
   const device auto &vertices = res.getVertices(light.instanceIdx);
 
   float3 vertexPositions[3];
+  float2 vertexTexCoords[3];
   for (int i = 0; i < 3; i++) {
     vertexPositions[i] = vertices.position[light.indices[i]];
+    vertexTexCoords[i] = loadTexCoords(vertices, light.indices[i]);
   }
 
   const float2 sampledCoords = samplers::sampleTriUniform(r);
@@ -423,9 +619,22 @@ LightSample sampleAreaLight(thread const Hit &hit, thread Resources &res,
       transformPoint(interpolate(vertexPositions, sampledCoords), transform);
   const float3 normal = normalize(transformVec(osNormal, transform));
 
+  float3 Li = light.emission;
+  device const auto &material =
+      res.getMaterial(light.instanceIdx, light.primitiveIdx);
+  if (material.emissionTextureId >= 0) {
+    constexpr sampler s(address::repeat, filter::linear);
+    const float2 uv = interpolate(vertexTexCoords, sampledCoords);
+    Li = idt * (material.emission *
+                sampleTextureLevelZero(res.textures[material.emissionTextureId],
+                                       s, uv)
+                    .rgb);
+    Li *= material.emissionStrength;
+  }
+
   const float3 wi = normalize(pos - hit.pos);
   return {
-      .Li = light.emission,
+      .Li = Li,
       .pos = pos,
       .normal = normal,
       .wi = wi,
@@ -434,23 +643,102 @@ LightSample sampleAreaLight(thread const Hit &hit, thread Resources &res,
   };
 }
 
+/*
+ * Environment light importance sampling, using either an alias table with one
+ * entry per texel or a 2D marginal/conditional CDF over a coarser grid. Both
+ * give a PDF over uv, converted to solid angle by the Jacobian of the
+ * equirectangular mapping, 2 pi^2 sin(theta).
+ */
+float envPdfUvToSolidAngle(float pdfUv, float v) {
+  const float sinTheta = sin(v * M_PI_F);
+  return sinTheta > 0.0f ? pdfUv / (2.0f * M_PI_F * M_PI_F * sinTheta) : 0.0f;
+}
+
+// Index of the last CDF entry <= u, among the first n
+uint32_t envCdfSearch(device const float *cdf, uint32_t n, float u) {
+  uint32_t lo = 0, hi = n;
+  while (lo + 1 < hi) {
+    const uint32_t mid = (lo + hi) / 2;
+    if (cdf[mid] <= u)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+float environmentLightPdf(device EnvironmentLight &light,
+                          texture2d<float> texture, float2 uv) {
+  uv = float2(fract(uv.x), saturate(uv.y));
+
+  float pdfUv;
+  if (light.sampling == pt::EnvironmentSampling_Cdf) {
+    const uint2 size = light.cdfSize;
+    const uint2 cell = min(uint2(uv * float2(size)), size - 1);
+    device const float *row = light.cdf + size.y + 1 + cell.y * (size.x + 1);
+
+    pdfUv = (light.cdf[cell.y + 1] - light.cdf[cell.y]) * float(size.y) *
+            (row[cell.x + 1] - row[cell.x]) * float(size.x);
+  } else {
+    const uint32_t w = texture.get_width(), h = texture.get_height();
+    const uint2 texel = min(uint2(uv * float2(w, h)), uint2(w, h) - 1);
+    pdfUv = light.alias[texel.y * w + texel.x].pdf;
+  }
+
+  return envPdfUvToSolidAngle(pdfUv, uv.y);
+}
+
 /*
  * Sample an environment light
  */
 LightSample sampleEnvironmentLight(thread const Hit &hit,
                                    const device Texture *textures,
                                    device EnvironmentLight &light, float2 r) {
-  // Sample the alias table
   auto texture = textures[light.textureIdx].tex;
-  uint64_t w = texture.get_width(), h = texture.get_height();
-  uint64_t n = w * h;
-  uint64_t i = min(n - 1, size_t(r.x * n));
 
-  if (r.y >= light.alias[i].p)
-    i = light.alias[i].aliasIdx;
+  float2 uv;
+  float pdfUv;
+  if (light.sampling == pt::EnvironmentSampling_Cdf) {
+    // Pick a row from the marginal CDF, then a column from the row's CDF
+    const uint2 size = light.cdfSize;
+    const uint32_t y = envCdfSearch(light.cdf, size.y, r.y);
+    const float pRow = light.cdf[y + 1] - light.cdf[y];
+
+    device const float *row = light.cdf + size.y + 1 + y * (size.x + 1);
+    const uint32_t x = envCdfSearch(row, size.x, r.x);
+    const float pCol = row[x + 1] - row[x];
+
+    // Place the sample within the cell, reusing the rest of each random number
+    const float2 offset(pCol > 0.0f ? (r.x - row[x]) / pCol : 0.5f,
+                        pRow > 0.0f ? (r.y - light.cdf[y]) / pRow : 0.5f);
+    uv = (float2(x, y) + clamp(offset, 0.0f, oneMinusEpsilon)) / float2(size);
+    pdfUv = pRow * float(size.y) * pCol * float(size.x);
+  } else {
+    // Sample the alias table
+    uint64_t w = texture.get_width(), h = texture.get_height();
+    uint64_t n = w * h;
+    uint64_t i = min(n - 1, size_t(r.x * n));
+
+    const float p = light.alias[i].p;
+    float u;
+    if (r.y < p) {
+      u = r.y / p;
+    } else {
+      u = (r.y - p) / (1.0f - p);
+      i = light.alias[i].aliasIdx;
+    }
 
-  uint64_t x = i % w, y = i / w;
-  float2 uv(float(x) / float(w), float(y) / float(h));
+    /*
+     * Place the sample uniformly within the texel, like the CDF path does. r.x
+     * has no precision left after picking one of many texels, so the rest of
+     * r.y is split instead: its low bits for u and its high bits for v.
+     */
+    const float2 offset(fract(u * 4096.0f), u);
+    uint64_t x = i % w, y = i / w;
+    uv = (float2(float(x), float(y)) + clamp(offset, 0.0f, oneMinusEpsilon)) /
+         float2(float(w), float(h));
+    pdfUv = light.alias[i].pdf;
+  }
 
   constexpr sampler s(address::repeat, filter::linear);
   const float3 Le = texture.sample(s, uv).rgb;
@@ -462,10 +750,197 @@ LightSample sampleEnvironmentLight(thread const Hit &hit,
       .pos = wi * 100.0,
       .normal = -wi,
       .wi = wi,
-      .pdf = light.alias[i].pdf / (4.0 * M_PI_F),
+      .pdf = envPdfUvToSolidAngle(pdfUv, uv.y),
   };
 }
 
+/*
+ * Pick a light to sample, choosing between environment and area lights, and
+ * sample it. Returns the probability of picking the sampled light in pLight.
+ */
+LightSample sampleLight(thread const Hit &hit, constant Arguments &args,
+                        thread Resources &res, float3 r, thread float &pLight) {
+  size_t envCount = args.constants.envLightCount;
+  float pInfinite = infiniteLightProbability(args.constants);
+
+  if (r.z < pInfinite) {
+    // Sample an infinite (environment) light
+    r.z /= pInfinite;
+    size_t idx = min(size_t(envCount - 1), size_t(r.z * envCount));
+    pLight = pInfinite /
+             float(envCount); // Probability of sampling this environment light
+    return sampleEnvironmentLight(hit, args.textures, args.envLights[idx],
+                                  r.xy);
+  }
+
+  // Sample an area light
+  r.z = (r.z - pInfinite) / (1.0f - pInfinite);
+  float pmf;
+  uint32_t lightIdx =
+      sampleLightTree(args.lightTree, hit.pos, hit.normal, r.z, pmf);
+  pLight = (1.0 - pInfinite) * pmf; // Probability of sampling this light
+  if (pLight == 0.0f)
+    return {};
+
+  return sampleAreaLight(hit, res, args.lights[lightIdx], args.constants.idt,
+                         r.xy);
+}
+
+/*
+ * PDF of sampling a point on an emitter through sampleLight(), in solid angle
+ * measure, from a shading point at pos with shading normal n. Zero if the
+ * primitive isn't in the light list.
+ */
+float areaLightPdf(constant Arguments &args, float3 pos, float3 n,
+                   uint32_t instanceIdx, uint32_t primitiveIdx,
+                   thread const Hit &hit, float3 dir) {
+  uint32_t offset = args.instanceLightOffsets[instanceIdx];
+  if (offset == ~0u)
+    return 0.0f;
+
+  uint32_t lightIdx = args.lightIndices[offset + primitiveIdx];
+  if (lightIdx == ~0u)
+    return 0.0f;
+
+  device auto &light = args.lights[lightIdx];
+  float pmf = (1.0f - infiniteLightProbability(args.constants)) *
+              lightTreePmf(args.lightTree, pos, n, light);
+  if (pmf == 0.0f)
+    return 0.0f;
+
+  return pmf * length_squared(pos - hit.pos) /
+         (abs(dot(dir, hit.geometricNormal)) * light.area);
+}
+
+/*
+ * Light from the environment along a ray that missed the scene. If mis is set,
+ * weight each environment light's contribution against the BSDF sample PDF.
+ */
+float3 environmentLight(constant Arguments &args, float3 dir, bool mis,
+                        float bsdfPdf) {
+  float3 L(0.0);
+  for (uint32_t i = 0; i < args.constants.envLightCount; i++) {
+    device auto &envLight = args.envLights[i];
+    device auto &texture = args.textures[envLight.textureIdx].tex;
+
+    constexpr sampler s(address::repeat, filter::linear);
+    float2 uv = rayDirToUv(dir);
+    const float3 Le = texture.sample(s, uv).rgb;
+
+    if (!mis) {
+      L += Le;
+    } else {
+      float lightPdf = infiniteLightProbability(args.constants) /
+                       float(args.constants.envLightCount) *
+                       environmentLightPdf(envLight, texture, uv);
+      float bsdfWeight = bsdfPdf / (bsdfPdf + lightPdf);
+
+      L += bsdfWeight * Le;
+    }
+  }
+
+  return L + backgroundColor;
+}
+
+/*
+ * Path guiding: sample directions from the SD-tree trained on the CPU (see
+ * path_guide.hpp). Directions map to the directional trees through the
+ * cylindrical mapping (cos theta, phi), which preserves area, so the PDF over
+ * the sphere is the PDF over [0, 1]^2 divided by 4 pi.
+ */
+float2 guidingDirToCanonical(float3 dir) {
+  float phi = atan2(dir.y, dir.x);
+  if (phi < 0.0f)
+    phi += 2.0f * M_PI_F;
+
+  return float2(saturate((dir.z + 1.0f) * 0.5f),
+                min(phi * 0.5f * M_1_PI_F, oneMinusEpsilon));
+}
+
+float3 guidingCanonicalToDir(float2 p) {
+  const float cosTheta = 2.0f * p.x - 1.0f;
+  const float sinTheta = sqrt(max(0.0f, 1.0f - cosTheta * cosTheta));
+
+  float cosPhi;
+  const float sinPhi = sincos(2.0f * M_PI_F * p.y, cosPhi);
+  return float3(sinTheta * cosPhi, sinTheta * sinPhi, cosTheta);
+}
+
+// Root of the directional tree for a position
+uint32_t guidingDTree(constant Arguments &args, float3 pos) {
+  uint32_t nodeIdx = 0;
+  while (args.guidingSpatial[nodeIdx].child != 0) {
+    const device auto &node = args.guidingSpatial[nodeIdx];
+    nodeIdx = node.child + (pos[node.axis] >= node.split ? 1 : 0);
+  }
+  return args.guidingSpatial[nodeIdx].dtree;
+}
+
+float guidingPdf(constant Arguments &args, uint32_t root, float3 dir) {
+  float2 p = guidingDirToCanonical(dir);
+  float pdf = 0.25f * M_1_PI_F;
+
+  uint32_t nodeIdx = root;
+  while (true) {
+    const device auto &node = args.guidingDirectional[nodeIdx];
+    const float total = node.sum.x + node.sum.y + node.sum.z + node.sum.w;
+    if (!(total > 0.0f))
+      return pdf;
+
+    const uint2 qxy = uint2(p >= 0.5f);
+    const uint32_t q = qxy.x | (qxy.y << 1);
+    pdf *= 4.0f * node.sum[q] / total;
+    if (node.child[q] == 0)
+      return pdf;
+
+    p = p * 2.0f - float2(qxy);
+    nodeIdx = node.child[q];
+  }
+}
+
+float3 guidingSample(constant Arguments &args, uint32_t root, float2 u) {
+  float2 origin(0.0f);
+  float scale = 1.0f;
+
+  uint32_t nodeIdx = root;
+  while (true) {
+    const device auto &node = args.guidingDirectional[nodeIdx];
+    const float total = node.sum.x + node.sum.y + node.sum.z + node.sum.w;
+    if (!(total > 0.0f))
+      return guidingCanonicalToDir(origin + u * scale);
+
+    // Pick the left or right half, then a quadrant within it
+    uint2 qxy;
+    const float pLeft = (node.sum[0] + node.sum[2]) / total;
+    if (u.x < pLeft) {
+      qxy.x = 0;
+      u.x = min(u.x / pLeft, oneMinusEpsilon);
+    } else {
+      qxy.x = 1;
+      u.x = min((u.x - pLeft) / (1.0f - pLeft), oneMinusEpsilon);
+    }
+
+    const float column = node.sum[qxy.x] + node.sum[qxy.x + 2];
+    const float pBottom = column > 0.0f ? node.sum[qxy.x] / column : 0.5f;
+    if (u.y < pBottom) {
+      qxy.y = 0;
+      u.y = min(u.y / pBottom, oneMinusEpsilon);
+    } else {
+      qxy.y = 1;
+      u.y = min((u.y - pBottom) / (1.0f - pBottom), oneMinusEpsilon);
+    }
+
+    scale *= 0.5f;
+    origin += float2(qxy) * scale;
+
+    const uint32_t q = qxy.x | (qxy.y << 1);
+    if (node.child[q] == 0)
+      return guidingCanonicalToDir(origin + u * scale);
+
+    nodeIdx = node.child[q];
+  }
+}
+
 /*
  * A better path tracing kernel using multiple importance sampling to combine
  * NEE with BSDF importance sampling.
@@ -473,7 +948,8 @@ LightSample sampleEnvironmentLight(thread const Hit &hit,
 kernel void misKernel(uint2 tid [[thread_position_in_grid]],
                       constant Arguments &args [[buffer(0)]],
                       texture2d<float, access::read_write> acc [[texture(0)]]) {
-  if (tid.x < args.constants.size.x && tid.y < args.constants.size.y) {
+  uint2 pixel;
+  if (getPixel(tid, args.constants, acc, pixel)) {
     /*
      * Create the resources struct for extracting intersection data
      */
@@ -488,14 +964,14 @@ kernel void misKernel(uint2 tid [[thread_position_in_grid]],
     /*
      * Initialize the sampler
      */
-    samplers::HaltonSampler halton(tid, args.constants.size, args.constants.spp,
-                                   args.constants.frameIdx);
+    samplers::HaltonSampler halton(pixel, args.constants.size,
+                                   args.constants.spp, args.constants.frameIdx);
 
     /*
      * Spawn ray and create an intersector
      */
-    auto ray = spawnRayFromCamera(args.constants.camera, tid, halton.sample2d(),
-                                  halton.sample2d());
+    auto ray = spawnRayFromCamera(args.constants.camera, pixel,
+                                  halton.sample2d(), halton.sample2d());
     auto i = createTriangleIntersector();
     triangle_instance_intersection intersection;
 
@@ -504,8 +980,27 @@ kernel void misKernel(uint2 tid [[thread_position_in_grid]],
      */
     float3 attenuation(1.0);
     float3 L(0.0);
+    const float coneSpread =
+        rayConeSpread(args.constants.camera, args.constants.size);
+    float pathLength = 0.0f; // Distance travelled, for texture LOD
     Hit lastHit;
     bsdf::Sample lastSample;
+    bool restirDirect = false; // Direct light at the primary hit came from ReSTIR
+
+    /*
+     * Path guiding state. While training, the path remembers the first few
+     * vertices it could guide, to write radiance records once it ends.
+     */
+    const bool guiding = (args.constants.flags & RendererFlags_PathGuiding) &&
+                         args.guidingSpatial != nullptr;
+    const float guidingAlpha = args.constants.guidingBsdfFraction;
+    float3 recordPos[Guiding_RecordsPerPath];
+    float2 recordDir[Guiding_RecordsPerPath];
+    float recordPdf[Guiding_RecordsPerPath];
+    float3 recordAttenuation[Guiding_RecordsPerPath];
+    float3 recordL[Guiding_RecordsPerPath];
+    uint32_t recordCount = 0;
+
     for (int bounce = 0; bounce < MAX_BOUNCES; bounce++) {
       float ir = halton.sample1d();
       intersection = i.intersect(ray, args.accelStruct,
@@ -515,34 +1010,20 @@ kernel void misKernel(uint2 tid [[thread_position_in_grid]],
        * Stop on ray miss
        */
       if (intersection.type == intersection_type::none) {
-        for (uint32_t i = 0; i < args.constants.envLightCount; i++) {
-          device auto &envLight = args.envLights[i];
-          device auto &texture = args.textures[envLight.textureIdx].tex;
-
-          constexpr sampler s(address::repeat, filter::linear);
-          float2 uv = rayDirToUv(ray.direction);
-          const float3 Le = texture.sample(s, uv).rgb;
-
-          if (bounce == 0 || lastSample.flags & bsdf::Sample_Specular) {
-            L += attenuation * Le;
-          } else {
-            uint32_t w = texture.get_width();
-            uint32_t h = texture.get_height();
-            uint32_t x = w * uv.x;
-            uint32_t y = h * uv.y;
-
-            float lightPdf = envLight.alias[y * w + x].pdf * 0.25 * M_1_PI_F;
-            float bsdfWeight = lastSample.pdf / (lastSample.pdf + lightPdf);
-
-            L += attenuation * bsdfWeight * Le;
-          }
+        bool mis = bounce > 0 && !(lastSample.flags & bsdf::Sample_Specular);
+        if (mis && restirDirect && bounce == 1) {
+          // Environment lights were already accounted for by ReSTIR
+          L += attenuation * backgroundColor;
+        } else {
+          L += attenuation *
+               environmentLight(args, ray.direction, mis, lastSample.pdf);
         }
-
-        L += attenuation * backgroundColor;
         break;
       }
 
-      const auto hit = resources.getIntersectionData(ray, intersection);
+      pathLength += intersection.distance;
+      const auto hit = resources.getIntersectionData(ray, intersection,
+                                                     coneSpread * pathLength);
 
       /*
        * Sample the BSDF to get the next ray direction
@@ -550,7 +1031,7 @@ kernel void misKernel(uint2 tid [[thread_position_in_grid]],
       auto r = float4(halton.sample2d(), halton.sample1d(), halton.sample1d());
 
       bsdf::ShadingContext ctx(*hit.material, hit.uv, args.constants.idt,
-                               args.textures);
+                               args.textures, hit.lod);
       auto bsdf = bsdf::BSDF(ctx, args.constants, args.luts);
       auto sample = bsdf.sample(hit.wo, r, halton.sample2d());
 
@@ -561,20 +1042,57 @@ kernel void misKernel(uint2 tid [[thread_position_in_grid]],
         if (bounce == 0 || lastSample.flags & bsdf::Sample_Specular) {
           L += attenuation * sample.Le;
         } else {
-          // Calculate light PDF, BSDF weight and do MIS.
-          // Sampling pdf is 1 / area, light sample pdf is power / totalPower
-          // Because power = Le * pi * area, the areas cancel each other out and
-          // we can simplify
-          const float lightPdf = (dot(sample.Le, float3(0, 1, 0)) * M_PI_F /
-                                  args.constants.totalLightPower) *
-                                 length_squared(lastHit.pos - hit.pos) /
-                                 abs(dot(ray.direction, hit.geometricNormal));
-          const float bsdfWeight = lastSample.pdf / (lastSample.pdf + lightPdf);
+          // Calculate light PDF, BSDF weight and do MIS
+          const float lightPdf =
+              areaLightPdf(args, lastHit.pos, lastHit.normal,
+                           intersection.instance_id, intersection.primitive_id,
+                           hit, ray.direction);
+          float bsdfWeight = lastSample.pdf / (lastSample.pdf + lightPdf);
+
+          // ReSTIR covers every light the light sampler can pick
+          if (restirDirect && bounce == 1)
+            bsdfWeight = lightPdf > 0.0f ? 0.0f : 1.0f;
 
           L += attenuation * bsdfWeight * sample.Le;
         }
       }
 
+      /*
+       * Path guiding: pick the next direction from either the BSDF or the
+       * guiding distribution, and use the PDF of the mixture for MIS. Only
+       * reflective surfaces are guided, as eval() doesn't handle transmission.
+       */
+      const bool guidable =
+          ctx.transmission == 0.0f &&
+          !(ctx.flags & MaterialGPU::Material_ThinDielectric) &&
+          hit.wo.z > 1.5e-3f;
+      uint32_t dtree = 0;
+      if (guiding && guidable) {
+        dtree = guidingDTree(args, hit.pos);
+        const float u = halton.sample1d();
+        const float2 rGuide = halton.sample2d();
+
+        if (u >= guidingAlpha) {
+          sample.wi = hit.frame.worldToLocal(guidingSample(args, dtree, rGuide));
+          sample.flags = (sample.flags & bsdf::Sample_Emitted) |
+                         bsdf::Sample_Reflected | bsdf::Sample_Glossy;
+        }
+
+        if (sample.flags & bsdf::Sample_Specular) {
+          // Specular directions can only come from the BSDF
+          sample.pdf *= guidingAlpha;
+        } else if (sample.flags & bsdf::Sample_Reflected) {
+          const auto eval = bsdf.eval(hit.wo, sample.wi);
+          const float3 wi = hit.frame.localToWorld(sample.wi);
+          sample.f = eval.f;
+          sample.pdf = guidingAlpha * eval.pdf +
+                       (1.0f - guidingAlpha) * guidingPdf(args, dtree, wi);
+
+          if (!(sample.pdf > 0.0f) || length_squared(eval.f) == 0.0f)
+            sample.flags &= bsdf::Sample_Emitted;
+        }
+      }
+
       /*
        * Set new ray origin, this is the same used for NEE and for the next
        * bounce
@@ -584,41 +1102,57 @@ kernel void misKernel(uint2 tid [[thread_position_in_grid]],
       /*
        * Calculate direct lighting contribution
        */
-      if (ctx.roughness > 0.0 || ctx.metallic + ctx.transmission < 1.0) {
+      const bool nee =
+          ctx.roughness > 0.0 || ctx.metallic + ctx.transmission < 1.0;
+      if (nee && bounce == 0 &&
+          (args.constants.flags & RendererFlags_ReSTIR)) {
+        /*
+         * Use the light sample picked by the ReSTIR passes, which ran on the
+         * same primary hit
+         */
+        const uint32_t pixelCount = acc.get_width() * acc.get_height();
+        const LightReservoir reservoir =
+            args.reservoirs[pixelCount + tid.y * acc.get_width() + tid.x];
+        restirDirect = true;
+
+        if (reservoir.W > 0.0f) {
+          float3 wi = reservoir.pos;
+          float G = 1.0f;
+          ray.max_distance = INFINITY;
+          if (!reservoir.isEnv) {
+            const float dist = length(reservoir.pos - hit.pos);
+            wi = (reservoir.pos - hit.pos) / dist;
+            G = abs(dot(reservoir.normal, wi)) / (dist * dist);
+            ray.max_distance = dist - 1e-3f;
+          }
+
+          const float3 wiLocal = hit.frame.worldToLocal(wi);
+          const auto bsdfEval = bsdf.eval(hit.wo, wiLocal);
+
+          if (length_squared(bsdfEval.f) > 0.0f) {
+            ray.direction = wi;
+            i.accept_any_intersection(true);
+            float ir = halton.sample1d();
+            intersection = i.intersect(ray, args.accelStruct,
+                                       args.intersectionFunctionTable, ir);
+            auto occluded = intersection.type != intersection_type::none;
+            i.accept_any_intersection(false);
+
+            if (!occluded)
+              L += attenuation * reservoir.Li * bsdfEval.f * abs(wiLocal.z) *
+                   G * reservoir.W;
+          }
+        }
+      } else if (nee) {
         auto r = float3(halton.sample2d(), halton.sample1d());
 
-        LightSample lightSample;
         float pLight = 0;
-
-        size_t envCount = args.constants.envLightCount;
-        float pInfinite = args.constants.lightCount == 0
-                              ? 1.0
-                              : float(envCount) / float(envCount + 1);
-
-        if (r.z < pInfinite) {
-          // Sample an infinite (environment) light
-          r.z /= pInfinite;
-          size_t idx = min(size_t(envCount - 1), size_t(r.z * envCount));
-          pLight =
-              pInfinite /
-              float(envCount); // Probability of sampling this environment light
-          lightSample = sampleEnvironmentLight(hit, args.textures,
-                                               args.envLights[idx], r.xy);
-        } else {
-          // Sample an area light
-          r.z = (r.z - pInfinite) / (1.0f - pInfinite);
-          device auto &light =
-              sampleLightPower(args.lights, args.constants, r.z);
-          pLight = (1.0 - pInfinite) * light.power /
-                   args.constants
-                       .totalLightPower; // Probability of sampling this light
-          lightSample = sampleAreaLight(hit, resources, light, r.xy);
-        }
+        auto lightSample = sampleLight(hit, args, resources, r, pLight);
 
         const float3 wi = hit.frame.worldToLocal(lightSample.wi);
         const auto bsdfEval = bsdf.eval(hit.wo, wi);
 
-        if (length_squared(bsdfEval.f) > 0.0f) {
+        if (pLight > 0.0f && length_squared(bsdfEval.f) > 0.0f) {
           ray.direction = lightSample.wi;
           ray.max_distance = length(lightSample.pos - hit.pos) - 1e-3f;
           i.accept_any_intersection(true);
@@ -630,9 +1164,15 @@ kernel void misKernel(uint2 tid [[thread_position_in_grid]],
 
           if (!occluded) {
             float pdfLight = pLight * lightSample.pdf;
+            float pdfBsdf = bsdfEval.pdf;
+            if (guiding && guidable)
+              pdfBsdf = guidingAlpha * pdfBsdf +
+                        (1.0f - guidingAlpha) *
+                            guidingPdf(args, dtree, lightSample.wi);
+
             float3 Ld =
                 lightSample.Li * bsdfEval.f * abs(wi.z) // Base lighting term
-                / (pdfLight + bsdfEval.pdf); // MIS weight/pdf (simplified)
+                / (pdfLight + pdfBsdf); // MIS weight/pdf (simplified)
             L += attenuation * Ld;
           }
         }
@@ -667,13 +1207,49 @@ kernel void misKernel(uint2 tid [[thread_position_in_grid]],
       ray.direction = normalize(hit.frame.localToWorld(sample.wi));
       lastHit = hit;
       lastSample = sample;
+
+      /*
+       * Remember the vertex for training the path guiding tree. Radiance
+       * arriving here is whatever the path gathers from now on, divided by
+       * the throughput so far.
+       */
+      if (args.guidingRecords != nullptr && guidable &&
+          !(sample.flags & bsdf::Sample_Specular) &&
+          recordCount < Guiding_RecordsPerPath) {
+        recordPos[recordCount] = hit.pos;
+        recordDir[recordCount] = guidingDirToCanonical(ray.direction);
+        recordPdf[recordCount] = sample.pdf;
+        recordAttenuation[recordCount] = attenuation;
+        recordL[recordCount] = L;
+        recordCount++;
+      }
+    }
+
+    /*
+     * Write path guiding records
+     */
+    for (uint32_t k = 0; k < recordCount; k++) {
+      const float3 Li =
+          select(float3(0.0f), (L - recordL[k]) / recordAttenuation[k],
+                 recordAttenuation[k] > 0.0f);
+
+      const uint32_t slot = atomic_fetch_add_explicit(
+          args.guidingRecordCount, 1, memory_order_relaxed);
+      if (slot >= args.constants.guidingRecordCapacity)
+        break;
+
+      args.guidingRecords[slot] = {
+          .pos = recordPos[k],
+          .dir = recordDir[k],
+          .value = max(dot(Li, float3(0.2126f, 0.7152f, 0.0722f)), 0.0f) /
+                   recordPdf[k],
+      };
     }
 
     /*
      * Accumulate samples
      */
-    uint32_t localFrameIdx =
-        args.constants.frameIdx / args.constants.gmonBuckets;
+    uint32_t localFrameIdx = args.constants.bucketFrameIdx;
     if (localFrameIdx > 0) {
       float3 L_prev = acc.read(tid).xyz;
 
@@ -684,3 +1260,684 @@ kernel void misKernel(uint2 tid [[thread_position_in_grid]],
     acc.write(float4(L, 1.0f), tid);
   }
 }
+
+/*
+ * Wavefront path tracing kernels. Implements the same estimator as misKernel,
+ * split into stages that each do one kind of work for every active path:
+ * generate camera rays, extend paths (closest hit), sort hits by material,
+ * shade, and trace shadow rays. Paths that terminate are dropped from the
+ * path queue, so later bounces only dispatch threads for live paths.
+ *
+ * Buffer bindings are shared by all stages, so they can be set once per frame.
+ */
+#define WAVEFRONT_BUFFERS                                                      \
+  constant Arguments &args [[buffer(0)]],                                      \
+      device PathState *paths [[buffer(1)]],                                   \
+      device WavefrontCounters &counters [[buffer(2)]],                        \
+      constant uint32_t &queueIdx [[buffer(3)]],                               \
+      constant uint32_t &bounce [[buffer(4)]],                                 \
+      device uint32_t *queue [[buffer(5)]],                                    \
+      device uint32_t *nextQueue [[buffer(6)]],                                \
+      device uint32_t *sortedQueue [[buffer(7)]],                              \
+      device PathHit *hits [[buffer(8)]],                                      \
+      device ShadowRay *shadowRays [[buffer(9)]]
+
+__attribute__((always_inline)) DispatchArgs wavefrontDispatch(uint32_t count) {
+  return {{(count + Wavefront_ThreadsPerThreadgroup - 1) /
+               Wavefront_ThreadsPerThreadgroup,
+           1, 1}};
+}
+
+__attribute__((always_inline)) void wavefrontPush(device metal_atomic_uint &count,
+                                                  device uint32_t *queue,
+                                                  uint32_t pathIdx) {
+  uint32_t slot = atomic_fetch_add_explicit(&count, 1, memory_order_relaxed);
+  queue[slot] = pathIdx;
+}
+
+__attribute__((always_inline)) Resources
+makeResources(constant Arguments &args) {
+  return {
+      .instances = args.instances,
+      .vertexResources = args.vertexResources,
+      .primitiveResources = args.primitiveResources,
+      .instanceResources = args.instanceResources,
+      .textures = args.textures,
+  };
+}
+
+/*
+ * Generate a camera ray for every pixel, and add all paths to the first queue.
+ */
+kernel void wavefrontGenerate(uint2 tid [[thread_position_in_grid]],
+                              WAVEFRONT_BUFFERS,
+                              texture2d<float, access::read_write> acc
+                              [[texture(0)]]) {
+  uint2 pixel;
+  if (getPixel(tid, args.constants, acc, pixel)) {
+    samplers::HaltonSampler halton(pixel, args.constants.size,
+                                   args.constants.spp, args.constants.frameIdx);
+    auto ray = spawnRayFromCamera(args.constants.camera, pixel,
+                                  halton.sample2d(), halton.sample2d());
+
+    uint32_t pathIdx = tid.y * acc.get_width() + tid.x;
+    device auto &path = paths[pathIdx];
+    path.origin = ray.origin;
+    path.direction = ray.direction;
+    path.attenuation = float3(1.0);
+    path.L = float3(0.0);
+    path.lastPos = float3(0.0);
+    path.lastNormal = float3(0.0);
+    path.lastPdf = 0.0;
+    path.lastFlags = 0;
+    path.pathLength = 0.0f;
+    path.samplerOffset = halton.offset();
+    path.samplerDim = halton.dimension();
+
+    wavefrontPush(counters.pathCount[queueIdx], queue, pathIdx);
+  }
+}
+
+/*
+ * Set up the extend dispatch for the current path queue, and reset counters
+ * for the rest of the bounce. Once every path has terminated, the rest of the
+ * bounce and all later ones dispatch nothing, see Renderer::renderWavefront().
+ */
+kernel void wavefrontPrepareExtend(WAVEFRONT_BUFFERS) {
+  uint32_t count = atomic_load_explicit(&counters.pathCount[queueIdx],
+                                        memory_order_relaxed);
+  counters.extendArgs = wavefrontDispatch(count);
+  counters.bounceArgs = {{count > 0 ? 1u : 0u, 1, 1}};
+  if (count == 0) {
+    counters.shadeArgs = wavefrontDispatch(0);
+    counters.shadowArgs = wavefrontDispatch(0);
+  }
+
+  atomic_store_explicit(&counters.pathCount[queueIdx ^ 1], 0,
+                        memory_order_relaxed);
+  atomic_store_explicit(&counters.shadowCount, 0, memory_order_relaxed);
+  for (uint32_t i = 0; i < Wavefront_MaterialBins; i++)
+    atomic_store_explicit(&counters.binCount[i], 0, memory_order_relaxed);
+}
+
+/*
+ * Find the closest hit for every active path. Paths that miss the scene pick
+ * up environment light and terminate here; hits are counted per material bin.
+ */
+kernel void
+wavefrontExtend(uint idx [[thread_position_in_grid]], WAVEFRONT_BUFFERS,
+                IntersectionFunctionTable ift [[buffer(10)]]) {
+  if (idx >= atomic_load_explicit(&counters.pathCount[queueIdx],
+                                  memory_order_relaxed))
+    return;
+
+  uint32_t pathIdx = queue[idx];
+  device auto &path = paths[pathIdx];
+  samplers::HaltonSampler halton(path.samplerOffset, path.samplerDim);
+
+  ray ray(path.origin, path.direction, 1e-3f, INFINITY);
+  auto i = createTriangleIntersector();
+  float ir = halton.sample1d();
+  auto intersection = i.intersect(ray, args.accelStruct, ift, ir);
+
+  path.samplerDim = halton.dimension();
+
+  /*
+   * Terminate on ray miss
+   */
+  if (intersection.type == intersection_type::none) {
+    bool mis = bounce > 0 && !(path.lastFlags & bsdf::Sample_Specular);
+    path.L += path.attenuation *
+              environmentLight(args, ray.direction, mis, path.lastPdf);
+    hits[pathIdx].bin = Wavefront_MaterialBins;
+    return;
+  }
+
+  /*
+   * Store the hit, and bin it by material flags so hits with similar
+   * materials are shaded together
+   */
+  auto resources = makeResources(args);
+  device const auto &material =
+      resources.getMaterial(intersection.instance_id, intersection.primitive_id);
+  uint32_t bin = uint32_t(material.flags) & (Wavefront_MaterialBins - 1);
+
+  device auto &data = *(device PrimitiveData *)intersection.primitive_data;
+  device auto &hit = hits[pathIdx];
+  hit.instanceIdx = intersection.instance_id;
+  hit.primitiveIdx = intersection.primitive_id;
+  for (int j = 0; j < 3; j++)
+    hit.indices[j] = data.indices[j];
+  hit.bin = bin;
+  hit.barycentricCoords = intersection.triangle_barycentric_coord;
+  hit.distance = intersection.distance;
+
+  atomic_fetch_add_explicit(&counters.binCount[bin], 1, memory_order_relaxed);
+}
+
+/*
+ * Compute bin offsets for the sorted hit queue, and set up the shade dispatch.
+ */
+kernel void wavefrontPrepareShade(WAVEFRONT_BUFFERS) {
+  uint32_t offset = 0;
+  for (uint32_t i = 0; i < Wavefront_MaterialBins; i++) {
+    atomic_store_explicit(&counters.binOffset[i], offset, memory_order_relaxed);
+    offset +=
+        atomic_load_explicit(&counters.binCount[i], memory_order_relaxed);
+  }
+
+  atomic_store_explicit(&counters.hitCount, offset, memory_order_relaxed);
+  counters.shadeArgs = wavefrontDispatch(offset);
+}
+
+/*
+ * Counting sort: scatter paths that hit something into the sorted queue,
+ * grouped by material bin.
+ */
+kernel void wavefrontSort(uint idx [[thread_position_in_grid]],
+                          WAVEFRONT_BUFFERS) {
+  if (idx >= atomic_load_explicit(&counters.pathCount[queueIdx],
+                                  memory_order_relaxed))
+    return;
+
+  uint32_t pathIdx = queue[idx];
+  uint32_t bin = hits[pathIdx].bin;
+  if (bin < Wavefront_MaterialBins)
+    wavefrontPush(counters.binOffset[bin], sortedQueue, pathIdx);
+}
+
+/*
+ * Shade hits in material order: add emission, sample a light and queue a
+ * shadow ray for it, then sample the BSDF and push the path to the next queue
+ * if it continues.
+ */
+kernel void wavefrontShade(uint idx [[thread_position_in_grid]],
+                           WAVEFRONT_BUFFERS) {
+  if (idx >= atomic_load_explicit(&counters.hitCount, memory_order_relaxed))
+    return;
+
+  uint32_t pathIdx = sortedQueue[idx];
+  device auto &path = paths[pathIdx];
+  const auto pathHit = hits[pathIdx];
+  samplers::HaltonSampler halton(path.samplerOffset, path.samplerDim);
+
+  auto resources = makeResources(args);
+  ray ray(path.origin, path.direction, 1e-3f, INFINITY);
+  const float pathLength = path.pathLength + pathHit.distance;
+  const auto hit = resources.getIntersectionData(
+      ray, pathHit.instanceIdx, pathHit.primitiveIdx,
+      uint3(pathHit.indices[0], pathHit.indices[1], pathHit.indices[2]),
+      pathHit.barycentricCoords, pathHit.distance,
+      rayConeSpread(args.constants.camera, args.constants.size) * pathLength);
+
+  float3 attenuation = path.attenuation;
+  float3 L = path.L;
+
+  /*
+   * Sample the BSDF to get the next ray direction
+   */
+  auto r = float4(halton.sample2d(), halton.sample1d(), halton.sample1d());
+
+  bsdf::ShadingContext ctx(*hit.material, hit.uv, args.constants.idt,
+                           args.textures, hit.lod);
+  auto bsdf = bsdf::BSDF(ctx, args.constants, args.luts);
+  auto sample = bsdf.sample(hit.wo, r, halton.sample2d());
+
+  /*
+   * Handle light hit
+   */
+  if (sample.flags & bsdf::Sample_Emitted) {
+    if (bounce == 0 || path.lastFlags & bsdf::Sample_Specular) {
+      L += attenuation * sample.Le;
+    } else {
+      const float lightPdf = areaLightPdf(
+          args, path.lastPos, path.lastNormal, pathHit.instanceIdx,
+          pathHit.primitiveIdx, hit, ray.direction);
+      const float bsdfWeight = path.lastPdf / (path.lastPdf + lightPdf);
+
+      L += attenuation * bsdfWeight * sample.Le;
+    }
+  }
+
+  /*
+   * Sample direct lighting, deferring the visibility test to the shadow stage
+   */
+  if (ctx.roughness > 0.0 || ctx.metallic + ctx.transmission < 1.0) {
+    auto r = float3(halton.sample2d(), halton.sample1d());
+
+    float pLight = 0;
+    auto lightSample = sampleLight(hit, args, resources, r, pLight);
+
+    const float3 wi = hit.frame.worldToLocal(lightSample.wi);
+    const auto bsdfEval = bsdf.eval(hit.wo, wi);
+
+    if (pLight > 0.0f && length_squared(bsdfEval.f) > 0.0f) {
+      float pdfLight = pLight * lightSample.pdf;
+      uint32_t slot = atomic_fetch_add_explicit(&counters.shadowCount, 1,
+                                                memory_order_relaxed);
+      shadowRays[slot] = {
+          .origin = hit.pos,
+          .direction = lightSample.wi,
+          .Ld = attenuation * lightSample.Li * bsdfEval.f * abs(wi.z) /
+                (pdfLight + bsdfEval.pdf),
+          .maxDistance = length(lightSample.pos - hit.pos) - 1e-3f,
+          .alphaSample = halton.sample1d(),
+          .pathIdx = pathIdx,
+      };
+    }
+  }
+
+  /*
+   * Continue the path if the ray was reflected or transmitted, and it survives
+   * russian roulette
+   */
+  bool alive = sample.flags & (bsdf::Sample_Reflected | bsdf::Sample_Transmitted);
+  if (alive) {
+    attenuation *= sample.f * abs(sample.wi.z) / sample.pdf;
+
+    if (bounce > 0) {
+      float q = max(0.0,
+                    1.0 - max(attenuation.r, max(attenuation.g, attenuation.b)));
+      if (halton.sample1d() < q)
+        alive = false;
+      else
+        attenuation /= 1.0 - q;
+    }
+  }
+
+  path.L = L;
+  path.attenuation = attenuation;
+  path.samplerDim = halton.dimension();
+
+  if (alive) {
+    path.origin = hit.pos;
+    path.direction = normalize(hit.frame.localToWorld(sample.wi));
+    path.pathLength = pathLength;
+    path.lastPos = hit.pos;
+    path.lastNormal = hit.normal;
+    path.lastPdf = sample.pdf;
+    path.lastFlags = sample.flags;
+
+    wavefrontPush(counters.pathCount[queueIdx ^ 1], nextQueue, pathIdx);
+  }
+}
+
+/*
+ * Set up the shadow ray dispatch.
+ */
+kernel void wavefrontPrepareShadow(WAVEFRONT_BUFFERS) {
+  uint32_t count =
+      atomic_load_explicit(&counters.shadowCount, memory_order_relaxed);
+  counters.shadowArgs = wavefrontDispatch(count);
+}
+
+/*
+ * Trace shadow rays, adding the light contribution of unoccluded ones. Each
+ * path queues at most one shadow ray per bounce, so there are no write races.
+ */
+kernel void
+wavefrontShadow(uint idx [[thread_position_in_grid]], WAVEFRONT_BUFFERS,
+                IntersectionFunctionTable ift [[buffer(10)]]) {
+  if (idx >= atomic_load_explicit(&counters.shadowCount, memory_order_relaxed))
+    return;
+
+  const auto shadowRay = shadowRays[idx];
+  ray ray(shadowRay.origin, shadowRay.direction, 1e-3f, shadowRay.maxDistance);
+
+  auto i = createTriangleIntersector();
+  i.accept_any_intersection(true);
+  auto intersection =
+      i.intersect(ray, args.accelStruct, ift, shadowRay.alphaSample);
+
+  if (intersection.type == intersection_type::none)
+    paths[shadowRay.pathIdx].L += shadowRay.Ld;
+}
+
+/*
+ * Accumulate the radiance of finished paths.
+ */
+kernel void wavefrontAccumulate(uint2 tid [[thread_position_in_grid]],
+                                WAVEFRONT_BUFFERS,
+                                texture2d<float, access::read_write> acc
+                                [[texture(0)]]) {
+  uint2 pixel;
+  if (getPixel(tid, args.constants, acc, pixel)) {
+    float3 L = paths[tid.y * acc.get_width() + tid.x].L;
+
+    uint32_t localFrameIdx = args.constants.bucketFrameIdx;
+    if (localFrameIdx > 0) {
+      float3 L_prev = acc.read(tid).xyz;
+
+      L += L_prev * localFrameIdx;
+      L /= (localFrameIdx + 1);
+    }
+
+    acc.write(float4(L, 1.0f), tid);
+  }
+}
+
+/*
+ * ReSTIR direct lighting at the primary hit (Bitterli et al. 2020,
+ * "Spatiotemporal reservoir resampling for real-time ray tracing with dynamic
+ * direct lighting"). Runs before misKernel, which shades the primary hit with
+ * the light sample left in the final reservoir:
+ * - restirInitial traces the primary ray, resamples a set of light sample
+ *   candidates and combines them with the previous frame's final reservoir.
+ * - restirSpatial combines each reservoir with a few of its neighbours'.
+ * The target function is the unshadowed contribution of a light sample, and
+ * reservoirs are combined with 1/Z weights, so the result is unbiased.
+ * Samples on area lights are reused in area measure, environment samples in
+ * solid angle measure, so no jacobian is needed when moving between pixels.
+ */
+
+// RGB weights for the target function
+constexpr constant float3 restirLuma(0.2126f, 0.7152f, 0.0722f);
+
+/*
+ * Unshadowed contribution of a reservoir's sample at a shading point
+ */
+float restirTarget(thread const Hit &hit, thread bsdf::BSDF &bsdf,
+                   thread const LightReservoir &r) {
+  float3 wi = r.pos;
+  float G = 1.0f;
+  if (!r.isEnv) {
+    const float dist2 = length_squared(r.pos - hit.pos);
+    if (dist2 == 0.0f)
+      return 0.0f;
+
+    wi = (r.pos - hit.pos) * rsqrt(dist2);
+    G = abs(dot(r.normal, wi)) / dist2;
+  }
+
+  const float3 wiLocal = hit.frame.worldToLocal(wi);
+  const auto eval = bsdf.eval(hit.wo, wiLocal);
+  return max(dot(r.Li * eval.f, restirLuma), 0.0f) * abs(wiLocal.z) * G;
+}
+
+/*
+ * Stream a sample into a reservoir, with resampling weight w. Returns true if
+ * the sample was selected.
+ */
+bool restirUpdate(thread LightReservoir &r, thread const LightReservoir &y,
+                  float w, float u) {
+  if (!(w > 0.0f) || isinf(w))
+    return false;
+
+  r.wSum += w;
+  if (u * r.wSum >= w)
+    return false;
+
+  r.pos = y.pos;
+  r.normal = y.normal;
+  r.Li = y.Li;
+  r.isEnv = y.isEnv;
+  return true;
+}
+
+__attribute__((always_inline)) Hit restirHit(thread Resources &res,
+                                             thread const RestirSurface &s,
+                                             float coneSpread) {
+  ray ray(s.origin, s.direction, 1e-3f, INFINITY);
+  return res.getIntersectionData(
+      ray, s.instanceIdx, s.primitiveIdx,
+      uint3(s.indices[0], s.indices[1], s.indices[2]), s.barycentricCoords,
+      s.distance, coneSpread * s.distance);
+}
+
+/*
+ * Trace the primary ray, resample light candidates and reuse the previous
+ * frame's reservoir. Writes the first set of reservoirs.
+ */
+kernel void restirInitial(uint2 tid [[thread_position_in_grid]],
+                          constant Arguments &args [[buffer(0)]],
+                          IntersectionFunctionTable ift [[buffer(1)]],
+                          texture2d<float, access::read_write> acc
+                          [[texture(0)]]) {
+  if (tid.x >= acc.get_width() || tid.y >= acc.get_height())
+    return;
+
+  const uint32_t idx = tid.y * acc.get_width() + tid.x;
+  const uint32_t pixelCount = acc.get_width() * acc.get_height();
+  const uint32_t frameIdx = args.constants.frameIdx;
+
+  // Read last frame's data before overwriting it
+  const RestirSurface prevSurface = args.restirSurfaces[idx];
+  LightReservoir prev = args.reservoirs[pixelCount + idx];
+
+  LightReservoir r{.frameIdx = frameIdx};
+  RestirSurface surface{.valid = 0};
+
+  uint2 pixel;
+  if (!getPixel(tid, args.constants, acc, pixel)) {
+    args.restirSurfaces[idx] = surface;
+    args.reservoirs[idx] = r;
+    return;
+  }
+
+  auto resources = makeResources(args);
+
+  /*
+   * Trace the same primary ray as misKernel: same sampler, same dimensions
+   */
+  samplers::HaltonSampler halton(pixel, args.constants.size,
+                                 args.constants.spp, frameIdx);
+  auto ray = spawnRayFromCamera(args.constants.camera, pixel,
+                                halton.sample2d(), halton.sample2d());
+  auto i = createTriangleIntersector();
+  float ir = halton.sample1d();
+  auto intersection = i.intersect(ray, args.accelStruct, ift, ir);
+
+  if (intersection.type == intersection_type::none ||
+      args.constants.lightCount + args.constants.envLightCount == 0) {
+    args.restirSurfaces[idx] = surface;
+    args.reservoirs[idx] = r;
+    return;
+  }
+
+  const float coneSpread =
+      rayConeSpread(args.constants.camera, args.constants.size);
+  const auto hit = resources.getIntersectionData(
+      ray, intersection, coneSpread * intersection.distance);
+  bsdf::ShadingContext ctx(*hit.material, hit.uv, args.constants.idt,
+                           args.textures, hit.lod);
+  auto bsdf = bsdf::BSDF(ctx, args.constants, args.luts);
+
+  // Purely specular surfaces don't sample lights
+  if (!(ctx.roughness > 0.0 || ctx.metallic + ctx.transmission < 1.0)) {
+    args.restirSurfaces[idx] = surface;
+    args.reservoirs[idx] = r;
+    return;
+  }
+
+  device auto &data = *(device PrimitiveData *)intersection.primitive_data;
+  surface = {
+      .origin = ray.origin,
+      .direction = ray.direction,
+      .normal = hit.normal,
+      .instanceIdx = intersection.instance_id,
+      .primitiveIdx = intersection.primitive_id,
+      .indices = {data.indices[0], data.indices[1], data.indices[2]},
+      .barycentricCoords = intersection.triangle_barycentric_coord,
+      .distance = intersection.distance,
+      .valid = 1,
+  };
+
+  /*
+   * Resample light candidates, picked the same way as for NEE. The ratio of
+   * target to source PDF is the same in area and solid angle measure.
+   */
+  samplers::PCG4DSampler rng(pixel, args.constants.size, args.constants.spp,
+                             frameIdx);
+  const float pInfinite = infiniteLightProbability(args.constants);
+
+  float target = 0.0f;
+  for (uint32_t k = 0; k < Restir_Candidates; k++) {
+    auto rl = float3(rng.sample2d(), rng.sample1d());
+    const bool env = rl.z < pInfinite;
+
+    float pLight = 0;
+    const auto lightSample = sampleLight(hit, args, resources, rl, pLight);
+    if (pLight == 0.0f)
+      continue;
+
+    const LightReservoir y{
+        .pos = env ? lightSample.wi : lightSample.pos,
+        .normal = lightSample.normal,
+        .Li = lightSample.Li,
+        .isEnv = env,
+    };
+    const float yTarget = restirTarget(hit, bsdf, y);
+    const float source = pLight * lightSample.pdf;
+    if (!(yTarget > 0.0f) || !(source > 0.0f) || isinf(source))
+      continue;
+
+    const float G = env ? 1.0f
+                        : abs(dot(y.normal, lightSample.wi)) /
+                              length_squared(y.pos - hit.pos);
+    if (restirUpdate(r, y, yTarget / (source * G), rng.sample1d()))
+      target = yTarget;
+  }
+
+  r.M = Restir_Candidates;
+  r.W = target > 0.0f ? r.wSum / (float(r.M) * target) : 0.0f;
+
+  /*
+   * Temporal reuse: combine with last frame's final reservoir for this pixel.
+   * The camera doesn't move during a render, so the history is at the same
+   * pixel, only the primary hit changes with the pixel jitter.
+   */
+  if (prev.frameIdx + 1 == frameIdx && prevSurface.valid && prev.M > 0) {
+    prev.M = min(prev.M, uint32_t(Restir_HistoryLimit * Restir_Candidates));
+
+    LightReservoir combined{.frameIdx = frameIdx};
+    float combinedTarget = 0.0f;
+    if (restirUpdate(combined, r, target * r.W * float(r.M), rng.sample1d()))
+      combinedTarget = target;
+
+    const float prevTarget = restirTarget(hit, bsdf, prev);
+    if (restirUpdate(combined, prev, prevTarget * prev.W * float(prev.M),
+                     rng.sample1d()))
+      combinedTarget = prevTarget;
+
+    combined.M = r.M + prev.M;
+
+    // Only count the history if it could have produced the selected sample
+    uint32_t Z = r.M;
+    const auto prevHit = restirHit(resources, prevSurface, coneSpread);
+    bsdf::ShadingContext prevCtx(*prevHit.material, prevHit.uv,
+                                 args.constants.idt, args.textures,
+                                 prevHit.lod);
+    auto prevBsdf = bsdf::BSDF(prevCtx, args.constants, args.luts);
+    if (restirTarget(prevHit, prevBsdf, combined) > 0.0f)
+      Z += prev.M;
+
+    combined.W = combinedTarget > 0.0f
+                     ? combined.wSum / (float(Z) * combinedTarget)
+                     : 0.0f;
+    r = combined;
+  }
+
+  args.restirSurfaces[idx] = surface;
+  args.reservoirs[idx] = r;
+}
+
+/*
+ * Spatial reuse: combine each pixel's reservoir with those of a few similar
+ * neighbours. Writes the final set of reservoirs, read by misKernel and by the
+ * next frame's temporal reuse.
+ */
+kernel void restirSpatial(uint2 tid [[thread_position_in_grid]],
+                          constant Arguments &args [[buffer(0)]],
+                          texture2d<float, access::read_write> acc
+                          [[texture(0)]]) {
+  uint2 pixel;
+  if (!getPixel(tid, args.constants, acc, pixel))
+    return;
+
+  const uint32_t width = acc.get_width(), height = acc.get_height();
+  const uint32_t idx = tid.y * width + tid.x;
+  const uint32_t frameIdx = args.constants.frameIdx;
+  device auto &output = args.reservoirs[width * height + idx];
+
+  const RestirSurface surface = args.restirSurfaces[idx];
+  const LightReservoir r = args.reservoirs[idx];
+  if (!surface.valid) {
+    output = {.frameIdx = frameIdx};
+    return;
+  }
+
+  auto resources = makeResources(args);
+  const float coneSpread =
+      rayConeSpread(args.constants.camera, args.constants.size);
+  const auto hit = restirHit(resources, surface, coneSpread);
+  bsdf::ShadingContext ctx(*hit.material, hit.uv, args.constants.idt,
+                           args.textures, hit.lod);
+  auto bsdf = bsdf::BSDF(ctx, args.constants, args.luts);
+
+  samplers::PCG4DSampler rng(pixel, args.constants.size, args.constants.spp,
+                             ~frameIdx);
+
+  LightReservoir combined{.frameIdx = frameIdx};
+  float combinedTarget = 0.0f;
+
+  const float rTarget = restirTarget(hit, bsdf, r);
+  if (restirUpdate(combined, r, rTarget * r.W * float(r.M), rng.sample1d()))
+    combinedTarget = rTarget;
+  combined.M = r.M;
+
+  /*
+   * Pick neighbours in a disk around the pixel, skipping those with a very
+   * different depth or normal
+   */
+  uint32_t neighbours[Restir_SpatialNeighbors];
+  uint32_t neighbourCount = 0;
+  for (uint32_t k = 0; k < Restir_SpatialNeighbors; k++) {
+    const float2 offset =
+        samplers::sampleDisk(rng.sample2d()) * float(Restir_SpatialRadius);
+    const int2 q = int2(tid) + int2(round(offset));
+    if (q.x < 0 || q.y < 0 || q.x >= int(width) || q.y >= int(height) ||
+        all(uint2(q) == tid))
+      continue;
+
+    const uint32_t qIdx = uint32_t(q.y) * width + uint32_t(q.x);
+    device const auto &qSurface = args.restirSurfaces[qIdx];
+    if (!qSurface.valid ||
+        abs(qSurface.distance - surface.distance) > 0.1f * surface.distance ||
+        dot(qSurface.normal, surface.normal) < 0.9f)
+      continue;
+
+    const LightReservoir qr = args.reservoirs[qIdx];
+    if (qr.M == 0)
+      continue;
+
+    const float qTarget = restirTarget(hit, bsdf, qr);
+    if (restirUpdate(combined, qr, qTarget * qr.W * float(qr.M),
+                     rng.sample1d()))
+      combinedTarget = qTarget;
+    combined.M += qr.M;
+
+    neighbours[neighbourCount++] = qIdx;
+  }
+
+  /*
+   * 1/Z weights: count the candidates of every reservoir that could have
+   * produced the selected sample
+   */
+  uint32_t Z = r.M;
+  if (combinedTarget > 0.0f) {
+    for (uint32_t k = 0; k < neighbourCount; k++) {
+      const RestirSurface qSurface = args.restirSurfaces[neighbours[k]];
+      const auto qHit = restirHit(resources, qSurface, coneSpread);
+      bsdf::ShadingContext qCtx(*qHit.material, qHit.uv, args.constants.idt,
+                                args.textures, qHit.lod);
+      auto qBsdf = bsdf::BSDF(qCtx, args.constants, args.luts);
+      if (restirTarget(qHit, qBsdf, combined) > 0.0f)
+        Z += args.reservoirs[neighbours[k]].M;
+    }
+  }
+
+  combined.W = combinedTarget > 0.0f
+                   ? combined.wSum / (float(Z) * combinedTarget)
+                   : 0.0f;
+  output = combined;
+}
@@ -498,18 +498,34 @@ float2 aspectCompensatedUvInverse(float2 uv, float aspect) {
   return uv;
 }
 
+/*
+ * Map between tile and full image UVs, for position dependent passes. Image
+ * UVs are clamped to the image edge, matching what the sampler does when
+ * rendering the full frame at once.
+ */
+float2 tileToImageUv(float2 uv, constant pp::TileInfo& tile) {
+  return tile.offset + uv * tile.scale;
+}
+
+float2 imageToTileUv(float2 uv, constant pp::TileInfo& tile) {
+  float2 halfTexel = 0.5 / tile.imageSize;
+  uv = clamp(uv, halfTexel, 1.0 - halfTexel);
+  return (uv - tile.offset) / tile.scale;
+}
+
 fragment float4 vignette(
   VertexOut in [[stage_in]],
   texture2d<float> src,
-  constant pp::VignetteOptions& options [[buffer(0)]]
+  constant pp::VignetteOptions& options [[buffer(0)]],
+  constant pp::TileInfo& tile [[buffer(1)]]
 ) {
   constexpr sampler sampler(min_filter::linear, mag_filter::linear, mip_filter::none);
 
   float3 color = src.sample(sampler, in.uv).xyz;
 
-  float aspect = float(src.get_width()) / float(src.get_height());
+  float aspect = tile.imageSize.x / tile.imageSize.y;
   aspect = mix(1.0, aspect, options.roundness * 0.01);
-  float2 uvMapped = aspectCompensatedUv(in.uv, aspect);
+  float2 uvMapped = aspectCompensatedUv(tileToImageUv(in.uv, tile), aspect);
 
   float cornerToCenter = distance(float2(0.0), float2(0.5));
   float distanceToCenter = distance(uvMapped, float2(0.5));
@@ -529,24 +545,25 @@ fragment float4 vignette(
 fragment float4 chromaticAberration(
   VertexOut in [[stage_in]],
   texture2d<float> src,
-  constant pp::ChromaticAberrationOptions& options [[buffer(0)]]
+  constant pp::ChromaticAberrationOptions& options [[buffer(0)]],
+  constant pp::TileInfo& tile [[buffer(1)]]
 ) {
   constexpr sampler sampler(min_filter::linear, mag_filter::linear, mip_filter::none);
 
   float3 color = src.sample(sampler, in.uv).rgb;
   if (options.amount == 0.0) return float4(color, 1.0);
 
-  float aspect = float(src.get_width()) / float(src.get_height());
-  float2 uvMapped = aspectCompensatedUv(in.uv, aspect);
+  float aspect = tile.imageSize.x / tile.imageSize.y;
+  float2 uvMapped = aspectCompensatedUv(tileToImageUv(in.uv, tile), aspect);
 
   float amount = options.amount * 0.005 * 0.01;
   float2 uvRed = aspectCompensatedUvInverse((uvMapped - 0.5) * (1.0 + amount) + 0.5, aspect);
   float2 uvGreen = aspectCompensatedUvInverse((uvMapped - 0.5) * (1.0 - amount * options.greenShift * 0.01) + 0.5, aspect);
   float2 uvBlue = aspectCompensatedUvInverse((uvMapped - 0.5) * (1.0 - amount) + 0.5, aspect);
 
-  color.r = src.sample(sampler, uvRed).r;
-  color.g = src.sample(sampler, uvGreen).g;
-  color.b = src.sample(sampler, uvBlue).b;
+  color.r = src.sample(sampler, imageToTileUv(uvRed, tile)).r;
+  color.g = src.sample(sampler, imageToTileUv(uvGreen, tile)).g;
+  color.b = src.sample(sampler, imageToTileUv(uvBlue, tile)).b;
 
   return float4(color, 1.0);
 }
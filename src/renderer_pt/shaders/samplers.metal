@@ -60,9 +60,10 @@ uint32_t scrambleHash(uint32_t x) {
 }
 
 ZSampler::ZSampler(uint2 tid, uint2 size, uint32_t spp, uint32_t sample) {
+  // Integer log2 so the CPU implementation gets the same digit count
   uint32_t resolution = nextPowerOfTwo(max(size.x, size.y));
-  m_log2Resolution = uint32_t(ceil(log2(float(resolution))));
-  m_log2spp = uint32_t(ceil(log2(float(spp))));
+  m_log2Resolution = ctz(resolution);
+  m_log2spp = spp > 1 ? 32 - clz(spp - 1) : 0;
 
   m_base4Digits = m_log2Resolution + (m_log2spp + 1) / 2;
 
@@ -118,7 +119,7 @@ uint32_t ZSampler::index(uint32_t dim) {
     uint32_t x = (m_z >> (2 * shift));
     uint32_t digit = x & 3;
     uint32_t prefix = x >> 2;
-    digit = c_permutations[hash(prefix, dim)][digit];
+    digit = zPermutations[hash(prefix, dim)][digit];
     z_pi |= digit;
   }
 
@@ -167,16 +168,20 @@ float2 HaltonSampler::sample2d() {
 
 __attribute__((always_inline))
 float HaltonSampler::halton(uint32_t i, uint32_t d) {
-  uint32_t b = c_primes[d];
+  uint32_t b = haltonPrimes[d];
 
+  /*
+   * Correctly rounded reciprocal and explicit FMA, so fast math can't change
+   * the result and the CPU implementation matches bit for bit
+   */
   float f = 1.0f;
-  float invB = 1.0f / b;
+  float invB = precise::divide(1.0f, float(b));
 
   float r = 0;
 
   while (i > 0) {
     f = f * invB;
-    r = r + f * (i % b);
+    r = fma(f, float(i % b), r);
     i = i / b;
   }
 
@@ -0,0 +1,85 @@
+#include "instance_batcher.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+
+#include <utils/matrices.hpp>
+#include <utils/utils.hpp>
+
+namespace pt::renderer_studio::batching {
+
+static float3x3 normalMatrix(const float4x4& transform) {
+  return transpose(inverse(mat::submatrix3(transform)));
+}
+
+bool Batcher::update(std::span<const Instance> instances) {
+  const size_t count = instances.size();
+  m_updates++;
+
+  /*
+   * Find each instance's cache entry, adding new nodes. Entries are referred
+   * to by position, which stays valid while inserting.
+   */
+  m_slots.resize(count);
+  m_dirty.clear();
+  for (size_t i = 0; i < count; i++) {
+    const auto& instance = instances[i];
+    auto [it, inserted] = m_cache.try_emplace(instance.nodeIdx);
+    m_slots[i] = uint32_t(it - m_cache.begin());
+
+    if (inserted || std::memcmp(&it->second.transform, &instance.transform, sizeof(float4x4)) != 0)
+      m_dirty.push_back(uint32_t(i));
+    it->second.update = m_updates;
+  }
+
+  m_recomputed = m_dirty.size();
+  utils::parallelFor(m_dirty.size(), [&](size_t i) {
+    const auto& instance = instances[m_dirty[i]];
+    auto& cached = (m_cache.begin() + m_slots[m_dirty[i]])->second;
+    cached.transform = instance.transform;
+    cached.normalModel = normalMatrix(instance.transform);
+  }, 1024);
+
+  /*
+   * Group by mesh and level, keeping the incoming order within each batch
+   */
+  m_order.resize(count);
+  std::iota(m_order.begin(), m_order.end(), 0u);
+  std::ranges::stable_sort(m_order, [&](uint32_t a, uint32_t b) {
+    if (instances[a].mesh != instances[b].mesh) return instances[a].mesh < instances[b].mesh;
+    return instances[a].level < instances[b].level;
+  });
+
+  std::vector<Batch> batches;
+  for (uint32_t i = 0; i < count; i++) {
+    const auto& instance = instances[m_order[i]];
+    if (batches.empty() || batches.back().mesh != instance.mesh || batches.back().level != instance.level)
+      batches.push_back({instance.mesh, instance.level, i, 0});
+    batches.back().count++;
+  }
+
+  bool changed = m_recomputed > 0 || batches != m_batches || m_orderedNodes.size() != count;
+  m_batches = std::move(batches);
+  m_orderedNodes.resize(count);
+  m_nodeData.resize(count);
+  for (size_t i = 0; i < count; i++) {
+    const auto& instance = instances[m_order[i]];
+    const auto& cached = (m_cache.begin() + m_slots[m_order[i]])->second;
+
+    changed |= m_orderedNodes[i] != instance.nodeIdx;
+    m_orderedNodes[i] = instance.nodeIdx;
+    m_nodeData[i] = {
+      .model = cached.transform,
+      .normalModel = cached.normalModel,
+      .nodeIdx = instance.nodeIdx,
+    };
+  }
+
+  // Forget nodes that are gone
+  if (m_cache.size() > count) std::erase_if(m_cache, [&](const auto& entry) { return entry.second.update != m_updates; });
+
+  return changed;
+}
+
+}
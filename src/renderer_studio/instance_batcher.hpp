@@ -0,0 +1,81 @@
+#ifndef PLATINUM_INSTANCE_BATCHER_HPP
+#define PLATINUM_INSTANCE_BATCHER_HPP
+
+#include <span>
+#include <vector>
+#include <simd/simd.h>
+#include <unordered_dense.h>
+
+#include "shader_defs.hpp"
+
+using namespace simd;
+
+namespace pt::renderer_studio::batching {
+
+/*
+ * Instance as seen by the batcher, independent of the scene and renderer
+ */
+struct Instance {
+  uint32_t nodeIdx;   // Identifies the instance between updates, unique
+  uint64_t mesh;      // Mesh asset ID
+  uint32_t level;     // Level of detail to draw
+  float4x4 transform;
+};
+
+/*
+ * Range of per instance data drawn with a single instanced draw
+ */
+struct Batch {
+  uint64_t mesh;
+  uint32_t level;
+  uint32_t first, count;
+
+  bool operator==(const Batch& other) const = default;
+};
+
+/*
+ * Groups instances by mesh and level of detail into instanced draws, and lays
+ * out the per instance data batch by batch, in the order instances came in.
+ * Normal matrices only depend on the model transform, the view rotation is
+ * applied in the shader, so they're cached per node and only recomputed (in
+ * parallel) for instances that are new or whose transform changed. Moving the
+ * camera recomputes nothing.
+ * Doesn't touch the GPU, the renderer uploads nodeData() when update()
+ * reports a change.
+ */
+class Batcher {
+public:
+  /*
+   * Returns true if the per instance data or the batches changed since the
+   * last update.
+   */
+  bool update(std::span<const Instance> instances);
+
+  [[nodiscard]] constexpr const std::vector<Batch>& batches() const { return m_batches; }
+  [[nodiscard]] constexpr const std::vector<shaders_studio::NodeData>& nodeData() const { return m_nodeData; }
+
+  // Normal matrices recomputed by the last update
+  [[nodiscard]] constexpr size_t recomputed() const { return m_recomputed; }
+
+private:
+  struct Cached {
+    float4x4 transform;
+    float3x3 normalModel;
+    uint64_t update = 0; // Last update the node was seen in
+  };
+
+  ankerl::unordered_dense::map<uint32_t, Cached> m_cache;
+  uint64_t m_updates = 0;
+  size_t m_recomputed = 0;
+
+  std::vector<Batch> m_batches;
+  std::vector<shaders_studio::NodeData> m_nodeData;
+  std::vector<uint32_t> m_orderedNodes; // Node of each entry in m_nodeData
+
+  // Scratch space
+  std::vector<uint32_t> m_slots, m_dirty, m_order;
+};
+
+}
+
+#endif //PLATINUM_INSTANCE_BATCHER_HPP
@@ -0,0 +1,158 @@
+#include "lod_cache.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+namespace pt::renderer_studio {
+
+LodCache::~LodCache() {
+  for (auto& [id, entry]: m_entries) {
+    for (auto& level: entry.levels) level.indices->release();
+  }
+}
+
+void LodCache::update(Scene& scene, MTL::Device* device, std::span<const Scene::AssetID> meshes) {
+  std::erase_if(m_entries, [&](auto& entry) {
+    if (scene.assetValid(entry.first)) return false;
+
+    for (auto& level: entry.second.levels) level.indices->release();
+    return true;
+  });
+
+  /*
+   * Pick up the running build if it's done. Builds for meshes that were
+   * removed in the meantime are stopped and discarded.
+   */
+  if (m_job) {
+    if (!scene.assetValid(m_job->mesh)) m_job->thread.request_stop();
+    if (m_job->result.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+
+    auto build = m_job->result.get();
+    if (!m_job->thread.get_stop_token().stop_requested()) {
+      Entry entry{.center = build.center, .radius = build.radius};
+      for (const auto& lod: build.lods) {
+        auto buffer = device->newBuffer(
+          lod.indices.data(),
+          lod.indices.size() * sizeof(uint32_t),
+          MTL::ResourceStorageModeShared
+        );
+        entry.levels.push_back({buffer, lod.indices.size(), lod.error});
+      }
+      m_entries[m_job->mesh] = std::move(entry);
+    }
+
+    m_job.reset();
+  }
+
+  /*
+   * Start the next build. Meshes too small to have levels get an empty entry
+   * right away.
+   */
+  constexpr size_t minTriangles = mesh_simplifier::LodOptions{}.minTriangles;
+  for (auto id: meshes) {
+    if (m_entries.contains(id)) continue;
+
+    const auto* mesh = scene.getAsset<Mesh>(id);
+    if (mesh->indexCount() / 3 / 2 < minTriangles) {
+      m_entries[id] = {};
+      continue;
+    }
+
+    startBuild(id, *mesh);
+    break;
+  }
+}
+
+const LodCache::Entry* LodCache::get(Scene::AssetID id) const {
+  auto it = m_entries.find(id);
+  return it == m_entries.end() ? nullptr : &it->second;
+}
+
+size_t LodCache::select(
+  const Entry& entry,
+  const float4x4& transform,
+  float3 cameraPosition,
+  float pixelsPerUnit,
+  float maxPixelError
+) {
+  if (entry.levels.empty()) return 0;
+
+  const float scale = std::max({
+    length(transform.columns[0].xyz),
+    length(transform.columns[1].xyz),
+    length(transform.columns[2].xyz),
+  });
+  const float3 center = (transform * make_float4(entry.center, 1.0f)).xyz;
+
+  // Closest point of the bounding sphere, full detail if the camera is inside
+  const float dist = distance(center, cameraPosition) - entry.radius * scale;
+  if (dist <= 0.0f) return 0;
+
+  // Levels get coarser and their error only grows, so stop at the first one that's too coarse
+  const float pixelsPerMeshUnit = scale * pixelsPerUnit / dist;
+  size_t level = 0;
+  for (size_t i = 0; i < entry.levels.size(); i++) {
+    if (entry.levels[i].error * pixelsPerMeshUnit > maxPixelError) break;
+    level = i + 1;
+  }
+  return level;
+}
+
+void LodCache::startBuild(Scene::AssetID id, const Mesh& mesh) {
+  /*
+   * Copy the mesh's buffers, so the build doesn't depend on the mesh staying
+   * alive. Unpacking the vertices is left to the build thread.
+   */
+  auto positions = static_cast<const PackedFloat3*>(mesh.vertexPositions()->contents());
+  auto vertexData = static_cast<const PackedVertexData*>(mesh.vertexData()->contents());
+  auto indices = static_cast<const uint32_t*>(mesh.indices()->contents());
+  auto materialIndices = static_cast<const uint32_t*>(mesh.materialIndices()->contents());
+
+  std::vector<PackedFloat3> packedPositions(positions, positions + mesh.vertexCount());
+  std::vector<PackedVertexData> packedVertexData(vertexData, vertexData + mesh.vertexCount());
+  std::vector<float2> texCoords;
+  if (mesh.texCoordData()) {
+    auto fullTexCoords = static_cast<const float2*>(mesh.texCoordData()->contents());
+    texCoords.assign(fullTexCoords, fullTexCoords + mesh.vertexCount());
+  }
+  mesh_optimizer::MeshData data{
+    .indices = {indices, indices + mesh.indexCount()},
+    .materialIndices = {materialIndices, materialIndices + mesh.indexCount() / 3},
+  };
+
+  std::promise<Build> promise;
+  m_job.emplace(Job{id, promise.get_future(), {}});
+  m_job->thread = std::jthread(
+    [
+      promise = std::move(promise),
+      packedPositions = std::move(packedPositions),
+      packedVertexData = std::move(packedVertexData),
+      texCoords = std::move(texCoords),
+      data = std::move(data),
+      bounds = mesh.texCoordBounds()
+    ](std::stop_token stopToken) mutable {
+      data.positions.resize(packedPositions.size());
+      data.vertexData.resize(packedVertexData.size());
+      for (size_t v = 0; v < packedPositions.size(); v++) {
+        data.positions[v] = {packedPositions[v].x, packedPositions[v].y, packedPositions[v].z};
+        data.vertexData[v] = vertex_format::unpack(packedVertexData[v], bounds);
+        if (!texCoords.empty()) data.vertexData[v].texCoords = texCoords[v];
+      }
+
+      float3 lo = std::numeric_limits<float>::infinity(), hi = -lo;
+      for (auto p: data.positions) {
+        lo = min(lo, p);
+        hi = max(hi, p);
+      }
+
+      Build build{.center = data.positions.empty() ? float3{0, 0, 0} : (lo + hi) * 0.5f, .radius = 0.0f};
+      for (auto p: data.positions) build.radius = std::max(build.radius, distance(p, build.center));
+
+      build.lods = mesh_simplifier::buildLods(data, {}, {.stopToken = stopToken});
+      promise.set_value(std::move(build));
+    }
+  );
+}
+
+}
@@ -0,0 +1,90 @@
+#ifndef PLATINUM_LOD_CACHE_HPP
+#define PLATINUM_LOD_CACHE_HPP
+
+#include <future>
+#include <optional>
+#include <span>
+#include <thread>
+#include <vector>
+#include <Metal/Metal.hpp>
+
+#include <core/scene.hpp>
+#include <core/mesh_simplifier.hpp>
+
+namespace pt::renderer_studio {
+
+/*
+ * Simplified levels of detail for the studio viewport. Levels are built on a
+ * background thread, one mesh at a time, and meshes are drawn at full detail
+ * until theirs are ready. Each level is an index buffer into the mesh's own
+ * vertex buffers, so levels only cost index memory.
+ * Entries are keyed by mesh, like the path tracer's caches: meshes are never
+ * modified in place, so an edited mesh gets a new ID and new levels. The path
+ * tracer always uses the full mesh.
+ */
+class LodCache {
+public:
+  struct Level {
+    MTL::Buffer* indices = nullptr;
+    size_t indexCount = 0;
+    float error = 0.0f; // Distance to the full mesh, in mesh space units
+  };
+
+  struct Entry {
+    std::vector<Level> levels; // Finest first, not including the full mesh
+
+    // Bounding sphere, in mesh space
+    float3 center = {0, 0, 0};
+    float radius = 0.0f;
+  };
+
+  LodCache() = default;
+  LodCache(const LodCache& m) = delete;
+  LodCache& operator=(const LodCache& m) = delete;
+
+  ~LodCache();
+
+  /*
+   * Drop entries for meshes that no longer exist, pick up a finished build and
+   * start building the next mesh without an entry.
+   */
+  void update(Scene& scene, MTL::Device* device, std::span<const Scene::AssetID> meshes);
+
+  [[nodiscard]] const Entry* get(Scene::AssetID id) const;
+
+  /*
+   * Pick the coarsest level whose error projects to at most maxPixelError
+   * pixels on screen, for an instance of the mesh. pixelsPerUnit is the size
+   * in pixels of one world unit at unit distance from the camera. Returns 0
+   * for the full mesh, or i for levels[i - 1].
+   */
+  [[nodiscard]] static size_t select(
+    const Entry& entry,
+    const float4x4& transform,
+    float3 cameraPosition,
+    float pixelsPerUnit,
+    float maxPixelError
+  );
+
+private:
+  struct Build {
+    std::vector<mesh_simplifier::Lod> lods;
+    float3 center;
+    float radius;
+  };
+
+  struct Job {
+    Scene::AssetID mesh;
+    std::future<Build> result;
+    std::jthread thread; // Destroyed first, which stops and joins it
+  };
+
+  hashmap<Scene::AssetID, Entry> m_entries;
+  std::optional<Job> m_job;
+
+  void startBuild(Scene::AssetID id, const Mesh& mesh);
+};
+
+}
+
+#endif //PLATINUM_LOD_CACHE_HPP
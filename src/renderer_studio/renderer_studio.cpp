@@ -130,7 +130,7 @@ Scene::NodeID Renderer::readbackObjectIdAt(uint32_t x, uint32_t y, float dpiScal
   cmd->commit();
   cmd->waitUntilCompleted();
 
-  uint16_t objectId;
+  uint32_t objectId;
   auto contents = m_objectIdReadbackBuffer->contents();
   memcpy(&objectId, contents, m_objectIdPixelSize);
 
@@ -197,20 +197,42 @@ void Renderer::render(Scene::NodeID selectedNodeId) {
   enc->setFragmentBytes(&m_camera.position, sizeof(m_camera.position), 0);
   enc->setFragmentBuffer(m_constantsBuffer, m_constantsOffset, 1);
 
-  size_t dataOffset = 0;
-  for (const auto& md: m_instances) {
-    enc->setVertexBuffer(md.mesh.asset->vertexPositions(), 0, 0);
-    enc->setVertexBuffer(md.mesh.asset->vertexData(), 0, 1);
-    enc->setVertexBuffer(m_instanceBuffer, dataOffset, 2);
+  /*
+   * One instanced draw per mesh and level of detail. Levels share the mesh's
+   * vertex buffers, so those are only bound when the mesh changes. Instance
+   * data is bound once, each draw starts at its batch through the base
+   * instance, which [[instance_id]] includes. Offsetting the binding instead
+   * would break the alignment Metal requires for constant buffers.
+   */
+  enc->setVertexBuffer(m_instanceBuffer, 0, 2);
+
+  const Mesh* boundMesh = nullptr;
+  for (const auto& batch: m_batcher.batches()) {
+    const auto* mesh = m_store.scene().getAsset<Mesh>(batch.mesh);
+    if (mesh != boundMesh) {
+      enc->setVertexBuffer(mesh->vertexPositions(), 0, 0);
+      enc->setVertexBuffer(mesh->vertexData(), 0, 1);
+      boundMesh = mesh;
+    }
+
+    MTL::Buffer* indices = mesh->indices();
+    size_t indexCount = mesh->indexCount();
+    if (batch.level > 0) {
+      const auto& level = m_lodCache.get(batch.mesh)->levels[batch.level - 1];
+      indices = level.indices;
+      indexCount = level.indexCount;
+    }
+
     enc->drawIndexedPrimitives(
       MTL::PrimitiveTypeTriangle,
-      md.mesh.asset->indexCount(),
+      indexCount,
       MTL::IndexTypeUInt32,
-      md.mesh.asset->indices(),
-      0
+      indices,
+      0,
+      batch.count,
+      0,
+      batch.first
     );
-
-    dataOffset += sizeof(shaders_studio::NodeData);
   }
 
   enc->endEncoding();
@@ -245,20 +267,16 @@ void Renderer::render(Scene::NodeID selectedNodeId) {
   enc->setFragmentBytes(&selectedNodeId, sizeof(selectedNodeId), 0);
   enc->setFragmentBytes(&m_edgeConstants, sizeof(m_edgeConstants), 1);
 
-  // TODO this can use instanced rendering
-  // probably no big deal because we won't ever have more than a few cameras
-  dataOffset = 0;
-  for ([[maybe_unused]] const auto& camera: m_cameras) {
-    enc->setVertexBuffer(m_cameraBuffer, dataOffset, 1);
+  if (!m_cameras.empty()) {
+    enc->setVertexBuffer(m_cameraBuffer, 0, 1);
     enc->drawIndexedPrimitives(
       MTL::PrimitiveTypeLine,
       16,
       MTL::IndexTypeUInt32,
       m_cameraIndexBuffer,
-      0
+      0,
+      m_cameras.size()
     );
-
-    dataOffset += sizeof(shaders_studio::NodeData);
   }
 
   /*
@@ -332,7 +350,7 @@ void Renderer::buildPipelines() {
     {
       .vertexFunction = metal_utils::getFunction(lib, "vertexShader"),
       .fragmentFunction = metal_utils::getFunction(lib, "fragmentShader"),
-      .colorAttachments = {MTL::PixelFormatRGBA8Unorm, MTL::PixelFormatR16Uint},
+      .colorAttachments = {MTL::PixelFormatRGBA8Unorm, MTL::PixelFormatR32Uint},
       .depthFormat = MTL::PixelFormatDepth32Float,
       .stencilFormat = MTL::PixelFormatStencil8,
     },
@@ -343,14 +361,14 @@ void Renderer::buildPipelines() {
           .bufferIndex = 0,
         },
         {
-          .format = MTL::VertexFormatFloat3,
-          .offset = offsetof(VertexData, normal),
+          .format = MTL::VertexFormatShort2Normalized,
+          .offset = offsetof(PackedVertexData, normal),
           .bufferIndex = 1,
         }
       },
       .layouts = {
-        {.stride = sizeof(float3)},
-        {.stride = sizeof(VertexData)},
+        {.stride = sizeof(PackedFloat3)},
+        {.stride = sizeof(PackedVertexData)},
       }
     }
   );
@@ -468,7 +486,8 @@ void Renderer::rebuildDataBuffers() {
   auto instances = m_store.scene().getInstances();
   auto cameras = m_store.scene().getCameras();
 
-  if (m_instances.size() != instances.size()) {
+  const bool instanceBufferRebuilt = m_instances.size() != instances.size();
+  if (instanceBufferRebuilt) {
     if (m_instanceBuffer != nullptr) m_instanceBuffer->release();
     m_instanceBuffer = m_device->newBuffer(
       instances.size() * sizeof(shaders_studio::NodeData),
@@ -487,29 +506,40 @@ void Renderer::rebuildDataBuffers() {
   m_instances = std::move(instances);
   m_cameras = std::move(cameras);
 
+  std::vector<Scene::AssetID> meshIds;
+  meshIds.reserve(m_instances.size());
+  for (const auto& instance: m_instances) meshIds.push_back(instance.mesh.id);
+  m_lodCache.update(m_store.scene(), m_device, meshIds);
+
   /*
-   * Fill transform buffers
+   * Pick a level of detail for each instance and batch them. Per instance
+   * data is only uploaded if it changed.
    */
-  float4x4 view = m_camera.view();
+  const float pixelsPerUnit = m_camera.projection(m_aspect).columns[1].y * m_viewportSize.y * 0.5f;
+
+  std::vector<batching::Instance> batchInstances(m_instances.size());
   for (size_t i = 0; i < m_instances.size(); i++) {
     const auto& instance = m_instances[i];
 
-    float4x4 vmit = transpose(inverse(view * instance.transformMatrix));
-    float3x3 normalViewModel(
-      vmit.columns[0].xyz,
-      vmit.columns[1].xyz,
-      vmit.columns[2].xyz
-    );
+    uint32_t level = 0;
+    if (const auto* lods = m_lodCache.get(instance.mesh.id)) {
+      level = uint32_t(LodCache::select(
+        *lods, instance.transformMatrix, m_camera.position, pixelsPerUnit, m_lodPixelError
+      ));
+    }
 
-    const shaders_studio::NodeData nodeData = {
-      .model = instance.transformMatrix,
-      .normalViewModel = normalViewModel,
-      .nodeIdx = uint16_t(instance.node.id()), // TODO: upgrade to i32
+    batchInstances[i] = {
+      .nodeIdx = uint32_t(instance.node.id()),
+      .mesh = instance.mesh.id,
+      .level = level,
+      .transform = instance.transformMatrix,
     };
+  }
 
-    // Transform
-    void* dbw = (char*) m_instanceBuffer->contents() + i * sizeof(shaders_studio::NodeData);
-    memcpy(dbw, &nodeData, sizeof(shaders_studio::NodeData));
+  const bool instancesChanged = m_batcher.update(batchInstances);
+  if ((instancesChanged || instanceBufferRebuilt) && !m_instances.empty()) {
+    const auto& nodeData = m_batcher.nodeData();
+    memcpy(m_instanceBuffer->contents(), nodeData.data(), nodeData.size() * sizeof(shaders_studio::NodeData));
   }
 
   for (size_t i = 0; i < m_cameras.size(); i++) {
@@ -534,7 +564,7 @@ void Renderer::rebuildDataBuffers() {
     // Don't need a normal transform matrix, leave it empty
     const shaders_studio::NodeData nodeData = {
       .model = transform,
-      .nodeIdx = uint16_t(camera.node.id()),
+      .nodeIdx = uint32_t(camera.node.id()),
     };
 
     // Transform
@@ -561,7 +591,7 @@ void Renderer::rebuildRenderTargets() {
   m_auxRenderTarget = m_device->newTexture(texd);
   m_primaryRenderTarget = m_device->newTexture(texd);
 
-  texd->setPixelFormat(MTL::PixelFormatR16Uint);
+  texd->setPixelFormat(MTL::PixelFormatR32Uint);
   m_objectIdRenderTarget = m_device->newTexture(texd);
 
   texd->setPixelFormat(MTL::PixelFormatDepth32Float);
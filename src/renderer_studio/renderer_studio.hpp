@@ -4,6 +4,8 @@
 #include <Metal/Metal.hpp>
 
 #include <core/store.hpp>
+#include "instance_batcher.hpp"
+#include "lod_cache.hpp"
 #include "shader_defs.hpp"
 #include "studio_camera.hpp"
 
@@ -69,6 +71,13 @@ private:
   MTL::Buffer* m_instanceBuffer = nullptr;
   std::vector<Scene::Instance> m_instances;
 
+  // Mesh levels of detail, picked per instance by projected error
+  LodCache m_lodCache;
+  float m_lodPixelError = 1.0f;
+
+  // Instances grouped into instanced draws, with per instance data in draw order
+  batching::Batcher m_batcher;
+
   // Camera pass pipeline state and buffers
   MTL::RenderPipelineState* m_cameraPso = nullptr;
   MTL::DepthStencilState* m_cameraDsso = nullptr;
@@ -95,7 +104,7 @@ private:
   MTL::SamplerState* m_postPassSso = nullptr;
 
   // Readback buffer
-  static constexpr const uint32_t m_objectIdPixelSize = sizeof(uint16_t);
+  static constexpr const uint32_t m_objectIdPixelSize = sizeof(uint32_t);
   MTL::Buffer* m_objectIdReadbackBuffer = nullptr;
 
   // Constants
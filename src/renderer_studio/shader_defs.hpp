@@ -6,6 +6,8 @@
 
 #include <simd/simd.h>
 
+#include "../core/vertex_format.hpp"
+
 using namespace simd;
 
 // Don't nest namespaces here, the MSL compiler complains it's a C++ 17 ext
@@ -14,13 +16,13 @@ namespace shaders_studio {
 
 struct Vertex {
   float3 position [[attribute(0)]];
-  float3 normal [[attribute(1)]];
+  float2 normal [[attribute(1)]]; // Octahedral encoding
 };
 
 struct NodeData {
   float4x4 model;
-  float3x3 normalViewModel;
-  uint16_t nodeIdx = 0;
+  float3x3 normalModel; // Inverse transpose of the model matrix, view rotation is applied in the shader
+  uint32_t nodeIdx = 0;
 };
 
 struct Constants {
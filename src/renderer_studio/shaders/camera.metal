@@ -7,14 +7,17 @@ using namespace pt::shaders_studio;
 
 struct VertexOut {
   float4 position [[position]];
-  uint16_t objectId;
+  uint32_t objectId;
 };
 
 vertex VertexOut cameraVertex(
   Vertex in [[stage_in]],
-  constant NodeData &data [[buffer(1)]],
+  uint instanceId [[instance_id]],
+  constant NodeData *nodes [[buffer(1)]],
   constant Constants &c [[buffer(2)]]
 ) {
+  constant NodeData &data = nodes[instanceId];
+
   VertexOut out;
   out.position = c.projection * c.view * data.model * float4(in.position, 1.0);
   out.objectId = data.nodeIdx;
@@ -24,7 +27,7 @@ vertex VertexOut cameraVertex(
 
 fragment float4 cameraFragment(
   VertexOut in [[stage_in]],
-  constant uint16_t& selectedNodeId [[buffer(0)]],
+  constant uint32_t& selectedNodeId [[buffer(0)]],
   constant EdgeConstants& c [[buffer(1)]]
 ) {
   float3 drawColor = selectedNodeId == in.objectId ? c.selectionColor : c.outlineColor;
@@ -33,10 +33,10 @@ vertex VertexOut edgePassVertex(unsigned short vid [[vertex_id]]) {
 fragment float4 edgePassFragment(
   VertexOut in [[stage_in]],
   texture2d<float> colorTexture [[texture(0)]],
-  texture2d<uint16_t> objectTexture [[texture(1)]],
+  texture2d<uint32_t> objectTexture [[texture(1)]],
   sampler sampler [[sampler(0)]],
   constant float2& viewportSize [[buffer(0)]],
-  constant uint16_t& selectedNodeId [[buffer(1)]],
+  constant uint32_t& selectedNodeId [[buffer(1)]],
   constant EdgeConstants& c [[buffer(2)]]
 ) {
   float2 offset = 1.0 / viewportSize;
@@ -47,13 +47,15 @@ fragment float4 edgePassFragment(
   };
 
   float3 drawColor = c.outlineColor;
+  // Compare IDs instead of weighting them, large IDs don't fit exactly in a float
+  uint32_t center = objectTexture.sample(sampler, in.texCoords).x;
   float edge = 0.0;
   for (int8_t i = 0; i < 9; i++) {
     float2 localOffset = offset * float2(i % 3 - 1, i / 3 - 1);
-    uint16_t sample = objectTexture.sample(sampler, in.texCoords + localOffset).x;
+    uint32_t sample = objectTexture.sample(sampler, in.texCoords + localOffset).x;
     if (sample != 0 && sample == selectedNodeId) drawColor = c.selectionColor;
 
-    edge += edgeKernel[i] * sample;
+    edge += edgeKernel[i] * float(sample != center);
   }
   edge = smoothstep(0.0, 1.0, abs(edge));
 
@@ -9,12 +9,12 @@ struct VertexOut {
     float4 position [[position]];
     float4 wsPosition;
     float3 vsNormal;
-    uint16_t objectId;
+    uint32_t objectId;
 };
 
 struct FragmentOut {
     float4 color [[color(0)]];
-    uint16_t objectId [[color(1)]];
+    uint32_t objectId [[color(1)]];
     uint32_t stencil [[stencil]];
 };
 
@@ -23,13 +23,19 @@ constant float ambientLight = 0.5;
 
 vertex VertexOut vertexShader(
     Vertex in [[stage_in]],
-    constant NodeData &data [[buffer(2)]],
+    uint instanceId [[instance_id]],
+    constant NodeData *nodes [[buffer(2)]],
     constant Constants &c [[buffer(3)]]
 ) {
+    constant NodeData &data = nodes[instanceId];
+
+    // The view matrix is a rigid transform, so its rotation also transforms normals
+    float3x3 viewRotation(c.view[0].xyz, c.view[1].xyz, c.view[2].xyz);
+
     VertexOut out;
     out.wsPosition = data.model * float4(in.position, 1.0);
     out.position = c.projection * c.view * out.wsPosition;
-    out.vsNormal = normalize(data.normalViewModel * in.normal);
+    out.vsNormal = normalize(viewRotation * data.normalModel * pt::vertex_format::octDecode(in.normal));
     out.objectId = data.nodeIdx;
 
     return out;
@@ -113,6 +113,7 @@ struct TextureParams {
   MTL::StorageMode storageMode = MTL::StorageModeShared;
   MTL::PixelFormat format;
   MTL::TextureUsage usage = MTL::TextureUsageShaderRead;
+  uint32_t mipLevels = 1;
 };
 
 NS::SharedPtr<MTL::TextureDescriptor> makeTextureDescriptor(const TextureParams& params);
@@ -89,6 +89,7 @@ NS::SharedPtr<MTL::TextureDescriptor> makeTextureDescriptor(const TextureParams&
   texd->setStorageMode(params.storageMode);
   texd->setUsage(params.usage);
   texd->setPixelFormat(params.format);
+  texd->setMipmapLevelCount(params.mipLevels);
 
   return texd;
 }
@@ -1,5 +1,11 @@
 #include "utils.hpp"
 
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace pt::utils {
 
 std::optional<fs::path> fileOpen(const fs::path &defaultPath,
@@ -16,6 +22,25 @@ std::optional<fs::path> fileOpen(const fs::path &defaultPath,
   }
 }
 
+std::vector<fs::path> fileOpenMultiple(const fs::path &defaultPath,
+                                       const std::string &filters) {
+  nfdpathset_t pathSet;
+  auto result =
+      NFD_OpenDialogMultiple(filters.c_str(), defaultPath.c_str(), &pathSet);
+
+  std::vector<fs::path> paths;
+  if (result == NFD_OKAY) {
+    size_t count = NFD_PathSet_GetCount(&pathSet);
+    paths.reserve(count);
+    for (size_t i = 0; i < count; i++)
+      paths.emplace_back(NFD_PathSet_GetPath(&pathSet, i));
+
+    NFD_PathSet_Free(&pathSet);
+  }
+
+  return paths;
+}
+
 std::optional<fs::path> fileSave(const fs::path &defaultPath,
                                  const std::string &filters) {
   char *path = nullptr;
@@ -30,4 +55,43 @@ std::optional<fs::path> fileSave(const fs::path &defaultPath,
   }
 }
 
+std::optional<fs::path> cacheDirectory(std::string_view subdirectory) {
+  const char *home = std::getenv("HOME");
+  fs::path path = home ? fs::path(home) / "Library" / "Caches" / "platinum"
+                       : fs::temp_directory_path() / "platinum";
+  if (!subdirectory.empty())
+    path /= subdirectory;
+
+  std::error_code error;
+  fs::create_directories(path, error);
+  if (error)
+    return std::nullopt;
+
+  return path;
+}
+
+MappedFile::MappedFile(const fs::path &path) noexcept {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+
+  struct stat info {};
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    void *data =
+        mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      m_data = (const uint8_t *)data;
+      m_size = size_t(info.st_size);
+    }
+  }
+
+  // The mapping stays valid after the descriptor is closed
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (m_data)
+    munmap((void *)m_data, m_size);
+}
+
 } // namespace pt::utils
@@ -1,10 +1,16 @@
 #ifndef PLATINUM_UTILS_HPP
 #define PLATINUM_UTILS_HPP
 
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <filesystem>
 #include <nfd.h>
 #include <optional>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
 namespace fs = std::filesystem;
 
@@ -15,9 +21,88 @@ constexpr size_t align(size_t n, size_t to) { return ((n - 1) / to + 1) * to; }
 std::optional<fs::path> fileOpen(const fs::path &defaultPath,
                                  const std::string &filters = "");
 
+std::vector<fs::path> fileOpenMultiple(const fs::path &defaultPath,
+                                       const std::string &filters = "");
+
 std::optional<fs::path> fileSave(const fs::path &defaultPath,
                                  const std::string &filters = "");
 
+/*
+ * Per user cache directory for derived data, created if it doesn't exist.
+ * Returns nullopt if there's no usable location.
+ */
+std::optional<fs::path> cacheDirectory(std::string_view subdirectory = "");
+
+/*
+ * Read only memory mapping of a whole file. Empty if the file can't be
+ * opened or mapped.
+ */
+class MappedFile {
+public:
+  explicit MappedFile(const fs::path &path) noexcept;
+
+  MappedFile(const MappedFile &m) noexcept = delete;
+  MappedFile &operator=(const MappedFile &m) = delete;
+
+  ~MappedFile();
+
+  [[nodiscard]] constexpr const uint8_t *data() const { return m_data; }
+  [[nodiscard]] constexpr size_t size() const { return m_size; }
+  [[nodiscard]] constexpr explicit operator bool() const {
+    return m_data != nullptr;
+  }
+
+private:
+  const uint8_t *m_data = nullptr;
+  size_t m_size = 0;
+};
+
+namespace detail {
+inline thread_local bool serialParallelFor = false;
+}
+
+/*
+ * Make parallelFor() calls on the current thread run serially, for threads
+ * that already share a workload between themselves
+ */
+inline void runParallelForSerially() { detail::serialParallelFor = true; }
+
+/*
+ * Call f(i) for every i in [0, count), splitting the range in contiguous chunks
+ * of at least minChunk indices across the hardware threads. The calling thread
+ * takes the first chunk. Returns once every call has finished.
+ * Nested calls, and calls on threads set up with runParallelForSerially(), run
+ * serially on the calling thread instead of spawning more threads.
+ */
+template <typename F>
+void parallelFor(size_t count, F &&f, size_t minChunk = 1) {
+  const size_t maxThreads = std::max(1u, std::thread::hardware_concurrency());
+  const size_t threads =
+      std::min(maxThreads, (count + minChunk - 1) / std::max(minChunk, size_t(1)));
+
+  if (threads <= 1 || detail::serialParallelFor) {
+    for (size_t i = 0; i < count; i++)
+      f(i);
+    return;
+  }
+
+  const size_t chunk = (count + threads - 1) / threads;
+  auto run = [&](size_t t) {
+    const bool serial = std::exchange(detail::serialParallelFor, true);
+    const size_t end = std::min(count, (t + 1) * chunk);
+    for (size_t i = t * chunk; i < end; i++)
+      f(i);
+    detail::serialParallelFor = serial;
+  };
+
+  std::vector<std::jthread> workers;
+  workers.reserve(threads - 1);
+  for (size_t t = 1; t < threads; t++)
+    workers.emplace_back(run, t);
+
+  run(0);
+}
+
 /*
  * String literal type to allow strings in template parameters
  * https://ctrpeach.io/posts/cpp20-string-literal-template-parameters/
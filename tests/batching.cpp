@@ -0,0 +1,247 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <numeric>
+#include <vector>
+
+#include <renderer_studio/instance_batcher.hpp>
+#include <utils/matrices.hpp>
+
+#include "test.hpp"
+
+using namespace pt;
+using namespace pt::renderer_studio::batching;
+using pt::test::hash;
+using pt::test::unorm;
+
+namespace {
+
+constexpr uint32_t instanceCount = 20000, meshCount = 64, levelCount = 4;
+
+float4x4 randomTransform(uint32_t seed) {
+  const float3 axis = normalize(float3{unorm(hash(seed)), unorm(hash(seed + 1)), unorm(hash(seed + 2))} - 0.5f);
+  const float3 scale = {0.5f + unorm(hash(seed + 3)), 0.5f + unorm(hash(seed + 4)), 0.5f + unorm(hash(seed + 5))};
+  const float3 offset = float3{unorm(hash(seed + 6)), unorm(hash(seed + 7)), unorm(hash(seed + 8))} * 100.0f;
+  return mat::translation(offset) * mat::rotation(unorm(hash(seed + 9)) * 6.28f, axis) * mat::scaling(scale);
+}
+
+std::vector<Instance> generateInstances() {
+  std::vector<Instance> instances;
+  for (uint32_t i = 0; i < instanceCount; i++) {
+    instances.push_back({i, hash(i) % meshCount, hash(i + 1) % levelCount, randomTransform(i * 16)});
+  }
+  return instances;
+}
+
+// Compares lanes one by one, the padding lane of a float3 is undefined
+bool equal(const float3x3& a, const float3x3& b) {
+  for (int i = 0; i < 3; i++) {
+    const float3 x = a.columns[i], y = b.columns[i];
+    if (x.x != y.x || x.y != y.y || x.z != y.z) return false;
+  }
+  return true;
+}
+
+/*
+ * Batches and per instance data computed from scratch
+ */
+bool matchesReference(std::span<const Instance> instances, const Batcher& batcher) {
+  std::vector<uint32_t> order(instances.size());
+  std::iota(order.begin(), order.end(), 0u);
+  std::ranges::stable_sort(order, [&](uint32_t a, uint32_t b) {
+    return std::pair(instances[a].mesh, instances[a].level) < std::pair(instances[b].mesh, instances[b].level);
+  });
+
+  const auto& batches = batcher.batches();
+  const auto& nodeData = batcher.nodeData();
+  if (nodeData.size() != instances.size()) return false;
+
+  size_t covered = 0;
+  for (size_t b = 0; b < batches.size(); b++) {
+    const auto& batch = batches[b];
+    if (batch.first != covered || batch.count == 0) return false;
+    if (b > 0 && batches[b - 1].mesh == batch.mesh && batches[b - 1].level == batch.level) return false;
+    covered += batch.count;
+
+    for (uint32_t i = batch.first; i < batch.first + batch.count; i++) {
+      const auto& instance = instances[order[i]];
+      if (instance.mesh != batch.mesh || instance.level != batch.level) return false;
+
+      const float3x3 normal = transpose(inverse(mat::submatrix3(instance.transform)));
+      if (std::memcmp(&nodeData[i].model, &instance.transform, sizeof(float4x4)) != 0) return false;
+      if (!equal(nodeData[i].normalModel, normal)) return false;
+      if (nodeData[i].nodeIdx != instance.nodeIdx) return false;
+    }
+  }
+
+  return covered == instances.size();
+}
+
+/*
+ * Runs an update and checks the result against batching from scratch, and
+ * the change flag and number of recomputed normal matrices against what the
+ * edit should cause.
+ */
+void checkUpdate(Batcher& batcher, std::span<const Instance> instances, bool expectChanged, size_t expectRecomputed) {
+  const bool changed = batcher.update(instances);
+  CHECK(changed == expectChanged);
+  CHECK(batcher.recomputed() == expectRecomputed);
+  CHECK(matchesReference(instances, batcher));
+}
+
+}
+
+TEST(batching, first_update) {
+  const auto instances = generateInstances();
+
+  Batcher batcher;
+  checkUpdate(batcher, instances, true, instanceCount);
+  CHECK(batcher.batches().size() == meshCount * levelCount);
+}
+
+TEST(batching, no_changes) {
+  const auto instances = generateInstances();
+
+  Batcher batcher;
+  batcher.update(instances);
+  checkUpdate(batcher, instances, false, 0);
+}
+
+TEST(batching, moved_instances) {
+  auto instances = generateInstances();
+
+  Batcher batcher;
+  batcher.update(instances);
+
+  std::vector<uint32_t> moved;
+  for (uint32_t i = 0; i < 100; i++) {
+    const uint32_t idx = hash(i + 1000) % instanceCount;
+    instances[idx].transform = randomTransform(i * 16 + 7);
+    moved.push_back(idx);
+  }
+  std::ranges::sort(moved);
+  moved.erase(std::unique(moved.begin(), moved.end()), moved.end());
+  checkUpdate(batcher, instances, true, moved.size());
+}
+
+TEST(batching, level_of_detail_changes) {
+  auto instances = generateInstances();
+
+  Batcher batcher;
+  batcher.update(instances);
+
+  for (uint32_t i = 0; i < instanceCount; i += 3) instances[i].level = (instances[i].level + 1) % levelCount;
+  checkUpdate(batcher, instances, true, 0);
+}
+
+TEST(batching, removed_and_added_instances) {
+  auto instances = generateInstances();
+
+  Batcher batcher;
+  batcher.update(instances);
+
+  instances.erase(instances.begin() + 1000, instances.begin() + 1500);
+  for (uint32_t i = 0; i < 200; i++) {
+    const uint32_t node = instanceCount + i;
+    instances.insert(instances.begin() + hash(node) % instances.size(), {node, hash(node) % meshCount, 0, randomTransform(node * 16)});
+  }
+  checkUpdate(batcher, instances, true, 200);
+
+  // Removed nodes are forgotten, so one coming back is recomputed
+  instances.push_back({1200, 0, 0, randomTransform(12345)});
+  checkUpdate(batcher, instances, true, 1);
+}
+
+TEST(batching, reordered_instances) {
+  auto instances = generateInstances();
+
+  Batcher batcher;
+  batcher.update(instances);
+
+  // Swapping two instances of the same batch changes the per instance data
+  const auto it = std::ranges::find_if(instances.begin() + 1, instances.end(), [&](const Instance& instance) {
+    return instance.mesh == instances[0].mesh && instance.level == instances[0].level;
+  });
+  std::swap(instances[0], *it);
+  checkUpdate(batcher, instances, true, 0);
+}
+
+/*
+ * Node IDs past 16 bits keep their high bits, picking and selection in the
+ * studio viewport read them back from the object ID target
+ */
+TEST(batching, large_node_ids) {
+  auto instances = generateInstances();
+  for (auto& instance: instances) instance.nodeIdx += 0x10000 * (instance.nodeIdx % 7 + 1);
+
+  Batcher batcher;
+  checkUpdate(batcher, instances, true, instanceCount);
+
+  // Nodes whose IDs only differ above bit 16 are different nodes
+  instances[0].nodeIdx = 0x90001;
+  instances[1].nodeIdx = 0xa0001;
+  checkUpdate(batcher, instances, true, 2);
+}
+
+TEST(batching, empty) {
+  Batcher batcher;
+  checkUpdate(batcher, {}, false, 0);
+  CHECK(batcher.batches().empty());
+
+  const auto instances = generateInstances();
+  batcher.update(instances);
+  checkUpdate(batcher, {}, true, 0);
+  CHECK(batcher.batches().empty());
+}
+
+/*
+ * Draws bind the instance data once and start each batch at its base instance.
+ * With batches of uneven sizes, most start at odd indices, and every instance
+ * ID the shader sees must land on an instance of the batch being drawn.
+ */
+TEST(batching, base_instance_draws) {
+  std::vector<Instance> instances;
+  const uint32_t counts[] = {3, 2, 5, 1, 4};
+  for (uint32_t mesh = 0; mesh < std::size(counts); mesh++) {
+    for (uint32_t i = 0; i < counts[mesh]; i++) {
+      const uint32_t node = uint32_t(instances.size());
+      instances.push_back({node, mesh, 0, randomTransform(node * 16)});
+    }
+  }
+
+  Batcher batcher;
+  checkUpdate(batcher, instances, true, instances.size());
+  if (!CHECK(batcher.batches().size() == std::size(counts))) return;
+
+  const auto& nodeData = batcher.nodeData();
+  for (const auto& batch: batcher.batches()) {
+    for (uint32_t instanceId = batch.first; instanceId < batch.first + batch.count; instanceId++) {
+      if (!CHECK(instanceId < nodeData.size())) return;
+      CHECK(instances[nodeData[instanceId].nodeIdx].mesh == batch.mesh);
+    }
+  }
+}
+
+/*
+ * Update timing with and without transform changes
+ */
+BENCHMARK(batching, update) {
+  auto instances = generateInstances();
+
+  Batcher batcher;
+  batcher.update(instances);
+
+  auto time = [&](bool moveAll) {
+    if (moveAll) {
+      for (auto& instance: instances) instance.transform.columns[3].x += 1.0f;
+    }
+
+    const auto start = std::chrono::high_resolution_clock::now();
+    batcher.update(instances);
+    const auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+  };
+
+  const double all = time(true), clean = time(false);
+  pt::test::report("{} instances: {:.2f} ms with every instance moved, {:.2f} ms with none", instanceCount, all, clean);
+}
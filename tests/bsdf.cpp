@@ -0,0 +1,378 @@
+#include <algorithm>
+#include <cmath>
+#include <format>
+#include <numbers>
+#include <random>
+#include <vector>
+
+#include <renderer_pt/bsdf_batch.hpp>
+#include <renderer_pt/ggx_luts.hpp>
+
+#include "test.hpp"
+
+using namespace pt;
+using namespace pt::renderer_pt;
+using namespace pt::renderer_pt::bsdf;
+using pt::shaders_pt::MaterialGPU;
+
+namespace {
+
+constexpr float pi = std::numbers::pi_v<float>;
+
+// Chi-square test parameters
+constexpr uint32_t thetaBins = 10, phiBins = 20;
+constexpr uint32_t integrationRes = 12; // Integration points per bin, per axis
+constexpr uint32_t chi2Samples = 1 << 20;
+constexpr double minExpected = 5.0;
+constexpr double significance = 0.01;
+
+// Furnace test parameters
+constexpr uint32_t furnaceSamples = 1 << 18;
+constexpr double furnaceTolerance = 0.01;
+
+/*
+ * The opaque dielectric lobe gains a few percent of energy at high roughness,
+ * the diffuse base isn't attenuated by the rough specular layer's multiple
+ * scattering. The port matches the shader here, so the test allows for it
+ * instead of failing on a known limitation of the model.
+ */
+constexpr double opaqueDielectricGain = 0.06;
+
+struct TestCase {
+  const char *name;
+  MaterialGPU material;
+  float cosThetaO;
+};
+
+class Rng {
+public:
+  explicit Rng(uint32_t seed) : m_gen(seed) {}
+
+  BatchFloat next() {
+    BatchFloat result;
+    for (size_t i = 0; i < batchWidth; i++)
+      result[i] = m_dist(m_gen);
+    return result;
+  }
+
+private:
+  std::mt19937 m_gen;
+  std::uniform_real_distribution<float> m_dist{0.0f, 1.0f};
+};
+
+BatchShadingContext makeContext(const MaterialGPU &mat) {
+  BatchShadingContext ctx{};
+  for (size_t i = 0; i < batchWidth; i++)
+    ctx.set(i, mat, matrix_identity_float3x3);
+  return ctx;
+}
+
+BatchFloat3 broadcast(float3 w) {
+  BatchFloat3 result{};
+  for (size_t i = 0; i < batchWidth; i++)
+    result.set(i, w);
+  return result;
+}
+
+float3 outgoing(float cosThetaO) {
+  const float sinThetaO = std::sqrt(1.0f - cosThetaO * cosThetaO);
+  return {sinThetaO, 0.0f, cosThetaO};
+}
+
+float3 direction(float theta, float phi) {
+  return {std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi),
+          std::cos(theta)};
+}
+
+/*
+ * Regularized upper incomplete gamma function Q(a, x), used to compute
+ * chi-square p-values. Series expansion for x < a + 1, continued fraction
+ * otherwise (Numerical Recipes, 6.2)
+ */
+double gammaQ(double a, double x) {
+  if (x <= 0.0)
+    return 1.0;
+
+  const double lnPrefix = -x + a * std::log(x) - std::lgamma(a);
+  if (x < a + 1.0) {
+    double ap = a, del = 1.0 / a, sum = del;
+    for (int i = 0; i < 1000 && std::abs(del) > std::abs(sum) * 1e-15; i++) {
+      ap += 1.0;
+      del *= x / ap;
+      sum += del;
+    }
+    return 1.0 - sum * std::exp(lnPrefix);
+  }
+
+  constexpr double tiny = 1e-300;
+  double b = x + 1.0 - a, c = 1.0 / tiny, d = 1.0 / b, h = d;
+  for (int i = 1; i < 1000; i++) {
+    const double an = -i * (i - a);
+    b += 2.0;
+    d = an * d + b;
+    if (std::abs(d) < tiny)
+      d = tiny;
+    c = b + an / c;
+    if (std::abs(c) < tiny)
+      c = tiny;
+    d = 1.0 / d;
+    const double del = d * c;
+    h *= del;
+    if (std::abs(del - 1.0) < 1e-15)
+      break;
+  }
+  return std::exp(lnPrefix) * h;
+}
+
+/*
+ * Bin sampled directions over the upper hemisphere and compare against the
+ * PDF reported by eval(), integrated numerically over each bin. Samples that
+ * are absorbed or leave the upper hemisphere land in an extra bin, whose
+ * expected count is the PDF mass missing from the hemisphere.
+ * Returns the p-value of the chi-square statistic.
+ */
+double chi2Test(const GgxLuts &luts, const TestCase &test, Rng &rng) {
+  const auto ctx = makeContext(test.material);
+  const BatchBSDF bsdf(ctx, luts, shaders_pt::RendererFlags_MultiscatterGGX);
+  const auto wo = broadcast(outgoing(test.cosThetaO));
+
+  constexpr uint32_t binCount = thetaBins * phiBins;
+  constexpr float dTheta = 0.5f * pi / thetaBins, dPhi = 2.0f * pi / phiBins;
+
+  // Histogram sampled directions
+  std::vector<double> observed(binCount + 1, 0.0);
+  for (uint32_t n = 0; n < chi2Samples; n += batchWidth) {
+    const BatchFloat3 r = {rng.next(), rng.next(), rng.next()};
+    const auto rLobe = rng.next();
+    const BatchFloat2 rc = {rng.next(), rng.next()};
+    const auto s = bsdf.sample(wo, r, rLobe, rc);
+
+    for (size_t i = 0; i < batchWidth; i++) {
+      const auto wi = s.wi.get(i);
+      if (s.flags[i] == Sample_Absorbed || (s.flags[i] & Sample_Specular) ||
+          !(s.pdf[i] > 0.0f) || wi.z <= 0.0f) {
+        observed[binCount] += 1.0;
+        continue;
+      }
+
+      const float theta = std::acos(std::min(wi.z, 1.0f));
+      float phi = std::atan2(wi.y, wi.x);
+      if (phi < 0.0f)
+        phi += 2.0f * pi;
+
+      const auto t = std::min(uint32_t(theta / dTheta), thetaBins - 1);
+      const auto p = std::min(uint32_t(phi / dPhi), phiBins - 1);
+      observed[t * phiBins + p] += 1.0;
+    }
+  }
+
+  // Integrate the PDF over each bin using the midpoint rule
+  std::vector<double> expected(binCount + 1, 0.0);
+  std::vector<std::pair<uint32_t, float3>> points;
+  std::vector<float> weights;
+  constexpr float subTheta = dTheta / integrationRes;
+  constexpr float subPhi = dPhi / integrationRes;
+  for (uint32_t t = 0; t < thetaBins * integrationRes; t++) {
+    const float theta = (float(t) + 0.5f) * subTheta;
+    for (uint32_t p = 0; p < phiBins * integrationRes; p++) {
+      const float phi = (float(p) + 0.5f) * subPhi;
+      const auto bin = (t / integrationRes) * phiBins + p / integrationRes;
+      points.emplace_back(bin, direction(theta, phi));
+      weights.push_back(std::sin(theta) * subTheta * subPhi);
+    }
+  }
+
+  for (size_t j = 0; j < points.size(); j += batchWidth) {
+    BatchFloat3 wi{};
+    for (size_t i = 0; i < batchWidth; i++)
+      wi.set(i, points[std::min(j + i, points.size() - 1)].second);
+
+    const auto e = bsdf.eval(wo, wi);
+    for (size_t i = 0; i < batchWidth && j + i < points.size(); i++)
+      expected[points[j + i].first] += double(e.pdf[i]) * weights[j + i];
+  }
+
+  double total = 0.0;
+  for (uint32_t i = 0; i < binCount; i++) {
+    expected[i] *= chi2Samples;
+    total += expected[i];
+  }
+  expected[binCount] = std::max(double(chi2Samples) - total, 0.0);
+
+  /*
+   * Compute the chi-square statistic, pooling bins with a low expected count
+   * so the chi-square distribution remains a good approximation.
+   */
+  std::vector<uint32_t> order(binCount + 1);
+  for (uint32_t i = 0; i <= binCount; i++)
+    order[i] = i;
+  std::ranges::sort(order, {}, [&](uint32_t i) { return expected[i]; });
+
+  double chi2 = 0.0, pooledObserved = 0.0, pooledExpected = 0.0;
+  int dof = 0;
+  for (auto i : order) {
+    if (expected[i] == 0.0) {
+      // Samples where the PDF is zero
+      if (observed[i] > chi2Samples * 1e-5)
+        return 0.0;
+    } else if (expected[i] < minExpected) {
+      pooledObserved += observed[i];
+      pooledExpected += expected[i];
+    } else {
+      const auto diff = observed[i] - expected[i];
+      chi2 += diff * diff / expected[i];
+      dof++;
+    }
+  }
+
+  if (pooledExpected > 0.0) {
+    const auto diff = pooledObserved - pooledExpected;
+    chi2 += diff * diff / pooledExpected;
+    dof++;
+  }
+  dof--;
+
+  if (dof <= 0)
+    return 1.0;
+  return gammaQ(dof * 0.5, chi2 * 0.5);
+}
+
+struct FurnaceResult {
+  double albedo, stdError;
+};
+
+/*
+ * Estimate the directional albedo for a white material using the BSDF's own
+ * importance sampling.
+ */
+FurnaceResult furnaceTest(const GgxLuts &luts, const TestCase &test,
+                          Rng &rng) {
+  const auto ctx = makeContext(test.material);
+  const BatchBSDF bsdf(ctx, luts, shaders_pt::RendererFlags_MultiscatterGGX);
+  const auto wo = broadcast(outgoing(test.cosThetaO));
+
+  double sum = 0.0, sumSq = 0.0;
+  for (uint32_t n = 0; n < furnaceSamples; n += batchWidth) {
+    const BatchFloat3 r = {rng.next(), rng.next(), rng.next()};
+    const auto rLobe = rng.next();
+    const BatchFloat2 rc = {rng.next(), rng.next()};
+    const auto s = bsdf.sample(wo, r, rLobe, rc);
+
+    for (size_t i = 0; i < batchWidth; i++) {
+      if (s.flags[i] == Sample_Absorbed || !(s.pdf[i] > 0.0f))
+        continue;
+
+      const auto f = s.f.get(i);
+      const double weight = double(std::max({f.x, f.y, f.z})) *
+                            std::abs(s.wi.z[i]) / double(s.pdf[i]);
+      sum += weight;
+      sumSq += weight * weight;
+    }
+  }
+
+  const double mean = sum / furnaceSamples;
+  const double variance = std::max(sumSq / furnaceSamples - mean * mean, 0.0);
+  return {mean, std::sqrt(variance / furnaceSamples)};
+}
+
+MaterialGPU material(float roughness, float metallic, float transmission,
+                     float clearcoat = 0.0f) {
+  MaterialGPU mat;
+  mat.roughness = roughness;
+  mat.metallic = metallic;
+  mat.transmission = transmission;
+  mat.clearcoat = clearcoat;
+  mat.clearcoatRoughness = roughness;
+  return mat;
+}
+
+const GgxLuts *loadLuts() {
+  static const auto luts = GgxLuts::load(fs::path(PLATINUM_RESOURCE_DIR) / "lut");
+  return pt::test::check(luts.has_value(), "GGX LUTs load") ? &*luts : nullptr;
+}
+
+} // namespace
+
+/*
+ * Chi-square goodness of fit tests comparing the distribution of sampled
+ * directions against the PDF reported by eval(), for rough lobes. Clearcoat
+ * is excluded, as the lobe selection uses a stochastic fresnel estimate and
+ * doesn't match the eval() PDF exactly.
+ */
+TEST(bsdf, chi2_sampling) {
+  const auto *luts = loadLuts();
+  if (!luts)
+    return;
+
+  Rng rng(0x5eed);
+  std::vector<TestCase> tests;
+  for (float cosThetaO : {0.3f, 0.7f, 0.95f}) {
+    tests.push_back({"metallic, roughness 0.5", material(0.5f, 1.0f, 0.0f),
+                     cosThetaO});
+
+    auto anisotropic = material(0.6f, 1.0f, 0.0f);
+    anisotropic.anisotropy = 0.8f;
+    tests.push_back(
+        {"metallic anisotropic, roughness 0.6", anisotropic, cosThetaO});
+
+    tests.push_back({"opaque dielectric, roughness 0.4",
+                     material(0.4f, 0.0f, 0.0f), cosThetaO});
+  }
+
+  // Sidak correction for multiple tests
+  const double alpha =
+      1.0 - std::pow(1.0 - significance, 1.0 / double(tests.size()));
+
+  for (const auto &test : tests) {
+    const double pValue = chi2Test(*luts, test, rng);
+    pt::test::check(pValue > alpha,
+                    std::format("chi2 {}, cos(theta_o) = {:.2f}: p = {:.4f}",
+                                test.name, test.cosThetaO, pValue));
+  }
+}
+
+/*
+ * White furnace tests checking that no lobe reflects more energy than it
+ * receives with a white albedo.
+ */
+TEST(bsdf, white_furnace) {
+  const auto *luts = loadLuts();
+  if (!luts)
+    return;
+
+  Rng rng(0x5eed);
+  std::vector<TestCase> tests;
+  for (float roughness : {0.0f, 0.25f, 0.5f, 1.0f}) {
+    for (float cosThetaO : {0.2f, 0.6f, 0.99f}) {
+      auto metallic = material(roughness, 1.0f, 0.0f);
+      auto opaque = material(roughness, 0.0f, 0.0f);
+      auto transparent = material(roughness, 0.0f, 1.0f);
+      auto thin = material(roughness, 0.0f, 1.0f);
+      auto clearcoat = material(roughness, 1.0f, 0.0f, 1.0f);
+      thin.flags |= MaterialGPU::Material_ThinDielectric;
+
+      for (auto *mat : {&metallic, &opaque, &transparent, &thin, &clearcoat})
+        mat->baseColor = {1.0f, 1.0f, 1.0f, 1.0f};
+
+      tests.push_back({"metallic", metallic, cosThetaO});
+      tests.push_back({"opaque dielectric", opaque, cosThetaO});
+      tests.push_back({"transparent dielectric", transparent, cosThetaO});
+      tests.push_back({"thin dielectric", thin, cosThetaO});
+      tests.push_back({"clearcoat", clearcoat, cosThetaO});
+    }
+  }
+
+  for (const auto &test : tests) {
+    const auto result = furnaceTest(*luts, test, rng);
+    const double tolerance =
+        test.material.metallic == 0.0f && test.material.transmission == 0.0f
+            ? opaqueDielectricGain
+            : furnaceTolerance;
+    pt::test::check(
+        result.albedo <= 1.0 + 3.0 * result.stdError + tolerance,
+        std::format("furnace {}, roughness {:.2f}, cos(theta_o) = {:.2f}: "
+                    "albedo = {:.4f} +- {:.4f}",
+                    test.name, test.material.roughness, test.cosThetaO,
+                    result.albedo, result.stdError));
+  }
+}
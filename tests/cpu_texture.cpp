@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <format>
+#include <string_view>
+#include <vector>
+
+#include <renderer_pt/cpu_texture.hpp>
+
+#include "test.hpp"
+
+using namespace pt::renderer_pt;
+using bsdf::batchWidth;
+using pt::test::hash;
+using pt::test::unorm;
+
+namespace {
+
+// 64MB of float4 texels, well past the last level cache
+constexpr uint32_t textureSize = 2048;
+constexpr size_t lookupCount = size_t(1) << 22;
+
+// Lookups compared against the reference, from the start of each pattern
+constexpr size_t checkedLookups = size_t(1) << 16;
+constexpr float maxError = 1e-5f;
+
+// Smaller texture for the tests, but still several tiles in each direction
+constexpr uint32_t testTextureSize = 256;
+
+/*
+ * Reference: row major texels, with the same filtering as CpuTexture
+ */
+struct RowMajorTexture {
+  uint32_t width, height;
+  std::vector<float4> pixels;
+
+  [[nodiscard]] float4 sample(float2 uv) const {
+    const float x = uv.x * float(width) - 0.5f;
+    const float y = uv.y * float(height) - 0.5f;
+    const float fx = std::floor(x), fy = std::floor(y);
+    const float tx = x - fx, ty = y - fy;
+
+    auto texel = [&](float px, float py) {
+      auto wrap = [](float v, uint32_t size) {
+        auto i = int64_t(v) % int64_t(size);
+        return uint32_t(i < 0 ? i + size : i);
+      };
+      return pixels[wrap(py, height) * width + wrap(px, width)];
+    };
+
+    return (texel(fx, fy) * (1.0f - tx) + texel(fx + 1.0f, fy) * tx) *
+               (1.0f - ty) +
+           (texel(fx, fy + 1.0f) * (1.0f - tx) +
+            texel(fx + 1.0f, fy + 1.0f) * tx) *
+               ty;
+  }
+};
+
+RowMajorTexture randomTexture(uint32_t size) {
+  RowMajorTexture texture{size, size, {}};
+  texture.pixels.resize(size_t(size) * size);
+  for (size_t i = 0; i < texture.pixels.size(); i++) {
+    const auto h = uint32_t(i * 4);
+    texture.pixels[i] = {unorm(hash(h)), unorm(hash(h + 1)), unorm(hash(h + 2)),
+                         unorm(hash(h + 3))};
+  }
+  return texture;
+}
+
+/*
+ * UVs of a textured plane rotated 30 degrees on screen, about one texel per
+ * pixel, visited in 8x8 pixel tiles like the tiled renderer does
+ */
+std::vector<float2> coherentUVs(uint32_t size, size_t count) {
+  constexpr uint32_t screenWidth = 2048, tile = 8;
+  constexpr uint32_t tilesX = screenWidth / tile;
+  const float c = std::cos(0.5235988f) / float(size);
+  const float s = std::sin(0.5235988f) / float(size);
+
+  std::vector<float2> uvs(count);
+  for (size_t i = 0; i < count; i++) {
+    const size_t t = i / (tile * tile), p = i % (tile * tile);
+    const auto px = float((t % tilesX) * tile + p % tile);
+    const auto py = float((t / tilesX) * tile + p / tile);
+    uvs[i] = {px * c - py * s, px * s + py * c};
+  }
+  return uvs;
+}
+
+std::vector<float2> randomUVs(size_t count) {
+  std::vector<float2> uvs(count);
+  for (size_t i = 0; i < count; i++)
+    uvs[i] = {unorm(hash(uint32_t(2 * i))), unorm(hash(uint32_t(2 * i + 1)))};
+  return uvs;
+}
+
+/*
+ * Time a run over every lookup, after a warm up run. Results are summed so
+ * the lookups can't be optimized away.
+ */
+template <typename F> double lookupsPerSecond(F &&run) {
+  volatile float sink = run().x;
+
+  const auto start = std::chrono::high_resolution_clock::now();
+  sink = run().x;
+  const auto end = std::chrono::high_resolution_clock::now();
+  (void)sink;
+
+  return double(lookupCount) / std::chrono::duration<double>(end - start).count();
+}
+
+float4 sumScalar(const auto &texture, const std::vector<float2> &uvs) {
+  float4 sum = 0.0f;
+  for (const auto &uv : uvs)
+    sum += texture.sample(uv);
+  return sum;
+}
+
+float4 sumBatched(const CpuTexture &texture, const std::vector<float> &u,
+                  const std::vector<float> &v) {
+  bsdf::BatchFloat4 sum{};
+  bsdf::BatchFloat2 uv;
+  for (size_t i = 0; i < u.size(); i += batchWidth) {
+    std::memcpy(&uv.x, u.data() + i, sizeof(uv.x));
+    std::memcpy(&uv.y, v.data() + i, sizeof(uv.y));
+
+    const auto values = texture.sample(uv);
+    sum.x += values.x;
+    sum.y += values.y;
+    sum.z += values.z;
+    sum.w += values.w;
+  }
+
+  float4 result = 0.0f;
+  for (size_t lane = 0; lane < batchWidth; lane++)
+    result += sum.get(lane);
+  return result;
+}
+
+/*
+ * Largest difference from the reference over the first lookups, scalar and
+ * batched
+ */
+float maxDifference(const RowMajorTexture &reference,
+                    const CpuTexture &texture, const std::vector<float2> &uvs) {
+  const size_t checked = std::min(uvs.size(), checkedLookups);
+  float maxDiff = 0.0f;
+  auto check = [&](float4 a, float4 b) {
+    maxDiff = std::max(maxDiff, reduce_max(abs(a - b)));
+  };
+
+  for (size_t i = 0; i + batchWidth <= checked; i += batchWidth) {
+    bsdf::BatchFloat2 uv;
+    for (size_t lane = 0; lane < batchWidth; lane++) {
+      uv.x[lane] = uvs[i + lane].x;
+      uv.y[lane] = uvs[i + lane].y;
+    }
+
+    const auto batch = texture.sample(uv);
+    for (size_t lane = 0; lane < batchWidth; lane++) {
+      const float4 expected = reference.sample(uvs[i + lane]);
+      check(texture.sample(uvs[i + lane]), expected);
+      check(batch.get(lane), expected);
+    }
+  }
+
+  return maxDiff;
+}
+
+} // namespace
+
+/*
+ * Scalar and batched lookups return the same values as the row major
+ * reference, for coherent and random patterns
+ */
+TEST(cpu_texture, matches_row_major) {
+  const auto reference = randomTexture(testTextureSize);
+  const CpuTexture tiled(testTextureSize, testTextureSize, reference.pixels);
+
+  const std::pair<std::string_view, std::vector<float2>> patterns[] = {
+      {"coherent", coherentUVs(testTextureSize, checkedLookups)},
+      {"random", randomUVs(checkedLookups)},
+  };
+
+  for (const auto &[name, uvs] : patterns) {
+    const float diff = maxDifference(reference, tiled, uvs);
+    pt::test::check(diff <= maxError,
+                    std::format("{} lookups: max difference {:.2e}", name, diff));
+  }
+}
+
+/*
+ * Constant textures take the fast path, which has to return the colour
+ * everywhere
+ */
+TEST(cpu_texture, constant_colour) {
+  const float4 colour = {0.2f, 0.4f, 0.6f, 1.0f};
+  const RowMajorTexture reference{
+      testTextureSize, testTextureSize,
+      std::vector<float4>(size_t(testTextureSize) * testTextureSize, colour)};
+  const CpuTexture constant(testTextureSize, testTextureSize, reference.pixels);
+
+  const float diff = maxDifference(reference, constant, randomUVs(checkedLookups));
+  pt::test::check(diff <= maxError,
+                  std::format("max difference {:.2e}", diff));
+}
+
+/*
+ * Texel fetch throughput against a plain row major image, for coherent (a
+ * rotated textured plane, in screen tiles) and random lookups, scalar and
+ * batched, plus the constant colour fast path
+ */
+BENCHMARK(cpu_texture, lookups) {
+  pt::test::report("{0}x{0} texels, {1} lookups, {2}-wide batches", textureSize,
+                   lookupCount, batchWidth);
+
+  const auto reference = randomTexture(textureSize);
+  const CpuTexture tiled(textureSize, textureSize, reference.pixels);
+  const std::vector<float4> constantPixels(reference.pixels.size(),
+                                           float4{0.2f, 0.4f, 0.6f, 1.0f});
+  const CpuTexture constant(textureSize, textureSize, constantPixels);
+
+  const std::pair<std::string_view, std::vector<float2>> patterns[] = {
+      {"coherent", coherentUVs(textureSize, lookupCount)},
+      {"random", randomUVs(lookupCount)},
+  };
+
+  for (const auto &[name, uvs] : patterns) {
+    std::vector<float> u(lookupCount), v(lookupCount);
+    for (size_t i = 0; i < lookupCount; i++) {
+      u[i] = uvs[i].x;
+      v[i] = uvs[i].y;
+    }
+
+    const double base =
+        lookupsPerSecond([&] { return sumScalar(reference, uvs); });
+    const double scalar =
+        lookupsPerSecond([&] { return sumScalar(tiled, uvs); });
+    const double batched =
+        lookupsPerSecond([&] { return sumBatched(tiled, u, v); });
+    const double constantBatched =
+        lookupsPerSecond([&] { return sumBatched(constant, u, v); });
+
+    pt::test::report("{} lookups:", name);
+    pt::test::report("  row major, scalar    {:8.1f} M/s", base * 1e-6);
+    pt::test::report("  tiled, scalar        {:8.1f} M/s ({:.2f}x)",
+                     scalar * 1e-6, scalar / base);
+    pt::test::report("  tiled, batched       {:8.1f} M/s ({:.2f}x)",
+                     batched * 1e-6, batched / base);
+    pt::test::report("  constant, batched    {:8.1f} M/s ({:.2f}x)",
+                     constantBatched * 1e-6, constantBatched / base);
+  }
+}
@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <cmath>
+#include <format>
+#include <vector>
+
+#include <renderer_pt/light_tree.hpp>
+
+#include "test.hpp"
+
+using namespace pt::renderer_pt;
+using pt::test::hash;
+using pt::test::unorm;
+
+namespace {
+
+constexpr uint32_t lightCount = 500;
+constexpr uint32_t shadingPointCount = 64;
+
+// Picks drawn for the frequency test, and the allowed deviation in sigmas
+constexpr uint32_t pickCount = 1 << 18;
+constexpr float maxDeviation = 5.0f;
+
+float3 randomPoint(uint32_t seed, float size) {
+  return (float3{unorm(hash(seed)), unorm(hash(seed + 1)), unorm(hash(seed + 2))} - 0.5f) * size;
+}
+
+/*
+ * Small triangles scattered through a box, with a few much brighter ones so
+ * the tree isn't balanced by power
+ */
+std::vector<LightBounds> randomLights(uint32_t count) {
+  std::vector<LightBounds> lights;
+  for (uint32_t i = 0; i < count; i++) {
+    const uint32_t seed = i * 16;
+    const float3 v0 = randomPoint(seed, 20.0f);
+    const float3 v1 = v0 + randomPoint(seed + 3, 0.5f);
+    const float3 v2 = v0 + randomPoint(seed + 6, 0.5f);
+    const float power = 0.1f + unorm(hash(seed + 9)) * (i % 50 == 0 ? 500.0f : 10.0f);
+    lights.push_back(LightBounds::triangle(v0, v1, v2, power));
+  }
+  return lights;
+}
+
+struct ShadingPoint {
+  float3 pos, n;
+};
+
+ShadingPoint randomShadingPoint(uint32_t i) {
+  const uint32_t seed = 0x5eed0000 + i * 8;
+  return {randomPoint(seed, 24.0f), normalize(randomPoint(seed + 3, 2.0f))};
+}
+
+}
+
+/*
+ * Every light's probability adds up to one at any shading point some light
+ * can reach, and to zero where sample() finds no light
+ */
+TEST(light_tree, pmf_sums_to_one) {
+  const auto lights = randomLights(lightCount);
+  const LightTree tree(lights);
+
+  for (uint32_t i = 0; i < shadingPointCount; i++) {
+    const auto [pos, n] = randomShadingPoint(i);
+
+    double sum = 0.0;
+    for (uint32_t l = 0; l < lightCount; l++) sum += tree.pmf(pos, n, l);
+
+    const double expected = tree.sample(pos, n, 0.5f) ? 1.0 : 0.0;
+    pt::test::check(std::abs(sum - expected) < 1e-4, std::format("point {}: pmf sums to {}, expected {}", i, sum, expected));
+  }
+}
+
+/*
+ * The probability sample() returns is the one pmf() computes for the light
+ */
+TEST(light_tree, sample_matches_pmf) {
+  const auto lights = randomLights(lightCount);
+  const LightTree tree(lights);
+
+  uint32_t mismatches = 0, samples = 0;
+  for (uint32_t i = 0; i < shadingPointCount; i++) {
+    const auto [pos, n] = randomShadingPoint(i);
+    for (uint32_t j = 0; j < 64; j++) {
+      const auto sample = tree.sample(pos, n, unorm(hash(i * 64 + j)));
+      if (!sample) continue;
+
+      samples++;
+      const float pmf = tree.pmf(pos, n, sample->lightIdx);
+      if (!(sample->pmf > 0.0f) || std::abs(sample->pmf - pmf) > 1e-5f * pmf) mismatches++;
+    }
+  }
+
+  CHECK(samples > 0);
+  pt::test::check(mismatches == 0, std::format("{} of {} samples disagree with pmf()", mismatches, samples));
+}
+
+/*
+ * Lights are picked as often as their probability says, within a few standard
+ * deviations of the binomial count
+ */
+TEST(light_tree, pick_frequencies) {
+  const auto lights = randomLights(lightCount);
+  const LightTree tree(lights);
+
+  for (uint32_t i = 0; i < 2; i++) {
+    const auto [pos, n] = randomShadingPoint(i);
+
+    std::vector<uint32_t> picks(lightCount);
+    for (uint32_t j = 0; j < pickCount; j++) {
+      const auto sample = tree.sample(pos, n, unorm(hash(j + i * pickCount)));
+      if (sample) picks[sample->lightIdx]++;
+    }
+
+    float worst = 0.0f;
+    for (uint32_t l = 0; l < lightCount; l++) {
+      const float p = tree.pmf(pos, n, l);
+      const float expected = p * float(pickCount);
+      const float sigma = std::sqrt(expected * (1.0f - p));
+      worst = std::max(worst, std::abs(float(picks[l]) - expected) / std::max(sigma, 1.0f));
+    }
+
+    pt::test::check(worst <= maxDeviation, std::format("point {}: picks deviate by up to {:.2f} sigma", i, worst));
+  }
+}
+
+TEST(light_tree, empty) {
+  const LightTree tree({});
+  CHECK(tree.nodes().empty());
+  CHECK(!tree.sample({0, 0, 0}, {0, 0, 1}, 0.5f));
+  CHECK(tree.pmf({0, 0, 0}, {0, 0, 1}, 0) == 0.0f);
+}
@@ -0,0 +1,70 @@
+#include <cstdio>
+#include <print>
+#include <string_view>
+#include <vector>
+
+#include "test.hpp"
+
+namespace pt::test {
+
+struct Case {
+  std::string_view suite, name;
+  Fn fn;
+  bool benchmark;
+};
+
+static std::vector<Case>& registry() {
+  static std::vector<Case> cases;
+  return cases;
+}
+
+static size_t s_failures = 0;
+
+Registration::Registration(std::string_view suite, std::string_view name, Fn fn, bool benchmark) {
+  registry().push_back({suite, name, fn, benchmark});
+}
+
+bool check(bool ok, std::string_view detail, std::source_location location) {
+  if (!ok) {
+    std::println("  [FAIL] {} ({}:{})", detail, location.file_name(), location.line());
+    s_failures++;
+  }
+  return ok;
+}
+
+}
+
+/*
+ * Usage:
+ *  platinum_tests [<suite>]          run every test, or the tests in a suite
+ *  platinum_tests --bench [<suite>]  run every benchmark, or those in a suite
+ */
+int main(int argc, char** argv) {
+  using namespace pt::test;
+
+  int arg = 1;
+  const bool benchmarks = argc > arg && std::string_view(argv[arg]) == "--bench";
+  if (benchmarks) arg++;
+  const std::string_view suite = argc > arg ? argv[arg] : "";
+
+  size_t run = 0, failed = 0;
+  for (const auto& c: registry()) {
+    if (c.benchmark != benchmarks || (!suite.empty() && c.suite != suite)) continue;
+
+    std::println("{}.{}", c.suite, c.name);
+    std::fflush(stdout);
+
+    const size_t before = s_failures;
+    c.fn();
+    run++;
+    if (s_failures != before) failed++;
+  }
+
+  if (run == 0) {
+    std::println(stderr, "No {} found{}{}", benchmarks ? "benchmarks" : "tests", suite.empty() ? "" : " in suite ", suite);
+    return 1;
+  }
+
+  std::println("{} / {} passed", run - failed, run);
+  return failed == 0 ? 0 : 1;
+}
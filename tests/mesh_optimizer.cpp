@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <array>
+#include <format>
+#include <iterator>
+#include <vector>
+
+#include <core/mesh_optimizer.hpp>
+
+#include "test.hpp"
+
+using namespace pt;
+using namespace pt::mesh_optimizer;
+using pt::test::hash;
+
+namespace {
+
+constexpr uint32_t gridSize = 64;
+
+/*
+ * Cube with 4 vertices per face, 24 in total. The texture coordinates either
+ * depend on the position only, so the faces share all attributes at each
+ * corner, or are laid out per face, which splits every corner on a UV seam.
+ */
+MeshData cube(bool uvSeams) {
+  const float3 normals[] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+
+  MeshData mesh;
+  for (uint32_t face = 0; face < 6; face++) {
+    const float3 n = normals[face];
+    const float3 u = n.x != 0.0f ? float3{0, 1, 0} : float3{1, 0, 0};
+    const float3 v = cross(n, u);
+
+    const uint32_t base = uint32_t(mesh.positions.size());
+    const float2 corners[] = {{-1, -1}, {1, -1}, {1, 1}, {-1, 1}};
+    for (const auto& c: corners) {
+      const float3 p = n + u * c.x + v * c.y;
+      mesh.positions.push_back(p);
+      mesh.vertexData.push_back({
+        .normal = normalize(p),
+        .tangent = {1, 0, 0, 1},
+        .texCoords = uvSeams ? float2{float(face) * 4.0f + c.x, c.y} : float2{p.x, p.y} + p.z * 0.25f,
+      });
+    }
+
+    mesh.indices.insert(mesh.indices.end(), {base, base + 1, base + 2, base, base + 2, base + 3});
+    mesh.materialIndices.insert(mesh.materialIndices.end(), {0, 0});
+  }
+  return mesh;
+}
+
+/*
+ * Flat grid of shared vertices, triangles in row order and each one with its
+ * own material, so it can be told apart after reordering
+ */
+MeshData grid(uint32_t size) {
+  MeshData mesh;
+  for (uint32_t y = 0; y <= size; y++) {
+    for (uint32_t x = 0; x <= size; x++) {
+      mesh.positions.push_back({float(x), float(y), 0.0f});
+      mesh.vertexData.push_back({.normal = {0, 0, 1}, .tangent = {1, 0, 0, 1}, .texCoords = {float(x), float(y)}});
+    }
+  }
+
+  for (uint32_t y = 0; y < size; y++) {
+    for (uint32_t x = 0; x < size; x++) {
+      const uint32_t a = y * (size + 1) + x, b = a + size + 1;
+      mesh.indices.insert(mesh.indices.end(), {a, b, a + 1, a + 1, b, b + 1});
+      mesh.materialIndices.push_back(uint32_t(mesh.materialIndices.size()));
+      mesh.materialIndices.push_back(uint32_t(mesh.materialIndices.size()));
+    }
+  }
+  return mesh;
+}
+
+// Fisher-Yates shuffle of the triangles, keeping materials with them
+void shuffleTriangles(MeshData& mesh) {
+  for (size_t t = mesh.materialIndices.size() - 1; t > 0; t--) {
+    const size_t other = hash(uint32_t(t)) % (t + 1);
+    std::swap_ranges(mesh.indices.begin() + ptrdiff_t(t * 3), mesh.indices.begin() + ptrdiff_t(t * 3 + 3), mesh.indices.begin() + ptrdiff_t(other * 3));
+    std::swap(mesh.materialIndices[t], mesh.materialIndices[other]);
+  }
+}
+
+/*
+ * Triangles by the positions of their corners, rotated to start at the
+ * smallest one so winding is kept, with their material
+ */
+using Triangle = std::array<float, 10>;
+
+std::vector<Triangle> triangles(const MeshData& mesh) {
+  std::vector<Triangle> result;
+  for (size_t t = 0; t < mesh.materialIndices.size(); t++) {
+    std::array<float3, 3> p;
+    for (int i = 0; i < 3; i++) p[i] = mesh.positions[mesh.indices[t * 3 + i]];
+
+    auto less = [](float3 a, float3 b) { return std::array{a.x, a.y, a.z} < std::array{b.x, b.y, b.z}; };
+    std::rotate(p.begin(), std::min_element(p.begin(), p.end(), less), p.end());
+
+    result.push_back({p[0].x, p[0].y, p[0].z, p[1].x, p[1].y, p[1].z, p[2].x, p[2].y, p[2].z, float(mesh.materialIndices[t])});
+  }
+  std::ranges::sort(result);
+  return result;
+}
+
+}
+
+TEST(mesh_optimizer, cube_welds_matching_corners) {
+  auto mesh = cube(false);
+  const auto stats = optimize(mesh);
+
+  CHECK(stats.verticesBefore == 24);
+  pt::test::check(stats.verticesAfter == 8, std::format("{} vertices after welding", stats.verticesAfter));
+  CHECK(mesh.positions.size() == 8 && mesh.vertexData.size() == 8);
+  CHECK(stats.trianglesAfter == 12);
+}
+
+TEST(mesh_optimizer, cube_keeps_uv_seams) {
+  auto mesh = cube(true);
+  const auto before = triangles(mesh);
+  const auto stats = optimize(mesh);
+
+  pt::test::check(stats.verticesAfter == 24, std::format("{} vertices after welding", stats.verticesAfter));
+  CHECK(triangles(mesh) == before);
+}
+
+TEST(mesh_optimizer, attributes_within_tolerance_weld) {
+  auto mesh = cube(false);
+  for (size_t v = 0; v < mesh.vertexData.size(); v++) mesh.vertexData[v].texCoords.x += float(v % 3) * 2e-5f;
+
+  CHECK(optimize(mesh).verticesAfter == 8);
+
+  mesh = cube(false);
+  for (size_t v = 0; v < mesh.vertexData.size(); v++) mesh.vertexData[v].normal.z += float(v % 3) * 1e-3f;
+  CHECK(optimize(mesh).verticesAfter > 8);
+}
+
+/*
+ * A triangle and its flip are two sides of a surface, not duplicates. The same
+ * triangle again, starting from another corner, is.
+ */
+TEST(mesh_optimizer, duplicates_keep_opposite_winding) {
+  MeshData mesh{
+    .positions = {{0, 0, 0}, {1, 0, 0}, {0, 1, 0}},
+    .vertexData = std::vector<VertexData>(3, {.normal = {0, 0, 1}, .tangent = {1, 0, 0, 1}, .texCoords = {0, 0}}),
+    .indices = {0, 1, 2, 0, 2, 1, 1, 2, 0, 2, 1, 0},
+    .materialIndices = {0, 0, 0, 1},
+  };
+
+  const auto stats = optimize(mesh);
+  CHECK(stats.duplicateTriangles == 1);
+  CHECK(stats.trianglesAfter == 3);
+  CHECK(mesh.materialIndices.size() == 3);
+}
+
+TEST(mesh_optimizer, degenerate_triangles) {
+  MeshData mesh{
+    .positions = {{0, 0, 0}, {1, 0, 0}, {0, 1, 0}, {2, 0, 0}},
+    .vertexData = std::vector<VertexData>(4, {.normal = {0, 0, 1}, .tangent = {1, 0, 0, 1}, .texCoords = {0, 0}}),
+    .indices = {0, 1, 2, 0, 0, 2, 0, 1, 3},
+    .materialIndices = {0, 0, 0},
+  };
+
+  const auto stats = optimize(mesh);
+  CHECK(stats.degenerateTriangles == 2);
+  CHECK(stats.trianglesAfter == 1);
+  CHECK(mesh.positions.size() == 3);
+}
+
+/*
+ * Reordering moves triangles around, but every triangle keeps its corners,
+ * winding and material
+ */
+TEST(mesh_optimizer, materials_stay_with_triangles) {
+  auto mesh = grid(gridSize);
+  shuffleTriangles(mesh);
+  const auto before = triangles(mesh);
+
+  const auto stats = optimize(mesh);
+  CHECK(stats.trianglesAfter == before.size());
+  CHECK(triangles(mesh) == before);
+}
+
+/*
+ * Row order is already decent for a grid, the optimizer must not make it
+ * worse. A shuffled grid must get at least as good as row order.
+ */
+TEST(mesh_optimizer, vertex_cache) {
+  auto rows = grid(gridSize);
+  const auto rowStats = optimize(rows);
+  pt::test::check(
+    rowStats.cacheMissesAfter <= rowStats.cacheMissesBefore,
+    std::format("row order: {} -> {} cache misses", rowStats.cacheMissesBefore, rowStats.cacheMissesAfter)
+  );
+
+  auto shuffled = grid(gridSize);
+  shuffleTriangles(shuffled);
+  const auto shuffledStats = optimize(shuffled);
+  pt::test::check(
+    shuffledStats.cacheMissesAfter <= rowStats.cacheMissesBefore,
+    std::format("shuffled: {} -> {} cache misses", shuffledStats.cacheMissesBefore, shuffledStats.cacheMissesAfter)
+  );
+
+  // Vertices come in order of first use
+  uint32_t next = 0;
+  bool ordered = true;
+  for (uint32_t idx: shuffled.indices) {
+    ordered &= idx <= next;
+    if (idx == next) next++;
+  }
+  CHECK(ordered && next == shuffled.positions.size());
+}
@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <format>
+#include <map>
+#include <numbers>
+#include <set>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <core/mesh_simplifier.hpp>
+
+#include "test.hpp"
+
+using namespace pt;
+using namespace pt::mesh_simplifier;
+using pt::mesh_optimizer::MeshData;
+using pt::test::hash;
+using pt::test::unorm;
+
+namespace {
+
+constexpr uint32_t sphereRings = 64, sphereSegments = 128;
+constexpr uint32_t gridSize = 96;
+
+// Low enough to get several levels out of the test meshes
+constexpr LodOptions lodOptions = {.ratio = 0.5f, .minTriangles = 512, .maxLevels = 8};
+
+struct TestMesh {
+  std::string name;
+  MeshData data;
+  std::vector<bool> locked; // Vertices whose position must be in every level
+};
+
+/*
+ * UV sphere with a seam at u = 0, and the pole vertices split per triangle.
+ * Vertices on the seam and at the poles share their position with others.
+ */
+TestMesh sphere() {
+  TestMesh mesh{.name = "sphere"};
+  auto& data = mesh.data;
+
+  auto vertex = [&](uint32_t ring, uint32_t segment, bool seam) {
+    const float theta = std::numbers::pi_v<float> * float(ring) / float(sphereRings);
+    const float phi = 2.0f * std::numbers::pi_v<float> * float(segment % sphereSegments) / float(sphereSegments);
+    const float3 n = {std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi)};
+
+    data.positions.push_back(ring == 0 || ring == sphereRings ? float3{0, n.y, 0} : n);
+    data.vertexData.push_back({
+      .normal = n,
+      .tangent = {-std::sin(phi), 0, std::cos(phi), 1},
+      .texCoords = {float(segment) / float(sphereSegments), float(ring) / float(sphereRings)},
+    });
+    mesh.locked.push_back(seam);
+    return uint32_t(data.positions.size() - 1);
+  };
+
+  // Rings 1 to sphereRings - 1, with the first segment repeated at the end
+  std::vector<uint32_t> rings;
+  for (uint32_t i = 1; i < sphereRings; i++) {
+    for (uint32_t j = 0; j <= sphereSegments; j++) rings.push_back(vertex(i, j, j == 0 || j == sphereSegments));
+  }
+  auto ring = [&](uint32_t i, uint32_t j) { return rings[(i - 1) * (sphereSegments + 1) + j]; };
+
+  for (uint32_t j = 0; j < sphereSegments; j++) {
+    const uint32_t top = vertex(0, j, true), bottom = vertex(sphereRings, j, true);
+    data.indices.insert(data.indices.end(), {top, ring(1, j + 1), ring(1, j)});
+    data.indices.insert(data.indices.end(), {bottom, ring(sphereRings - 1, j), ring(sphereRings - 1, j + 1)});
+  }
+  for (uint32_t i = 1; i < sphereRings - 1; i++) {
+    for (uint32_t j = 0; j < sphereSegments; j++) {
+      const uint32_t a = ring(i, j), b = ring(i + 1, j), c = ring(i, j + 1), d = ring(i + 1, j + 1);
+      data.indices.insert(data.indices.end(), {a, c, b, c, d, b});
+    }
+  }
+
+  data.materialIndices.assign(data.indices.size() / 3, 0);
+  return mesh;
+}
+
+/*
+ * Open grid, slightly bumpy so the quadrics aren't all zero. The border is
+ * the outline of the square.
+ */
+TestMesh grid() {
+  TestMesh mesh{.name = "grid"};
+  auto& data = mesh.data;
+
+  for (uint32_t y = 0; y <= gridSize; y++) {
+    for (uint32_t x = 0; x <= gridSize; x++) {
+      const float h = (unorm(hash(y * (gridSize + 1) + x)) - 0.5f) * 0.01f;
+      data.positions.push_back({float(x) / float(gridSize), float(y) / float(gridSize), h});
+      data.vertexData.push_back({
+        .normal = {0, 0, 1},
+        .tangent = {1, 0, 0, 1},
+        .texCoords = {float(x) / float(gridSize), float(y) / float(gridSize)},
+      });
+      mesh.locked.push_back(false);
+    }
+  }
+
+  for (uint32_t y = 0; y < gridSize; y++) {
+    for (uint32_t x = 0; x < gridSize; x++) {
+      const uint32_t a = y * (gridSize + 1) + x, b = a + gridSize + 1;
+      data.indices.insert(data.indices.end(), {a, a + 1, b, a + 1, b + 1, b});
+    }
+  }
+
+  // The corners can't move without changing the outline
+  for (uint32_t corner: {0u, gridSize, gridSize * (gridSize + 1), (gridSize + 1) * (gridSize + 1) - 1})
+    mesh.locked[corner] = true;
+
+  data.materialIndices.assign(data.indices.size() / 3, 0);
+  return mesh;
+}
+
+bool onGridBorder(float3 p) {
+  return p.x == 0.0f || p.x == 1.0f || p.y == 0.0f || p.y == 1.0f;
+}
+
+/*
+ * Edges by position, with how many triangles use each one. Closed surfaces
+ * have every edge twice, open borders once.
+ */
+std::map<std::pair<std::array<float, 3>, std::array<float, 3>>, uint32_t> edges(const MeshData& mesh, std::span<const uint32_t> indices) {
+  std::map<std::pair<std::array<float, 3>, std::array<float, 3>>, uint32_t> result;
+  for (size_t t = 0; t < indices.size(); t += 3) {
+    for (int e = 0; e < 3; e++) {
+      const float3 a = mesh.positions[indices[t + e]], b = mesh.positions[indices[t + (e + 1) % 3]];
+      auto key = std::pair{std::array{a.x, a.y, a.z}, std::array{b.x, b.y, b.z}};
+      if (key.second < key.first) std::swap(key.first, key.second);
+      result[key]++;
+    }
+  }
+  return result;
+}
+
+/*
+ * Checks common to both meshes: level sizes, indices and locked vertices
+ */
+void checkLevels(const TestMesh& mesh, const std::vector<Lod>& lods) {
+  if (!pt::test::check(lods.size() >= 3, std::format("{}: {} levels", mesh.name, lods.size()))) return;
+
+  size_t previousTriangles = mesh.data.indices.size() / 3;
+  float previousError = 0.0f;
+  for (size_t level = 0; level < lods.size(); level++) {
+    const auto& lod = lods[level];
+    const auto name = std::format("{} level {}", mesh.name, level);
+    const size_t triangles = lod.indices.size() / 3;
+
+    // Every level halves the previous one, up to the last collapse
+    const auto target = size_t(float(previousTriangles) * lodOptions.ratio);
+    pt::test::check(
+      triangles <= target && triangles + 2 >= target,
+      std::format("{}: {} triangles, previous level {}", name, triangles, previousTriangles)
+    );
+
+    bool valid = lod.indices.size() % 3 == 0;
+    for (size_t i = 0; i < lod.indices.size(); i += 3) {
+      const uint32_t a = lod.indices[i], b = lod.indices[i + 1], c = lod.indices[i + 2];
+      valid &= a < mesh.data.positions.size() && b < mesh.data.positions.size() && c < mesh.data.positions.size();
+      valid &= a != b && b != c && c != a;
+    }
+    pt::test::check(valid, std::format("{}: indices out of range or degenerate", name));
+
+    std::set<std::array<float, 3>> used;
+    for (uint32_t idx: lod.indices) {
+      const float3 p = mesh.data.positions[idx];
+      used.insert({p.x, p.y, p.z});
+    }
+    size_t missing = 0;
+    for (size_t v = 0; v < mesh.locked.size(); v++) {
+      const float3 p = mesh.data.positions[v];
+      if (mesh.locked[v] && !used.contains({p.x, p.y, p.z})) missing++;
+    }
+    pt::test::check(missing == 0, std::format("{}: {} locked positions removed", name, missing));
+
+    pt::test::check(
+      lod.error >= previousError && std::isfinite(lod.error),
+      std::format("{}: error {}, previous level {}", name, lod.error, previousError)
+    );
+
+    previousTriangles = triangles;
+    previousError = lod.error;
+  }
+}
+
+}
+
+TEST(mesh_simplifier, closed_sphere) {
+  const auto mesh = sphere();
+  const auto lods = buildLods(mesh.data, lodOptions);
+  checkLevels(mesh, lods);
+
+  // Seams are kept, so the surface stays closed
+  for (size_t level = 0; level < lods.size(); level++) {
+    const auto counts = edges(mesh.data, lods[level].indices);
+    const bool closed = std::ranges::all_of(counts, [](const auto& edge) { return edge.second == 2; });
+    pt::test::check(closed, std::format("sphere level {}: open or non-manifold edges", level));
+  }
+}
+
+TEST(mesh_simplifier, open_grid) {
+  const auto mesh = grid();
+  const auto lods = buildLods(mesh.data, lodOptions);
+  checkLevels(mesh, lods);
+
+  // Border vertices only slide along the border, so its outline stays
+  for (size_t level = 0; level < lods.size(); level++) {
+    size_t borderEdges = 0, offBorder = 0;
+    for (const auto& [edge, count]: edges(mesh.data, lods[level].indices)) {
+      if (count != 1) continue;
+      borderEdges++;
+      const auto& [a, b] = edge;
+      if (!onGridBorder({a[0], a[1], a[2]}) || !onGridBorder({b[0], b[1], b[2]})) offBorder++;
+    }
+    pt::test::check(
+      borderEdges >= 4 && offBorder == 0,
+      std::format("grid level {}: {} border edges, {} off the border", level, borderEdges, offBorder)
+    );
+  }
+}
+
+TEST(mesh_simplifier, stop_request) {
+  const auto mesh = sphere();
+
+  std::stop_source stop;
+  stop.request_stop();
+  const auto lods = buildLods(mesh.data, lodOptions, {.stopToken = stop.get_token()});
+  pt::test::check(lods.empty(), std::format("{} levels after a stop request", lods.size()));
+}
+
+TEST(mesh_simplifier, small_mesh) {
+  const auto lods = buildLods(grid().data, {.minTriangles = 1 << 20});
+  CHECK(lods.empty());
+}
@@ -0,0 +1,208 @@
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <vector>
+
+#include <renderer_pt/partial_render.hpp>
+#include <renderer_pt/pt_shader_defs.hpp>
+
+#include "test.hpp"
+
+using namespace pt::renderer_pt;
+using pt::test::hash;
+using pt::test::unorm;
+
+namespace {
+
+constexpr uint2 imageSize = {37, 23};
+constexpr uint32_t sampleTotal = 96;
+constexpr uint32_t gmonBuckets = 5;
+
+// Running means round differently depending on where a bucket's range starts
+constexpr float maxRelativeError = 1e-5f;
+
+// Radiance of a pixel's sample at a frame index, some of it well above 1
+float4 sample(size_t pixel, uint32_t frameIdx) {
+  const auto h = hash(uint32_t(pixel) * 7919u + frameIdx * 104729u);
+  const float scale = (h & 15) == 0 ? 40.0f : 1.0f;
+  return float4{unorm(hash(h)), unorm(hash(h + 1)), unorm(hash(h + 2)), 1.0f} * scale;
+}
+
+/*
+ * Render a sample range the way the renderer does: each frame goes to a
+ * bucket, accumulated as a running mean like the path tracing kernels, then
+ * read back as sums like Renderer::readbackPartialRender()
+ */
+PartialRender render(uint32_t start, uint32_t count, int flags) {
+  const uint32_t buckets = (flags & pt::shaders_pt::RendererFlags_GMoN) ? gmonBuckets : 1;
+
+  PartialRender partial{
+    .size = imageSize,
+    .sampleTotal = sampleTotal,
+    .sampleStart = start,
+    .sampleCount = count,
+    .buckets = buckets,
+    .flags = flags,
+    .bucketSamples = std::vector<uint32_t>(buckets, 0),
+  };
+
+  const size_t pixelCount = partial.pixelCount();
+  std::vector<float4> means(pixelCount * buckets, float4{0, 0, 0, 0});
+  for (uint32_t frameIdx = start; frameIdx < start + count; frameIdx++) {
+    const uint32_t bucket = std::min(frameIdx / partial.samplesPerBucket(), buckets - 1);
+    const uint32_t localFrameIdx = partial.bucketSamples[bucket]++;
+
+    for (size_t i = 0; i < pixelCount; i++) {
+      float4 L = sample(i, frameIdx);
+      if (localFrameIdx > 0) {
+        L += means[bucket * pixelCount + i] * float(localFrameIdx);
+        L /= float(localFrameIdx + 1);
+      }
+      means[bucket * pixelCount + i] = L;
+    }
+  }
+
+  partial.sums.resize(means.size());
+  for (uint32_t bucket = 0; bucket < buckets; bucket++) {
+    for (size_t i = 0; i < pixelCount; i++) {
+      const size_t idx = bucket * pixelCount + i;
+      partial.sums[idx] = means[idx] * float(partial.bucketSamples[bucket]);
+    }
+  }
+
+  return partial;
+}
+
+bool sameSums(const PartialRender& a, const PartialRender& b) {
+  for (size_t i = 0; i < a.sums.size(); i++) {
+    for (int c = 0; c < 4; c++) {
+      const float x = a.sums[i][c], y = b.sums[i][c];
+      if (std::abs(x - y) > maxRelativeError * std::max(std::abs(y), 1.0f)) {
+        pt::test::check(false, std::format("sum {} channel {}: {} != {}", i, c, x, y));
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void checkMergeMatchesSingleRender(int flags) {
+  // Uneven ranges, given out of order, that cross bucket boundaries
+  const std::vector<PartialRender> partials = {
+    render(40, 33, flags),
+    render(0, 17, flags),
+    render(73, 23, flags),
+    render(17, 23, flags),
+  };
+
+  const auto merged = PartialRender::merge(partials);
+  if (!CHECK(merged.has_value())) return;
+
+  const auto single = render(0, sampleTotal, flags);
+  CHECK(merged->valid());
+  CHECK(merged->sampleStart == single.sampleStart);
+  CHECK(merged->sampleCount == single.sampleCount);
+  CHECK(merged->bucketSamples == single.bucketSamples);
+  if (!CHECK(merged->sums.size() == single.sums.size())) return;
+  sameSums(*merged, single);
+}
+
+fs::path tempFile(std::string_view name) {
+  return fs::temp_directory_path() / std::format("platinum_tests_{}.ptpartial", name);
+}
+
+// Overwrite a 32 bit header field of a saved partial render
+void patch(const fs::path& path, size_t offset, uint32_t value) {
+  std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+  file.seekp(std::streamoff(offset));
+  file.write((const char*) &value, sizeof(value));
+}
+
+// Header field offsets: magic, version, size, then the 32 bit fields
+constexpr size_t sampleStartOffset = 20;
+constexpr size_t bucketsOffset = 28;
+constexpr size_t flagsOffset = 32;
+
+}
+
+TEST(partial_render, merge_matches_single_render) {
+  checkMergeMatchesSingleRender(0);
+}
+
+TEST(partial_render, gmon_merge_matches_single_render) {
+  checkMergeMatchesSingleRender(pt::shaders_pt::RendererFlags_GMoN);
+}
+
+TEST(partial_render, merge_rejects_gaps_and_overlaps) {
+  CHECK(!PartialRender::merge({render(0, 32, 0), render(48, 16, 0)}).has_value());
+  CHECK(!PartialRender::merge({render(0, 32, 0), render(16, 32, 0)}).has_value());
+  CHECK(!PartialRender::merge({render(0, 32, 0), render(32, 16, pt::shaders_pt::RendererFlags_GMoN)}).has_value());
+}
+
+TEST(partial_render, valid_checks_bucket_samples) {
+  auto partial = render(10, 50, pt::shaders_pt::RendererFlags_GMoN);
+  CHECK(partial.valid());
+
+  partial.bucketSamples[1]++;
+  CHECK(!partial.valid());
+}
+
+TEST(partial_render, save_load_round_trip) {
+  const auto path = tempFile("round_trip");
+  const auto partial = render(24, 40, pt::shaders_pt::RendererFlags_GMoN);
+  if (!CHECK(partial.saveToFile(path))) return;
+
+  const auto loaded = PartialRender::loadFromFile(path);
+  fs::remove(path);
+  if (!CHECK(loaded.has_value())) return;
+
+  CHECK(equal(loaded->size, partial.size));
+  CHECK(loaded->sampleTotal == partial.sampleTotal);
+  CHECK(loaded->sampleStart == partial.sampleStart);
+  CHECK(loaded->sampleCount == partial.sampleCount);
+  CHECK(loaded->buckets == partial.buckets);
+  CHECK(loaded->flags == partial.flags);
+  CHECK(loaded->bucketSamples == partial.bucketSamples);
+  CHECK(std::memcmp(loaded->sums.data(), partial.sums.data(), sizeof(float4) * partial.sums.size()) == 0);
+}
+
+TEST(partial_render, load_rejects_bad_files) {
+  const auto partial = render(0, 32, pt::shaders_pt::RendererFlags_GMoN);
+  const auto path = tempFile("bad");
+
+  auto saveAndPatch = [&](size_t offset, uint32_t value) {
+    CHECK(partial.saveToFile(path));
+    patch(path, offset, value);
+  };
+
+  // Truncated, and with trailing data
+  CHECK(partial.saveToFile(path));
+  fs::resize_file(path, fs::file_size(path) - 16);
+  CHECK(!PartialRender::loadFromFile(path).has_value());
+
+  CHECK(partial.saveToFile(path));
+  fs::resize_file(path, fs::file_size(path) + 16);
+  CHECK(!PartialRender::loadFromFile(path).has_value());
+
+  // Not a partial render, or a newer version
+  saveAndPatch(0, 0x12345678);
+  CHECK(!PartialRender::loadFromFile(path).has_value());
+  saveAndPatch(4, 2);
+  CHECK(!PartialRender::loadFromFile(path).has_value());
+
+  // Header fields out of bounds or inconsistent with each other
+  saveAndPatch(bucketsOffset, 1u << 20);
+  CHECK(!PartialRender::loadFromFile(path).has_value());
+  saveAndPatch(sampleStartOffset, sampleTotal);
+  CHECK(!PartialRender::loadFromFile(path).has_value());
+  saveAndPatch(flagsOffset, 1u << 16);
+  CHECK(!PartialRender::loadFromFile(path).has_value());
+
+  // Bucket sample counts that don't match the range
+  saveAndPatch(sampleStartOffset, 1);
+  CHECK(!PartialRender::loadFromFile(path).has_value());
+
+  fs::remove(path);
+}
@@ -0,0 +1,190 @@
+#include <algorithm>
+#include <cmath>
+#include <format>
+#include <iterator>
+#include <limits>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <core/texture.hpp>
+#include <loaders/pixel_convert.hpp>
+
+#include "test.hpp"
+
+using namespace pt;
+using namespace pt::loaders::texture;
+using pt::test::hash;
+using pt::test::unorm;
+
+namespace {
+
+/*
+ * Pixel counts that leave a remainder for the scalar tail after both the 16
+ * pixel NEON and 4 pixel SSSE3 loops, and one that spans several chunks
+ */
+constexpr size_t pixelCounts[] = {1, 3, 7, 17, 30, 1001, (1 << 16) * 2 + 13};
+
+// Channel maps the loader uses, plus swizzles the SIMD paths must also honor
+const std::vector<uint8_t> channelMaps[] = {
+  {0}, {3}, {0, 1}, {0, 3}, {0, 1, 2, 3}, {2, 1, 0, 3}, {3, 3, 3, 3},
+};
+
+std::vector<uint8_t> randomPixels(size_t count, uint32_t seed, bool opaque) {
+  std::vector<uint8_t> pixels(count * 4);
+  for (size_t i = 0; i < pixels.size(); i++)
+    pixels[i] = opaque && i % 4 == 3 ? 255 : uint8_t(hash(uint32_t(i) * 4 + seed));
+  return pixels;
+}
+
+/*
+ * Reference: one pixel at a time, the same mapping as the scalar tail
+ */
+bool referenceConvert(std::span<const uint8_t> src, std::span<const uint8_t> map, bool hasAlphaChannel, uint8_t* dst) {
+  const size_t n = map.size();
+  bool hasAlpha = false;
+  for (size_t i = 0; i < src.size() / 4; i++) {
+    hasAlpha |= hasAlphaChannel && src[i * 4 + 3] < 255;
+    for (size_t c = 0; c < n; c++)
+      dst[i * n + c] = src[i * 4 + map[c]];
+    if (!hasAlphaChannel && n == 4)
+      dst[i * 4 + 3] = 255;
+  }
+  return hasAlpha;
+}
+
+std::string mapName(std::span<const uint8_t> map) {
+  std::string name;
+  for (auto c: map) name += "rgba"[c];
+  return name;
+}
+
+}
+
+/*
+ * Every channel map, with and without source alpha, matches the reference at
+ * every pixel, including the ones left over for the scalar tail
+ */
+TEST(pixel_convert, channel_maps) {
+  for (size_t count: pixelCounts) {
+    const auto src = randomPixels(count, uint32_t(count), false);
+    for (const auto& map: channelMaps) {
+      for (bool hasAlphaChannel: {true, false}) {
+        std::vector<uint8_t> converted(count * map.size()), expected(count * map.size());
+        const bool hasAlpha = convertPixels(src.data(), count, map, hasAlphaChannel, converted.data());
+        const bool expectAlpha = referenceConvert(src, map, hasAlphaChannel, expected.data());
+
+        const auto mismatch = std::ranges::mismatch(converted, expected).in1 - converted.begin();
+        const auto name = std::format("{} pixels, map {}, source alpha {}", count, mapName(map), hasAlphaChannel);
+        pt::test::check(mismatch == ptrdiff_t(converted.size()), std::format("{}: first mismatch at byte {}", name, mismatch));
+        pt::test::check(hasAlpha == expectAlpha, std::format("{}: alpha {}, expected {}", name, hasAlpha, expectAlpha));
+      }
+    }
+  }
+}
+
+/*
+ * A single translucent pixel is found wherever it is, whether the SIMD loop or
+ * the scalar tail reads it. Sources without alpha never report any.
+ */
+TEST(pixel_convert, alpha_minimum) {
+  const uint8_t map[] = {0, 1, 2, 3};
+  for (size_t count: pixelCounts) {
+    auto src = randomPixels(count, 5, true);
+    std::vector<uint8_t> converted(count * 4);
+
+    pt::test::check(
+      !convertPixels(src.data(), count, map, true, converted.data()),
+      std::format("{} opaque pixels reported alpha", count)
+    );
+
+    for (size_t pixel: {size_t(0), count / 2, count - 1}) {
+      src[pixel * 4 + 3] = 254;
+      pt::test::check(
+        convertPixels(src.data(), count, map, true, converted.data()),
+        std::format("{} pixels: alpha at pixel {} not found", count, pixel)
+      );
+      pt::test::check(
+        !convertPixels(src.data(), count, map, false, converted.data()),
+        std::format("{} pixels: alpha reported for a source without alpha", count)
+      );
+      src[pixel * 4 + 3] = 255;
+    }
+  }
+}
+
+/*
+ * Half conversion matches the scalar conversion bit for bit over a wide range
+ * of magnitudes, so it doesn't matter which path converts a pixel
+ */
+TEST(pixel_convert, half_matches_scalar) {
+  for (size_t count: pixelCounts) {
+    std::vector<float> src(count * 4);
+    for (size_t i = 0; i < src.size(); i++) {
+      const auto h = hash(uint32_t(i));
+      src[i] = std::ldexp(unorm(h), int(h % 48) - 30) * (h & 0x10 ? -1.0f : 1.0f);
+    }
+
+    std::vector<uint16_t> converted(src.size());
+    convertPixelsToHalf(src.data(), count, converted.data());
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < src.size(); i++)
+      if (converted[i] != Texture::floatToHalf(src[i])) mismatches++;
+    pt::test::check(mismatches == 0, std::format("{} pixels: {} values differ from the scalar conversion", count, mismatches));
+  }
+}
+
+/*
+ * Rounding to nearest even, including denormals, and clamping to ±65504
+ */
+TEST(pixel_convert, half_rounding_and_clamping) {
+  constexpr float inf = std::numeric_limits<float>::infinity();
+  const struct { float value; uint16_t half; } cases[] = {
+    {0.0f, 0x0000},
+    {1.0f, 0x3c00},
+    {1.0f + 0x1p-11f, 0x3c00},              // Tie, rounds down to even
+    {1.0f + 0x3p-11f, 0x3c02},              // Tie, rounds up to even
+    {1.0f + 0x1p-11f + 0x1p-20f, 0x3c01},   // Just past the tie
+    {-2.0f, 0xc000},
+    {0x1p-24f, 0x0001},                     // Smallest denormal
+    {0x1p-25f, 0x0000},                     // Denormal tie, rounds to zero
+    {0x3p-25f, 0x0002},                     // Denormal tie, rounds up to even
+    {0x1p-14f, 0x0400},                     // Smallest normal
+    {65504.0f, 0x7bff},
+    {65519.0f, 0x7bff},
+    {65536.0f, 0x7bff},
+    {1e9f, 0x7bff},
+    {-1e9f, 0xfbff},
+    {inf, 0x7bff},
+    {-inf, 0xfbff},
+  };
+
+  /*
+   * Shift the cases through every position in a chunk of 4 values, and repeat
+   * them past the 16 pixel SIMD width
+   */
+  std::vector<float> src;
+  std::vector<uint16_t> expected;
+  for (size_t shift = 0; shift < 4; shift++) {
+    for (size_t i = 0; i < 32; i++) {
+      const auto& c = cases[(i + shift) % std::size(cases)];
+      src.push_back(c.value);
+      expected.push_back(c.half);
+    }
+  }
+
+  std::vector<uint16_t> converted(src.size());
+  convertPixelsToHalf(src.data(), src.size() / 4, converted.data());
+
+  for (size_t i = 0; i < src.size(); i++) {
+    pt::test::check(
+      converted[i] == expected[i],
+      std::format("{:a} converted to {:#06x}, expected {:#06x}", src[i], converted[i], expected[i])
+    );
+    pt::test::check(
+      Texture::floatToHalf(src[i]) == expected[i],
+      std::format("{:a} scalar converted to {:#06x}, expected {:#06x}", src[i], Texture::floatToHalf(src[i]), expected[i])
+    );
+  }
+}
@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <format>
+#include <functional>
+#include <span>
+#include <vector>
+
+#include <Metal/Metal.hpp>
+#include <renderer_pt/samplers.hpp>
+#include <utils/metal_utils.hpp>
+
+#include "shaders/sampler_reference.hpp"
+#include "test.hpp"
+
+using namespace pt;
+using namespace pt::renderer_pt::samplers;
+using namespace pt::test_shaders;
+
+namespace {
+
+constexpr uint2 testSize = {64, 48};
+constexpr uint32_t testSpp = 1024;
+
+// Dimensions per pixel for the determinism and GPU tests. Not a multiple of
+// the batch width, so partial blocks get tested too
+constexpr uint32_t testDimensions = 37;
+
+// Discrepancy test parameters
+constexpr uint32_t discrepancyPoints = 1024;
+constexpr uint32_t discrepancyPairs = 3; // 2D projections tested per sampler
+constexpr double lowDiscrepancyFactor = 0.5;
+constexpr double randomFactor = 2.0;
+
+bool bitwiseEqual(std::span<const float> a, std::span<const float> b) {
+  return a.size() == b.size() &&
+         std::ranges::equal(a, b, {}, std::bit_cast<uint32_t, float>,
+                            std::bit_cast<uint32_t, float>);
+}
+
+/*
+ * Sequences for the determinism tests
+ */
+template <typename Sampler>
+std::vector<float> scalarSequence(uint2 tid, uint32_t sample, uint32_t count) {
+  Sampler sampler(tid, testSize, testSpp, sample);
+
+  std::vector<float> result(count);
+  for (auto &value : result)
+    value = sampler.sample1d();
+  return result;
+}
+
+template <typename Sampler>
+std::vector<float> blockSequence(uint2 tid, uint32_t sample, uint32_t count) {
+  Sampler sampler(tid, testSize, testSpp, sample);
+
+  // Start with a few scalar calls, so blocks don't start at dimension 0
+  std::vector<float> result(count);
+  for (uint32_t i = 0; i < 3; i++)
+    result[i] = sampler.sample1d();
+  sampler.sample1d(std::span(result).subspan(3));
+  return result;
+}
+
+/*
+ * Discrepancy tests
+ */
+
+// L2-star discrepancy of a 2D point set, using Warnock's formula
+double l2StarDiscrepancy(std::span<const float2> points) {
+  const double n = double(points.size());
+
+  double sum1 = 0.0;
+  for (const auto &p : points)
+    sum1 += (1.0 - double(p.x) * p.x) * (1.0 - double(p.y) * p.y);
+
+  double sum2 = 0.0;
+  for (const auto &p : points) {
+    for (const auto &q : points)
+      sum2 += (1.0 - std::max(p.x, q.x)) * (1.0 - std::max(p.y, q.y));
+  }
+
+  return std::sqrt(1.0 / 9.0 - sum1 / (2.0 * n) + sum2 / (n * n));
+}
+
+// Expected L2-star discrepancy of n independent uniform points in 2D
+double randomDiscrepancy(uint32_t n) {
+  return std::sqrt((1.0 / 4.0 - 1.0 / 9.0) / double(n));
+}
+
+// Points for a single pixel: every sample, 2D projection at the given pair
+std::vector<float2> zPoints(uint32_t pair) {
+  std::vector<float2> points(discrepancyPoints);
+  for (uint32_t i = 0; i < discrepancyPoints; i++) {
+    ZSampler sampler({19, 11}, testSize, discrepancyPoints, i);
+    for (uint32_t d = 0; d < pair; d++)
+      sampler.sample2d();
+    points[i] = sampler.sample2d();
+  }
+  return points;
+}
+
+/*
+ * The Halton sampler randomizes its start offset per sample, so we test the
+ * underlying sequence: consecutive indices from an arbitrary offset.
+ */
+std::vector<float2> haltonPoints(uint32_t pair) {
+  std::vector<float2> points(discrepancyPoints);
+  for (uint32_t i = 0; i < discrepancyPoints; i++) {
+    HaltonSampler sampler(0x1234u + i, 2 * pair);
+    points[i] = sampler.sample2d();
+  }
+  return points;
+}
+
+std::vector<float2> pcg4dPoints(uint32_t pair) {
+  std::vector<float2> points(discrepancyPoints);
+  for (uint32_t i = 0; i < discrepancyPoints; i++) {
+    PCG4DSampler sampler({19, 11}, testSize, discrepancyPoints, i);
+    for (uint32_t d = 0; d < pair; d++)
+      sampler.sample2d();
+    points[i] = sampler.sample2d();
+  }
+  return points;
+}
+
+/*
+ * GPU comparison
+ */
+std::vector<float> gpuReference(MTL::Device *device,
+                                MTL::ComputePipelineState *pipeline,
+                                SamplerType type,
+                                uint32_t sample) {
+  SamplerReferenceParams params{
+      .size = testSize,
+      .spp = testSpp,
+      .sample = sample,
+      .dimensions = testDimensions,
+      .type = uint32_t(type),
+  };
+
+  const size_t count = size_t(testSize.x) * testSize.y * testDimensions;
+  auto *outBuffer = device->newBuffer(count * sizeof(float),
+                                      MTL::ResourceStorageModeShared);
+
+  auto *commandQueue = device->newCommandQueue();
+  auto *cmd = commandQueue->commandBuffer();
+  auto *enc = cmd->computeCommandEncoder();
+
+  enc->setBytes(&params, sizeof(params), 0);
+  enc->setBuffer(outBuffer, 0, 1);
+  enc->setComputePipelineState(pipeline);
+  enc->dispatchThreads({testSize.x, testSize.y, 1}, {8, 8, 1});
+  enc->endEncoding();
+
+  cmd->commit();
+  cmd->waitUntilCompleted();
+
+  std::vector<float> result(count);
+  std::memcpy(result.data(), outBuffer->contents(), count * sizeof(float));
+
+  outBuffer->release();
+  commandQueue->release();
+  return result;
+}
+
+template <typename Sampler>
+std::vector<float> cpuReference(uint32_t sample) {
+  std::vector<float> result(size_t(testSize.x) * testSize.y * testDimensions);
+  for (uint32_t y = 0; y < testSize.y; y++) {
+    for (uint32_t x = 0; x < testSize.x; x++) {
+      Sampler sampler({x, y}, testSize, testSpp, sample);
+      for (uint32_t i = 0; i < testDimensions; i++)
+        result[(y * testSize.x + x) * testDimensions + i] = sampler.sample1d();
+    }
+  }
+  return result;
+}
+
+} // namespace
+
+/*
+ * Determinism tests
+ */
+TEST(samplers, z_block_1d_matches_scalar) {
+  for (uint32_t sample : {0u, 1u, 77u, testSpp - 1}) {
+    for (uint2 tid : {uint2{0, 0}, uint2{13, 7}, uint2{63, 47}}) {
+      auto scalar = scalarSequence<ZSampler>(tid, sample, testDimensions);
+      auto block = blockSequence<ZSampler>(tid, sample, testDimensions);
+      if (!pt::test::check(bitwiseEqual(scalar, block),
+                           std::format("mismatch at pixel ({}, {}), sample {}",
+                                       tid.x, tid.y, sample)))
+        return;
+    }
+  }
+}
+
+TEST(samplers, z_block_2d_matches_scalar) {
+  for (uint32_t sample : {0u, 1u, 77u, testSpp - 1}) {
+    ZSampler scalar({5, 9}, testSize, testSpp, sample);
+    ZSampler block({5, 9}, testSize, testSpp, sample);
+
+    std::vector<float2> blockValues(testDimensions);
+    block.sample2d(blockValues);
+
+    for (uint32_t i = 0; i < testDimensions; i++) {
+      const float2 expected = scalar.sample2d();
+      const bool equal = std::bit_cast<uint32_t>(expected.x) ==
+                             std::bit_cast<uint32_t>(blockValues[i].x) &&
+                         std::bit_cast<uint32_t>(expected.y) ==
+                             std::bit_cast<uint32_t>(blockValues[i].y);
+      if (!pt::test::check(equal,
+                           std::format("mismatch at sample {}, dimension {}",
+                                       sample, i)))
+        return;
+    }
+
+    // Both samplers must be left at the same dimension
+    if (!pt::test::check(scalar.sample1d() == block.sample1d(),
+                         "samplers out of sync after block"))
+      return;
+  }
+}
+
+TEST(samplers, halton_block_matches_scalar) {
+  for (uint32_t sample : {0u, 1u, 77u, testSpp - 1}) {
+    for (uint2 tid : {uint2{0, 0}, uint2{13, 7}, uint2{63, 47}}) {
+      auto scalar = scalarSequence<HaltonSampler>(tid, sample, testDimensions);
+      auto block = blockSequence<HaltonSampler>(tid, sample, testDimensions);
+      if (!pt::test::check(bitwiseEqual(scalar, block),
+                           std::format("mismatch at pixel ({}, {}), sample {}",
+                                       tid.x, tid.y, sample)))
+        return;
+    }
+  }
+}
+
+TEST(samplers, pixel_seed_block_matches_scalar) {
+  std::vector<uint32_t> seeds(testSize.x);
+  for (uint32_t y : {0u, 21u}) {
+    pixelSeeds({0, y}, 5, seeds);
+    for (uint32_t x = 0; x < testSize.x; x++) {
+      HaltonSampler sampler({x, y}, testSize, testSpp, 5);
+      if (!pt::test::check(sampler.offset() == seeds[x],
+                           std::format("mismatch at pixel ({}, {})", x, y)))
+        return;
+    }
+  }
+}
+
+TEST(samplers, same_seed_same_sequence) {
+  const uint2 tid = {31, 17};
+  CHECK(bitwiseEqual(scalarSequence<ZSampler>(tid, 3, testDimensions),
+                     scalarSequence<ZSampler>(tid, 3, testDimensions)));
+  CHECK(bitwiseEqual(scalarSequence<HaltonSampler>(tid, 3, testDimensions),
+                     scalarSequence<HaltonSampler>(tid, 3, testDimensions)));
+  CHECK(bitwiseEqual(scalarSequence<PCG4DSampler>(tid, 3, testDimensions),
+                     scalarSequence<PCG4DSampler>(tid, 3, testDimensions)));
+}
+
+/*
+ * L2-star discrepancy of 2D projections: the low discrepancy samplers have to
+ * beat independent random samples, and PCG4D has to be about as good.
+ */
+TEST(samplers, discrepancy) {
+  const double expected = randomDiscrepancy(discrepancyPoints);
+  struct DiscrepancyTest {
+    const char *name;
+    std::function<std::vector<float2>(uint32_t)> points;
+    double maxFactor;
+  };
+  const DiscrepancyTest discrepancyTests[] = {
+      {"z-sampler", zPoints, lowDiscrepancyFactor},
+      {"halton", haltonPoints, lowDiscrepancyFactor},
+      {"pcg4d", pcg4dPoints, randomFactor},
+  };
+
+  for (const auto &test : discrepancyTests) {
+    for (uint32_t pair = 0; pair < discrepancyPairs; pair++) {
+      const double d = l2StarDiscrepancy(test.points(pair));
+      const double limit = test.maxFactor * expected;
+      pt::test::check(d < limit,
+                      std::format("discrepancy {}, dimensions {}-{}: {:.6f} "
+                                  "(limit {:.6f})",
+                                  test.name, 2 * pair, 2 * pair + 1, d, limit));
+    }
+  }
+}
+
+/*
+ * Bitwise comparison against the GPU samplers, using the reference kernel in
+ * tests.metallib
+ */
+TEST(samplers, gpu_matches_cpu) {
+  NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+  MTL::Device *device = MTL::CreateSystemDefaultDevice();
+  if (!pt::test::check(device != nullptr, "Metal device available")) {
+    pool->release();
+    return;
+  }
+
+  MTL::Library *lib = metal_utils::createLibrary(device, "tests");
+  auto *pipeline = metal_utils::createComputePipeline(
+      device, "samplerReference",
+      {
+          .function = metal_utils::getFunction(lib, "samplerReference"),
+          .threadGroupSizeIsMultipleOfExecutionWidth = false,
+      });
+  lib->release();
+
+  for (uint32_t sample : {0u, 1u, 77u}) {
+    pt::test::check(
+        bitwiseEqual(cpuReference<ZSampler>(sample),
+                     gpuReference(device, pipeline, Sampler_Z, sample)),
+        std::format("gpu z-sampler, sample {}", sample));
+    pt::test::check(
+        bitwiseEqual(cpuReference<HaltonSampler>(sample),
+                     gpuReference(device, pipeline, Sampler_Halton, sample)),
+        std::format("gpu halton, sample {}", sample));
+    pt::test::check(
+        bitwiseEqual(cpuReference<PCG4DSampler>(sample),
+                     gpuReference(device, pipeline, Sampler_PCG4D, sample)),
+        std::format("gpu pcg4d, sample {}", sample));
+  }
+
+  pipeline->release();
+  device->release();
+  pool->release();
+}
@@ -0,0 +1,37 @@
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunknown-attributes"
+
+#ifndef PLATINUM_SAMPLER_REFERENCE_HPP
+#define PLATINUM_SAMPLER_REFERENCE_HPP
+
+#include <simd/simd.h>
+
+using namespace simd;
+
+// Don't nest namespaces here, the MSL compiler complains it's a C++ 17 ext
+namespace pt { // NOLINT(*-concat-nested-namespaces)
+namespace test_shaders {
+
+/*
+ * Sampler reference kernel, used to check the CPU samplers against the GPU.
+ */
+enum SamplerType {
+  Sampler_Z = 0,
+  Sampler_Halton,
+  Sampler_PCG4D,
+};
+
+struct SamplerReferenceParams {
+  uint2 size;
+  uint32_t spp;
+  uint32_t sample;
+  uint32_t dimensions;  // Values written per pixel
+  uint32_t type;
+};
+
+}
+}
+
+#endif //PLATINUM_SAMPLER_REFERENCE_HPP
+
+#pragma clang diagnostic pop
@@ -0,0 +1,37 @@
+#include <metal_stdlib>
+
+#include <renderer_pt/shaders/defs.metal>
+
+#include "sampler_reference.hpp"
+
+using namespace pt::test_shaders;
+
+/*
+ * Write the first params.dimensions values of the selected sampler for every
+ * pixel. Used to validate the CPU samplers against the GPU implementation.
+ */
+kernel void samplerReference(uint2 tid [[thread_position_in_grid]],
+                             constant SamplerReferenceParams &params
+                             [[buffer(0)]],
+                             device float *out [[buffer(1)]]) {
+  if (tid.x >= params.size.x || tid.y >= params.size.y) return;
+
+  device float *pixelOut =
+      out + (tid.y * params.size.x + tid.x) * params.dimensions;
+
+  if (params.type == Sampler_Z) {
+    samplers::ZSampler sampler(tid, params.size, params.spp, params.sample);
+    for (uint32_t i = 0; i < params.dimensions; i++)
+      pixelOut[i] = sampler.sample1d();
+  } else if (params.type == Sampler_Halton) {
+    samplers::HaltonSampler sampler(tid, params.size, params.spp,
+                                    params.sample);
+    for (uint32_t i = 0; i < params.dimensions; i++)
+      pixelOut[i] = sampler.sample1d();
+  } else {
+    samplers::PCG4DSampler sampler(tid, params.size, params.spp,
+                                   params.sample);
+    for (uint32_t i = 0; i < params.dimensions; i++)
+      pixelOut[i] = sampler.sample1d();
+  }
+}
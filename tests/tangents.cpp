@@ -0,0 +1,227 @@
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <format>
+#include <limits>
+#include <numbers>
+#include <string>
+#include <vector>
+#include <mikktspace.h>
+
+#include <core/tangents.hpp>
+
+#include "test.hpp"
+
+using namespace pt;
+
+namespace {
+
+// Small and odd, so chunks split faces everywhere
+constexpr size_t testChunkFaces = 251;
+
+struct TestMesh {
+  std::string name;
+  std::vector<float3> positions, normals;
+  std::vector<float2> texCoords;
+  std::vector<uint32_t> indices;
+};
+
+/*
+ * UV sphere with a seam and pole vertices split per triangle
+ */
+TestMesh sphere(uint32_t lat, uint32_t lng) {
+  TestMesh mesh{.name = std::format("sphere {}x{}", lat, lng)};
+
+  for (uint32_t i = 0; i <= lat; i++) {
+    for (uint32_t j = 0; j <= lng; j++) {
+      const float theta = std::numbers::pi_v<float> * float(i) / float(lat);
+      const float phi = 2.0f * std::numbers::pi_v<float> * float(j) / float(lng);
+      const float3 n = {std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi)};
+
+      mesh.positions.push_back(n);
+      mesh.normals.push_back(n);
+      mesh.texCoords.push_back({float(j) / float(lng), float(i) / float(lat)});
+    }
+  }
+
+  for (uint32_t i = 0; i < lat; i++) {
+    for (uint32_t j = 0; j < lng; j++) {
+      const uint32_t a = i * (lng + 1) + j, b = a + lng + 1;
+      mesh.indices.insert(mesh.indices.end(), {a, b, a + 1, a + 1, b, b + 1});
+    }
+  }
+
+  return mesh;
+}
+
+/*
+ * Wavy grid with the texture mirrored on one half, as a triangle soup so
+ * shared vertices only match by value. Every few cells has a hard edge or a
+ * degenerate triangle.
+ */
+TestMesh grid(uint32_t size) {
+  TestMesh mesh{.name = std::format("grid {}x{}", size, size)};
+
+  auto height = [](float x, float y) { return 0.2f * std::sin(0.3f * x) * std::cos(0.2f * y); };
+  auto normal = [](float x, float y) {
+    const float dx = 0.06f * std::cos(0.3f * x) * std::cos(0.2f * y);
+    const float dy = -0.04f * std::sin(0.3f * x) * std::sin(0.2f * y);
+    return normalize(float3{-dx, -dy, 1.0f});
+  };
+
+  for (uint32_t y = 0; y < size; y++) {
+    for (uint32_t x = 0; x < size; x++) {
+      const bool hardEdge = (x * 7 + y * 3) % 29 == 0;
+      const bool degenerate = (x * 5 + y * 11) % 37 == 0;
+
+      auto corner = [&](uint32_t cx, uint32_t cy) {
+        const float px = float(cx), py = float(cy);
+        const float u = cx > size / 2 ? float(size - cx) : px; // Mirrored
+        mesh.positions.push_back({px, py, height(px, py)});
+        mesh.normals.push_back(hardEdge ? float3{0.0f, 0.0f, 1.0f} : normal(px, py));
+        mesh.texCoords.push_back({u / float(size), py / float(size)});
+        return uint32_t(mesh.positions.size() - 1);
+      };
+
+      const uint32_t a = corner(x, y), b = corner(x + 1, y), c = corner(x + 1, y + 1), d = corner(x, y + 1);
+      mesh.indices.insert(mesh.indices.end(), {a, b, c});
+      if (degenerate) mesh.indices.insert(mesh.indices.end(), {a, c, corner(x + 1, y + 1)});
+      else mesh.indices.insert(mesh.indices.end(), {a, c, d});
+    }
+  }
+
+  return mesh;
+}
+
+/*
+ * Reference output: a single plain MikkTSpace run over the whole mesh, the
+ * way tangents were generated before chunking
+ */
+namespace reference {
+
+const TestMesh& mesh(const SMikkTSpaceContext* ctx) {
+  return *static_cast<const std::pair<const TestMesh*, std::vector<float4>*>*>(ctx->m_pUserData)->first;
+}
+
+uint32_t vertexIndex(const SMikkTSpaceContext* ctx, int face, int vert) {
+  return mesh(ctx).indices[size_t(face) * 3 + vert];
+}
+
+int getNumFaces(const SMikkTSpaceContext* ctx) { return int(mesh(ctx).indices.size() / 3); }
+
+int getNumVerticesOfFace(const SMikkTSpaceContext*, int) { return 3; }
+
+void getPosition(const SMikkTSpaceContext* ctx, float* out, int face, int vert) {
+  const float3 p = mesh(ctx).positions[vertexIndex(ctx, face, vert)];
+  out[0] = p.x;
+  out[1] = p.y;
+  out[2] = p.z;
+}
+
+void getNormal(const SMikkTSpaceContext* ctx, float* out, int face, int vert) {
+  const float3 n = mesh(ctx).normals[vertexIndex(ctx, face, vert)];
+  out[0] = n.x;
+  out[1] = n.y;
+  out[2] = n.z;
+}
+
+void getTexCoord(const SMikkTSpaceContext* ctx, float* out, int face, int vert) {
+  const float2 uv = mesh(ctx).texCoords[vertexIndex(ctx, face, vert)];
+  out[0] = uv.x;
+  out[1] = uv.y;
+}
+
+void setTSpaceBasic(const SMikkTSpaceContext* ctx, const float* tangent, float sign, int face, int vert) {
+  auto& tangents = *static_cast<const std::pair<const TestMesh*, std::vector<float4>*>*>(ctx->m_pUserData)->second;
+  tangents[size_t(face) * 3 + vert] = float4{tangent[0], tangent[1], tangent[2], sign};
+}
+
+std::vector<float4> tangents(const TestMesh& testMesh) {
+  // Corners MikkTSpace skips (degenerate triangles) keep the same default as generate()
+  std::vector<float4> result(testMesh.indices.size(), float4{1.0f, 0.0f, 0.0f, 1.0f});
+  std::pair<const TestMesh*, std::vector<float4>*> data{&testMesh, &result};
+
+  SMikkTSpaceInterface interface{
+    .m_getNumFaces = getNumFaces,
+    .m_getNumVerticesOfFace = getNumVerticesOfFace,
+    .m_getPosition = getPosition,
+    .m_getNormal = getNormal,
+    .m_getTexCoord = getTexCoord,
+    .m_setTSpaceBasic = setTSpaceBasic,
+    .m_setTSpace = nullptr,
+  };
+  SMikkTSpaceContext ctx{.m_pInterface = &interface, .m_pUserData = &data};
+  genTangSpaceDefault(&ctx);
+
+  return result;
+}
+
+}
+
+size_t mismatches(const std::vector<float4>& a, const std::vector<float4>& b) {
+  if (a.size() != b.size()) return std::max(a.size(), b.size());
+
+  size_t count = 0;
+  for (size_t i = 0; i < a.size(); i++) {
+    if (std::memcmp(&a[i], &b[i], sizeof(float4)) != 0) count++;
+  }
+  return count;
+}
+
+/*
+ * Both a single run and chunked generation must match the reference bitwise
+ */
+void checkAgainstReference(const TestMesh& mesh) {
+  const auto expected = reference::tangents(mesh);
+  const auto single = tangents::generate(
+    mesh.positions, mesh.normals, mesh.texCoords, mesh.indices, std::numeric_limits<size_t>::max()
+  );
+  const auto chunked = tangents::generate(mesh.positions, mesh.normals, mesh.texCoords, mesh.indices, testChunkFaces);
+
+  const size_t corners = mesh.indices.size();
+  const size_t singleMismatches = mismatches(expected, single), chunkedMismatches = mismatches(expected, chunked);
+  pt::test::check(
+    singleMismatches == 0,
+    std::format("{}, single run: {} of {} corners differ", mesh.name, singleMismatches, corners)
+  );
+  pt::test::check(
+    chunkedMismatches == 0,
+    std::format("{}, chunked: {} of {} corners differ", mesh.name, chunkedMismatches, corners)
+  );
+}
+
+}
+
+TEST(tangents, sphere_matches_mikktspace) {
+  checkAgainstReference(sphere(24, 48));
+  checkAgainstReference(sphere(96, 192));
+}
+
+TEST(tangents, mirrored_grid_matches_mikktspace) {
+  checkAgainstReference(grid(64));
+  checkAgainstReference(grid(160));
+}
+
+TEST(tangents, empty_mesh) {
+  CHECK(tangents::generate({}, {}, {}, {}).empty());
+}
+
+/*
+ * Timing on a larger mesh, default chunk size
+ */
+BENCHMARK(tangents, generate) {
+  const auto large = grid(320);
+  auto time = [&](size_t chunkFaces) {
+    const auto start = std::chrono::high_resolution_clock::now();
+    const auto tangents = tangents::generate(large.positions, large.normals, large.texCoords, large.indices, chunkFaces);
+    const auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+  };
+
+  const double single = time(std::numeric_limits<size_t>::max());
+  const double chunked = time(tangents::defaultChunkFaces);
+  pt::test::report(
+    "{}, {} triangles: single run {:.0f} ms, chunked {:.0f} ms ({:.2f}x)",
+    large.name, large.indices.size() / 3, single, chunked, single / chunked
+  );
+}
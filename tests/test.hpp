@@ -0,0 +1,66 @@
+#ifndef PLATINUM_TEST_HPP
+#define PLATINUM_TEST_HPP
+
+#include <cstdint>
+#include <format>
+#include <print>
+#include <source_location>
+#include <string_view>
+
+/*
+ * Minimal test harness for platinum_tests. Tests register themselves by suite
+ * and name, and the runner takes a suite to run, so ctest can run each suite
+ * as a separate test. Benchmarks are registered the same way but only run
+ * when asked for with --bench, they aren't part of the test run.
+ */
+namespace pt::test {
+
+using Fn = void (*)();
+
+struct Registration {
+  Registration(std::string_view suite, std::string_view name, Fn fn, bool benchmark = false);
+};
+
+/*
+ * Record a check, printing the detail on failure. Returns ok, so tests can
+ * bail out early when later checks would be meaningless.
+ */
+bool check(bool ok, std::string_view detail, std::source_location location = std::source_location::current());
+
+// Integer hash for reproducible pseudo-random test data
+inline uint32_t hash(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
+
+// Top 24 bits of a hash as a float in [0, 1)
+inline float unorm(uint32_t x) { return float(x >> 8) * 0x1p-24f; }
+
+// Print a line of benchmark output
+template<typename... Args>
+void report(std::format_string<Args...> fmt, Args&&... args) {
+  std::println("  {}", std::format(fmt, std::forward<Args>(args)...));
+}
+
+}
+
+#define PT_TEST_CONCAT_(a, b) a##b
+#define PT_TEST_CONCAT(a, b) PT_TEST_CONCAT_(a, b)
+
+#define PT_TEST_DEFINE_(suite, name, benchmark)                                          \
+  static void PT_TEST_CONCAT(suite##_##name, _fn)();                                     \
+  static const pt::test::Registration PT_TEST_CONCAT(suite##_##name, _registration)(     \
+    #suite, #name, &PT_TEST_CONCAT(suite##_##name, _fn), benchmark                       \
+  );                                                                                     \
+  static void PT_TEST_CONCAT(suite##_##name, _fn)()
+
+#define TEST(suite, name) PT_TEST_DEFINE_(suite, name, false)
+#define BENCHMARK(suite, name) PT_TEST_DEFINE_(suite, name, true)
+
+#define CHECK(condition) pt::test::check((condition), #condition)
+
+#endif //PLATINUM_TEST_HPP
@@ -0,0 +1,363 @@
+#include <algorithm>
+#include <cmath>
+#include <format>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include <core/texture_compression.hpp>
+
+#include "test.hpp"
+
+using namespace pt::compression;
+using pt::test::hash;
+using pt::test::unorm;
+using simd::float4;
+
+namespace {
+
+constexpr BlockFormat formats[] = {BlockFormat::BC4, BlockFormat::BC5, BlockFormat::BC6H, BlockFormat::BC7};
+constexpr Quality qualities[] = {Quality::Fast, Quality::Normal, Quality::High};
+
+// Not a multiple of the block size in either direction, so edge blocks are partial
+constexpr uint32_t imageWidth = 61, imageHeight = 35;
+
+// Values are scaled up for BC6H, to cover more than the [0, 1] range
+constexpr float hdrScale = 40.0f;
+
+std::string_view formatName(BlockFormat format) {
+  switch (format) {
+    case BlockFormat::BC4: return "BC4";
+    case BlockFormat::BC5: return "BC5";
+    case BlockFormat::BC6H: return "BC6H";
+    case BlockFormat::BC7: return "BC7";
+  }
+  return "";
+}
+
+std::string_view qualityName(Quality quality) {
+  switch (quality) {
+    case Quality::Fast: return "fast";
+    case Quality::Normal: return "normal";
+    case Quality::High: return "high";
+  }
+  return "";
+}
+
+int channelCount(BlockFormat format) {
+  switch (format) {
+    case BlockFormat::BC4: return 1;
+    case BlockFormat::BC5: return 2;
+    case BlockFormat::BC6H: return 3;
+    case BlockFormat::BC7: return 4;
+  }
+  return 0;
+}
+
+float scale(BlockFormat format) { return format == BlockFormat::BC6H ? hdrScale : 1.0f; }
+
+/*
+ * Smooth gradients with a little noise, like most real textures, and white
+ * noise, the worst case for the single subset modes the encoder writes
+ */
+std::vector<float4> smoothImage(uint32_t width, uint32_t height, float scale) {
+  std::vector<float4> pixels(size_t(width) * height);
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      const uint32_t i = y * width + x;
+      for (int c = 0; c < 4; c++) {
+        const float wave = 0.5f + 0.4f * std::sin(float(x) * 0.11f + float(y) * 0.07f * float(c + 1) + float(c));
+        const float noise = (unorm(hash(i * 4 + c)) - 0.5f) * 0.02f;
+        pixels[i][c] = std::clamp(wave + noise, 0.0f, 1.0f) * scale;
+      }
+    }
+  }
+  return pixels;
+}
+
+std::vector<float4> noiseImage(uint32_t width, uint32_t height, float scale) {
+  std::vector<float4> pixels(size_t(width) * height);
+  for (size_t i = 0; i < pixels.size(); i++) {
+    for (int c = 0; c < 4; c++) pixels[i][c] = unorm(hash(uint32_t(i) * 4 + c + 0x1000)) * scale;
+  }
+  return pixels;
+}
+
+/*
+ * RMS error over the channels a format stores, relative to the range of the
+ * image so the same bounds work for BC6H
+ */
+float rmsError(std::span<const float4> a, std::span<const float4> b, BlockFormat format) {
+  const int channels = channelCount(format);
+  double sum = 0.0;
+  for (size_t i = 0; i < a.size(); i++) {
+    for (int c = 0; c < channels; c++) {
+      const float d = (a[i][c] - b[i][c]) / scale(format);
+      sum += double(d) * d;
+    }
+  }
+  return float(std::sqrt(sum / double(a.size() * channels)));
+}
+
+// Largest error relative to the value, for BC6H which stores floats
+float maxError(std::span<const float4> a, std::span<const float4> b, BlockFormat format) {
+  float error = 0.0f;
+  for (size_t i = 0; i < a.size(); i++) {
+    for (int c = 0; c < channelCount(format); c++) {
+      const float d = std::abs(a[i][c] - b[i][c]);
+      error = std::max(error, format == BlockFormat::BC6H && a[i][c] > 0.0f ? d / a[i][c] : d);
+    }
+  }
+  return error;
+}
+
+std::vector<float4> roundTrip(std::span<const float4> pixels, uint32_t width, uint32_t height, BlockFormat format, Quality quality, bool srgb = false) {
+  const auto data = encode(pixels, width, height, format, quality, srgb);
+  if (!CHECK(data.size() == encodedSize(format, width, height))) return {};
+  return decode(data, width, height, format, srgb);
+}
+
+/*
+ * LSB first bit packing, as in the BC6H and BC7 specs, to build blocks by hand
+ */
+struct BlockBits {
+  uint8_t data[16] = {};
+  uint32_t pos = 0;
+
+  void write(uint32_t value, uint32_t bits) {
+    for (uint32_t i = 0; i < bits; i++, pos++) {
+      if ((value >> i) & 1) data[pos / 8] |= uint8_t(1 << (pos % 8));
+    }
+  }
+};
+
+constexpr int weights4[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+}
+
+/*
+ * Smooth images stay close to the source at every quality, and a higher
+ * quality is never worse overall
+ */
+TEST(texture_compression, smooth_images) {
+  for (auto format: formats) {
+    const auto pixels = smoothImage(imageWidth, imageHeight, scale(format));
+    float previous = INFINITY;
+    for (auto quality: qualities) {
+      const auto decoded = roundTrip(pixels, imageWidth, imageHeight, format, quality);
+      if (decoded.size() != pixels.size()) continue;
+
+      const float bound = format == BlockFormat::BC4 || format == BlockFormat::BC5 ? 0.01f : 0.025f;
+      const float error = rmsError(pixels, decoded, format);
+      const auto name = std::format("{} {}", formatName(format), qualityName(quality));
+      pt::test::check(error <= bound, std::format("{}: RMS error {:.5f}, bound {}", name, error, bound));
+      pt::test::check(error <= previous * 1.001f, std::format("{}: RMS error {:.5f}, lower quality {:.5f}", name, error, previous));
+      previous = error;
+    }
+  }
+}
+
+/*
+ * White noise is far from what a single subset can represent, but every
+ * format must still do better than a flat gray block (RMS error 0.29)
+ */
+TEST(texture_compression, noise_images) {
+  for (auto format: formats) {
+    const auto pixels = noiseImage(imageWidth, imageHeight, scale(format));
+    for (auto quality: qualities) {
+      const auto decoded = roundTrip(pixels, imageWidth, imageHeight, format, quality);
+      if (decoded.size() != pixels.size()) continue;
+
+      const float bound = format == BlockFormat::BC4 || format == BlockFormat::BC5 ? 0.04f : 0.27f;
+      const float error = rmsError(pixels, decoded, format);
+      pt::test::check(
+        error <= bound,
+        std::format("{} {}: RMS error {:.5f}, bound {}", formatName(format), qualityName(quality), error, bound)
+      );
+    }
+  }
+}
+
+/*
+ * Constant blocks of 8 bit values are exact for BC4 and BC5. BC7 endpoints
+ * share a p-bit across channels, so channels of opposite parity can be off by
+ * one step. BC6H mode 11 keeps 5 bits of mantissa in its 10 bit endpoints.
+ */
+TEST(texture_compression, constant_blocks) {
+  for (auto format: formats) {
+    for (uint32_t v = 0; v < 256; v += 15) {
+      const float value = float(v) / 255.0f;
+      const std::vector<float4> pixels(16, float4{value, 1.0f - value, value, 1.0f - value} * scale(format));
+      for (auto quality: qualities) {
+        const auto decoded = roundTrip(pixels, 4, 4, format, quality);
+        if (decoded.size() != pixels.size()) continue;
+
+        const float bound = format == BlockFormat::BC6H ? 1.0f / 64.0f : format == BlockFormat::BC7 ? 1.0f / 255.0f + 1e-6f : 1e-6f;
+        const float error = maxError(pixels, decoded, format);
+        pt::test::check(
+          error <= bound,
+          std::format("{} {}, value {}: max error {:.6f}", formatName(format), qualityName(quality), v, error)
+        );
+      }
+    }
+  }
+}
+
+/*
+ * Partial edge blocks repeat edge texels, decoding drops the texels past the
+ * edge, and decoding a range of rows matches the same rows of a full decode
+ */
+TEST(texture_compression, partial_blocks) {
+  const uint32_t sizes[][2] = {{1, 1}, {3, 2}, {5, 7}, {imageWidth, imageHeight}};
+  for (auto format: formats) {
+    for (const auto& [width, height]: sizes) {
+      const auto pixels = smoothImage(width, height, scale(format));
+      const auto data = encode(pixels, width, height, format, Quality::Normal);
+      if (!CHECK(data.size() == encodedSize(format, width, height))) continue;
+
+      const auto decoded = decode(data, width, height, format);
+      if (!CHECK(decoded.size() == pixels.size())) continue;
+
+      const auto name = std::format("{} {}x{}", formatName(format), width, height);
+      const float error = rmsError(pixels, decoded, format);
+      pt::test::check(error <= 0.02f, std::format("{}: RMS error {:.5f}", name, error));
+
+      const uint32_t y0 = height / 3, y1 = height - height / 4;
+      const auto rows = decode(data, width, height, format, false, y0, y1);
+      const bool same = rows.size() == size_t(width) * (y1 - y0) &&
+                        std::equal(rows.begin(), rows.end(), decoded.begin() + ptrdiff_t(y0) * width, [](float4 a, float4 b) {
+                          return simd::all(a == b);
+                        });
+      pt::test::check(same, std::format("{}: rows [{}, {}) differ from the full decode", name, y0, y1));
+    }
+  }
+}
+
+/*
+ * BC4 blocks with exact 0 and 1 next to values in between use the mode with
+ * 0 and 1 in the palette (r0 <= r1) when the encoder searches both modes
+ */
+TEST(texture_compression, bc4_modes) {
+  std::vector<float4> pixels(16);
+  for (uint32_t i = 0; i < 16; i++) {
+    const float v = i < 4 ? 0.0f : i < 8 ? 1.0f : 0.4f + float(i) * 0.01f;
+    pixels[i] = float4{v, v, v, v};
+  }
+
+  for (auto quality: {Quality::Normal, Quality::High}) {
+    const auto data = encode(pixels, 4, 4, BlockFormat::BC4, quality);
+    CHECK(data[0] <= data[1]);
+
+    const auto decoded = decode(data, 4, 4, BlockFormat::BC4);
+    bool exact = true;
+    for (uint32_t i = 0; i < 8; i++) exact &= decoded[i].x == pixels[i].x;
+    pt::test::check(exact, std::format("{}: 0 and 1 not exact", qualityName(quality)));
+  }
+
+  // A smooth ramp is better served by the six interpolated values
+  for (uint32_t i = 0; i < 16; i++) pixels[i].x = 0.2f + float(i) * 0.03f;
+  const auto data = encode(pixels, 4, 4, BlockFormat::BC4, Quality::High);
+  CHECK(data[0] > data[1]);
+}
+
+/*
+ * Encoded blocks carry the mode the decoder expects: BC7 mode 6 (bit 6 set
+ * after six zeros) and BC6H mode 11 (five bits 00011)
+ */
+TEST(texture_compression, mode_bits) {
+  for (auto format: {BlockFormat::BC6H, BlockFormat::BC7}) {
+    const auto pixels = noiseImage(imageWidth, imageHeight, scale(format));
+    for (auto quality: qualities) {
+      const auto data = encode(pixels, imageWidth, imageHeight, format, quality);
+
+      uint32_t wrong = 0;
+      for (size_t block = 0; block < data.size(); block += 16) {
+        const uint8_t bits = data[block];
+        if (format == BlockFormat::BC7 ? (bits & 0x7f) != 0x40 : (bits & 0x1f) != 0x03) wrong++;
+      }
+      pt::test::check(wrong == 0, std::format("{} {}: {} blocks with the wrong mode", formatName(format), qualityName(quality), wrong));
+    }
+  }
+}
+
+/*
+ * Anchor index: the first texel's index is stored with 3 bits and an implicit
+ * high bit of 0. Blocks built by hand to the spec decode to the spec's values,
+ * and blocks where the first texel is at the far end of the range round trip.
+ */
+TEST(texture_compression, anchor_index) {
+  // BC7 mode 6, endpoints 0 and 255, texel i at index 15 - i except the anchor
+  BlockBits bc7;
+  bc7.write(1 << 6, 7);
+  for (int c = 0; c < 4; c++) {
+    bc7.write(0, 7);
+    bc7.write(127, 7);
+  }
+  bc7.write(0, 1);
+  bc7.write(1, 1);
+  for (int i = 0; i < 16; i++) bc7.write(i == 0 ? 7 : 15 - i, i == 0 ? 3 : 4);
+  CHECK(bc7.pos == 128);
+
+  const auto decoded = decode(bc7.data, 4, 4, BlockFormat::BC7);
+  uint32_t wrong = 0;
+  for (int i = 0; i < 16; i++) {
+    const int w = weights4[i == 0 ? 7 : 15 - i];
+    const float expected = float((255 * w + 32) >> 6) / 255.0f;
+    if (!simd::all(decoded[i] == expected)) wrong++;
+  }
+  pt::test::check(wrong == 0, std::format("BC7: {} texels differ from the spec", wrong));
+
+  // BC6H mode 11 has the same anchor layout after 65 bits of mode and endpoints
+  BlockBits bc6h;
+  bc6h.write(0x03, 5);
+  for (int e = 0; e < 2; e++) {
+    for (int c = 0; c < 3; c++) bc6h.write(e == 0 ? 0 : 1000, 10);
+  }
+  for (int i = 0; i < 16; i++) bc6h.write(i == 0 ? 5 : i, i == 0 ? 3 : 4);
+  CHECK(bc6h.pos == 128);
+  const auto hdr = decode(bc6h.data, 4, 4, BlockFormat::BC6H);
+  bool increasing = hdr[0].x > 0.0f;
+  for (int i = 2; i < 16; i++) increasing &= hdr[i].x > hdr[i - 1].x;
+  CHECK(increasing && hdr[0].x < hdr[6].x && hdr[0].x > hdr[4].x);
+
+  /*
+   * A ramp that starts at its brightest texel needs the encoder to swap the
+   * endpoints, and must come out as well as the same ramp starting at its
+   * darkest texel
+   */
+  for (auto format: formats) {
+    std::vector<float4> ascending(16), descending(16);
+    for (uint32_t i = 0; i < 16; i++) {
+      const float v = float(i) / 15.0f * scale(format);
+      ascending[i] = float4{v, v, v, v};
+      descending[15 - i] = ascending[i];
+    }
+
+    for (auto quality: qualities) {
+      const float up = rmsError(ascending, roundTrip(ascending, 4, 4, format, quality), format);
+      const float down = rmsError(descending, roundTrip(descending, 4, 4, format, quality), format);
+      pt::test::check(
+        std::abs(up - down) <= up * 0.1f + 1e-4f,
+        std::format("{} {}: ramp error {:.5f} ascending, {:.5f} descending", formatName(format), qualityName(quality), up, down)
+      );
+    }
+  }
+}
+
+/*
+ * sRGB BC7 round trips in the encoded space, so dark values keep their precision
+ */
+TEST(texture_compression, bc7_srgb) {
+  auto pixels = smoothImage(imageWidth, imageHeight, 1.0f);
+  for (auto& p: pixels) {
+    for (int c = 0; c < 3; c++) p[c] = p[c] * p[c] * 0.25f;
+  }
+
+  for (auto quality: qualities) {
+    const auto decoded = roundTrip(pixels, imageWidth, imageHeight, BlockFormat::BC7, quality, true);
+    if (decoded.size() != pixels.size()) continue;
+
+    const float error = rmsError(pixels, decoded, BlockFormat::BC7);
+    pt::test::check(error <= 0.01f, std::format("{}: RMS error {:.5f}", qualityName(quality), error));
+  }
+}
@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <cmath>
+#include <format>
+#include <iterator>
+#include <limits>
+#include <numbers>
+#include <vector>
+
+#include <Metal/Metal.hpp>
+#include <core/mesh.hpp>
+#include <core/vertex_format.hpp>
+
+#include "test.hpp"
+
+using namespace pt;
+using namespace pt::vertex_format;
+using pt::test::hash;
+using pt::test::unorm;
+
+namespace {
+
+constexpr uint32_t directionCount = 1 << 20, texCoordCount = 1 << 16;
+constexpr float maxAngleError = 0.01f; // Degrees
+
+float3 randomDirection(uint32_t i) {
+  const float z = 1.0f - 2.0f * unorm(hash(3 * i));
+  const float phi = 2.0f * std::numbers::pi_v<float> * unorm(hash(3 * i + 1));
+  const float r = std::sqrt(std::max(1.0f - z * z, 0.0f));
+  return {r * std::cos(phi), r * std::sin(phi), z};
+}
+
+float angleDegrees(float3 a, float3 b) {
+  return std::atan2(length(cross(a, b)), dot(a, b)) * 180.0f * std::numbers::inv_pi_v<float>;
+}
+
+uint32_t packNormal(float3 normal) {
+  return pack({.normal = normal, .tangent = {1, 0, 0, 1}, .texCoords = {0, 0}}, {{0, 0}, {1, 1}}).normal;
+}
+
+}
+
+/*
+ * Normals and tangents: angular error, bitangent sign, and drift when
+ * re-encoding, since meshes get decoded and packed again when edited
+ */
+TEST(vertex_format, normal_precision) {
+  float normalMax = 0.0f, driftMax = 0.0f;
+  for (uint32_t i = 0; i < directionCount; i++) {
+    const float3 v = randomDirection(i);
+    const float3 decoded = decodeNormal(packNormal(v));
+
+    normalMax = std::max(normalMax, angleDegrees(decoded, v));
+    driftMax = std::max(driftMax, angleDegrees(decodeNormal(packNormal(decoded)), decoded));
+  }
+
+  pt::test::check(normalMax <= maxAngleError, std::format("normal error: max {:.5f} deg", normalMax));
+  pt::test::check(driftMax <= maxAngleError, std::format("re-encoding drift: max {:.5f} deg", driftMax));
+}
+
+TEST(vertex_format, tangent_precision) {
+  float tangentMax = 0.0f;
+  uint32_t signErrors = 0;
+  for (uint32_t i = 0; i < directionCount; i++) {
+    const float3 v = randomDirection(i);
+    const float sign = hash(i) & 1 ? 1.0f : -1.0f;
+
+    const float4 decoded = decodeTangent(packTangent(make_float4(v, sign)));
+    tangentMax = std::max(tangentMax, angleDegrees(decoded.xyz, v));
+    if (decoded.w != sign) signErrors++;
+  }
+
+  pt::test::check(tangentMax <= maxAngleError, std::format("tangent error: max {:.5f} deg", tangentMax));
+  pt::test::check(signErrors == 0, std::format("bitangent sign errors: {}", signErrors));
+}
+
+/*
+ * Texture coordinates, for a few typical ranges. The error is bounded by half
+ * a quantization step.
+ */
+TEST(vertex_format, tex_coord_precision) {
+  const TexCoordBounds ranges[] = {
+    {{0.0f, 0.0f}, {1.0f, 1.0f}},
+    {{-2.0f, -2.0f}, {4.0f, 4.0f}},
+    {{0.0f, 0.0f}, {64.0f, 16.0f}},
+  };
+  for (const auto& bounds: ranges) {
+    // Half a quantization step, plus float rounding of the decode
+    const float2 maxAllowed = bounds.extent * (0.5f / 65535.0f) + (abs(bounds.origin) + bounds.extent) * 0x1p-22f;
+
+    float2 maxError = 0.0f;
+    for (uint32_t i = 0; i < texCoordCount; i++) {
+      const float2 uv = bounds.origin + bounds.extent * float2{unorm(hash(2 * i + 7)), unorm(hash(2 * i + 8))};
+      const VertexData vertex{.normal = {0, 0, 1}, .tangent = {1, 0, 0, 1}, .texCoords = uv};
+      maxError = max(maxError, abs(unpack(pack(vertex, bounds), bounds).texCoords - uv));
+    }
+
+    pt::test::check(
+      maxError.x <= maxAllowed.x && maxError.y <= maxAllowed.y,
+      std::format("UV range {}x{}: max error {:.3e}x{:.3e}", bounds.extent.x, bounds.extent.y, maxError.x, maxError.y)
+    );
+  }
+}
+
+TEST(vertex_format, tex_coord_bounds_ignore_non_finite) {
+  const VertexData vertices[] = {
+    {.normal = {0, 0, 1}, .tangent = {1, 0, 0, 1}, .texCoords = {-1.0f, 2.0f}},
+    {.normal = {0, 0, 1}, .tangent = {1, 0, 0, 1}, .texCoords = {3.0f, 0.5f}},
+    {.normal = {0, 0, 1}, .tangent = {1, 0, 0, 1}, .texCoords = {std::numeric_limits<float>::quiet_NaN(), 1.0f}},
+    {.normal = {0, 0, 1}, .tangent = {1, 0, 0, 1}, .texCoords = {0.0f, std::numeric_limits<float>::infinity()}},
+  };
+
+  const auto bounds = texCoordBounds(vertices, std::size(vertices));
+  CHECK(bounds.origin.x == -1.0f && bounds.origin.y == 0.5f);
+  CHECK(bounds.extent.x == 4.0f && bounds.extent.y == 1.5f);
+}
+
+/*
+ * Ranges too large for unorm16, like a tiling texture over a big surface, are
+ * kept at full precision by the mesh. Small ranges are still only packed.
+ */
+TEST(vertex_format, large_tex_coord_range) {
+  NS::AutoreleasePool* pool = NS::AutoreleasePool::alloc()->init();
+  MTL::Device* device = MTL::CreateSystemDefaultDevice();
+  if (!pt::test::check(device != nullptr, "Metal device available")) {
+    pool->release();
+    return;
+  }
+
+  for (float extent: {maxPackedTexCoordExtent, 2048.0f}) {
+    std::vector<float3> positions;
+    std::vector<VertexData> vertices;
+    for (uint32_t i = 0; i < texCoordCount; i++) {
+      const float2 uv = float2{-0.25f, -0.25f} * extent + extent * float2{unorm(hash(2 * i + 7)), unorm(hash(2 * i + 8))};
+      positions.push_back({float(i), 0.0f, 0.0f});
+      vertices.push_back({.normal = {0, 0, 1}, .tangent = {1, 0, 0, 1}, .texCoords = uv});
+    }
+
+    const bool packed = packsTexCoords(texCoordBounds(vertices.data(), vertices.size()));
+    const Mesh mesh(device, positions, vertices, {0, 1, 2}, {0});
+    pt::test::check(
+      packed == (extent <= maxPackedTexCoordExtent) && packed == (mesh.texCoordData() == nullptr),
+      std::format("UV range {}: packed {}, full precision buffer {}", extent, packed, mesh.texCoordData() != nullptr)
+    );
+
+    // A quarter of a 4K texel, which unorm16 only guarantees up to the threshold
+    const float maxAllowed = 0.25f / 4096.0f;
+    float maxError = 0.0f;
+    for (uint32_t i = 0; i < texCoordCount; i++) {
+      maxError = std::max(maxError, reduce_max(abs(mesh.texCoords(i) - vertices[i].texCoords)));
+      maxError = std::max(maxError, reduce_max(abs(mesh.vertex(i).texCoords - vertices[i].texCoords)));
+    }
+    pt::test::check(maxError <= maxAllowed, std::format("UV range {}: max error {:.3e}", extent, maxError));
+  }
+
+  device->release();
+  pool->release();
+}